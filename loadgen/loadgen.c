@@ -0,0 +1,696 @@
+/**
+ * @file
+ * @brief Генератор HTTP нагрузки на api мессенджера
+ *
+ * Генератор регистрирует --users синтетических пользователей и в течение
+ * --duration секунд выполняет смесь запросов send_message, get_message и
+ * get_user. Нагрузку создают --threads потоков, у каждого свой mg_mgr и
+ * --connections постоянных соединений. Без --rate каждое соединение
+ * отправляет следующий запрос сразу после ответа (закрытый цикл). С --rate
+ * запросы отправляются по расписанию, а задержка отсчитывается от
+ * запланированного, а не от фактического времени отправки, чтобы перегрузка
+ * сервера не скрывалась.
+ *
+ * Если не указан --url, сервер запускается в том же процессе на 127.0.0.1 с
+ * временной базой данных, которая удаляется после измерения.
+ *
+ * Для каждого действия выводится пропускная способность и процентили
+ * задержки по гистограмме с относительной точностью 1/64.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include "mongoose.h"
+#include "db_plugin.h"
+#include "message_cache.h"
+#include "conversations.h"
+#include "groups.h"
+#include "changes.h"
+#include "dedup.h"
+#include "arena.h"
+#include "wakeup.h"
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <time.h>
+#endif
+
+/// Количество поддиапазонов гистограммы в одном диапазоне степени двойки
+#define HISTOGRAM_SUB_BUCKETS 64
+
+/// Количество диапазонов гистограммы (задержки до 2^40 мкс)
+#define HISTOGRAM_BUCKETS 40
+
+/// Пароль всех синтетических пользователей
+#define LOADGEN_PASSWORD "loadgen"
+
+/// Действия, которые выполняет генератор
+enum loadgen_action {
+  LOADGEN_SEND_MESSAGE, ///< send_message
+  LOADGEN_GET_MESSAGE, ///< get_message
+  LOADGEN_GET_USER, ///< get_user
+  LOADGEN_ACTION_COUNT ///< Количество действий
+};
+
+/// Имена действий в отчёте
+static const char * s_action_names[LOADGEN_ACTION_COUNT] = {
+  "send_message", "get_message", "get_user"
+};
+
+/// Гистограмма задержек в микросекундах
+struct latency_histogram {
+  /// Счётчики: значение (sub << bucket) с точностью до 2^bucket
+  int64_t counts[HISTOGRAM_BUCKETS][2 * HISTOGRAM_SUB_BUCKETS];
+  int64_t total; ///< Количество значений
+  int64_t max; ///< Наибольшее значение
+};
+
+struct worker;
+
+/// Постоянное соединение генератора
+struct client_conn {
+  struct worker * w; ///< Поток, которому принадлежит соединение
+  struct mg_connection * nc; ///< Соединение или NULL, если его нужно открыть
+  int action; ///< Действие выполняемого запроса
+  int user; ///< Пользователь выполняемого запроса
+  int busy; ///< Запрос отправлен, ответ ещё не получен
+  double start_ns; ///< Время, от которого отсчитывается задержка
+  double next_ns; ///< Запланированное время следующего запроса
+};
+
+/// Поток генератора
+struct worker {
+  int index; ///< Номер потока
+  struct mg_mgr mgr; ///< Менеджер соединений потока
+  std::vector<client_conn> conns; ///< Соединения потока
+  std::vector<int64_t> cursors; ///< Последнее полученное сообщение пользователей
+  unsigned int random; ///< Состояние генератора случайных чисел
+  latency_histogram * histograms; ///< Гистограммы по действиям
+  int64_t errors[LOADGEN_ACTION_COUNT]; ///< Неуспешные ответы по действиям
+};
+
+/// Адрес сервера
+static std::string s_url;
+/// Адрес сервера для mg_connect
+static std::string s_address;
+/// Порт встроенного сервера
+static const char * s_port = "18000";
+/// Реализация хранилища встроенного сервера
+static const struct storage_vtable * s_storage = NULL;
+/// Количество пользователей
+static int s_users = 100;
+/// Количество потоков
+static int s_threads = 2;
+/// Количество соединений одного потока
+static int s_connections = 8;
+/// Длительность измерения в секундах
+static double s_duration = 10;
+/// Суммарная частота запросов в секунду, 0 - закрытый цикл
+static double s_rate = 0;
+/// Доли действий в смеси запросов
+static int s_mix[LOADGEN_ACTION_COUNT] = { 20, 75, 5 };
+/// Длина текста сообщения
+static int s_message_length = 100;
+/// Заголовки авторизации пользователей
+static std::vector<std::string> s_auth;
+/// Текст отправляемых сообщений
+static std::string s_message;
+/// Время окончания измерения
+static double s_deadline_ns = 0;
+/// Количество завершившихся потоков
+static std::atomic<int> s_finished(0);
+/// Признак остановки встроенного сервера, изменяется в его потоке
+static int s_server_stop = 0;
+/// Очередь пробуждения встроенного сервера
+static struct wakeup_queue * s_server_wakeup = NULL;
+/// Признак завершения встроенного сервера
+static std::atomic<int> s_server_done(0);
+/// Хранилище встроенного сервера
+static struct storage * s_db_handle = NULL;
+/// Количество незавершённых регистраций
+static int s_registering = 0;
+/// Количество неуспешных регистраций
+static int s_register_errors = 0;
+
+
+/**
+ * @brief Функция возвращает монотонное время в наносекундах
+ */
+static double now_ns(void){
+#ifdef _WIN32
+  LARGE_INTEGER counter, frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  return (double) counter.QuadPart * 1e9 / (double) frequency.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+#endif
+}
+
+
+/**
+ * @brief Функция приостанавливает поток на ms миллисекунд
+ */
+static void sleep_ms(int ms){
+#ifdef _WIN32
+  Sleep(ms);
+#else
+  usleep(ms * 1000);
+#endif
+}
+
+
+/**
+ * @brief Функция возвращает псевдослучайное число от 0 до n - 1
+ */
+static int random_below(unsigned int * state, int n){
+  *state = *state * 1103515245U + 12345U;
+  return (int) ((*state >> 8) % (unsigned int) n);
+}
+
+
+/**
+ * @brief Функция добавляет значение в гистограмму
+ */
+static void histogram_record(struct latency_histogram * h,
+                             int64_t value){
+  int64_t sub = value < 0 ? 0 : value;
+  int bucket = 0;
+
+  while (sub >= 2 * HISTOGRAM_SUB_BUCKETS && bucket < HISTOGRAM_BUCKETS - 1){
+    sub >>= 1;
+    bucket++;
+  }
+  if (sub >= 2 * HISTOGRAM_SUB_BUCKETS){
+    sub = 2 * HISTOGRAM_SUB_BUCKETS - 1;
+  }
+  h->counts[bucket][sub]++;
+  h->total++;
+  if (value > h->max){
+    h->max = value;
+  }
+}
+
+
+/**
+ * @brief Функция добавляет значения гистограммы from в гистограмму to
+ */
+static void histogram_merge(struct latency_histogram * to,
+                            const struct latency_histogram * from){
+  for (int b = 0; b < HISTOGRAM_BUCKETS; b++){
+    for (int s = 0; s < 2 * HISTOGRAM_SUB_BUCKETS; s++){
+      to->counts[b][s] += from->counts[b][s];
+    }
+  }
+  to->total += from->total;
+  if (from->max > to->max){
+    to->max = from->max;
+  }
+}
+
+
+/**
+ * @brief Функция возвращает значение, не меньшее доли percentile значений
+ * гистограммы (верхнюю границу поддиапазона)
+ */
+static int64_t histogram_percentile(const struct latency_histogram * h,
+                                    double percentile){
+  int64_t rank = (int64_t) (percentile / 100.0 * h->total + 0.5);
+  int64_t seen = 0;
+
+  if (rank < 1){
+    rank = 1;
+  }
+  for (int b = 0; b < HISTOGRAM_BUCKETS; b++){
+    for (int s = 0; s < 2 * HISTOGRAM_SUB_BUCKETS; s++){
+      seen += h->counts[b][s];
+      if (seen >= rank){
+        int64_t value = (((int64_t) s + 1) << b) - 1;
+        return value < h->max ? value : h->max;
+      }
+    }
+  }
+  return h->max;
+}
+
+
+/**
+ * @brief Функция-обработчик событий встроенного сервера
+ */
+static void server_handler(struct mg_connection * nc, int ev, void * ev_data){
+  struct http_message * hm = (struct http_message *) ev_data;
+
+  switch (ev){
+    case MG_EV_HTTP_REQUEST:
+      if (nc->user_data == NULL){
+        nc->user_data = arena_new();
+      }
+      db_op(nc, hm, s_db_handle, API_OP_POST);
+      arena_reset((struct arena *) nc->user_data);
+      break;
+    case MG_EV_CLOSE:
+      arena_delete((struct arena *) nc->user_data);
+      nc->user_data = NULL;
+      break;
+    default:
+      break;
+  }
+}
+
+
+/**
+ * @brief Функция останавливает встроенный сервер, вызывается в его потоке
+ */
+static void stop_server(struct mg_connection * nc, void * data){
+  (void) nc;
+  (void) data;
+  s_server_stop = 1;
+}
+
+
+/**
+ * @brief Функция потока встроенного сервера
+ */
+static void * server_thread(void * arg){
+  struct mg_mgr * mgr = (struct mg_mgr *) arg;
+
+  // Stopping wakes the loop, the timeout is never waited out
+  while (!s_server_stop){
+    mg_mgr_poll(mgr, 1000);
+  }
+  s_server_done = 1;
+  return NULL;
+}
+
+
+/**
+ * @brief Функция-обработчик ответов на запросы регистрации
+ */
+static void register_handler(struct mg_connection * nc, int ev, void * ev_data){
+  struct http_message * hm = (struct http_message *) ev_data;
+
+  switch (ev){
+    case MG_EV_CONNECT:
+      if (*(int *) ev_data != 0){
+        s_register_errors++;
+      }
+      break;
+    case MG_EV_HTTP_REPLY:
+      // An existing user is fine when the server is reused
+      if (hm->resp_code != 200 && hm->resp_code != 401){
+        s_register_errors++;
+      }
+      nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+      break;
+    case MG_EV_CLOSE:
+      s_registering--;
+      break;
+    default:
+      break;
+  }
+}
+
+
+/**
+ * @brief Функция регистрирует пользователей по s_users параллельных
+ * запросов mg_connect_http
+ *
+ * @retval 1 Все пользователи зарегистрированы
+ * @retval 0 Ошибка регистрации
+ */
+static int register_users(void){
+  struct mg_mgr mgr;
+  char body[64];
+  int i = 0;
+
+  mg_mgr_init(&mgr, NULL);
+  while (i < s_users || s_registering > 0){
+    for (; i < s_users && s_registering < 64; i++){
+      snprintf(body, sizeof(body), "action=register&user=u%d&password=%s", i,
+               LOADGEN_PASSWORD);
+      if (mg_connect_http(&mgr, register_handler, s_url.c_str(),
+          "Content-Type: application/x-www-form-urlencoded\r\n",
+          body) == NULL){
+        s_register_errors++;
+        continue;
+      }
+      s_registering++;
+    }
+    mg_mgr_poll(&mgr, 10);
+  }
+  mg_mgr_free(&mgr);
+  return s_register_errors == 0;
+}
+
+
+static void client_handler(struct mg_connection * nc, int ev, void * ev_data);
+
+
+/**
+ * @brief Функция отправляет по соединению следующий запрос смеси
+ */
+static void client_send(struct client_conn * c, double start_ns){
+  struct worker * w = c->w;
+  int total = s_mix[0] + s_mix[1] + s_mix[2];
+  int pick = random_below(&w->random, total);
+  char body[64];
+  int len;
+
+  c->action = pick < s_mix[0] ? LOADGEN_SEND_MESSAGE :
+              pick < s_mix[0] + s_mix[1] ? LOADGEN_GET_MESSAGE :
+              LOADGEN_GET_USER;
+  // Users are split between threads, so cursors are never shared
+  c->user = w->index + s_threads * random_below(&w->random,
+    (s_users - w->index + s_threads - 1) / s_threads);
+
+  switch (c->action){
+    case LOADGEN_SEND_MESSAGE:
+      len = snprintf(body, sizeof(body), "action=send_message&to=u%d&message=",
+                     random_below(&w->random, s_users));
+      break;
+    case LOADGEN_GET_MESSAGE:
+      len = snprintf(body, sizeof(body),
+                     "action=get_message&last_message=%" INT64_FMT,
+                     w->cursors[c->user]);
+      break;
+    default:
+      len = snprintf(body, sizeof(body), "action=get_user&user=u%d",
+                     random_below(&w->random, s_users));
+      break;
+  }
+  int message_len = c->action == LOADGEN_SEND_MESSAGE ?
+                    (int) s_message.size() : 0;
+  mg_printf(c->nc,
+            "POST /messenger_api HTTP/1.1\r\n"
+            "Host: %s\r\n"
+            "%s"
+            "Content-Type: application/x-www-form-urlencoded\r\n"
+            "Content-Length: %d\r\n\r\n%s%s",
+            s_address.c_str(), s_auth[c->user].c_str(), len + message_len,
+            body, message_len > 0 ? s_message.c_str() : "");
+  c->busy = 1;
+  c->start_ns = start_ns;
+}
+
+
+/**
+ * @brief Функция-обработчик событий соединений генератора
+ */
+static void client_handler(struct mg_connection * nc, int ev, void * ev_data){
+  struct client_conn * c = (struct client_conn *) nc->user_data;
+  struct http_message * hm = (struct http_message *) ev_data;
+
+  switch (ev){
+    case MG_EV_HTTP_REPLY: {
+      struct worker * w = c->w;
+      double now = now_ns();
+      histogram_record(&w->histograms[c->action],
+                       (int64_t) ((now - c->start_ns) / 1000));
+      if (hm->resp_code != 200 && hm->resp_code != 204){
+        w->errors[c->action]++;
+      }
+      // Follow the conversation like a polling client does
+      if (c->action == LOADGEN_GET_MESSAGE && hm->resp_code == 200){
+        static const char key[] = "{\"message_id\":";
+        if (hm->body.len > sizeof(key) - 1 &&
+            memcmp(hm->body.p, key, sizeof(key) - 1) == 0){
+          w->cursors[c->user] = to64(hm->body.p + sizeof(key) - 1);
+        }
+      }
+      c->busy = 0;
+      if (s_rate > 0){
+        c->next_ns += s_threads * s_connections * 1e9 / s_rate;
+      } else if (now < s_deadline_ns){
+        client_send(c, now);
+      }
+      break;
+    }
+    case MG_EV_CLOSE:
+      if (c != NULL){
+        if (c->busy){
+          c->w->errors[c->action]++;
+          c->busy = 0;
+        }
+        c->nc = NULL;
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+
+/**
+ * @brief Функция потока генератора
+ */
+static void * worker_thread(void * arg){
+  struct worker * w = (struct worker * ) arg;
+  double interval_ns = s_rate > 0 ?
+                       s_threads * s_connections * 1e9 / s_rate : 0;
+  double now = now_ns();
+
+  mg_mgr_init(&w->mgr, NULL);
+  for (size_t i = 0; i < w->conns.size(); i++){
+    w->conns[i].w = w;
+    w->conns[i].nc = NULL;
+    w->conns[i].busy = 0;
+    // Spread the schedule of the connections over one interval
+    w->conns[i].next_ns = now + interval_ns * (w->index * s_connections + i) /
+                          (s_threads * s_connections);
+  }
+  while ((now = now_ns()) < s_deadline_ns){
+    for (size_t i = 0; i < w->conns.size(); i++){
+      struct client_conn * c = &w->conns[i];
+      if (c->nc == NULL){
+        c->nc = mg_connect(&w->mgr, s_address.c_str(), client_handler);
+        if (c->nc == NULL){
+          continue;
+        }
+        c->nc->user_data = c;
+        mg_set_protocol_http_websocket(c->nc);
+        if (s_rate == 0){
+          client_send(c, now);
+        }
+      }
+      if (s_rate > 0 && !c->busy && c->next_ns <= now){
+        client_send(c, c->next_ns);
+      }
+    }
+    mg_mgr_poll(&w->mgr, 1);
+  }
+  // Requests still in flight are not counted
+  for (size_t i = 0; i < w->conns.size(); i++){
+    if (w->conns[i].nc != NULL){
+      w->conns[i].busy = 0;
+      w->conns[i].nc->user_data = NULL;
+    }
+  }
+  mg_mgr_free(&w->mgr);
+  s_finished++;
+  return NULL;
+}
+
+
+/**
+ * @brief Функция удаляет файлы временной базы данных
+ */
+static void remove_db_files(const std::string & path){
+  char segment[32];
+
+  remove(path.c_str());
+  for (int i = 0; ; i++){
+    snprintf(segment, sizeof(segment), ".%06d.log", i);
+    if (remove((path + segment).c_str()) != 0){
+      break;
+    }
+  }
+}
+
+
+/**
+ * @brief Функция разбирает смесь действий вида send:get:user
+ */
+static int parse_mix(const char * mix){
+  return sscanf(mix, "%d:%d:%d", &s_mix[0], &s_mix[1], &s_mix[2]) == 3 &&
+         s_mix[0] >= 0 && s_mix[1] >= 0 && s_mix[2] >= 0 &&
+         s_mix[0] + s_mix[1] + s_mix[2] > 0;
+}
+
+
+/**
+ * @brief Точка входа
+ */
+int main(int argc, char* argv[]) {
+  struct mg_mgr server_mgr;
+  std::string db_path;
+  int i;
+
+  /* Parse command line arguments */
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--url") == 0 && i + 1 < argc) {
+      s_url = argv[++i];
+    } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+      s_port = argv[++i];
+    } else if (strcmp(argv[i], "--storage") == 0 && i + 1 < argc) {
+      if ((s_storage = storage_find_vtable(argv[++i])) == NULL) {
+        fprintf(stderr, "Unknown storage [%s]\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--users") == 0 && i + 1 < argc) {
+      s_users = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      s_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {
+      s_connections = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+      s_duration = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+      s_rate = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--mix") == 0 && i + 1 < argc) {
+      if (!parse_mix(argv[++i])) {
+        fprintf(stderr, "Invalid mix [%s], expected send:get:user\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--message-length") == 0 && i + 1 < argc) {
+      s_message_length = atoi(argv[++i]);
+    } else {
+      fprintf(stderr, "Unknown option [%s]\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (s_users < 1 || s_threads < 1 || s_threads > s_users ||
+      s_connections < 1 || s_duration <= 0 || s_rate < 0 ||
+      s_message_length < 0 || s_message_length >= MESSAGE_MAX_LENGTH) {
+    fprintf(stderr, "Invalid load parameters\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* Start the server in this process unless an external one is given */
+  if (s_url.empty()) {
+    const char * tmp = getenv("TEMP") != NULL ? getenv("TEMP") :
+                       getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+    char name[64];
+    snprintf(name, sizeof(name), "/messenger_loadgen_%d.db", (int) getpid());
+    db_path = std::string(tmp) + name;
+    remove_db_files(db_path);
+    if ((s_db_handle = storage_open(s_storage != NULL ? s_storage :
+                                    storage_find_vtable(NULL),
+                                    db_path.c_str())) == NULL) {
+      fprintf(stderr, "Cannot open DB [%s]\n", db_path.c_str());
+      exit(EXIT_FAILURE);
+    }
+    message_cache_init(MESSAGE_CACHE_BUDGET, MESSAGE_CACHE_RING_SIZE);
+    load_latest_messages(s_db_handle);
+    load_conversations(s_db_handle);
+    load_groups(s_db_handle);
+    load_changes(s_db_handle);
+
+    std::string address = std::string("127.0.0.1:") + s_port;
+    mg_mgr_init(&server_mgr, NULL);
+    struct mg_connection * nc = mg_bind(&server_mgr, address.c_str(),
+                                        server_handler);
+    if (nc == NULL) {
+      fprintf(stderr, "Cannot bind to [%s]\n", address.c_str());
+      exit(EXIT_FAILURE);
+    }
+    mg_set_protocol_http_websocket(nc);
+    if ((s_server_wakeup = wakeup_create(&server_mgr)) == NULL) {
+      fprintf(stderr, "Cannot create the server wakeup queue\n");
+      exit(EXIT_FAILURE);
+    }
+    mg_start_thread(server_thread, &server_mgr);
+    s_url = "http://" + address + "/messenger_api";
+  }
+  // mg_connect wants host:port, the path is always /messenger_api
+  s_address = s_url;
+  if (s_address.compare(0, 7, "http://") == 0) {
+    s_address = s_address.substr(7);
+  }
+  s_address = s_address.substr(0, s_address.find('/'));
+
+  for (i = 0; i < s_users; i++) {
+    char user[32];
+    struct mbuf header;
+    snprintf(user, sizeof(user), "u%d", i);
+    mbuf_init(&header, 0);
+    mg_basic_auth_header(user, LOADGEN_PASSWORD, &header);
+    s_auth.push_back(std::string(header.buf, header.len));
+    mbuf_free(&header);
+  }
+  s_message.assign(s_message_length, 'x');
+
+  double start = now_ns();
+  if (!register_users()) {
+    fprintf(stderr, "Cannot register users at [%s]\n", s_url.c_str());
+    exit(EXIT_FAILURE);
+  }
+  printf("Registered %d users in %.1f ms\n", s_users, (now_ns() - start) / 1e6);
+
+  std::vector<worker> workers(s_threads);
+  start = now_ns();
+  s_deadline_ns = start + s_duration * 1e9;
+  for (i = 0; i < s_threads; i++) {
+    workers[i].index = i;
+    workers[i].conns.resize(s_connections);
+    workers[i].cursors.assign(s_users, 0);
+    workers[i].random = 1 + i;
+    workers[i].histograms = new latency_histogram[LOADGEN_ACTION_COUNT];
+    memset(workers[i].histograms, 0,
+           LOADGEN_ACTION_COUNT * sizeof(struct latency_histogram));
+    memset(workers[i].errors, 0, sizeof(workers[i].errors));
+    mg_start_thread(worker_thread, &workers[i]);
+  }
+  while (s_finished < s_threads) {
+    sleep_ms(10);
+  }
+  double elapsed = (now_ns() - start) / 1e9;
+
+  printf("%-13s %10s %8s %12s %10s %10s %10s %10s %10s\n", "action",
+         "requests", "errors", "req_per_sec", "p50_ms", "p90_ms", "p99_ms",
+         "p99.9_ms", "max_ms");
+  for (int a = 0; a < LOADGEN_ACTION_COUNT; a++) {
+    latency_histogram * h = new latency_histogram;
+    int64_t errors = 0;
+    memset(h, 0, sizeof(*h));
+    for (i = 0; i < s_threads; i++) {
+      histogram_merge(h, &workers[i].histograms[a]);
+      errors += workers[i].errors[a];
+    }
+    printf("%-13s %10d %8d %12.1f %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+           s_action_names[a], (int) h->total, (int) errors, h->total / elapsed,
+           histogram_percentile(h, 50) / 1e3,
+           histogram_percentile(h, 90) / 1e3,
+           histogram_percentile(h, 99) / 1e3,
+           histogram_percentile(h, 99.9) / 1e3, h->max / 1e3);
+    delete h;
+  }
+  for (i = 0; i < s_threads; i++) {
+    delete[] workers[i].histograms;
+  }
+
+  if (s_db_handle != NULL) {
+    wakeup_post(s_server_wakeup, NULL, stop_server, NULL);
+    while (!s_server_done) {
+      sleep_ms(10);
+    }
+    mg_mgr_free(&server_mgr);
+    message_cache_free();
+    conversations_free();
+    groups_free();
+    changes_free();
+    dedup_free();
+    storage_close(&s_db_handle);
+    remove_db_files(db_path);
+  }
+  return 0;
+}
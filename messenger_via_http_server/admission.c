@@ -0,0 +1,123 @@
+/**
+ * @file
+ * @brief Контроль допуска нагрузки
+ *
+ * Все счётчики изменяются только из потока цикла событий. Ограничение,
+ * равное 0, выключает соответствующую проверку.
+ *
+ */
+
+#include <string.h>
+
+#include "admission.h"
+#include "db_plugin.h"
+
+/// Наибольшее количество соединений
+static int s_max_connections = ADMISSION_MAX_CONNECTIONS;
+/// Наибольшее количество запросов api за итерацию
+static int s_max_requests = ADMISSION_MAX_REQUESTS;
+/// Наибольшее время обработки запросов api за итерацию
+static int64_t s_max_work_ns = (int64_t) ADMISSION_MAX_WORK_MS * 1000000;
+/// Запросы api, принятые в текущей итерации
+static int s_requests = 0;
+/// Время обработки запросов api в текущей итерации
+static int64_t s_work_ns = 0;
+/// Статистика
+static struct admission_stats s_stats;
+
+
+/**
+ * @brief Функция устанавливает ограничения, 0 выключает ограничение
+ *
+ * @param[in] max_connections Наибольшее количество соединений
+ * @param[in] max_requests Наибольшее количество запросов api за итерацию
+ * @param[in] max_work_ns Наибольшее время обработки запросов api за итерацию
+ */
+void admission_init(int max_connections,
+                    int max_requests,
+                    int64_t max_work_ns){
+  s_max_connections = max_connections;
+  s_max_requests = max_requests;
+  s_max_work_ns = max_work_ns;
+  memset(&s_stats, 0, sizeof(s_stats));
+}
+
+
+/**
+ * @brief Функция учитывает принятое соединение
+ *
+ * Соединение учитывается и при отказе, admission_close вызывается для
+ * каждого принятого соединения.
+ *
+ * @retval 1 Соединение допущено
+ * @retval 0 Превышено количество соединений
+ */
+int admission_accept(void){
+  s_stats.connections++;
+  if (s_max_connections > 0 && s_stats.connections > s_max_connections){
+    s_stats.shed[ADMISSION_CONNECTIONS]++;
+    return 0;
+  }
+  return 1;
+}
+
+
+/**
+ * @brief Функция учитывает закрытие принятого соединения
+ */
+void admission_close(void){
+  s_stats.connections--;
+}
+
+
+/**
+ * @brief Функция начинает итерацию цикла событий
+ */
+void admission_iteration_begin(void){
+  s_requests = 0;
+  s_work_ns = 0;
+}
+
+
+/**
+ * @brief Функция решает, обрабатывать ли запрос api
+ *
+ * @param[in] action Действие api, enum api_action
+ * @retval 1 Запрос допущен, после обработки нужно вызвать admission_done
+ * @retval 0 Запросу нужно отказать
+ */
+int admission_request(int action){
+  // Registration yields to message delivery
+  int shift = action == API_ACTION_REGISTER ? 1 : 0;
+
+  if (s_max_requests > 0 && s_requests >= s_max_requests >> shift){
+    s_stats.shed[ADMISSION_REQUESTS]++;
+    return 0;
+  }
+  if (s_max_work_ns > 0 && s_work_ns >= s_max_work_ns >> shift){
+    s_stats.shed[ADMISSION_WORK]++;
+    return 0;
+  }
+  s_requests++;
+  return 1;
+}
+
+
+/**
+ * @brief Функция учитывает время обработки допущенного запроса
+ *
+ * @param[in] elapsed_ns Время обработки запроса
+ */
+void admission_done(int64_t elapsed_ns){
+  s_work_ns += elapsed_ns;
+}
+
+
+/**
+ * @brief Функция возвращает статистику контроля допуска
+ *
+ * @param[out] stats Статистика
+ */
+void admission_get_stats(struct admission_stats * stats){
+  *stats = s_stats;
+}
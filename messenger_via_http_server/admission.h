@@ -0,0 +1,72 @@
+/**
+ * @file
+ * @brief Заголовочный файл контроля допуска нагрузки.
+ *
+ * При всплеске нагрузки сервер принимает все соединения и обрабатывает все
+ * пришедшие запросы в одной итерации цикла событий, а ответы mongoose
+ * отправляет только на следующей итерации. Задержка растёт для всех
+ * клиентов сразу. Контроль допуска ограничивает количество соединений,
+ * количество запросов api за итерацию (их ответы ждут отправки) и время
+ * обработки запросов api за итерацию. Сверх ограничений сервер сразу
+ * отвечает 503 с заголовком Retry-After.
+ *
+ * Регистрация менее приоритетна, чем доставка сообщений: ей отказывается
+ * уже при достижении половины ограничений на запросы и время обработки.
+ *
+ */
+
+#ifndef _MESSENGER_VIA_HTTP_SERVER__ADMISSION_H_
+#define _MESSENGER_VIA_HTTP_SERVER__ADMISSION_H_
+
+#include "mongoose.h"
+
+/// Наибольшее количество соединений по умолчанию
+#define ADMISSION_MAX_CONNECTIONS 1000
+
+/// Наибольшее количество запросов api за итерацию по умолчанию
+#define ADMISSION_MAX_REQUESTS 512
+
+/// Наибольшее время обработки запросов api за итерацию по умолчанию (мс)
+#define ADMISSION_MAX_WORK_MS 200
+
+/// Значение заголовка Retry-After по умолчанию (в секундах)
+#define ADMISSION_RETRY_AFTER 1
+
+/// Причины отказа
+enum admission_reason {
+  ADMISSION_CONNECTIONS, ///< Превышено количество соединений
+  ADMISSION_REQUESTS, ///< Превышено количество запросов api за итерацию
+  ADMISSION_WORK, ///< Превышено время обработки запросов api за итерацию
+  ADMISSION_REASON_COUNT ///< Количество причин, не причина
+};
+
+/// Статистика контроля допуска
+struct admission_stats {
+  int connections; ///< Принятые открытые соединения
+  int64_t shed[ADMISSION_REASON_COUNT]; ///< Отказы по причинам
+};
+
+void admission_init(int max_connections,
+                    int max_requests,
+                    int64_t max_work_ns);
+
+
+int admission_accept(void);
+
+
+void admission_close(void);
+
+
+void admission_iteration_begin(void);
+
+
+int admission_request(int action);
+
+
+void admission_done(int64_t elapsed_ns);
+
+
+void admission_get_stats(struct admission_stats * stats);
+
+
+#endif //_MESSENGER_VIA_HTTP_SERVER__ADMISSION_H_
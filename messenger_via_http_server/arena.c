@@ -0,0 +1,245 @@
+/**
+ * @file
+ * @brief Арена памяти запроса
+ *
+ * Память выделяется сдвигом указателя в основном блоке. Если блока не
+ * хватает, память выделяется из кучи отдельными кусками, которые
+ * освобождаются при очистке арены, а основной блок увеличивается, чтобы
+ * следующий такой же запрос обошёлся без обращений к куче.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#include "arena.h"
+
+/// Выравнивание памяти, выделяемой из арены
+#define ARENA_ALIGN 8
+
+/// Кусок памяти, выделенный из кучи при переполнении основного блока
+struct arena_chunk {
+  struct arena_chunk * next; ///< Следующий кусок
+  double data[1]; ///< Начало памяти куска (выровнено)
+};
+
+struct arena {
+  char * base; ///< Основной блок
+  size_t size; ///< Размер основного блока
+  size_t used; ///< Занятая часть основного блока
+  struct arena_chunk * chunks; ///< Куски, выделенные при переполнении
+  size_t overflow; ///< Память, выделенная в кусках
+  int mallocs; ///< Выделения из кучи с момента последней очистки
+};
+
+/// Статистика всех арен
+static struct arena_stats s_stats = { 0, 0, 0, 0 };
+
+
+/**
+ * @brief Функция освобождает куски, выделенные при переполнении
+ */
+static void arena_free_chunks(struct arena * a){
+  while (a->chunks != NULL){
+    struct arena_chunk * next = a->chunks->next;
+    delete[] (char *) a->chunks;
+    a->chunks = next;
+  }
+}
+
+
+/**
+ * @brief Функция создаёт арену
+ *
+ * @return Указатель на арену
+ */
+struct arena * arena_new(void){
+  struct arena * a = new arena;
+
+  a->size = ARENA_BLOCK_SIZE;
+  a->base = new char[a->size];
+  a->used = 0;
+  a->chunks = NULL;
+  a->overflow = 0;
+  a->mallocs = 0;
+  return a;
+}
+
+
+/**
+ * @brief Функция освобождает арену и всю выделенную из неё память
+ *
+ * @param[in] a Арена или NULL
+ */
+void arena_delete(struct arena * a){
+  if (a == NULL){
+    return;
+  }
+  arena_free_chunks(a);
+  delete[] a->base;
+  delete a;
+}
+
+
+/**
+ * @brief Функция выделяет память из арены
+ *
+ * @param[in] a Арена
+ * @param[in] size Размер памяти в байтах
+ * @return Указатель на память, действительный до очистки арены
+ */
+void * arena_alloc(struct arena * a,
+                   size_t size){
+  size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+  if (a->used + size <= a->size){
+    void * p = a->base + a->used;
+    a->used += size;
+    return p;
+  }
+  char * block = new char[offsetof(struct arena_chunk, data) + size];
+  struct arena_chunk * chunk = (struct arena_chunk *) block;
+  chunk->next = a->chunks;
+  a->chunks = chunk;
+  a->overflow += size;
+  a->mallocs++;
+  return chunk->data;
+}
+
+
+/**
+ * @brief Функция очищает арену после обработки запроса и учитывает запрос в
+ * статистике
+ *
+ * @param[in] a Арена
+ */
+void arena_reset(struct arena * a){
+  size_t bytes = a->used + a->overflow;
+
+  arena_free_chunks(a);
+  // Grow the block so that the next request of this size needs no heap
+  if (a->overflow > 0 && a->size < ARENA_BLOCK_MAX_SIZE){
+    size_t size = a->size;
+    while (size < bytes && size < ARENA_BLOCK_MAX_SIZE){
+      size *= 2;
+    }
+    delete[] a->base;
+    a->base = new char[size];
+    a->size = size;
+    a->mallocs++;
+  }
+
+  s_stats.requests++;
+  s_stats.mallocs += a->mallocs;
+  s_stats.bytes += bytes;
+  if (bytes > s_stats.peak_bytes){
+    s_stats.peak_bytes = bytes;
+  }
+  a->used = 0;
+  a->overflow = 0;
+  a->mallocs = 0;
+}
+
+
+/**
+ * @brief Функция возвращает память, которую арена занимает между запросами
+ *
+ * @param[in] a Арена или NULL
+ * @return Размер арены и её основного блока в байтах
+ */
+size_t arena_size(const struct arena * a){
+  return a != NULL ? sizeof(*a) + a->size : 0;
+}
+
+
+/**
+ * @brief Функция возвращает статистику использования арен
+ *
+ * @param[out] stats Статистика
+ */
+void arena_get_stats(struct arena_stats * stats){
+  *stats = s_stats;
+}
+
+
+/**
+ * @brief Функция начинает пустую строку в памяти арены
+ *
+ * @param[in] b Строка
+ * @param[in] a Арена
+ * @param[in] cap Ожидаемая длина строки
+ */
+void arena_buf_init(struct arena_buf * b,
+                    struct arena * a,
+                    size_t cap){
+  b->arena = a;
+  b->data = (char *) arena_alloc(a, cap + 1);
+  b->data[0] = '\0';
+  b->len = 0;
+  b->cap = cap;
+}
+
+
+/**
+ * @brief Функция обеспечивает место для продолжения строки
+ *
+ * Если места не хватает, строка копируется в новый, не меньше чем вдвое 
+ * больший кусок арены: прежний кусок освобождается вместе с ареной.
+ *
+ * @param[in] b Строка
+ * @param[in] size Длина продолжения без завершающего нуля
+ * @return Указатель на конец строки, после которого есть size + 1 байт
+ */
+char * arena_buf_reserve(struct arena_buf * b,
+                         size_t size){
+  if (b->len + size > b->cap){
+    size_t cap = std::max(b->cap * 2, b->len + size);
+    char * data = (char *) arena_alloc(b->arena, cap + 1);
+    memcpy(data, b->data, b->len + 1);
+    b->data = data;
+    b->cap = cap;
+  }
+  return b->data + b->len;
+}
+
+
+/**
+ * @brief Функция дописывает строку
+ *
+ * @param[in] b Строка
+ * @param[in] s Дописываемая строка
+ */
+void arena_buf_append(struct arena_buf * b,
+                      const char * s){
+  size_t len = strlen(s);
+
+  memcpy(arena_buf_reserve(b, len), s, len + 1);
+  b->len += len;
+}
+
+
+/**
+ * @brief Функция дописывает строку по формату printf
+ *
+ * @param[in] b Строка
+ * @param[in] fmt Формат
+ */
+void arena_buf_printf(struct arena_buf * b,
+                      const char * fmt,
+                      ...){
+  va_list ap;
+  int len;
+
+  va_start(ap, fmt);
+  len = vsnprintf(b->data + b->len, b->cap - b->len + 1, fmt, ap);
+  va_end(ap);
+  if (len < 0){
+    return;
+  }
+  if (b->len + len > b->cap){
+    va_start(ap, fmt);
+    vsnprintf(arena_buf_reserve(b, len), len + 1, fmt, ap);
+    va_end(ap);
+  }
+  b->len += len;
+}
@@ -0,0 +1,80 @@
+/**
+ * @file
+ * @brief Заголовочный файл арены памяти запроса.
+ *
+ * Все временные буферы функций api выделяются из арены соединения и не
+ * освобождаются по отдельности: арена очищается целиком после того, как
+ * ответ на запрос поставлен в очередь отправки.
+ *
+ */
+
+#ifndef _MESSENGER_VIA_HTTP_SERVER__ARENA_H_
+#define _MESSENGER_VIA_HTTP_SERVER__ARENA_H_
+
+#include <stdarg.h>
+#include <stddef.h>
+#include "mongoose.h"
+
+/// Начальный размер основного блока арены
+#define ARENA_BLOCK_SIZE 8192
+
+/// Максимальный размер, до которого растёт основной блок арены
+#define ARENA_BLOCK_MAX_SIZE (64 * 1024)
+
+/// Арена памяти одного соединения
+struct arena;
+
+/// Строка, которая собирается в памяти арены
+struct arena_buf {
+  struct arena * arena; ///< Арена, из которой выделяется память
+  char * data; ///< Строка, завершённая нулём
+  size_t len; ///< Длина строки
+  size_t cap; ///< Память под строку без завершающего нуля
+};
+
+/// Статистика использования арен всеми запросами
+struct arena_stats {
+  int64_t requests; ///< Количество обработанных запросов
+  int64_t mallocs; ///< Количество выделений памяти из кучи самими аренами
+  int64_t bytes; ///< Суммарная память, выделенная запросам из арен
+  size_t peak_bytes; ///< Наибольшая память, выделенная одному запросу
+};
+
+struct arena * arena_new(void);
+
+
+void arena_delete(struct arena * a);
+
+
+void * arena_alloc(struct arena * a,
+                   size_t size);
+
+
+void arena_reset(struct arena * a);
+
+
+size_t arena_size(const struct arena * a);
+
+
+void arena_get_stats(struct arena_stats * stats);
+
+
+void arena_buf_init(struct arena_buf * b,
+                    struct arena * a,
+                    size_t cap);
+
+
+char * arena_buf_reserve(struct arena_buf * b,
+                         size_t size);
+
+
+void arena_buf_append(struct arena_buf * b,
+                      const char * s);
+
+
+void arena_buf_printf(struct arena_buf * b,
+                      const char * fmt,
+                      ...);
+
+
+#endif //_MESSENGER_VIA_HTTP_SERVER__ARENA_H_
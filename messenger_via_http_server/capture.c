@@ -0,0 +1,291 @@
+/**
+ * @file
+ * @brief Запись трафика api
+ *
+ * Запросы пишутся через буфер stdio, поэтому запись почти не добавляет
+ * времени к обработке запроса. Номера соединений выдаются по порядку при
+ * первом запросе соединения и освобождаются при его закрытии.
+ *
+ * Пароли в заголовке Authorization и в параметре password заменяются на
+ * CAPTURE_PASSWORD до записи, пароль отклонённого запроса - на
+ * CAPTURE_REJECTED_PASSWORD, Content-Length исправляется под новую длину
+ * тела. Запросы без паролей пишутся без копирования.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+#include "capture.h"
+#include "metrics.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/// Размер буфера файла записи
+#define CAPTURE_BUFFER_SIZE (64 * 1024)
+
+/// Файл записи или NULL, если запись выключена
+static FILE * s_file = NULL;
+/// Время начала записи
+static int64_t s_start_ns = 0;
+/// Номер следующего соединения
+static uint32_t s_next_connection = 0;
+/// Номера соединений, по которым уже были запросы
+static std::unordered_map<struct mg_connection *, uint32_t> s_connections;
+
+/// Замена части запроса
+struct capture_edit {
+  size_t offset; ///< Начало заменяемой части от начала запроса
+  size_t length; ///< Длина заменяемой части
+  std::string text; ///< Новый текст
+};
+
+
+/**
+ * @brief Функция создаёт файл записи и включает запись
+ *
+ * Файл доступен только владельцу: в нём остаются имена пользователей и
+ * тексты сообщений.
+ *
+ * @param[in] path Путь к файлу записи
+ * @retval 1 Запись включена
+ * @retval 0 Не удалось создать файл
+ */
+int capture_open(const char * path){
+#ifdef _WIN32
+  s_file = fopen(path, "wb");
+#else
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  // An existing file keeps its mode, O_CREAT only applies to new ones
+  if (fd >= 0 && fchmod(fd, S_IRUSR | S_IWUSR) != 0){
+    close(fd);
+    fd = -1;
+  }
+  if (fd >= 0 && (s_file = fdopen(fd, "wb")) == NULL){
+    close(fd);
+  }
+#endif
+  if (s_file == NULL){
+    return 0;
+  }
+  setvbuf(s_file, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+  if (fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LENGTH, s_file) !=
+      CAPTURE_MAGIC_LENGTH){
+    fclose(s_file);
+    s_file = NULL;
+    return 0;
+  }
+  s_start_ns = metrics_now_ns();
+  return 1;
+}
+
+
+/**
+ * @brief Функция добавляет замены значений параметра password, имя которого
+ * сравнивается без учёта регистра, как в mg_get_http_var
+ *
+ * @param[in] hm Запрос
+ * @param[in] vars Параметры запроса: строка запроса или тело
+ * @param[out] edits Замены
+ * @return Изменение длины параметров после замен
+ */
+static long redact_passwords(const struct http_message * hm,
+                             const struct mg_str * vars,
+                             std::vector<struct capture_edit> * edits){
+  static const char name[] = "password=";
+  const size_t name_length = sizeof(name) - 1;
+  long delta = 0;
+
+  for (size_t i = 0; i + name_length <= vars->len; i++){
+    // mg_get_http_var matches parameter names ignoring case
+    if ((i > 0 && vars->p[i - 1] != '&') ||
+        mg_ncasecmp(vars->p + i, name, name_length) != 0){
+      continue;
+    }
+    size_t end = i + name_length;
+    while (end < vars->len && vars->p[end] != '&'){
+      end++;
+    }
+    struct capture_edit edit;
+    edit.offset = (size_t) (vars->p - hm->message.p) + i + name_length;
+    edit.length = end - i - name_length;
+    edit.text = CAPTURE_PASSWORD;
+    delta += (long) edit.text.size() - (long) edit.length;
+    edits->push_back(edit);
+    i = end;
+  }
+  return delta;
+}
+
+
+/**
+ * @brief Функция сравнивает замены так, чтобы последние в запросе шли первыми
+ */
+static bool edit_after(const struct capture_edit & a,
+                       const struct capture_edit & b){
+  return a.offset > b.offset;
+}
+
+
+/**
+ * @brief Функция заменяет пароли в запросе на CAPTURE_PASSWORD
+ *
+ * @param[in] hm Запрос
+ * @param[in] status Код ответа
+ * @param[out] message Запрос с заменёнными паролями
+ * @retval 1 Пароли заменены
+ * @retval 0 В запросе нет паролей, запрос записывается как есть
+ */
+static int redact_request(struct http_message * hm,
+                          int status,
+                          std::string * message){
+  std::vector<struct capture_edit> edits;
+  char user[256], password[256];
+
+  redact_passwords(hm, &hm->query_string, &edits);
+  long delta = redact_passwords(hm, &hm->body, &edits);
+  for (int i = 0; i < MG_MAX_HTTP_HEADERS && hm->header_names[i].len > 0; i++){
+    struct capture_edit edit;
+    edit.offset = (size_t) (hm->header_values[i].p - hm->message.p);
+    edit.length = hm->header_values[i].len;
+    if (mg_vcasecmp(&hm->header_names[i], "Authorization") == 0 &&
+        mg_get_http_basic_auth(hm, user, sizeof(user), password,
+                               sizeof(password)) == 0){
+      std::string credentials = std::string(user) + ":" +
+        (status == 401 ? CAPTURE_REJECTED_PASSWORD : CAPTURE_PASSWORD);
+      std::vector<char> encoded(credentials.size() / 3 * 4 + 5);
+      mg_base64_encode((const unsigned char *) credentials.data(),
+                       (int) credentials.size(), &encoded[0]);
+      edit.text = std::string("Basic ") + &encoded[0];
+      edits.push_back(edit);
+    } else if (delta != 0 &&
+               mg_vcasecmp(&hm->header_names[i], "Content-Length") == 0){
+      char length[32];
+      snprintf(length, sizeof(length), "%lu",
+               (unsigned long) ((long) hm->body.len + delta));
+      edit.text = length;
+      edits.push_back(edit);
+    }
+  }
+  if (edits.empty()){
+    return 0;
+  }
+  // Replacing from the end keeps the offsets of earlier edits valid
+  std::sort(edits.begin(), edits.end(), edit_after);
+  message->assign(hm->message.p, hm->message.len);
+  for (size_t i = 0; i < edits.size(); i++){
+    message->replace(edits[i].offset, edits[i].length, edits[i].text);
+  }
+  return 1;
+}
+
+
+/**
+ * @brief Функция записывает обработанный запрос
+ *
+ * @param[in] nc Соединение, по которому пришёл запрос
+ * @param[in] hm Запрос
+ * @param[in] start_ns Время начала обработки, metrics_now_ns
+ * @param[in] status Код ответа или 0
+ * @param[in] elapsed_ns Время обработки запроса
+ */
+void capture_request(struct mg_connection * nc,
+                     struct http_message * hm,
+                     int64_t start_ns,
+                     int status,
+                     int64_t elapsed_ns){
+  struct capture_record record;
+  std::string redacted;
+  struct mg_str request;
+
+  if (s_file == NULL){
+    return;
+  }
+  request = hm->message;
+  if (redact_request(hm, status, &redacted)){
+    request = mg_mk_str_n(redacted.data(), redacted.size());
+  }
+  std::unordered_map<struct mg_connection *, uint32_t>::iterator it =
+    s_connections.find(nc);
+  if (it == s_connections.end()){
+    it = s_connections.insert(std::make_pair(nc, s_next_connection++)).first;
+  }
+  record.time_us = (start_ns - s_start_ns) / 1000;
+  record.connection = it->second;
+  record.length = (uint32_t) request.len;
+  record.status = (uint32_t) status;
+  record.elapsed_us = (uint32_t) (elapsed_ns / 1000);
+  if (fwrite(&record, sizeof(record), 1, s_file) != 1 ||
+      fwrite(request.p, 1, request.len, s_file) != request.len){
+    fprintf(stderr, "Cannot write capture, capture stopped\n");
+    capture_close();
+  }
+}
+
+
+/**
+ * @brief Функция забывает закрытое соединение
+ *
+ * @param[in] nc Закрываемое соединение
+ */
+void capture_forget(struct mg_connection * nc){
+  if (s_file != NULL){
+    s_connections.erase(nc);
+  }
+}
+
+
+/**
+ * @brief Функция завершает запись и закрывает файл
+ */
+void capture_close(void){
+  if (s_file != NULL){
+    fclose(s_file);
+    s_file = NULL;
+  }
+  s_connections.clear();
+}
+
+
+/**
+ * @brief Функция читает и проверяет сигнатуру файла записи
+ *
+ * @param[in] file Файл, открытый на чтение в двоичном режиме
+ * @retval 1 Файл является записью трафика
+ * @retval 0 В противном случае
+ */
+int capture_read_header(FILE * file){
+  char magic[CAPTURE_MAGIC_LENGTH];
+
+  return fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+         memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LENGTH) == 0;
+}
+
+
+/**
+ * @brief Функция читает следующую запись запроса
+ *
+ * @param[in] file Файл записи после capture_read_header
+ * @param[out] record Заголовок записи
+ * @param[out] message Запрос
+ * @retval 1 Запись прочитана
+ * @retval 0 Конец файла или запись обрезана
+ */
+int capture_read(FILE * file,
+                 struct capture_record * record,
+                 std::string * message){
+  if (fread(record, sizeof(*record), 1, file) != 1){
+    return 0;
+  }
+  message->resize(record->length);
+  return record->length == 0 ||
+         fread(&(*message)[0], 1, record->length, file) == record->length;
+}
@@ -0,0 +1,75 @@
+/**
+ * @file
+ * @brief Заголовочный файл записи трафика api.
+ *
+ * Сервер с параметром --capture записывает каждый обработанный запрос api
+ * вместе со временем получения, номером соединения, кодом и временем ответа.
+ * Файл воспроизводится утилитой replay на новом сервере для сравнения
+ * пропускной способности и задержек между версиями.
+ *
+ * Пароли из заголовков Authorization и параметров password записываются
+ * как CAPTURE_PASSWORD (CAPTURE_REJECTED_PASSWORD для отклонённых запросов),
+ * поэтому replay регистрирует пользователей с этим паролем. Остальное содержимое запросов, в том числе имена пользователей и
+ * тексты сообщений, записывается как есть, поэтому файл создаётся доступным
+ * только владельцу.
+ *
+ * Формат файла: сигнатура CAPTURE_MAGIC, затем записи capture_record, за
+ * каждой из которых следуют length байт запроса (строка запроса, заголовки и
+ * тело). Числа записываются в порядке байт машины, на которой сделана запись.
+ *
+ */
+
+#ifndef _MESSENGER_VIA_HTTP_SERVER__CAPTURE_H_
+#define _MESSENGER_VIA_HTTP_SERVER__CAPTURE_H_
+
+#include <stdio.h>
+#include <string>
+#include "mongoose.h"
+
+/// Сигнатура файла записи
+#define CAPTURE_MAGIC "MSGCAP01"
+
+/// Длина сигнатуры
+#define CAPTURE_MAGIC_LENGTH 8
+
+/// Пароль, которым заменяются пароли в записи
+#define CAPTURE_PASSWORD "captured"
+
+/// Пароль, которым заменяется пароль запроса, отклонённого с кодом 401,
+/// чтобы при воспроизведении запрос тоже был отклонён
+#define CAPTURE_REJECTED_PASSWORD "rejected"
+
+/// Заголовок записи запроса
+struct capture_record {
+  int64_t time_us; ///< Время получения запроса от начала записи
+  uint32_t connection; ///< Номер соединения, по которому пришёл запрос
+  uint32_t length; ///< Длина запроса
+  uint32_t status; ///< Код ответа или 0, если ответ не был отправлен
+  uint32_t elapsed_us; ///< Время обработки запроса сервером
+};
+
+int capture_open(const char * path);
+
+
+void capture_request(struct mg_connection * nc,
+                     struct http_message * hm,
+                     int64_t start_ns,
+                     int status,
+                     int64_t elapsed_ns);
+
+
+void capture_forget(struct mg_connection * nc);
+
+
+void capture_close(void);
+
+
+int capture_read_header(FILE * file);
+
+
+int capture_read(FILE * file,
+                 struct capture_record * record,
+                 std::string * message);
+
+
+#endif //_MESSENGER_VIA_HTTP_SERVER__CAPTURE_H_
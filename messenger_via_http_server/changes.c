@@ -0,0 +1,327 @@
+/**
+ * @file
+ * @brief Журнал изменений сообщений
+ *
+ * Все несжатые изменения лежат в одной очереди по возрастанию версии, журнал
+ * каждого адресата - очередь указателей на них. Изменение личного сообщения
+ * попадает в журналы отправителя и получателя, изменение сообщения группы -
+ * только в журнал группы: участник видит его, если сообщение попадает в
+ * один из его интервалов участия. Сжатие снимает изменения с начала общей
+ * очереди, и они же стоят в начале журналов адресатов.
+ *
+ * Последняя версия адресата не сбрасывается сжатием, поэтому версия,
+ * которую видит клиент, только растёт.
+ *
+ */
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "changes.h"
+#include "groups.h"
+#include "storage.h"
+
+/// Изменение со строками, на которые ссылается view
+struct change_entry {
+  struct change view; ///< Изменение, которое видят вызывающие функции
+  std::string from; ///< Отправитель сообщения
+  std::string to; ///< Адресат сообщения
+  std::string message; ///< Новый текст сообщения
+};
+
+/// Журнал адресата
+struct address_changes {
+  std::deque<const struct change_entry *> entries; ///< Несжатые изменения
+  int64_t latest; ///< Последняя версия адресата
+};
+
+/// Несжатые изменения по возрастанию версии
+static std::deque<struct change_entry> s_entries;
+/// Журналы по имени пользователя или адресу группы
+static std::unordered_map<std::string, struct address_changes> s_addresses;
+/// Последняя сжатая версия
+static int64_t s_horizon = 0;
+
+
+/**
+ * @brief Функция сравнивает изменение с версией для двоичного поиска
+ */
+static bool version_less(int64_t version,
+                         const struct change_entry * entry){
+  return version < entry->view.version;
+}
+
+
+/**
+ * @brief Функция сравнивает изменения по версии для сортировки
+ */
+static bool entry_less(const struct change_entry * a,
+                       const struct change_entry * b){
+  return a->view.version < b->view.version;
+}
+
+
+/**
+ * @brief Функция добавляет изменение в журнал адресата
+ */
+static void address_put(const std::string & address,
+                        const struct change_entry * entry){
+  struct address_changes & changes = s_addresses[address];
+
+  changes.entries.push_back(entry);
+  changes.latest = entry->view.version;
+}
+
+
+/**
+ * @brief Функция добавляет изменение в журнал
+ *
+ * @param[in] version Версия изменения, больше всех добавленных
+ * @param[in] message_id Изменённое сообщение
+ * @param[in] from Отправитель сообщения
+ * @param[in] to Адресат сообщения, для группы - с префиксом
+ * @param[in] message Новый текст сообщения, NULL - сообщение удалено
+ * @param[in] time Время изменения (UTC Unix)
+ */
+void changes_put(int64_t version,
+                 int64_t message_id,
+                 const char * from,
+                 const char * to,
+                 const char * message,
+                 int64_t time){
+  s_entries.push_back(change_entry());
+  struct change_entry & entry = s_entries.back();
+
+  entry.from = from;
+  entry.to = to;
+  if (message != NULL){
+    entry.message = message;
+  }
+  entry.view.version = version;
+  entry.view.message_id = message_id;
+  entry.view.from = entry.from.c_str();
+  entry.view.to = entry.to.c_str();
+  entry.view.message = message != NULL ? entry.message.c_str() : NULL;
+  entry.view.time = time;
+  // Group members find it through their memberships
+  address_put(entry.to, &entry);
+  if (to[0] != STORAGE_GROUP_PREFIX && entry.from != entry.to){
+    address_put(entry.from, &entry);
+  }
+}
+
+
+/**
+ * @brief Функция возвращает последнюю версию адресата
+ */
+static int64_t address_latest(const std::string & address){
+  std::unordered_map<std::string, struct address_changes>::const_iterator it =
+    s_addresses.find(address);
+  return it == s_addresses.end() ? 0 : it->second.latest;
+}
+
+
+/**
+ * @brief Функция учитывает последнюю версию группы для groups_membership_cb
+ */
+static void on_latest_group(const char * group,
+                            int64_t joined,
+                            int64_t left,
+                            void * arg){
+  int64_t * latest = (int64_t *) arg;
+  int64_t version = address_latest(STORAGE_GROUP_PREFIX + std::string(group));
+
+  (void) joined;
+  (void) left;
+  if (version > *latest){
+    *latest = version;
+  }
+}
+
+
+/**
+ * @brief Функция возвращает последнюю версию изменений, которые может
+ * видеть пользователь
+ *
+ * Изменения групп учитываются без проверки интервалов участия, поэтому
+ * версия может вырасти без видимых пользователю изменений, но не
+ * пропускает ни одного из них.
+ *
+ * @param[in] user Пользователь
+ * @return Версия, 0 если изменений не было
+ */
+int64_t changes_latest(const char * user){
+  int64_t latest = address_latest(user);
+
+  groups_memberships(user, on_latest_group, &latest);
+  return latest;
+}
+
+
+/**
+ * @brief Функция добавляет в result не больше limit изменений журнала
+ * адресата с версией больше since, сообщения которых попадают в промежуток
+ * (after, through]
+ */
+static void collect(const std::string & address,
+                    int64_t since,
+                    int64_t after,
+                    int64_t through,
+                    int limit,
+                    std::vector<const struct change_entry *> * result){
+  std::unordered_map<std::string, struct address_changes>::const_iterator it =
+    s_addresses.find(address);
+
+  if (it == s_addresses.end()){
+    return;
+  }
+  const std::deque<const struct change_entry *> & entries = it->second.entries;
+  std::deque<const struct change_entry *>::const_iterator entry =
+    std::upper_bound(entries.begin(), entries.end(), since, version_less);
+  for (; entry != entries.end() && limit > 0; ++entry){
+    if ((*entry)->view.message_id > after &&
+        (*entry)->view.message_id <= through){
+      result->push_back(*entry);
+      limit--;
+    }
+  }
+}
+
+
+/// Аргумент on_list_group
+struct list_arg {
+  int64_t since; ///< Последняя известная клиенту версия
+  int limit; ///< Наибольшее количество изменений из одного журнала
+  std::vector<const struct change_entry *> * result; ///< Найденные изменения
+};
+
+
+/**
+ * @brief Функция собирает изменения группы в интервале участия для
+ * groups_membership_cb
+ */
+static void on_list_group(const char * group,
+                          int64_t joined,
+                          int64_t left,
+                          void * arg){
+  struct list_arg * list = (struct list_arg *) arg;
+
+  collect(STORAGE_GROUP_PREFIX + std::string(group), list->since, joined, left,
+          list->limit, list->result);
+}
+
+
+/**
+ * @brief Функция обходит изменения, видимые пользователю, по возрастанию
+ * версии
+ *
+ * Каждый журнал (личный и каждого интервала участия в группе) даёт не
+ * больше limit изменений после since, первые limit из их объединения -
+ * ответ.
+ *
+ * @param[in] user Пользователь
+ * @param[in] since Последняя известная клиенту версия
+ * @param[in] limit Наибольшее количество изменений
+ * @param[in] cb Функция, вызываемая для каждого изменения
+ * @param[in] arg Аргумент cb
+ * @return Количество изменений, переданных в cb
+ */
+int changes_list(const char * user,
+                 int64_t since,
+                 int limit,
+                 change_cb cb,
+                 void * arg){
+  std::vector<const struct change_entry *> result;
+  struct list_arg list = { since, limit, &result };
+  int count = 0;
+
+  collect(user, since, 0, STORAGE_CURSOR_MAX, limit, &result);
+  groups_memberships(user, on_list_group, &list);
+  std::sort(result.begin(), result.end(), entry_less);
+  // Two intervals in one group can both hold a message
+  result.erase(std::unique(result.begin(), result.end()), result.end());
+  for (; count < (int) result.size() && count < limit; count++){
+    cb(&result[count]->view, arg);
+  }
+  return count;
+}
+
+
+/**
+ * @brief Функция устанавливает границу сжатия, прочитанную из хранилища
+ *
+ * @param[in] horizon Последняя сжатая версия
+ */
+void changes_set_horizon(int64_t horizon){
+  s_horizon = horizon;
+}
+
+
+/**
+ * @brief Функция возвращает последнюю сжатую версию
+ */
+int64_t changes_horizon(void){
+  return s_horizon;
+}
+
+
+/**
+ * @brief Функция находит границу следующей порции сжатия
+ *
+ * @param[in] before Сжимаются изменения, сделанные раньше этого времени
+ * (UTC Unix)
+ * @param[in] limit Наибольшее количество изменений в порции
+ * @return Последняя версия порции, changes_horizon() если сжимать нечего
+ */
+int64_t changes_compactable(int64_t before,
+                            int limit){
+  int64_t through = s_horizon;
+
+  for (int i = 0; i < limit && i < (int) s_entries.size() &&
+                  s_entries[i].view.time < before; i++){
+    through = s_entries[i].view.version;
+  }
+  return through;
+}
+
+
+/**
+ * @brief Функция снимает с начала журнала изменения до версии through,
+ * уже сжатые в хранилище
+ *
+ * @param[in] through Последняя сжатая версия
+ */
+void changes_compact(int64_t through){
+  while (!s_entries.empty() && s_entries.front().view.version <= through){
+    const struct change_entry & entry = s_entries.front();
+    s_addresses[entry.to].entries.pop_front();
+    if (entry.to[0] != STORAGE_GROUP_PREFIX && entry.from != entry.to){
+      s_addresses[entry.from].entries.pop_front();
+    }
+    s_entries.pop_front();
+  }
+  if (through > s_horizon){
+    s_horizon = through;
+  }
+}
+
+
+/**
+ * @brief Функция возвращает количество несжатых изменений в памяти
+ */
+size_t changes_count(void){
+  return s_entries.size();
+}
+
+
+/**
+ * @brief Функция освобождает журнал
+ */
+void changes_free(void){
+  s_addresses.clear();
+  s_entries.clear();
+  s_horizon = 0;
+}
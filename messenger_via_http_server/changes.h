@@ -0,0 +1,81 @@
+/**
+ * @file
+ * @brief Заголовочный файл журнала изменений сообщений.
+ *
+ * Правка и удаление сообщения получают версию из общей растущей
+ * последовательности хранилища. Клиент синхронизирует изменения так же, как
+ * сообщения: передаёт последнюю известную версию и получает изменения после
+ * неё, а не скачивает историю заново. Несжатые изменения хранятся в памяти
+ * в журнале каждого адресата (пользователя или группы), поэтому изменения
+ * пользователя выдаются без обращения к хранилищу. Журнал строится одним
+ * обходом хранилища при запуске сервера.
+ *
+ * Изменения старше срока хранения сжимаются порциями в цикле событий: они
+ * удаляются из журнала, а удалённые ими сообщения - из хранилища. Клиенту с
+ * версией до границы сжатия нужно заново скачать историю.
+ *
+ */
+
+#ifndef _MESSENGER_VIA_HTTP_SERVER__CHANGES_H_
+#define _MESSENGER_VIA_HTTP_SERVER__CHANGES_H_
+
+#include <stddef.h>
+#include "mongoose.h"
+
+/// Срок хранения изменений по умолчанию (в секундах)
+#define CHANGES_RETENTION_S (7 * 24 * 3600)
+
+/// Наибольшее количество изменений, сжимаемых за итерацию цикла событий
+#define CHANGES_COMPACT_BATCH 256
+
+/// Изменение сообщения
+struct change {
+  int64_t version; ///< Версия изменения
+  int64_t message_id; ///< Изменённое сообщение
+  const char * from; ///< Отправитель сообщения
+  const char * to; ///< Адресат сообщения
+  const char * message; ///< Новый текст сообщения, NULL - сообщение удалено
+  int64_t time; ///< Время изменения (UTC Unix)
+};
+
+/// Функция, вызываемая для каждого изменения при обходе журнала
+typedef void (*change_cb)(const struct change * change, void * arg);
+
+void changes_put(int64_t version,
+                 int64_t message_id,
+                 const char * from,
+                 const char * to,
+                 const char * message,
+                 int64_t time);
+
+
+int64_t changes_latest(const char * user);
+
+
+int changes_list(const char * user,
+                 int64_t since,
+                 int limit,
+                 change_cb cb,
+                 void * arg);
+
+
+void changes_set_horizon(int64_t horizon);
+
+
+int64_t changes_horizon(void);
+
+
+int64_t changes_compactable(int64_t before,
+                            int limit);
+
+
+void changes_compact(int64_t through);
+
+
+size_t changes_count(void);
+
+
+void changes_free(void);
+
+
+#endif //_MESSENGER_VIA_HTTP_SERVER__CHANGES_H_
@@ -0,0 +1,409 @@
+/**
+ * @file
+ * @brief Сжатие ответов HTTP
+ *
+ * Сжатая копия статического файла используется, только если она не старше
+ * оригинала; иначе файл отдаёт mg_serve_http как обычно. Копии создаются
+ * только для текстовых типов файлов и только если они меньше оригинала.
+ *
+ * Ответ api сжимается уже поставленным в буфер отправки: заголовок
+ * Content-Length заменяется, к ETag дописывается COMPRESS_ETAG_SUFFIX,
+ * добавляются Content-Encoding и Vary. Несжатый
+ * ответ api при включённом сжатии тоже получает Vary, иначе кэш мог бы
+ * отдать его клиенту, который принимает gzip, и наоборот.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "compress.h"
+#include "gzip.h"
+#include "metrics.h"
+
+#ifndef _WIN32
+#include <dirent.h>
+#endif
+
+/// Длина цепочки повторов для статических файлов, сжимаемых один раз
+#define COMPRESS_STATIC_CHAIN 256
+
+/// Тип содержимого по расширению файла
+struct compress_mime {
+  const char * extension; ///< Расширение с точкой
+  const char * type; ///< Тип содержимого
+};
+
+/// Типы файлов, которые имеет смысл сжимать
+static const struct compress_mime s_mime_types[] = {
+  { ".html", "text/html" },
+  { ".htm", "text/html" },
+  { ".css", "text/css" },
+  { ".js", "application/javascript" },
+  { ".json", "application/json" },
+  { ".svg", "image/svg+xml" },
+  { ".txt", "text/plain" },
+  { ".xml", "text/xml" }
+};
+
+/// Заголовки сжатого ответа
+static const struct mg_str s_gzip_headers =
+  MG_MK_STR("Content-Encoding: gzip\r\nVary: Accept-Encoding");
+
+/// Заголовок несжатого ответа
+static const struct mg_str s_vary_header =
+  MG_MK_STR("Vary: Accept-Encoding\r\n");
+
+/// Наименьший сжимаемый ответ api, 0 - ответы не сжимаются
+static size_t s_min_bytes = COMPRESS_MIN_BYTES;
+/// Время сжатия ответов за итерацию, 0 - без ограничения
+static int64_t s_budget_ns = (int64_t) COMPRESS_BUDGET_MS * 1000000;
+/// Время сжатия ответов в текущей итерации
+static int64_t s_spent_ns = 0;
+/// Статистика
+static struct compress_stats s_stats;
+
+
+/**
+ * @brief Функция устанавливает параметры сжатия ответов api
+ *
+ * @param[in] min_bytes Наименьший сжимаемый ответ, 0 выключает сжатие
+ * @param[in] budget_ns Время сжатия за итерацию, 0 - без ограничения
+ */
+void compress_init(size_t min_bytes,
+                   int64_t budget_ns){
+  s_min_bytes = min_bytes;
+  s_budget_ns = budget_ns;
+  memset(&s_stats, 0, sizeof(s_stats));
+}
+
+
+/**
+ * @brief Функция возвращает тип содержимого сжимаемого файла или NULL
+ */
+static const char * mime_type(const std::string & path){
+  for (size_t i = 0; i < sizeof(s_mime_types) / sizeof(s_mime_types[0]); i++){
+    size_t n = strlen(s_mime_types[i].extension);
+    if (path.size() > n &&
+        mg_ncasecmp(path.c_str() + path.size() - n,
+                    s_mime_types[i].extension, n) == 0){
+      return s_mime_types[i].type;
+    }
+  }
+  return NULL;
+}
+
+
+/**
+ * @brief Функция проверяет, что клиент принимает ответы в gzip
+ *
+ * "gzip;q=0" означает отказ от gzip.
+ */
+static int accepts_gzip(struct http_message * hm){
+  struct mg_str * h = mg_get_http_header(hm, "Accept-Encoding");
+  const char * p, * end;
+
+  if (h == NULL){
+    return 0;
+  }
+  for (p = h->p, end = h->p + h->len; p < end; p++){
+    const char * token = p;
+    const char * params;
+    while (p < end && *p != ','){
+      p++;
+    }
+    while (token < p && *token == ' '){
+      token++;
+    }
+    params = token;
+    while (params < p && *params != ';' && *params != ' '){
+      params++;
+    }
+    if (params - token != 4 || mg_ncasecmp(token, "gzip", 4) != 0){
+      continue;
+    }
+    const char * q = params;
+    while (q + 2 < p && mg_ncasecmp(q, "q=", 2) != 0){
+      q++;
+    }
+    return q + 2 < p ? atof(std::string(q + 2, p).c_str()) > 0 : 1;
+  }
+  return 0;
+}
+
+
+/**
+ * @brief Функция возвращает имена файлов и каталогов в каталоге dir
+ */
+static std::vector<std::string> list_dir(const std::string & dir){
+  std::vector<std::string> names;
+
+#ifdef _WIN32
+  WIN32_FIND_DATAA fd;
+  HANDLE h = FindFirstFileA((dir + "\\*").c_str(), &fd);
+  if (h == INVALID_HANDLE_VALUE){
+    return names;
+  }
+  do {
+    names.push_back(fd.cFileName);
+  } while (FindNextFileA(h, &fd));
+  FindClose(h);
+#else
+  DIR * d = opendir(dir.c_str());
+  struct dirent * e;
+  if (d == NULL){
+    return names;
+  }
+  while ((e = readdir(d)) != NULL){
+    names.push_back(e->d_name);
+  }
+  closedir(d);
+#endif
+  return names;
+}
+
+
+/**
+ * @brief Функция создаёт или обновляет сжатую копию файла path
+ *
+ * @retval 1 Свежая сжатая копия есть
+ * @retval 0 Файл не сжимается или копию не удалось записать
+ */
+static int prepare_file(const std::string & path,
+                        const cs_stat_t * st){
+  std::string gz = path + ".gz";
+  cs_stat_t gz_st;
+  std::string data, out;
+  char buf[8192];
+  size_t n;
+  FILE * f;
+
+  if (mg_stat(gz.c_str(), &gz_st) == 0 && gz_st.st_mtime >= st->st_mtime){
+    return 1;
+  }
+  if ((f = fopen(path.c_str(), "rb")) == NULL){
+    return 0;
+  }
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0){
+    data.append(buf, n);
+  }
+  fclose(f);
+  gzip_compress(data.data(), data.size(), COMPRESS_STATIC_CHAIN, &out);
+  if (out.size() >= data.size()){
+    // A stale copy would be served instead of the newer file
+    remove(gz.c_str());
+    return 0;
+  }
+  if ((f = fopen(gz.c_str(), "wb")) == NULL){
+    return 0;
+  }
+  n = fwrite(out.data(), 1, out.size(), f);
+  if (fclose(f) != 0 || n != out.size()){
+    remove(gz.c_str());
+    return 0;
+  }
+  return 1;
+}
+
+
+/**
+ * @brief Функция создаёт сжатые копии текстовых файлов каталога root и
+ * его подкаталогов, если копий нет или они старше файлов
+ *
+ * @param[in] root Корневой каталог статических файлов
+ * @return Количество файлов со свежими сжатыми копиями
+ */
+int compress_prepare_static(const char * root){
+  std::vector<std::string> names = list_dir(root);
+  int prepared = 0;
+
+  for (size_t i = 0; i < names.size(); i++){
+    std::string path = std::string(root) + "/" + names[i];
+    cs_stat_t st;
+
+    if (names[i] == "." || names[i] == ".." ||
+        mg_stat(path.c_str(), &st) != 0){
+      continue;
+    }
+    if ((st.st_mode & S_IFMT) == S_IFDIR){
+      prepared += compress_prepare_static(path.c_str());
+    } else if (mime_type(path) != NULL){
+      prepared += prepare_file(path, &st);
+    }
+  }
+  return prepared;
+}
+
+
+/**
+ * @brief Функция начинает итерацию цикла событий
+ */
+void compress_iteration_begin(void){
+  s_spent_ns = 0;
+}
+
+
+/**
+ * @brief Функция отдаёт сжатую копию статического файла, если клиент
+ * принимает gzip и копия свежая
+ *
+ * @param[in] nc Соединение
+ * @param[in] hm Запрос
+ * @param[in] root Корневой каталог статических файлов
+ * @retval 1 Файл отдан
+ * @retval 0 Файл нужно отдать mg_serve_http
+ */
+int compress_serve_static(struct mg_connection * nc,
+                          struct http_message * hm,
+                          const char * root){
+  std::string uri(hm->uri.p, hm->uri.len);
+  cs_stat_t st, gz_st;
+
+  // Encoded and relative paths are left to mongoose, it normalizes them
+  if (!accepts_gzip(hm) || uri.empty() || uri[0] != '/' ||
+      uri.find_first_of("%\\") != std::string::npos ||
+      uri.find("..") != std::string::npos){
+    return 0;
+  }
+  std::string path = root + uri;
+  if (uri[uri.size() - 1] == '/'){
+    path += "index.html";
+  }
+  const char * type = mime_type(path);
+  std::string gz = path + ".gz";
+  if (type == NULL || mg_stat(path.c_str(), &st) != 0 ||
+      (st.st_mode & S_IFMT) == S_IFDIR || mg_stat(gz.c_str(), &gz_st) != 0 ||
+      gz_st.st_mtime < st.st_mtime){
+    return 0;
+  }
+  mg_http_serve_file(nc, hm, gz.c_str(), mg_mk_str(type), s_gzip_headers);
+  s_stats.static_files++;
+  return 1;
+}
+
+
+/**
+ * @brief Функция заменяет ответ в буфере отправки сжатым
+ *
+ * Сжимаются ответы с Content-Length не меньше порога, без Content-Encoding,
+ * пока не исчерпан бюджет времени итерации.
+ *
+ * @param[in] nc Соединение
+ * @param[in] hm Запрос
+ * @param[in] offset Длина буфера отправки до ответа на запрос
+ * @param[in] headers_len Длина строки статуса и заголовков ответа без 
+ * завершающей пустой строки
+ * @retval 1 Ответ сжат
+ * @retval 0 Ответ оставлен как есть
+ */
+static int gzip_response(struct mg_connection * nc,
+                         struct http_message * hm,
+                         size_t offset,
+                         size_t headers_len){
+  static const struct mg_str length_header = MG_MK_STR("Content-Length:");
+  static const struct mg_str encoding_header = MG_MK_STR("Content-Encoding:");
+  static const struct mg_str etag_header = MG_MK_STR("ETag:");
+  struct mbuf * io = &nc->send_mbuf;
+  const char * response = io->buf + offset;
+  size_t len = io->len - offset;
+  size_t content_length = (size_t) -1;
+  std::string head, out;
+  size_t i;
+
+  if (len < s_min_bytes || !accepts_gzip(hm)){
+    return 0;
+  }
+  // Keep the status line and every header but Content-Length, mark the ETag
+  for (i = 0; i < headers_len;){
+    const char * line = response + i;
+    size_t n = (const char *) memchr(line, '\n', headers_len - i) - line + 1;
+    if (n > length_header.len &&
+        mg_ncasecmp(line, length_header.p, length_header.len) == 0){
+      content_length = (size_t) atol(line + length_header.len);
+    } else if (n > encoding_header.len &&
+               mg_ncasecmp(line, encoding_header.p, encoding_header.len) == 0){
+      return 0;
+    } else if (n > etag_header.len + 3 && line[n - 3] == '"' &&
+               mg_ncasecmp(line, etag_header.p, etag_header.len) == 0){
+      head.append(line, n - 3);
+      head.append(COMPRESS_ETAG_SUFFIX "\"\r\n");
+    } else {
+      head.append(line, n);
+    }
+    i += n;
+  }
+  // Only a single whole response with its body is rewritten
+  if (content_length != len - headers_len - 2 ||
+      content_length < s_min_bytes){
+    return 0;
+  }
+  if (s_budget_ns > 0 && s_spent_ns >= s_budget_ns){
+    s_stats.over_budget++;
+    return 0;
+  }
+
+  int64_t start = metrics_now_ns();
+  gzip_compress(response + headers_len + 2, content_length, GZIP_MAX_CHAIN,
+                &out);
+  s_spent_ns += metrics_now_ns() - start;
+  if (out.size() >= content_length){
+    return 0;
+  }
+  char length[64];
+  snprintf(length, sizeof(length), "Content-Length: %d\r\n\r\n",
+           (int) out.size());
+  head.append(s_gzip_headers.p, s_gzip_headers.len);
+  head.append("\r\n");
+  head.append(length);
+  s_stats.responses++;
+  s_stats.bytes_in += content_length;
+  s_stats.bytes_out += out.size();
+  io->len = offset;
+  mg_send(nc, head.data(), (int) head.size());
+  mg_send(nc, out.data(), (int) out.size());
+  return 1;
+}
+
+
+/**
+ * @brief Функция сжимает ответ, поставленный в буфер отправки, а несжатому
+ * ответу добавляет Vary: Accept-Encoding
+ *
+ * При выключенном сжатии ответ не меняется.
+ *
+ * @param[in] nc Соединение
+ * @param[in] hm Запрос
+ * @param[in] offset Длина буфера отправки до ответа на запрос
+ */
+void compress_response(struct mg_connection * nc,
+                       struct http_message * hm,
+                       size_t offset){
+  struct mbuf * io = &nc->send_mbuf;
+  size_t headers_len = 0;
+
+  if (s_min_bytes == 0){
+    return;
+  }
+  for (size_t i = offset; i + 3 < io->len; i++){
+    if (memcmp(io->buf + i, "\r\n\r\n", 4) == 0){
+      headers_len = i + 2 - offset;
+      break;
+    }
+  }
+  if (headers_len == 0 || gzip_response(nc, hm, offset, headers_len)){
+    return;
+  }
+  mbuf_insert(io, offset + headers_len, s_vary_header.p, s_vary_header.len);
+}
+
+
+/**
+ * @brief Функция возвращает статистику сжатия
+ *
+ * @param[out] stats Статистика
+ */
+void compress_get_stats(struct compress_stats * stats){
+  *stats = s_stats;
+}
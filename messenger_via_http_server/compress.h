@@ -0,0 +1,62 @@
+/**
+ * @file
+ * @brief Заголовочный файл сжатия ответов HTTP.
+ *
+ * Клиенту, который прислал Accept-Encoding с gzip, статические файлы
+ * отдаются из заранее сжатых копий file.gz рядом с оригиналом, а ответы api
+ * больше порога сжимаются перед отправкой. Все ответы api при включённом
+ * сжатии содержат Vary: Accept-Encoding. Копии готовятся при запуске
+ * сервера, поэтому на запрос файла процессор не тратится. Время сжатия
+ * ответов api за итерацию цикла событий ограничено: сверх бюджета ответы
+ * уходят несжатыми.
+ *
+ */
+
+#ifndef _MESSENGER_VIA_HTTP_SERVER__COMPRESS_H_
+#define _MESSENGER_VIA_HTTP_SERVER__COMPRESS_H_
+
+#include "mongoose.h"
+
+/// Наименьший сжимаемый ответ по умолчанию, байт
+#define COMPRESS_MIN_BYTES 1024
+
+/// Время сжатия ответов за итерацию по умолчанию (мс)
+#define COMPRESS_BUDGET_MS 10
+
+/// Суффикс, который дописывается внутри кавычек к ETag сжатого ответа:
+/// представления с разным Content-Encoding должны иметь разные ETag
+#define COMPRESS_ETAG_SUFFIX "-gz"
+
+/// Статистика сжатия
+struct compress_stats {
+  int64_t static_files; ///< Файлы, отданные из сжатых копий
+  int64_t responses; ///< Сжатые ответы
+  int64_t bytes_in; ///< Размер сжатых ответов до сжатия
+  int64_t bytes_out; ///< Размер сжатых ответов после сжатия
+  int64_t over_budget; ///< Ответы, не сжатые из-за бюджета
+};
+
+void compress_init(size_t min_bytes,
+                   int64_t budget_ns);
+
+
+int compress_prepare_static(const char * root);
+
+
+void compress_iteration_begin(void);
+
+
+int compress_serve_static(struct mg_connection * nc,
+                          struct http_message * hm,
+                          const char * root);
+
+
+void compress_response(struct mg_connection * nc,
+                       struct http_message * hm,
+                       size_t offset);
+
+
+void compress_get_stats(struct compress_stats * stats);
+
+
+#endif //_MESSENGER_VIA_HTTP_SERVER__COMPRESS_H_
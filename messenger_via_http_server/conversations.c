@@ -0,0 +1,333 @@
+/**
+ * @file
+ * @brief Список переписок пользователей
+ *
+ * Сводки переписок пользователя хранятся в таблице по собеседнику и
+ * упорядочены по последнему сообщению: идентификаторы сообщений растут,
+ * поэтому новое сообщение переносит переписку в начало списка за
+ * логарифмическое время, а список обходится без сортировки.
+ *
+ * Версия списка пользователя увеличивается при каждом изменении, по ней
+ * строится ETag ответа list_conversations. Сводки не вытесняются: их
+ * количество равно количеству пар собеседников, обменявшихся сообщениями.
+ *
+ */
+
+#include <string.h>
+#include <functional>
+#include <map>
+#include <string>
+#include <unordered_map>
+
+#include "conversations.h"
+
+/// Сводка переписки со строками, на которые ссылается view
+struct conversation_entry {
+  struct conversation view; ///< Сводка, которую видят вызывающие функции
+  std::string peer; ///< Собеседник
+  std::string from; ///< Отправитель последнего сообщения
+  std::string preview; ///< Начало текста последнего сообщения
+};
+
+/// Переписки одного пользователя
+struct user_conversations {
+  /// Переписки по собеседнику
+  std::unordered_map<std::string, struct conversation_entry> by_peer;
+  /// Переписки от новых к старым по последнему сообщению
+  std::map<int64_t, struct conversation_entry *, std::greater<int64_t> >
+    by_latest;
+  int64_t version; ///< Версия списка, растёт при каждом изменении
+};
+
+/// Переписки пользователей по имени пользователя
+static std::unordered_map<std::string, struct user_conversations> s_users;
+/// Количество сводок
+static size_t s_count = 0;
+
+
+/**
+ * @brief Функция возвращает длину начала текста, не разрезающую символ UTF-8
+ */
+static size_t preview_length(const char * message){
+  size_t len = strlen(message);
+
+  if (len <= CONVERSATIONS_PREVIEW_LENGTH){
+    return len;
+  }
+  len = CONVERSATIONS_PREVIEW_LENGTH;
+  while (len > 0 && ((unsigned char) message[len] & 0xc0) == 0x80){
+    len--;
+  }
+  return len;
+}
+
+
+/**
+ * @brief Функция заменяет начало текста последнего сообщения, удалённому 
+ * сообщению (NULL) соответствует пустая строка
+ */
+static void set_preview(struct conversation_entry * entry,
+                        const char * message){
+  if (message == NULL){
+    entry->preview.clear();
+  } else {
+    entry->preview.assign(message, preview_length(message));
+  }
+  entry->view.preview = entry->preview.c_str();
+}
+
+
+/**
+ * @brief Функция делает сообщение последним в переписке user с peer, если
+ * оно новее последнего
+ *
+ * @return Сводка переписки
+ */
+static struct conversation_entry * update(const char * user,
+                                          const char * peer,
+                                          int64_t message_id,
+                                          const char * from,
+                                          const char * message,
+                                          int64_t time){
+  struct user_conversations & conversations = s_users[user];
+  std::unordered_map<std::string, struct conversation_entry>::iterator it =
+    conversations.by_peer.find(peer);
+  struct conversation_entry * entry;
+
+  if (it == conversations.by_peer.end()){
+    entry = &conversations.by_peer[peer];
+    entry->peer = peer;
+    entry->view.message_id = 0;
+    entry->view.read = 0;
+    entry->view.unread = 0;
+    s_count++;
+  } else {
+    entry = &it->second;
+    if (message_id <= entry->view.message_id){
+      return entry;
+    }
+    conversations.by_latest.erase(entry->view.message_id);
+  }
+  entry->from = from;
+  set_preview(entry, message);
+  entry->view.peer = entry->peer.c_str();
+  entry->view.message_id = message_id;
+  entry->view.from = entry->from.c_str();
+  entry->view.time = time;
+  conversations.by_latest[message_id] = entry;
+  conversations.version++;
+  return entry;
+}
+
+
+/**
+ * @brief Функция заполняет сводку переписки, прочитанную из хранилища
+ *
+ * @param[in] user Пользователь
+ * @param[in] peer Собеседник
+ * @param[in] message_id Последнее сообщение переписки
+ * @param[in] from Отправитель последнего сообщения
+ * @param[in] message Текст последнего сообщения, NULL - сообщение удалено
+ * @param[in] time Время последнего сообщения (UTC Unix)
+ * @param[in] read Последнее прочитанное пользователем сообщение
+ * @param[in] unread Сообщения собеседника после прочитанного
+ */
+void conversations_set(const char * user,
+                       const char * peer,
+                       int64_t message_id,
+                       const char * from,
+                       const char * message,
+                       int64_t time,
+                       int64_t read,
+                       int64_t unread){
+  struct conversation_entry * entry =
+    update(user, peer, message_id, from, message, time);
+
+  entry->view.read = read;
+  entry->view.unread = unread;
+}
+
+
+/**
+ * @brief Функция учитывает отправленное сообщение в переписках отправителя
+ * и получателя
+ *
+ * @param[in] message_id Уникальный идентификатор сообщения
+ * @param[in] from От кого адресовано сообщение
+ * @param[in] to Кому адресовано сообщение
+ * @param[in] message Текст сообщения
+ * @param[in] time Время получения сообщения сервером (UTC Unix)
+ */
+void conversations_put(int64_t message_id,
+                       const char * from,
+                       const char * to,
+                       const char * message,
+                       int64_t time){
+  update(from, to, message_id, from, message, time);
+  if (strcmp(from, to)){
+    struct conversation_entry * entry =
+      update(to, from, message_id, from, message, time);
+    if (message_id > entry->view.read){
+      entry->view.unread++;
+    }
+  }
+}
+
+
+/**
+ * @brief Функция заменяет начало текста изменённого сообщения в сводке 
+ * переписки user с peer, если это последнее сообщение переписки
+ */
+static void change(const char * user,
+                   const char * peer,
+                   int64_t message_id,
+                   const char * message){
+  std::unordered_map<std::string, struct user_conversations>::iterator it =
+    s_users.find(user);
+
+  if (it == s_users.end()){
+    return;
+  }
+  std::unordered_map<std::string, struct conversation_entry>::iterator entry =
+    it->second.by_peer.find(peer);
+  if (entry != it->second.by_peer.end() &&
+      entry->second.view.message_id == message_id){
+    set_preview(&entry->second, message);
+    it->second.version++;
+  }
+}
+
+
+/**
+ * @brief Функция учитывает правку или удаление сообщения в переписках 
+ * отправителя и получателя
+ *
+ * Удалённое сообщение остаётся последним в переписке с пустым началом 
+ * текста до перезапуска сервера: сводки строятся заново из хранилища, где 
+ * после сжатия его уже нет.
+ *
+ * @param[in] message_id Изменённое сообщение
+ * @param[in] from От кого адресовано сообщение
+ * @param[in] to Кому адресовано сообщение
+ * @param[in] message Новый текст сообщения, NULL - сообщение удалено
+ */
+void conversations_change(int64_t message_id,
+                          const char * from,
+                          const char * to,
+                          const char * message){
+  change(from, to, message_id, message);
+  if (strcmp(from, to)){
+    change(to, from, message_id, message);
+  }
+}
+
+
+/**
+ * @brief Функция находит сводку переписки
+ *
+ * @param[in] user Пользователь
+ * @param[in] peer Собеседник
+ * @retval NULL Пользователь и собеседник не обменивались сообщениями
+ * @retval Указатель на сводку, действительный до следующего изменения
+ */
+const struct conversation * conversations_find(const char * user,
+                                               const char * peer){
+  std::unordered_map<std::string, struct user_conversations>::iterator it =
+    s_users.find(user);
+
+  if (it == s_users.end()){
+    return NULL;
+  }
+  std::unordered_map<std::string, struct conversation_entry>::iterator entry =
+    it->second.by_peer.find(peer);
+  return entry == it->second.by_peer.end() ? NULL : &entry->second.view;
+}
+
+
+/**
+ * @brief Функция отмечает переписку прочитанной до сообщения read
+ *
+ * @param[in] user Пользователь
+ * @param[in] peer Собеседник
+ * @param[in] read Последнее прочитанное сообщение
+ * @param[in] unread Сообщения собеседника после прочитанного
+ */
+void conversations_set_read(const char * user,
+                            const char * peer,
+                            int64_t read,
+                            int64_t unread){
+  std::unordered_map<std::string, struct user_conversations>::iterator it =
+    s_users.find(user);
+
+  if (it == s_users.end()){
+    return;
+  }
+  std::unordered_map<std::string, struct conversation_entry>::iterator entry =
+    it->second.by_peer.find(peer);
+  if (entry != it->second.by_peer.end()){
+    entry->second.view.read = read;
+    entry->second.view.unread = unread;
+    it->second.version++;
+  }
+}
+
+
+/**
+ * @brief Функция возвращает версию списка переписок пользователя
+ *
+ * @param[in] user Пользователь
+ * @return Версия, 0 если переписок нет
+ */
+int64_t conversations_version(const char * user){
+  std::unordered_map<std::string, struct user_conversations>::const_iterator
+    it = s_users.find(user);
+  return it == s_users.end() ? 0 : it->second.version;
+}
+
+
+/**
+ * @brief Функция обходит переписки пользователя от новых к старым
+ *
+ * @param[in] user Пользователь
+ * @param[in] limit Наибольшее количество переписок, 0 - все
+ * @param[in] cb Функция, вызываемая для каждой переписки
+ * @param[in] arg Аргумент cb
+ * @return Количество переписок, переданных в cb
+ */
+int conversations_list(const char * user,
+                       int limit,
+                       conversation_cb cb,
+                       void * arg){
+  std::unordered_map<std::string, struct user_conversations>::const_iterator
+    it = s_users.find(user);
+  int count = 0;
+
+  if (it == s_users.end()){
+    return 0;
+  }
+  std::map<int64_t, struct conversation_entry *,
+           std::greater<int64_t> >::const_iterator entry;
+  for (entry = it->second.by_latest.begin();
+       entry != it->second.by_latest.end() && (limit == 0 || count < limit);
+       ++entry, count++){
+    cb(&entry->second->view, arg);
+  }
+  return count;
+}
+
+
+/**
+ * @brief Функция возвращает количество сводок переписок в памяти
+ */
+size_t conversations_count(void){
+  return s_count;
+}
+
+
+/**
+ * @brief Функция освобождает все сводки
+ */
+void conversations_free(void){
+  s_users.clear();
+  s_count = 0;
+}
@@ -0,0 +1,87 @@
+/**
+ * @file
+ * @brief Заголовочный файл списка переписок пользователей.
+ *
+ * Для каждого пользователя в памяти хранится сводка каждой его переписки:
+ * собеседник, последнее сообщение с началом текста и количество
+ * непрочитанных сообщений собеседника. Сводки строятся одним обходом
+ * хранилища при запуске сервера и дальше обновляются при отправке, правке и
+ * удалении сообщений и отметках о прочтении, поэтому список переписок
+ * отдаётся без обращения к хранилищу за время, пропорциональное количеству
+ * переписок.
+ *
+ */
+
+#ifndef _MESSENGER_VIA_HTTP_SERVER__CONVERSATIONS_H_
+#define _MESSENGER_VIA_HTTP_SERVER__CONVERSATIONS_H_
+
+#include <stddef.h>
+#include "mongoose.h"
+
+/// Наибольшая длина начала текста последнего сообщения (в байтах)
+#define CONVERSATIONS_PREVIEW_LENGTH 64
+
+/// Сводка переписки пользователя с собеседником
+struct conversation {
+  const char * peer; ///< Собеседник
+  int64_t message_id; ///< Последнее сообщение переписки
+  const char * from; ///< Отправитель последнего сообщения
+  const char * preview; ///< Начало текста последнего сообщения
+  int64_t time; ///< Время последнего сообщения (UTC Unix)
+  int64_t read; ///< Последнее прочитанное пользователем сообщение
+  int64_t unread; ///< Сообщения собеседника после прочитанного
+};
+
+/// Функция, вызываемая для каждой переписки при обходе списка
+typedef void (*conversation_cb)(const struct conversation * conversation,
+                                void * arg);
+
+void conversations_set(const char * user,
+                       const char * peer,
+                       int64_t message_id,
+                       const char * from,
+                       const char * message,
+                       int64_t time,
+                       int64_t read,
+                       int64_t unread);
+
+
+void conversations_put(int64_t message_id,
+                       const char * from,
+                       const char * to,
+                       const char * message,
+                       int64_t time);
+
+
+void conversations_change(int64_t message_id,
+                          const char * from,
+                          const char * to,
+                          const char * message);
+
+
+const struct conversation * conversations_find(const char * user,
+                                               const char * peer);
+
+
+void conversations_set_read(const char * user,
+                            const char * peer,
+                            int64_t read,
+                            int64_t unread);
+
+
+int64_t conversations_version(const char * user);
+
+
+int conversations_list(const char * user,
+                       int limit,
+                       conversation_cb cb,
+                       void * arg);
+
+
+size_t conversations_count(void);
+
+
+void conversations_free(void);
+
+
+#endif //_MESSENGER_VIA_HTTP_SERVER__CONVERSATIONS_H_
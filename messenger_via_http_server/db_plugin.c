@@ -0,0 +1,2144 @@
+/**
+ * @file 
+ * @brief Прослойка между хранилищем и mongoose
+ *
+ * Функции, содержащиеся в файле выполняют роль прослойки между хранилищем 
+ * сообщений (см. storage.h) и серверной частью приложения, написанной с 
+ * использованием mongoose networking library. Так же содержит все функции api 
+ * сервера.
+ *
+ */
+
+#include <limits.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "mongoose.h"
+#include "db_plugin.h"
+#include "message_cache.h"
+#include "conversations.h"
+#include "groups.h"
+#include "changes.h"
+#include "dedup.h"
+#include "arena.h"
+#include "compress.h"
+#include "json.h"
+
+extern int is_equal(const struct mg_str * s1, const struct mg_str * s2);
+
+/// Заголовки ответа на запрос GET, проверяемого по ETag
+#define ETAG_CACHE_HEADERS \
+  "Cache-Control: private, no-cache\r\nVary: Authorization\r\n"
+
+/// Пароли, уже проверенные по хранилищу запросами GET. Пароль
+/// зарегистрированного пользователя не меняется, поэтому проверка остаётся
+/// верной
+static std::unordered_map<std::string, std::string> s_verified;
+/// Версии строк пользователей, известных существующими
+static std::unordered_map<std::string, int64_t> s_user_versions;
+/// Время запуска в мс, отличает ETag разных запусков сервера
+static int64_t s_etag_epoch = 0;
+
+/**
+ * @brief Функция формирует строку - JSON сообщение
+ *
+ * Строки сообщения экранируются json_write_string.
+ *
+ * @param[in] a Арена запроса, из которой выделяется строка
+ * @param[in] message_id Уникальный идентификатор сообщения
+ * @param[in] from От кого адресовано сообщение
+ * @param[in] to Кому адресовано сообщение
+ * @param[in] message Текст сообщения, NULL - сообщение удалено
+ * @param[in] time Время, в которое сообщение было получено сервером (UTC Unix)
+ * @return Указатель на строку, содержащую JSON сообщение
+ */
+char * build_message_json(struct arena * a,
+                          const char * message_id, 
+                          const char * from, 
+                          const char * to, 
+                          const char * message, 
+                          const char * time){
+  char * result = (char *) arena_alloc(a, strlen(message_id) +
+                                          json_string_length(from) +
+                                          json_string_length(to) +
+                                          (message != NULL ? 
+                                           json_string_length(message) : 4) +
+                                          strlen(time) + 60);
+  char * p = result;
+
+  p += sprintf(p, "{\"message_id\":%s,\"from\":", message_id);
+  p = json_write_string(p, from);
+  p += sprintf(p, ",\"to\":");
+  p = json_write_string(p, to);
+  p += sprintf(p, ",\"message\":");
+  if (message != NULL){
+    p = json_write_string(p, message);
+  } else {
+    // A deleted message keeps its place in the history
+    p += sprintf(p, "null");
+  }
+  sprintf(p, ",\"time\":%s}", time);
+  return result;
+}
+
+
+/**
+ * @brief Функция дописывает в ответ строку JSON в кавычках
+ *
+ * @param[in] b Ответ в памяти арены запроса
+ * @param[in] s Строка, специальные символы которой экранируются
+ */
+static void append_json_string(struct arena_buf * b,
+                               const char * s){
+  size_t len = json_string_length(s);
+
+  json_write_string(arena_buf_reserve(b, len), s);
+  b->len += len;
+}
+
+
+/**
+ * @brief Функция парсит параметр action HTTP запроса
+ *
+ * @param[in] buf Тело HTTP запроса с параметрами
+ * @return enum api_action
+ */
+int switch_action(const mg_str * buf){
+  char action[40];
+  int result = mg_get_http_var(buf, "action", action, sizeof(action));
+  if (result == 0 || result == -1){
+    return API_ACTION_NULL;
+  }
+  if (!strcmp(action, "send_message")){
+    return API_ACTION_SEND_MESSAGE;
+  }
+  if (!strcmp(action, "get_message")){
+    return API_ACTION_GET_MESSAGE;
+  }
+  if (!strcmp(action, "get_user")){
+    return API_ACTION_GET_USER;
+  }
+  if (!strcmp(action, "register")){
+    return API_ACTION_REGISTER;
+  }
+  if (!strcmp(action, "send_batch")){
+    return API_ACTION_SEND_BATCH;
+  }
+  if (!strcmp(action, "has_new")){
+    return API_ACTION_HAS_NEW;
+  }
+  if (!strcmp(action, "get_history")){
+    return API_ACTION_GET_HISTORY;
+  }
+  if (!strcmp(action, "list_conversations")){
+    return API_ACTION_LIST_CONVERSATIONS;
+  }
+  if (!strcmp(action, "mark_read")){
+    return API_ACTION_MARK_READ;
+  }
+  if (!strcmp(action, "create_group")){
+    return API_ACTION_CREATE_GROUP;
+  }
+  if (!strcmp(action, "add_member")){
+    return API_ACTION_ADD_MEMBER;
+  }
+  if (!strcmp(action, "remove_member")){
+    return API_ACTION_REMOVE_MEMBER;
+  }
+  if (!strcmp(action, "edit_message")){
+    return API_ACTION_EDIT_MESSAGE;
+  }
+  if (!strcmp(action, "delete_message")){
+    return API_ACTION_DELETE_MESSAGE;
+  }
+  if (!strcmp(action, "get_changes")){
+    return API_ACTION_GET_CHANGES;
+  }
+  return API_ACTION_NULL;
+}
+
+
+/**
+ * @brief Функция возвращает арену запроса, который обрабатывается соединением
+ *
+ * @param[in] nc Соединение
+ * @return Арена, созданная для соединения обработчиком событий
+ */
+static struct arena * request_arena(struct mg_connection * nc){
+  return (struct arena *) nc->user_data;
+}
+
+
+/**
+ * @brief Функция отправляет ответ JSON, собранный в памяти арены запроса
+ *
+ * Строка состояния и заголовки тоже собираются в арене: mg_printf выделяет 
+ * память из кучи под каждый ответ длиннее своего буфера.
+ *
+ * @param[in] nc Соединение, по которому нужно отправить ответ
+ * @param[in] headers Дополнительные заголовки, каждый с \r\n в конце
+ * @param[in] answer Тело ответа
+ */
+static void send_json(struct mg_connection * nc,
+                      const char * headers,
+                      const struct arena_buf * answer){
+  struct arena_buf head;
+
+  arena_buf_init(&head, request_arena(nc), strlen(headers) + 96);
+  arena_buf_printf(&head, 
+                   "HTTP/1.1 200 OK\r\n"
+                   "Content-Type: text/json\r\n"
+                   "%s"
+                   "Content-Length: %d\r\n\r\n",
+                   headers, (int) answer->len);
+  mg_send(nc, head.data, (int) head.len);
+  mg_send(nc, answer->data, (int) answer->len);
+}
+
+
+/**
+ * @brief Функция выполняет проверку авторизации
+ *
+ * @param[in] a Арена запроса, из которой выделяется имя пользователя
+ * @param[in] hm Тело HTTP запроса
+ * @param[in] db Хранилище
+ * @retval NULL если пользователь не найден, или неправильный пароль
+ * @retval Указатель на строку, содержащую имя пользователя
+ */
+char * check_auth(struct arena * a,
+                  const http_message * hm, 
+                  struct storage * db){
+  // Vars
+  char * user = (char *) arena_alloc(a, USERNAME_MAX_LENGTH);
+  char   pass[PASS_MAX_LENGTH];
+  char   pass_db[PASS_MAX_LENGTH];
+
+  if(mg_get_http_basic_auth(
+     (http_message *)hm, user, USERNAME_MAX_LENGTH, pass, sizeof(pass)
+     ) != 0){
+    return NULL;
+  }
+
+  if (db->vtable->lookup_user(db, user, pass_db, sizeof(pass_db)) != STORAGE_OK ||
+      strcmp(pass, pass_db)){
+    return NULL;
+  }
+
+  return user;
+}
+
+
+/**
+ * @brief Функция проверяет, что запрос к api пришёл методом GET
+ */
+static int is_get(const struct http_message * hm){
+  return mg_vcmp(&hm->method, "GET") == 0;
+}
+
+
+/**
+ * @brief Функция проверяет авторизацию запроса к api
+ *
+ * Пароль в запросе GET сравнивается с уже проверенным, чтобы повторный опрос 
+ * не обращался к хранилищу.
+ *
+ * @param[in] nc Соединение
+ * @param[in] hm Тело HTTP запроса
+ * @param[in] db Хранилище
+ * @retval NULL если пользователь не найден, или неправильный пароль
+ * @retval Указатель на строку, содержащую имя пользователя
+ */
+static char * request_user(struct mg_connection * nc,
+                           const struct http_message * hm,
+                           struct storage * db){
+  if (!is_get(hm)){
+    return check_auth(request_arena(nc), hm, db);
+  }
+
+  char * user = (char *) arena_alloc(request_arena(nc), USERNAME_MAX_LENGTH);
+  char   pass[PASS_MAX_LENGTH];
+
+  if (mg_get_http_basic_auth(
+      (http_message *) hm, user, USERNAME_MAX_LENGTH, pass, sizeof(pass)
+      ) != 0){
+    return NULL;
+  }
+  std::unordered_map<std::string, std::string>::const_iterator it =
+    s_verified.find(user);
+  if (it != s_verified.end()){
+    return it->second == pass ? user : NULL;
+  }
+  if (check_auth(request_arena(nc), hm, db) == NULL){
+    return NULL;
+  }
+  s_verified[user] = pass;
+  return user;
+}
+
+
+/**
+ * @brief Функция проверяет, что в заголовке If-None-Match есть etag
+ *
+ * @param[in] header Заголовок If-None-Match или NULL
+ * @param[in] etag ETag в кавычках
+ * @retval 1 ETag найден или заголовок равен "*"
+ * @retval 0 В противном случае
+ */
+static int etag_matches(const struct mg_str * header,
+                        const char * etag){
+  size_t len = strlen(etag);
+  const char * p, * end;
+
+  if (header == NULL){
+    return 0;
+  }
+  for (p = header->p, end = header->p + header->len; p < end; p++){
+    const char * token, * token_end;
+    while (p < end && *p == ' '){
+      p++;
+    }
+    // Weak comparison, as If-None-Match requires
+    if (end - p >= 2 && p[0] == 'W' && p[1] == '/'){
+      p += 2;
+    }
+    token = p;
+    while (p < end && *p != ','){
+      p++;
+    }
+    token_end = p;
+    while (token_end > token && token_end[-1] == ' '){
+      token_end--;
+    }
+    if ((token_end - token == 1 && *token == '*') ||
+        ((size_t) (token_end - token) == len && 
+         memcmp(token, etag, len) == 0)){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+/**
+ * @brief Функция готовит заголовки ответа на запрос GET и отвечает 304, если
+ * у клиента уже есть этот ответ
+ *
+ * ETag составлен из времени запуска сервера и счётчика версии, от которого 
+ * зависит ответ: пока счётчик не изменился, не изменился и ответ. Проверка 
+ * выполняется до обращения к хранилищу. Сжатый ответ получает ETag с 
+ * COMPRESS_ETAG_SUFFIX; клиенту, приславшему такой ETag, ответ 304 
+ * возвращает его же.
+ *
+ * @param[in] nc Соединение, по которому нужно отправить ответ
+ * @param[in] hm Тело HTTP запроса
+ * @param[in] kind Вид счётчика версии
+ * @param[in] version Значение счётчика версии
+ * @retval NULL Отправлен ответ 304
+ * @retval Заголовки ответа, пустая строка для запросов не GET
+ */
+static const char * check_etag(struct mg_connection * nc,
+                               const struct http_message * hm,
+                               char kind,
+                               int64_t version){
+  char etag[64], gzip_etag[64];
+
+  if (!is_get(hm)){
+    return "";
+  }
+  if (s_etag_epoch == 0){
+    s_etag_epoch = (int64_t) (mg_time() * 1000);
+  }
+  snprintf(etag, sizeof(etag), "\"%" INT64_FMT "-%c%" INT64_FMT "\"",
+           s_etag_epoch, kind, version);
+  snprintf(gzip_etag, sizeof(gzip_etag), 
+           "\"%" INT64_FMT "-%c%" INT64_FMT COMPRESS_ETAG_SUFFIX "\"",
+           s_etag_epoch, kind, version);
+  struct mg_str * if_none_match = 
+    mg_get_http_header((http_message *) hm, "If-None-Match");
+  const char * matched = etag_matches(if_none_match, etag) ? etag :
+                         etag_matches(if_none_match, gzip_etag) ? gzip_etag : 
+                         NULL;
+  if (matched != NULL){
+    mg_printf(nc,
+              "HTTP/1.1 304 Not Modified\r\n"
+              "ETag: %s\r\n"
+              ETAG_CACHE_HEADERS
+              "Content-Length: 0\r\n\r\n", matched);
+    return NULL;
+  }
+
+  size_t len = strlen(etag) + sizeof(ETAG_CACHE_HEADERS) + 16;
+  char * headers = (char *) arena_alloc(request_arena(nc), len);
+  snprintf(headers, len, "ETag: %s\r\n" ETAG_CACHE_HEADERS, etag);
+  return headers;
+}
+
+
+/**
+ * @brief Функция отправляет ответ, содержащий JSON сообщение
+ *
+ * @param[in] nc Соединение, по которому нужно отправить ответ
+ * @param[in] message_id Уникальный идентификатор сообщения
+ * @param[in] from От кого адресовано сообщение
+ * @param[in] to Кому адресовано сообщение
+ * @param[in] message Текст сообщения
+ * @param[in] time Время, в которое сообщение было получено сервером (UTC Unix)
+ * @param[in] headers Дополнительные заголовки ответа
+ */
+static void send_message_json(struct mg_connection * nc,
+                              const char * message_id, 
+                              const char * from, 
+                              const char * to, 
+                              const char * message, 
+                              const char * time,
+                              const char * headers){
+  char * answer = build_message_json(request_arena(nc), message_id, from, to,
+                                     message, time);
+  
+  mg_printf(nc,
+              "HTTP/1.1 200 OK\r\n"
+              "Content-Type: text/json\r\n"
+              "%s"
+              "Content-Length: %d\r\n\r\n%s",
+              headers, strlen(answer), answer);
+}
+
+
+/**
+ * @brief Функция отправляет ответ, содержащий JSON сообщение из хранилища
+ * или кэша
+ *
+ * @param[in] nc Соединение, по которому нужно отправить ответ
+ * @param[in] message_id Уникальный идентификатор сообщения
+ * @param[in] from От кого адресовано сообщение
+ * @param[in] to Кому адресовано сообщение
+ * @param[in] message Текст сообщения
+ * @param[in] time Время, в которое сообщение было получено сервером (UTC Unix)
+ * @param[in] headers Дополнительные заголовки ответа
+ */
+static void send_message_json(struct mg_connection * nc,
+                              int64_t message_id, 
+                              const char * from, 
+                              const char * to, 
+                              const char * message, 
+                              int64_t time,
+                              const char * headers){
+  char message_id_s[MESSAGE_ID_MAX_LENGTH];
+  char time_s[MESSAGE_ID_MAX_LENGTH];
+
+  snprintf(message_id_s, sizeof(message_id_s), "%" INT64_FMT, message_id);
+  snprintf(time_s, sizeof(time_s), "%" INT64_FMT, time);
+  send_message_json(nc, message_id_s, from, to, message, time_s, headers);
+}
+
+
+/**
+ * @brief Функция отправляет ответ об отсутствии новых сообщений
+ *
+ * В отличие от mg_http_send_error, соединение не закрывается, так как этот 
+ * ответ - самый частый.
+ *
+ * @param[in] nc Соединение, по которому нужно отправить ответ
+ * @param[in] headers Дополнительные заголовки ответа
+ */
+static void send_no_content(struct mg_connection * nc,
+                            const char * headers){
+  mg_printf(nc,
+              "HTTP/1.1 204 No Content\r\n"
+              "%s"
+              "Content-Length: 0\r\n\r\n", headers);
+}
+
+
+/**
+ * @brief Функция парсит параметр last_message HTTP запроса
+ *
+ * @param[in] body Тело HTTP запроса с параметрами
+ * @return Последнее известное клиенту сообщение или 0, если параметра нет
+ */
+static int64_t get_last_message(const struct mg_str * body){
+  char last_message[MESSAGE_ID_MAX_LENGTH];
+
+  if (mg_get_http_var(body, "last_message", last_message, 
+                      sizeof(last_message)) < 1){
+    return 0;
+  }
+  return to64(last_message);
+}
+
+
+/**
+ * @brief Функция обновляет таблицу последних сообщений для storage_latest_cb
+ */
+static void on_latest_message(const char * user, 
+                              int64_t message_id, 
+                              void * arg){
+  (void) arg;
+  if (user[0] == STORAGE_GROUP_PREFIX){
+    groups_put(user + 1, message_id);
+  } else {
+    message_cache_set_latest(user, message_id);
+  }
+}
+
+
+/**
+ * @brief Функция возвращает последнее сообщение, видимое пользователю: 
+ * личное или сообщение его групп
+ */
+static int64_t user_latest(const char * user){
+  int64_t latest = message_cache_latest(user);
+  int64_t group_latest = groups_latest(user);
+  return group_latest > latest ? group_latest : latest;
+}
+
+
+/**
+ * @brief Функция возвращает версию сообщений пользователя для ETag: она 
+ * растёт и с новым сообщением, и с изменением сообщения
+ */
+static int64_t user_version(const char * user){
+  return user_latest(user) + changes_latest(user);
+}
+
+
+/**
+ * @brief Функция заполняет таблицу последних сообщений пользователей
+ *
+ * Выполняется один раз при запуске сервера одним обходом хранилища. 
+ * Дальше таблица обновляется при каждом добавлении сообщения.
+ *
+ * @param[in] db Хранилище
+ * @retval 0 Ошибка хранилища
+ * @retval 1 Таблица заполнена
+ */
+int load_latest_messages(struct storage * db){
+  return db->vtable->scan_latest(db, on_latest_message, NULL) == STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция добавляет сводку переписки для storage_conversation_cb
+ */
+static void on_load_conversation(const struct storage_conversation * c, 
+                                 void * arg){
+  (void) arg;
+  conversations_set(c->user, c->peer, c->last.message_id, c->last.from, 
+                    c->last.message, c->last.time, c->read, c->unread);
+}
+
+
+/**
+ * @brief Функция заполняет список переписок пользователей
+ *
+ * Выполняется один раз при запуске сервера одним обходом хранилища. 
+ * Дальше список обновляется при отправке сообщений и отметках о прочтении.
+ *
+ * @param[in] db Хранилище
+ * @retval 0 Ошибка хранилища
+ * @retval 1 Список заполнен
+ */
+int load_conversations(struct storage * db){
+  return db->vtable->scan_conversations(db, on_load_conversation, NULL) == 
+         STORAGE_OK;
+}
+
+
+/// Закрытый интервал участия, прочитанный из хранилища
+struct closed_membership {
+  std::string group; ///< Имя группы
+  std::string user; ///< Участник
+  int64_t left; ///< Последнее сообщение хранилища при выходе
+};
+
+
+/**
+ * @brief Функция добавляет участие в таблицу групп для storage_membership_cb
+ */
+static void on_load_member(const struct storage_membership * membership, 
+                           void * arg){
+  std::vector<closed_membership> * closed = 
+    (std::vector<closed_membership> *) arg;
+
+  groups_join(membership->group, membership->user, membership->joined);
+  if (membership->left != STORAGE_CURSOR_MAX){
+    struct closed_membership c = { 
+      membership->group, membership->user, membership->left 
+    };
+    closed->push_back(c);
+  }
+}
+
+
+/**
+ * @brief Функция запоминает сообщение для storage_message_cb
+ */
+static void on_last_group_message(const struct storage_message * message, 
+                                  void * arg){
+  *(int64_t *) arg = message->message_id;
+}
+
+
+/**
+ * @brief Функция заполняет таблицу участников групп
+ *
+ * Выполняется один раз при запуске сервера после load_latest_messages. Для 
+ * закрытого интервала участия последнее сообщение группы внутри интервала 
+ * достаётся из хранилища одним запросом, открытому достаточно последнего 
+ * сообщения группы.
+ *
+ * @param[in] db Хранилище
+ * @retval 0 Ошибка хранилища
+ * @retval 1 Таблица заполнена
+ */
+int load_groups(struct storage * db){
+  std::vector<closed_membership> closed;
+
+  if (db->vtable->scan_members(db, on_load_member, &closed) != STORAGE_OK){
+    return 0;
+  }
+  for (size_t i = 0; i < closed.size(); i++){
+    std::string address = STORAGE_GROUP_PREFIX + closed[i].group;
+    int64_t last = 0;
+    if (db->vtable->scan_conversation(db, closed[i].user.c_str(), 
+                                      address.c_str(), closed[i].left + 1, 
+                                      STORAGE_SCAN_BACKWARD, 1, 
+                                      on_last_group_message, 
+                                      &last) != STORAGE_OK){
+      return 0;
+    }
+    groups_leave(closed[i].group.c_str(), closed[i].user.c_str(), 
+                 closed[i].left, last);
+  }
+  return 1;
+}
+
+
+/**
+ * @brief Функция добавляет изменение в журнал для storage_change_cb
+ */
+static void on_load_change(const struct storage_change * change, 
+                           void * arg){
+  (void) arg;
+  changes_put(change->version, change->message_id, change->from, change->to, 
+              change->message, change->time);
+}
+
+
+/**
+ * @brief Функция заполняет журнал изменений сообщений
+ *
+ * Выполняется один раз при запуске сервера после load_groups. Дальше журнал 
+ * пополняется при правке и удалении сообщений и сжимается compact_changes.
+ *
+ * @param[in] db Хранилище
+ * @retval 0 Ошибка хранилища
+ * @retval 1 Журнал заполнен
+ */
+int load_changes(struct storage * db){
+  int64_t horizon = 0;
+
+  if (db->vtable->scan_changes(db, &horizon, on_load_change, 
+                               NULL) != STORAGE_OK){
+    return 0;
+  }
+  changes_set_horizon(horizon);
+  return 1;
+}
+
+
+/**
+ * @brief Функция сжимает порцию изменений старше срока хранения
+ *
+ * Вызывается на каждой итерации цикла событий. Порция ограничена 
+ * CHANGES_COMPACT_BATCH изменениями, поэтому итерация не задерживается 
+ * надолго, а хранилище не трогается, пока сжимать нечего.
+ *
+ * @param[in] db Хранилище
+ * @param[in] retention Срок хранения изменений (в секундах)
+ */
+void compact_changes(struct storage * db, 
+                     int64_t retention){
+  int64_t through = changes_compactable((int64_t) time(NULL) - retention, 
+                                        CHANGES_COMPACT_BATCH);
+
+  if (through <= changes_horizon()){
+    return;
+  }
+  // On error the batch is retried on the next iteration
+  if (db->vtable->compact_changes(db, through) == STORAGE_OK){
+    changes_compact(through);
+  }
+}
+
+
+/**
+ * @brief Функция переносит порцию данных хранилища со старой схемы
+ *
+ * Вызывается на каждой итерации цикла событий. Пока перенос не закончен, 
+ * следующую итерацию не стоит задерживать ожиданием соединений.
+ *
+ * @param[in] db Хранилище
+ * @retval 1 Данные старой схемы ещё остались
+ * @retval 0 Переносить нечего
+ */
+int migrate_storage(struct storage * db){
+  return db->vtable->migrate != NULL && db->vtable->migrate(db);
+}
+
+
+/**
+ * @brief Функция добавляет сообщение в начало буфера для storage_message_cb
+ */
+static void on_cache_message(const struct storage_message * message, 
+                             void * arg){
+  message_cache_prepend((struct message_ring *) arg,
+                        message->message_id,
+                        message->from,
+                        message->to,
+                        message->message,
+                        message->time);
+}
+
+
+/**
+ * @brief Функция заполняет кэш последними сообщениями пользователя
+ *
+ * Вызывается, когда буфера пользователя нет в кэше. Достаёт из хранилища 
+ * ring_size + 1 последних сообщений, чтобы кэш мог определить границу 
+ * хранящейся истории.
+ *
+ * @param[in] db Хранилище
+ * @param[in] user Имя пользователя
+ */
+static void load_message_cache(struct storage * db, 
+                               const char * user){
+  struct message_ring * ring = message_cache_reset(user);
+
+  if (ring == NULL){
+    return;
+  }
+  // On error the ring is left empty, it is filled by send_message
+  db->vtable->scan_messages(db, user, STORAGE_CURSOR_MAX, 
+                            STORAGE_SCAN_BACKWARD, 
+                            message_cache_ring_size() + 1, 
+                            on_cache_message, ring);
+}
+
+
+/// Аргумент on_send_message
+struct send_message_arg {
+  struct mg_connection * nc; ///< Соединение, по которому нужно отправить ответ
+  const char * headers; ///< Дополнительные заголовки ответа
+  int sent; ///< Количество отправленных сообщений
+};
+
+
+/**
+ * @brief Функция отправляет найденное сообщение для storage_message_cb
+ */
+static void on_send_message(const struct storage_message * message, 
+                            void * arg){
+  struct send_message_arg * send_arg = (struct send_message_arg *) arg;
+
+  send_arg->sent++;
+  send_message_json(send_arg->nc,
+                    message->message_id,
+                    message->from,
+                    message->to,
+                    message->message,
+                    message->time,
+                    send_arg->headers);
+}
+
+
+/**
+ * @brief Функция api получения сообщения
+ *
+ * Функция проверяет авторизацию, достаёт из базы данных первое сообщение, 
+ * которое неизвестно клиенту и отправляет ответ. В случае, если сообщение не 
+ * найдено, возвращает ответ об отвутствии новых сообщений. Если курсор клиента
+ * не меньше последнего сообщения пользователя или попадает в кэш последних 
+ * сообщений, база данных не используется. Сообщения групп в кэш не попадают:
+ * если после курсора есть сообщение группы пользователя, сообщение 
+ * достаётся из хранилища. Ответ на запрос GET не меняется, 
+ * пока у пользователя нет новых или изменённых сообщений, поэтому его ETag - 
+ * версия сообщений пользователя.
+ *
+ * @param[in] nc Соединение, по которому нужно отправить ответ
+ * @param[in] hm Тело HTTP запроса
+ * @param[in] db Хранилище
+ */
+void get_message(struct mg_connection * nc, 
+                 const struct http_message * hm,
+                 struct storage * db){
+              
+  char * user = request_user(nc, hm, db);
+  
+  if (user == NULL){
+    mg_http_send_error(nc, 401, "Unauthorized");
+    return;
+  }
+  
+  const struct mg_str *body =
+      hm->query_string.len > 0 ? &hm->query_string : &hm->body;
+
+  int64_t last_message_i = get_last_message(body);
+  int64_t latest = user_latest(user);
+  const char * headers = check_etag(nc, hm, 'm', user_version(user));
+
+  if (headers == NULL){
+    return;
+  }
+  // Nothing new for this user, the most common answer
+  if (last_message_i >= latest){
+    send_no_content(nc, headers);
+    return;
+  }
+
+  // Group messages are not cached, the storage merges them with direct ones
+  const struct cached_message * cached = NULL;
+  int result = groups_latest(user) > last_message_i ? MESSAGE_CACHE_MISS :
+               message_cache_get(user, last_message_i, &cached);
+  if (result == MESSAGE_CACHE_ABSENT){
+    load_message_cache(db, user);
+    result = message_cache_get(user, last_message_i, &cached);
+  }
+  if (result == MESSAGE_CACHE_HIT){
+    if (cached == NULL){
+      send_no_content(nc, headers);
+    } else {
+      send_message_json(nc, cached->message_id, cached->from, cached->to, 
+                        cached->message, cached->time, headers);
+#ifdef _DEBUG
+      printf("%s get message with id %d from cache\n", user, 
+             (int) cached->message_id);
+#endif
+    }
+    return;
+  }
+
+  struct send_message_arg send_arg = { nc, headers, 0 };
+  if (db->vtable->scan_messages(db, user, last_message_i, STORAGE_SCAN_FORWARD,
+                                1, on_send_message, &send_arg) != STORAGE_OK){
+    mg_http_send_error(nc, 500, "Internal server error");
+  } else if (send_arg.sent == 0){
+    send_no_content(nc, headers);
+  }
+#ifdef _DEBUG
+  printf("%s get message after %d\n", user, (int) last_message_i);
+#endif
+}
+
+
+/**
+ * @brief Функция api проверки наличия новых сообщений
+ *
+ * Функция проверяет авторизацию и сравнивает курсор клиента с последним 
+ * сообщением пользователя, не обращаясь к таблице сообщений. В ответе есть и 
+ * последняя версия изменений: если она больше известной клиенту, изменения 
+ * забираются get_changes. ETag ответа на запрос GET - версия сообщений 
+ * пользователя.
+ *
+ * @param[in] nc Соединение, по которому нужно отправить ответ
+ * @param[in] hm Тело HTTP запроса
+ * @param[in] db Хранилище
+ */
+void has_new(struct mg_connection * nc, 
+             const struct http_message * hm,
+             struct storage * db){
+  char * user = request_user(nc, hm, db);
+  
+  if (user == NULL){
+    mg_http_send_error(nc, 401, "Unauthorized");
+    return;
+  }
+  
+  const struct mg_str *body =
+      hm->query_string.len > 0 ? &hm->query_string : &hm->body;
+  int64_t latest = user_latest(user);
+  const char * headers = check_etag(nc, hm, 'm', user_version(user));
+  char answer[128];
+
+  if (headers == NULL){
+    return;
+  }
+  int len = snprintf(answer, sizeof(answer), 
+                     "{\"has_new\":%s,\"last_message\":%" INT64_FMT 
+                     ",\"version\":%" INT64_FMT "}",
+                     get_last_message(body) < latest ? "true" : "false", 
+                     latest, changes_latest(user));
+
+  mg_printf(nc,
+              "HTTP/1.1 200 OK\r\n"
+              "Content-Type: text/json\r\n"
+              "%s"
+              "Content-Length: %d\r\n\r\n%s",
+              headers, len, answer);
+}
+
+
+/// Аргумент on_history_message
+struct history_arg {
+  struct arena * arena; ///< Арена запроса
+  struct arena_buf * answer; ///< Ответ
+  int limit; ///< Размер страницы
+  int found; ///< Количество найденных сообщений
+};
+
+
+/**
+ * @brief Функция добавляет найденное сообщение в ответ для storage_message_cb
+ *
+ * Хранилище просят на одно сообщение больше страницы: лишнее сообщение в 
+ * ответ не попадает, а только показывает, что история не закончилась.
+ */
+static void on_history_message(const struct storage_message * message, 
+                               void * arg){
+  struct history_arg * history = (struct history_arg *) arg;
+  char message_id_s[MESSAGE_ID_MAX_LENGTH];
+  char time_s[MESSAGE_ID_MAX_LENGTH];
+
+  if (history->found++ == history->limit){
+    return;
+  }
+  snprintf(message_id_s, sizeof(message_id_s), "%" INT64_FMT, 
+           message->message_id);
+  snprintf(time_s, sizeof(time_s), "%" INT64_FMT, message->time);
+  if (history->found > 1){
+    arena_buf_append(history->answer, ",");
+  }
+  arena_buf_append(history->answer, 
+                   build_message_json(history->arena, message_id_s, 
+                                      message->from, message->to, 
+                                      message->message, time_s));
+}
+
+
+/**
+ * @brief Функция api получения страницы истории переписки с собеседником
+ *
+ * Параметры: peer - собеседник или группа с префиксом STORAGE_GROUP_PREFIX,
+ * before или after - курсор (message_id), 
+ * limit - размер страницы. С before (или без курсора, тогда с конца истории) 
+ * сообщения идут от новых к старым, с after - от старых к новым. Следующую 
+ * страницу клиент запрашивает с курсором, равным message_id последнего 
+ * сообщения ответа, пока has_more равно true. Каждая страница - один обход 
+ * индекса пары собеседников в хранилище, сколько бы сообщений ни было у 
+ * пользователя. Удалённое сообщение до сжатия изменений остаётся в истории с 
+ * пустым текстом. ETag ответа на запрос GET - версия сообщений пользователя.
+ *
+ * @param[in] nc Соединение, по которому нужно отправить ответ
+ * @param[in] hm Тело HTTP запроса
+ * @param[in] db Хранилище
+ */
+void get_history(struct mg_connection * nc, 
+                 const struct http_message * hm,
+                 struct storage * db){
+
+  const struct mg_str *body =
+      hm->query_string.len > 0 ? &hm->query_string : &hm->body;
+
+  char * user = request_user(nc, hm, db);
+
+  if (user == NULL){
+    mg_http_send_error(nc, 401, "Unauthorized");
+    return;
+  }
+
+  char * peer = (char *) arena_alloc(request_arena(nc), USERNAME_MAX_LENGTH);
+  char before[MESSAGE_ID_MAX_LENGTH];
+  char after[MESSAGE_ID_MAX_LENGTH];
+  char limit_s[MESSAGE_ID_MAX_LENGTH];
+  int has_before = mg_get_http_var(body, "before", before, sizeof(before)) > 0;
+  int has_after = mg_get_http_var(body, "after", after, sizeof(after)) > 0;
+  int limit = HISTORY_PAGE_SIZE;
+
+  if (mg_get_http_var(body, "limit", limit_s, sizeof(limit_s)) > 0){
+    limit = atoi(limit_s);
+  }
+  if (mg_get_http_var(body, "peer", peer, USERNAME_MAX_LENGTH) < 1 ||
+      (has_before && has_after) || limit < 1 || limit > HISTORY_PAGE_MAX){
+    mg_http_send_error(nc, 400, "Bad request");
+    return;
+  }
+
+  const char * headers = check_etag(nc, hm, 'm', user_version(user));
+  if (headers == NULL){
+    return;
+  }
+
+  struct arena_buf answer;
+  struct history_arg history = { request_arena(nc), &answer, limit, 0 };
+  arena_buf_init(&answer, request_arena(nc), ANSWER_INITIAL_SIZE);
+  arena_buf_append(&answer, "{\"messages\":[");
+  int result = has_after ?
+    db->vtable->scan_conversation(db, user, peer, to64(after), 
+                                  STORAGE_SCAN_FORWARD, limit + 1, 
+                                  on_history_message, &history) :
+    db->vtable->scan_conversation(db, user, peer, 
+                                  has_before ? to64(before) : 
+                                               STORAGE_CURSOR_MAX, 
+                                  STORAGE_SCAN_BACKWARD, limit + 1, 
+                                  on_history_message, &history);
+  if (result != STORAGE_OK){
+    if (result == STORAGE_NOT_FOUND){
+      mg_http_send_error(nc, 404, "Not found");
+    } else {
+      mg_http_send_error(nc, 500, "Internal server error");
+    }
+    return;
+  }
+  arena_buf_printf(&answer, "],\"has_more\":%s}", 
+                   history.found > limit ? "true" : "false");
+
+  send_json(nc, headers, &answer);
+#ifdef _DEBUG
+  printf("%s get history with %s\n", user, peer);
+#endif
+}
+
+
+/// Аргумент on_list_conversation
+struct list_conversations_arg {
+  struct arena_buf * answer; ///< Ответ
+  int found; ///< Количество переписок в ответе
+};
+
+
+/**
+ * @brief Функция добавляет переписку в ответ для conversation_cb
+ */
+static void on_list_conversation(const struct conversation * c, 
+                                 void * arg){
+  struct list_conversations_arg * list = (struct list_conversations_arg *) arg;
+  arena_buf_append(list->answer, list->found++ ? ",{\"peer\":" : "{\"peer\":");
+  append_json_string(list->answer, c->peer);
+  arena_buf_printf(list->answer, ",\"message_id\":%" INT64_FMT ",\"from\":",
+                   c->message_id);
+  append_json_string(list->answer, c->from);
+  arena_buf_append(list->answer, ",\"preview\":");
+  append_json_string(list->answer, c->preview);
+  arena_buf_printf(list->answer, 
+                   ",\"time\":%" INT64_FMT ",\"unread\":%" INT64_FMT "}",
+                   c->time, c->unread);
+}
+
+
+/**
+ * @brief Функция api получения списка переписок
+ *
+ * Переписки идут от новых к старым по последнему сообщению, у каждой - 
+ * собеседник, последнее сообщение с началом текста и количество 
+ * непрочитанных сообщений собеседника. Необязательный параметр limit 
+ * ограничивает количество переписок. Список берётся из памяти без обращения 
+ * к хранилищу. ETag ответа на запрос GET - версия списка пользователя.
+ *
+ * @param[in] nc Соединение, по которому нужно отправить ответ
+ * @param[in] hm Тело HTTP запроса
+ * @param[in] db Хранилище
+ */
+void list_conversations(struct mg_connection * nc, 
+                        const struct http_message * hm,
+                        struct storage * db){
+
+  const struct mg_str *body =
+      hm->query_string.len > 0 ? &hm->query_string : &hm->body;
+
+  char * user = request_user(nc, hm, db);
+
+  if (user == NULL){
+    mg_http_send_error(nc, 401, "Unauthorized");
+    return;
+  }
+
+  char limit_s[MESSAGE_ID_MAX_LENGTH];
+  int limit = 0;
+
+  if (mg_get_http_var(body, "limit", limit_s, sizeof(limit_s)) > 0 &&
+      (limit = atoi(limit_s)) < 1){
+    mg_http_send_error(nc, 400, "Bad request");
+    return;
+  }
+
+  const char * headers = check_etag(nc, hm, 'c', conversations_version(user));
+  if (headers == NULL){
+    return;
+  }
+
+  struct arena_buf answer;
+  struct list_conversations_arg list = { &answer, 0 };
+  arena_buf_init(&answer, request_arena(nc), ANSWER_INITIAL_SIZE);
+  arena_buf_append(&answer, "{\"conversations\":[");
+  conversations_list(user, limit, on_list_conversation, &list);
+  arena_buf_append(&answer, "]}");
+
+  send_json(nc, headers, &answer);
+}
+
+
+/// Аргумент on_unread_message
+struct unread_arg {
+  const char * peer; ///< Собеседник
+  int64_t unread; ///< Количество сообщений собеседника
+};
+
+
+/**
+ * @brief Функция считает сообщения собеседника для storage_message_cb
+ */
+static void on_unread_message(const struct storage_message * message, 
+                              void * arg){
+  struct unread_arg * unread = (struct unread_arg *) arg;
+
+  if (!strcmp(message->from, unread->peer)){
+    unread->unread++;
+  }
+}
+
+
+/**
+ * @brief Функция api отметки о прочтении переписки
+ *
+ * Параметры: peer - собеседник, message_id - последнее прочитанное 
+ * сообщение, по умолчанию последнее сообщение переписки. Курсор прочтения 
+ * только растёт и сохраняется в хранилище. Если прочитано не всё, 
+ * непрочитанные сообщения пересчитываются одним обходом индекса пары 
+ * собеседников после курсора. В ответе - количество непрочитанных сообщений.
+ *
+ * @param[in] nc Соединение, по которому нужно отправить ответ
+ * @param[in] hm Тело HTTP запроса
+ * @param[in] db Хранилище
+ */
+void mark_read(struct mg_connection * nc, 
+               const struct http_message * hm,
+               struct storage * db){
+
+  const struct mg_str *body =
+      hm->query_string.len > 0 ? &hm->query_string : &hm->body;
+
+  char * user = check_auth(request_arena(nc), hm, db);
+
+  if (user == NULL){
+    mg_http_send_error(nc, 401, "Unauthorized");
+    return;
+  }
+
+  char * peer = (char *) arena_alloc(request_arena(nc), USERNAME_MAX_LENGTH);
+  char message_id_s[MESSAGE_ID_MAX_LENGTH];
+
+  if (mg_get_http_var(body, "peer", peer, USERNAME_MAX_LENGTH) < 1){
+    mg_http_send_error(nc, 400, "Bad request");
+    return;
+  }
+
+  const struct conversation * c = conversations_find(user, peer);
+  if (c == NULL){
+    mg_http_send_error(nc, 404, "Not found");
+    return;
+  }
+
+  int64_t read = c->message_id;
+  if (mg_get_http_var(body, "message_id", message_id_s, 
+                      sizeof(message_id_s)) > 0 &&
+      to64(message_id_s) < read){
+    read = to64(message_id_s);
+  }
+  // The cursor only moves forward, a late acknowledgement changes nothing
+  if (read > c->read){
+    struct unread_arg unread = { peer, 0 };
+    if (read < c->message_id &&
+        db->vtable->scan_conversation(db, user, peer, read, 
+                                      STORAGE_SCAN_FORWARD, INT_MAX, 
+                                      on_unread_message, 
+                                      &unread) != STORAGE_OK){
+      mg_http_send_error(nc, 500, "Internal server error");
+      return;
+    }
+    if (db->vtable->put_read_cursor(db, user, peer, read) != STORAGE_OK){
+      mg_http_send_error(nc, 500, "Internal server error");
+      return;
+    }
+    conversations_set_read(user, peer, read, unread.unread);
+  }
+
+  char answer[64];
+  int len = snprintf(answer, sizeof(answer), "{\"unread\":%" INT64_FMT "}", 
+                     c->unread);
+  mg_printf(nc,
+              "HTTP/1.1 200 OK\r\n"
+              "Content-Type: text/json\r\n"
+              "Content-Length: %d\r\n\r\n%s",
+              len, answer);
+#ifdef _DEBUG
+  printf("%s read %s up to %d\n", user, peer, (int) read);
+#endif
+}
+
+
+/**
+ * @brief Функция проверяет, что отправитель может писать группе
+ *
+ * @param[in] user Отправитель
+ * @param[in] to Получатель
+ * @retval 0 Получатель - не группа или отправитель в ней состоит
+ * @retval Код ответа HTTP: 404 - группы нет, 403 - отправитель не участник
+ */
+static int check_group_sender(const char * user, 
+                              const char * to){
+  if (to[0] != STORAGE_GROUP_PREFIX || groups_is_member(to + 1, user)){
+    return 0;
+  }
+  return groups_exists(to + 1) ? 403 : 404;
+}
+
+
+/**
+ * @brief Функция учитывает сохранённое сообщение в кэше и списке переписок 
+ * или, если это сообщение группе, в таблице групп
+ */
+static void put_sent_message(const struct storage_message * message){
+  if (message->to[0] == STORAGE_GROUP_PREFIX){
+    groups_put(message->to + 1, message->message_id);
+    return;
+  }
+  message_cache_put(message->message_id, message->from, message->to, 
+                    message->message, message->time);
+  conversations_put(message->message_id, message->from, message->to, 
+                    message->message, message->time);
+}
+
+
+/**
+ * @brief Функция отправляет ответ send_message с ключом повтора
+ */
+static void send_message_id(struct mg_connection * nc, 
+                            int64_t message_id){
+  char answer[64];
+  int len = snprintf(answer, sizeof(answer), "{\"message_id\":%" INT64_FMT "}", 
+                     message_id);
+  mg_printf(nc,
+              "HTTP/1.1 200 OK\r\n"
+              "Content-Type: text/json\r\n"
+              "Content-Length: %d\r\n\r\n%s",
+              len, answer);
+}
+
+
+/**
+ * @brief Функция api отправки сообщения
+ *
+ * Функция проверяет авторизацию, правильность запроса и существование 
+ * получателя, кладёт в базу данных новое сообщение. Получатель с префиксом 
+ * STORAGE_GROUP_PREFIX - группа, писать ей могут только её участники, 
+ * сообщение хранится один раз.
+ *
+ * Необязательный параметр client_msg_id - ключ повтора, уникальный для 
+ * отправителя. С ним в ответ отправляется JSON с message_id, а повтор 
+ * запроса с тем же ключом получает message_id исходного сообщения, не 
+ * сохраняя новое. Недавние ключи проверяются в памяти (dedup_find), 
+ * остальные повторы отклоняет уникальный индекс хранилища, поэтому 
+ * проверка не добавляет обращений к хранилищу.
+ *
+ * @param[in] nc Соединение, по которому нужно отправить ответ
+ * @param[in] hm Тело HTTP запроса
+ * @param[in] db Хранилище
+ */
+void send_message(struct mg_connection * nc, 
+                  const struct http_message * hm,
+                  struct storage * db){
+              
+  const struct mg_str *body =
+      hm->query_string.len > 0 ? &hm->query_string : &hm->body;
+
+  char * user = check_auth(request_arena(nc), hm, db);
+  
+  if (user == NULL){
+    mg_http_send_error(nc, 401, "Unauthorized");
+    return;
+  }
+
+  char * message = (char *) arena_alloc(request_arena(nc), MESSAGE_MAX_LENGTH);
+  char * to = (char *) arena_alloc(request_arena(nc), USERNAME_MAX_LENGTH);
+
+  int result = mg_get_http_var(body, "to", to, USERNAME_MAX_LENGTH);
+
+  if (result < 1 ||
+    !mg_get_http_var(body, "message", message, MESSAGE_MAX_LENGTH)){
+    mg_http_send_error(nc, 400, "Bad request");
+    return;
+  }
+
+  char client_msg_id[CLIENT_MSG_ID_MAX_LENGTH];
+  int keyed = mg_get_http_var(body, "client_msg_id", client_msg_id, 
+                              sizeof(client_msg_id));
+  if (keyed == 0 || keyed == -2){
+    mg_http_send_error(nc, 400, "Bad request");
+    return;
+  }
+  keyed = keyed > 0;
+  // A retry is answered before any other check, as the original was
+  int64_t sent = keyed ? dedup_find(user, client_msg_id) : 0;
+  if (sent != 0){
+    send_message_id(nc, sent);
+    return;
+  }
+  if ((result = check_group_sender(user, to)) != 0){
+    mg_http_send_error(nc, result, result == 403 ? "Forbidden" : "Not found");
+    return;
+  }
+  struct storage_message stored = { 
+    0, user, to, message, time(NULL), keyed ? client_msg_id : NULL 
+  };
+  result = db->vtable->put_messages(db, &stored, 1);
+  if (result == STORAGE_EXISTS && keyed){
+    // The key has left the table, the unique index still knows it
+    dedup_put(user, client_msg_id, stored.message_id);
+    send_message_id(nc, stored.message_id);
+    return;
+  }
+  if (result != STORAGE_OK){
+    if (result == STORAGE_NOT_FOUND){
+      mg_http_send_error(nc, 404, "Not found");
+    } else {
+      mg_http_send_error(nc, 500, "Internal server error");
+    }
+    return;
+  }
+  put_sent_message(&stored);
+  if (keyed){
+    dedup_put(user, client_msg_id, stored.message_id);
+    send_message_id(nc, stored.message_id);
+  } else {
+    mg_printf(nc,
+                "HTTP/1.1 200 OK\r\n"
+                "Content-Length: 0\r\n\r\n");
+  }
+#ifdef _DEBUG
+  printf("%s sent message to %s\n", user, to);
+#endif
+}
+
+
+/**
+ * @brief Функция собирает все значения параметра с именем name
+ *
+ * В отличие от mg_get_http_var, которая возвращает только первое вхождение, 
+ * функция находит все вхождения параметра в теле запроса. Значения не 
+ * декодируются и указывают прямо в буфер запроса.
+ *
+ * @param[in] buf Тело HTTP запроса с параметрами
+ * @param[in] name Имя параметра
+ * @param[out] values Массив для найденных значений
+ * @param[in] max_count Размер массива values
+ * @retval -1 Параметров больше, чем max_count
+ * @retval Количество найденных значений
+ */
+int get_http_var_list(const struct mg_str * buf, 
+                      const char * name, 
+                      struct mg_str * values, 
+                      int max_count){
+  size_t name_len = strlen(name);
+  const char * e = buf->p + buf->len;
+  int count = 0;
+
+  if (buf->p == NULL){
+    return 0;
+  }
+  for (const char * p = buf->p; p + name_len < e; p++){
+    if ((p == buf->p || p[-1] == '&') && p[name_len] == '=' &&
+        !mg_ncasecmp(name, p, name_len)){
+      if (count == max_count){
+        return -1;
+      }
+      p += name_len + 1;
+      const char * s = (const char *) memchr(p, '&', (size_t)(e - p));
+      if (s == NULL){
+        s = e;
+      }
+      values[count].p = p;
+      values[count].len = (size_t)(s - p);
+      count++;
+      p = s - 1;
+    }
+  }
+  return count;
+}
+
+
+/**
+ * @brief Функция api пакетной отправки сообщений
+ *
+ * Принимает повторяющиеся параметры to и message. Если message передан один 
+ * раз, то он рассылается всем получателям из списка to, иначе количество 
+ * параметров to и message должно совпадать и сообщения сопоставляются 
+ * попарно. Существование получателей проверяется по таблице пользователей в 
+ * памяти, все сообщения добавляются в одной транзакции. В ответ отправляется JSON со 
+ * списком присвоенных message_id в порядке следования параметров.
+ *
+ * @param[in] nc Соединение, по которому нужно отправить ответ
+ * @param[in] hm Тело HTTP запроса
+ * @param[in] db Хранилище
+ */
+void send_batch(struct mg_connection * nc, 
+                const struct http_message * hm,
+                struct storage * db){
+
+  const struct mg_str *body =
+      hm->query_string.len > 0 ? &hm->query_string : &hm->body;
+
+  char * user = check_auth(request_arena(nc), hm, db);
+
+  if (user == NULL){
+    mg_http_send_error(nc, 401, "Unauthorized");
+    return;
+  }
+
+  struct mg_str to_raw[BATCH_MAX_SIZE];
+  struct mg_str message_raw[BATCH_MAX_SIZE];
+  int to_count = get_http_var_list(body, "to", to_raw, BATCH_MAX_SIZE);
+  int message_count = get_http_var_list(body, "message", message_raw, 
+                                        BATCH_MAX_SIZE);
+
+  if (to_count < 1 || message_count < 1 ||
+      (message_count != 1 && message_count != to_count)){
+    mg_http_send_error(nc, 400, "Bad request");
+    return;
+  }
+
+  // Decoded values never grow, so one pool of the body size is enough
+  char * pool = (char *) arena_alloc(request_arena(nc), 
+                                    body->len + 2 * BATCH_MAX_SIZE);
+  char * pool_end = pool;
+  char * to[BATCH_MAX_SIZE];
+  char * message[BATCH_MAX_SIZE];
+  int bad_request = 0;
+
+  int forbidden = 0;
+
+  for (int i = 0; i < to_count && !bad_request; i++){
+    to[i] = pool_end;
+    int len = mg_url_decode(to_raw[i].p, to_raw[i].len, to[i], 
+                            USERNAME_MAX_LENGTH, 1);
+    bad_request = len < 1;
+    pool_end += len + 1;
+    if (!bad_request && forbidden == 0){
+      forbidden = check_group_sender(user, to[i]);
+    }
+  }
+  for (int i = 0; i < message_count && !bad_request; i++){
+    message[i] = pool_end;
+    int len = mg_url_decode(message_raw[i].p, message_raw[i].len, message[i],
+                            MESSAGE_MAX_LENGTH, 1);
+    bad_request = len < 0;
+    pool_end += len + 1;
+  }
+  if (bad_request){
+    mg_http_send_error(nc, 400, "Bad request");
+    return;
+  }
+  if (forbidden != 0){
+    mg_http_send_error(nc, forbidden, 
+                       forbidden == 403 ? "Forbidden" : "Not found");
+    return;
+  }
+
+  // All messages are stored atomically, unknown recipient fails the batch
+  struct storage_message stored[BATCH_MAX_SIZE];
+  int64_t now = time(NULL);
+  int i;
+
+  for (i = 0; i < to_count; i++){
+    stored[i].message_id = 0;
+    stored[i].from = user;
+    stored[i].to = to[i];
+    stored[i].message = message[message_count == 1 ? 0 : i];
+    stored[i].time = now;
+    stored[i].client_msg_id = NULL;
+  }
+  int result = db->vtable->put_messages(db, stored, to_count);
+  if (result != STORAGE_OK){
+    if (result == STORAGE_NOT_FOUND){
+      mg_http_send_error(nc, 404, "Not found");
+    } else {
+      mg_http_send_error(nc, 500, "Internal server error");
+    }
+    return;
+  }
+
+  for (i = 0; i < to_count; i++){
+    put_sent_message(&stored[i]);
+  }
+
+  struct arena_buf answer;
+  arena_buf_init(&answer, request_arena(nc), 
+                 16 + to_count * (MESSAGE_ID_MAX_LENGTH + 1));
+  arena_buf_append(&answer, "{\"message_id\":[");
+  for (i = 0; i < to_count; i++){
+    arena_buf_printf(&answer, i ? ",%" INT64_FMT : "%" INT64_FMT, 
+                     stored[i].message_id);
+  }
+  arena_buf_append(&answer, "]}");
+
+  send_json(nc, "", &answer);
+#ifdef _DEBUG
+  printf("%s sent %d messages in batch\n", user, to_count);
+#endif
+}
+
+
+/**
+ * @brief Функция api создания группы
+ *
+ * Параметр group - имя группы без префикса. Создатель становится первым 
+ * участником группы и видит её сообщения, отправленные после создания.
+ *
+ * @param[in] nc Соединение, по которому нужно отправить ответ
+ * @param[in] hm Тело HTTP запроса
+ * @param[in] db Хранилище
+ */
+void create_group(struct mg_connection * nc, 
+                  const struct http_message * hm,
+                  struct storage * db){
+
+  const struct mg_str *body =
+      hm->query_string.len > 0 ? &hm->query_string : &hm->body;
+
+  char * user = check_auth(request_arena(nc), hm, db);
+
+  if (user == NULL){
+    mg_http_send_error(nc, 401, "Unauthorized");
+    return;
+  }
+
+  // The address with the prefix must fit into a recipient name
+  char * group = (char *) arena_alloc(request_arena(nc), USERNAME_MAX_LENGTH);
+  if (mg_get_http_var(body, "group", group, USERNAME_MAX_LENGTH - 1) < 1 ||
+      group[0] == STORAGE_GROUP_PREFIX){
+    mg_http_send_error(nc, 400, "Bad request");
+    return;
+  }
+
+  int result = db->vtable->create_group(db, group, user);
+  if (result == STORAGE_EXISTS){
+    mg_http_send_error(nc, 409, "Group already exist");
+    return;
+  } else if (result != STORAGE_OK){
+    mg_http_send_error(nc, 500, "Internal server error");
+    return;
+  }
+  // A new group has no messages, every later one is visible
+  groups_join(group, user, 0);
+  mg_printf(nc,
+              "HTTP/1.1 200 OK\r\n"
+              "Content-Length: 0\r\n\r\n");
+#ifdef _DEBUG
+  printf("%s created group %s\n", user, group);
+#endif
+}
+
+
+/**
+ * @brief Функция api добавления и исключения участника группы
+ *
+ * Параметры: group - имя группы без префикса, user - участник. Менять состав 
+ * группы может только её участник, исключить себя - значит выйти из группы. 
+ * Сохранённые сообщения не переписываются: участие начинается или 
+ * заканчивается на последнем сообщении хранилища, поэтому добавленный 
+ * участник не видит старых сообщений группы, а исключённый - новых. 
+ * Повторное добавление или исключение ничего не меняет.
+ *
+ * @param[in] nc Соединение, по которому нужно отправить ответ
+ * @param[in] hm Тело HTTP запроса
+ * @param[in] db Хранилище
+ * @param[in] joined 1 - добавить участника, 0 - исключить
+ */
+void put_member(struct mg_connection * nc, 
+                const struct http_message * hm,
+                struct storage * db,
+                int joined){
+
+  const struct mg_str *body =
+      hm->query_string.len > 0 ? &hm->query_string : &hm->body;
+
+  char * user = check_auth(request_arena(nc), hm, db);
+
+  if (user == NULL){
+    mg_http_send_error(nc, 401, "Unauthorized");
+    return;
+  }
+
+  char * group = (char *) arena_alloc(request_arena(nc), USERNAME_MAX_LENGTH);
+  char * member = (char *) arena_alloc(request_arena(nc), USERNAME_MAX_LENGTH);
+  if (mg_get_http_var(body, "group", group, USERNAME_MAX_LENGTH) < 1 ||
+      mg_get_http_var(body, "user", member, USERNAME_MAX_LENGTH) < 1){
+    mg_http_send_error(nc, 400, "Bad request");
+    return;
+  }
+  if (!groups_is_member(group, user)){
+    if (groups_exists(group)){
+      mg_http_send_error(nc, 403, "Forbidden");
+    } else {
+      mg_http_send_error(nc, 404, "Not found");
+    }
+    return;
+  }
+
+  int64_t cursor = 0;
+  int result = db->vtable->put_member(db, group, member, joined, &cursor);
+  if (result == STORAGE_NOT_FOUND){
+    mg_http_send_error(nc, 404, "Not found");
+    return;
+  } else if (result == STORAGE_OK){
+    if (joined){
+      groups_join(group, member, cursor);
+    } else {
+      groups_leave(group, member, cursor, groups_last_message(group));
+    }
+  } else if (result != STORAGE_EXISTS){
+    mg_http_send_error(nc, 500, "Internal server error");
+    return;
+  }
+  mg_printf(nc,
+              "HTTP/1.1 200 OK\r\n"
+              "Content-Length: 0\r\n\r\n");
+#ifdef _DEBUG
+  printf("%s %s %s in group %s\n", user, joined ? "added" : "removed", 
+         member, group);
+#endif
+}
+
+
+/**
+ * @brief Функция api правки и удаления сообщения
+ *
+ * Параметры: message_id - сообщение, message - новый текст (только для 
+ * правки). Изменить можно только своё неудалённое сообщение. Удалённое 
+ * сообщение остаётся в истории с пустым текстом, пока изменение не сжато. 
+ * Изменение получает версию, она отправляется в ответе, а изменение 
+ * попадает в журналы отправителя и получателя (или группы). Буферы кэша 
+ * обоих собеседников сбрасываются и заполнятся из хранилища при следующем 
+ * запросе.
+ *
+ * @param[in] nc Соединение, по которому нужно отправить ответ
+ * @param[in] hm Тело HTTP запроса
+ * @param[in] db Хранилище
+ * @param[in] deleted 1 - удалить сообщение, 0 - заменить текст
+ */
+void change_message(struct mg_connection * nc, 
+                    const struct http_message * hm,
+                    struct storage * db,
+                    int deleted){
+
+  const struct mg_str *body =
+      hm->query_string.len > 0 ? &hm->query_string : &hm->body;
+
+  char * user = check_auth(request_arena(nc), hm, db);
+
+  if (user == NULL){
+    mg_http_send_error(nc, 401, "Unauthorized");
+    return;
+  }
+
+  char message_id_s[MESSAGE_ID_MAX_LENGTH];
+  char * message = NULL;
+
+  if (mg_get_http_var(body, "message_id", message_id_s, 
+                      sizeof(message_id_s)) < 1 || to64(message_id_s) < 1){
+    mg_http_send_error(nc, 400, "Bad request");
+    return;
+  }
+  if (!deleted){
+    message = (char *) arena_alloc(request_arena(nc), MESSAGE_MAX_LENGTH);
+    if (mg_get_http_var(body, "message", message, MESSAGE_MAX_LENGTH) < 1){
+      mg_http_send_error(nc, 400, "Bad request");
+      return;
+    }
+  }
+
+  struct storage_change change = { 
+    0, to64(message_id_s), user, NULL, message, time(NULL) 
+  };
+  int result = db->vtable->put_change(db, &change);
+  if (result != STORAGE_OK){
+    if (result == STORAGE_NOT_FOUND){
+      mg_http_send_error(nc, 404, "Not found");
+    } else {
+      mg_http_send_error(nc, 500, "Internal server error");
+    }
+    return;
+  }
+  // Group messages are neither cached nor in conversations
+  if (change.to[0] != STORAGE_GROUP_PREFIX){
+    message_cache_forget(user);
+    message_cache_forget(change.to);
+    conversations_change(change.message_id, user, change.to, message);
+  }
+  changes_put(change.version, change.message_id, user, change.to, message, 
+              change.time);
+
+  char answer[64];
+  int len = snprintf(answer, sizeof(answer), "{\"version\":%" INT64_FMT "}", 
+                     change.version);
+  mg_printf(nc,
+              "HTTP/1.1 200 OK\r\n"
+              "Content-Type: text/json\r\n"
+              "Content-Length: %d\r\n\r\n%s",
+              len, answer);
+#ifdef _DEBUG
+  printf("%s %s message %d\n", user, deleted ? "deleted" : "edited", 
+         (int) change.message_id);
+#endif
+}
+
+
+/// Аргумент on_list_change
+struct changes_arg {
+  struct arena * arena; ///< Арена запроса
+  struct arena_buf * answer; ///< Ответ
+  int64_t last; ///< Версия последнего изменения в ответе
+  int found; ///< Количество изменений в ответе
+};
+
+
+/**
+ * @brief Функция добавляет изменение в ответ для change_cb
+ */
+static void on_list_change(const struct change * c, 
+                           void * arg){
+  struct changes_arg * list = (struct changes_arg *) arg;
+  char message_id_s[MESSAGE_ID_MAX_LENGTH];
+  char time_s[MESSAGE_ID_MAX_LENGTH];
+
+  snprintf(message_id_s, sizeof(message_id_s), "%" INT64_FMT, c->message_id);
+  snprintf(time_s, sizeof(time_s), "%" INT64_FMT, c->time);
+  // The message JSON with the version in front
+  arena_buf_printf(list->answer, list->found++ ? ",{\"version\":%" INT64_FMT "," :
+                                                 "{\"version\":%" INT64_FMT ",", 
+                   c->version);
+  arena_buf_append(list->answer, 
+                   build_message_json(list->arena, message_id_s, c->from, 
+                                      c->to, c->message, time_s) + 1);
+  list->last = c->version;
+}
+
+
+/**
+ * @brief Функция api получения изменений сообщений
+ *
+ * Параметры: since - последняя известная клиенту версия, limit - размер 
+ * страницы. Изменения идут по возрастанию версии, у каждого - сообщение с 
+ * новым текстом, null для удалённого. Клиент запрашивает следующую страницу 
+ * с since, равным version ответа, пока has_more равно true, и запоминает 
+ * version последнего ответа. Без since ответ пустой и содержит только 
+ * текущую версию, с которой клиент, скачавший историю, начинает 
+ * синхронизацию. Если since меньше границы сжатия, часть изменений уже 
+ * потеряна, и ответ 410: клиенту нужно скачать историю заново. Изменения 
+ * берутся из памяти без обращения к хранилищу. ETag ответа на запрос GET - 
+ * версия изменений пользователя и граница сжатия.
+ *
+ * @param[in] nc Соединение, по которому нужно отправить ответ
+ * @param[in] hm Тело HTTP запроса
+ * @param[in] db Хранилище
+ */
+void get_changes(struct mg_connection * nc, 
+                 const struct http_message * hm,
+                 struct storage * db){
+
+  const struct mg_str *body =
+      hm->query_string.len > 0 ? &hm->query_string : &hm->body;
+
+  char * user = request_user(nc, hm, db);
+
+  if (user == NULL){
+    mg_http_send_error(nc, 401, "Unauthorized");
+    return;
+  }
+
+  char since_s[MESSAGE_ID_MAX_LENGTH];
+  char limit_s[MESSAGE_ID_MAX_LENGTH];
+  int has_since = mg_get_http_var(body, "since", since_s, sizeof(since_s)) > 0;
+  int64_t since = has_since ? to64(since_s) : 0;
+  int limit = HISTORY_PAGE_SIZE;
+
+  if (mg_get_http_var(body, "limit", limit_s, sizeof(limit_s)) > 0){
+    limit = atoi(limit_s);
+  }
+  if (since < 0 || limit < 1 || limit > HISTORY_PAGE_MAX){
+    mg_http_send_error(nc, 400, "Bad request");
+    return;
+  }
+
+  int64_t latest = changes_latest(user);
+  const char * headers = check_etag(nc, hm, 'v', 
+                                    latest + changes_horizon());
+  if (headers == NULL){
+    return;
+  }
+  if (has_since && since < changes_horizon()){
+    mg_http_send_error(nc, 410, "Gone");
+    return;
+  }
+
+  struct arena_buf answer;
+  struct changes_arg list = { request_arena(nc), &answer, 0, 0 };
+  int has_more = 0;
+  arena_buf_init(&answer, request_arena(nc), ANSWER_INITIAL_SIZE);
+  arena_buf_append(&answer, "{\"changes\":[");
+  if (has_since){
+    has_more = changes_list(user, since, limit + 1, on_list_change, &list) > 
+               limit;
+  }
+  arena_buf_printf(&answer, "],\"version\":%" INT64_FMT ",\"has_more\":%s}",
+                   has_more ? list.last : 
+                   std::max(std::max(since, changes_horizon()), latest),
+                   has_more ? "true" : "false");
+
+  send_json(nc, headers, &answer);
+}
+
+
+/**
+ * @brief Функция достаёт данные о пользователе из базы данных
+ *
+ * @param[in] a Арена запроса, из которой выделяется результат
+ * @param[in] db Хранилище
+ * @param[in] user Указатель на строку, содержащую имя пользователя
+ * @retval NULL если пользователь не найден в базе данных
+ * @retval Указатель на строку, содержащую имя пользователя
+ */
+char * get_user_from_db(struct arena * a,
+                        struct storage * db, 
+                        char * user){
+  if (db->vtable->lookup_user(db, user, NULL, 0) != STORAGE_OK){
+    return NULL;
+  }
+
+  char * result_user = (char *) arena_alloc(a, USERNAME_MAX_LENGTH);
+  strcpy(result_user, user);
+  return result_user;
+}
+
+
+/**
+ * @brief Функция api регистрации нового пользователя
+ *
+ * Функция проверяет правильность запроса, пытается добавить пользователя в базу
+ * данных. Результат попытки отправляет по открытому соединению. Получатель 
+ * без пароля, оставшийся после миграции схемы, может быть зарегистрирован.
+ *
+ * @param[in] nc Соединение, по которому нужно отправить ответ
+ * @param[in] hm Тело HTTP запроса
+ * @param[in] db Хранилище
+ */
+void register_user(struct mg_connection * nc, 
+                   const struct http_message * hm,
+                   struct storage * db){
+
+  const struct mg_str *body =
+      hm->query_string.len > 0 ? &hm->query_string : &hm->body;
+
+  char * user = (char *) arena_alloc(request_arena(nc), USERNAME_MAX_LENGTH);
+  int result = mg_get_http_var(body, "user", user, USERNAME_MAX_LENGTH);
+  // The prefix marks group addresses
+  if (result < 1 || user[0] == STORAGE_GROUP_PREFIX){
+    mg_http_send_error(nc, 400, "Bad request");
+    return;
+  }
+  
+  char pass[256];
+  result = mg_get_http_var(body, "password", pass, sizeof(pass));
+  if (result < 1){
+    mg_http_send_error(nc, 400, "Bad request");
+    return;
+  }
+
+  result = db->vtable->create_user(db, user, pass);
+  if (result == STORAGE_EXISTS){
+    mg_http_send_error(nc, 401, "User already exist");
+  } else if (result != STORAGE_OK){
+    mg_http_send_error(nc, 500, "Internal server error");
+  } else {
+    s_user_versions[user]++;
+#ifdef _DEBUG
+    printf("%s registered\n", user);
+#endif
+    mg_printf(nc,
+                "HTTP/1.1 200 OK\r\n"
+                "Content-Type: text/plain\r\n"
+                "Content-Length: 23\r\n\r\n"
+                "Registration successful");
+  }
+}
+
+
+/**
+ * @brief Функция api получения данных о пользователе
+ *
+ * Функция проверяет правильность запроса, отправляет по соединению данные о 
+ * пользователе. Пользователь, уже найденный однажды, в хранилище больше не 
+ * ищется, ETag ответа на запрос GET - версия строки пользователя.
+ *
+ * @param[in] nc Соединение, по которому нужно отправить ответ
+ * @param[in] hm Тело HTTP запроса
+ * @param[in] db Хранилище
+ */
+void get_user(struct mg_connection * nc, 
+              const struct http_message * hm,
+              struct storage * db){
+
+  const struct mg_str *body =
+      hm->query_string.len > 0 ? &hm->query_string : &hm->body;
+
+  char * user = (char *) arena_alloc(request_arena(nc), USERNAME_MAX_LENGTH);
+  int result = mg_get_http_var(body, "user", user, USERNAME_MAX_LENGTH);
+  if (result < 1){
+    mg_http_send_error(nc, 400, "Bad request");
+    return;
+  }
+
+  std::unordered_map<std::string, int64_t>::iterator it =
+    s_user_versions.find(user);
+  if (it == s_user_versions.end()){
+    if (get_user_from_db(request_arena(nc), db, user) == NULL){
+      mg_http_send_error(nc, 404, "Not found");
+      return;
+    }
+    it = s_user_versions.insert(std::make_pair(std::string(user), 
+                                               (int64_t) 1)).first;
+  }
+  const char * headers = check_etag(nc, hm, 'u', it->second);
+  if (headers == NULL){
+    return;
+  }
+  
+    mg_printf(nc,
+                "HTTP/1.1 200 OK\r\n"
+                "Content-Type: text/plain\r\n"
+                "%s"
+                "Content-Length: %d\r\n\r\n"
+                "%s", headers, strlen(user), user);
+}
+
+
+/**
+ * @brief Функция-обработчик POST запроса к api
+ *
+ * @param[in] nc Соединение, по которому нужно отправить ответ
+ * @param[in] hm Тело HTTP запроса
+ * @param[in] db Хранилище
+ * @return Действие api, enum api_action
+ */
+int op_post(struct mg_connection * nc, 
+            const struct http_message * hm,
+            struct storage * db){
+
+  const struct mg_str *body =
+      hm->query_string.len > 0 ? &hm->query_string : &hm->body;
+
+  int action = switch_action(body);
+
+  switch (action)
+  {
+  case API_ACTION_GET_MESSAGE:
+    get_message(nc, hm, db);
+    break;
+  case API_ACTION_SEND_MESSAGE:
+    send_message(nc, hm, db);
+    break;
+  case API_ACTION_SEND_BATCH:
+    send_batch(nc, hm, db);
+    break;
+  case API_ACTION_HAS_NEW:
+    has_new(nc, hm, db);
+    break;
+  case API_ACTION_GET_HISTORY:
+    get_history(nc, hm, db);
+    break;
+  case API_ACTION_LIST_CONVERSATIONS:
+    list_conversations(nc, hm, db);
+    break;
+  case API_ACTION_MARK_READ:
+    mark_read(nc, hm, db);
+    break;
+  case API_ACTION_CREATE_GROUP:
+    create_group(nc, hm, db);
+    break;
+  case API_ACTION_ADD_MEMBER:
+    put_member(nc, hm, db, 1);
+    break;
+  case API_ACTION_REMOVE_MEMBER:
+    put_member(nc, hm, db, 0);
+    break;
+  case API_ACTION_EDIT_MESSAGE:
+    change_message(nc, hm, db, 0);
+    break;
+  case API_ACTION_DELETE_MESSAGE:
+    change_message(nc, hm, db, 1);
+    break;
+  case API_ACTION_GET_CHANGES:
+    get_changes(nc, hm, db);
+    break;
+  case API_ACTION_GET_USER:
+    get_user(nc, hm, db);
+    break;
+  case API_ACTION_REGISTER:
+    register_user(nc, hm, db);
+    break;
+  default:
+    mg_http_send_error(nc, 501, "Not implemented");
+    break;
+  }
+  return action;
+}
+
+
+/**
+ * @brief Функция-обработчик GET запроса к api
+ *
+ * Методом GET доступны только действия чтения, параметры передаются в строке 
+ * запроса.
+ *
+ * @param[in] nc Соединение, по которому нужно отправить ответ
+ * @param[in] hm Тело HTTP запроса
+ * @param[in] db Хранилище
+ * @return Действие api, enum api_action
+ */
+int op_get(struct mg_connection * nc, 
+           const struct http_message * hm,
+           struct storage * db){
+
+  int action = switch_action(&hm->query_string);
+
+  switch (action)
+  {
+  case API_ACTION_GET_MESSAGE:
+    get_message(nc, hm, db);
+    break;
+  case API_ACTION_HAS_NEW:
+    has_new(nc, hm, db);
+    break;
+  case API_ACTION_GET_HISTORY:
+    get_history(nc, hm, db);
+    break;
+  case API_ACTION_LIST_CONVERSATIONS:
+    list_conversations(nc, hm, db);
+    break;
+  case API_ACTION_GET_CHANGES:
+    get_changes(nc, hm, db);
+    break;
+  case API_ACTION_GET_USER:
+    get_user(nc, hm, db);
+    break;
+  case API_ACTION_NULL:
+    mg_http_send_error(nc, 501, "Not implemented");
+    break;
+  default:
+    mg_http_send_error(nc, 405, "Method not allowed");
+    break;
+  }
+  return action;
+}
+
+
+/**
+ * @brief Функция-обработчик PUT запроса к api
+ *
+ * Методом PUT доступна только правка сообщения.
+ *
+ * @param[in] nc Соединение, по которому нужно отправить ответ
+ * @param[in] hm Тело HTTP запроса
+ * @param[in] db Хранилище
+ * @return Действие api, enum api_action
+ */
+int op_set(struct mg_connection * nc, 
+           const struct http_message * hm,
+           struct storage * db){
+
+  const struct mg_str *body =
+      hm->query_string.len > 0 ? &hm->query_string : &hm->body;
+
+  int action = switch_action(body);
+
+  switch (action)
+  {
+  case API_ACTION_EDIT_MESSAGE:
+    change_message(nc, hm, db, 0);
+    break;
+  case API_ACTION_NULL:
+    mg_http_send_error(nc, 501, "Not implemented");
+    break;
+  default:
+    mg_http_send_error(nc, 405, "Method not allowed");
+    break;
+  }
+  return action;
+}
+
+
+/**
+ * @brief Функция-обработчик DELETE запроса к api
+ *
+ * Методом DELETE доступно только удаление сообщения.
+ *
+ * @param[in] nc Соединение, по которому нужно отправить ответ
+ * @param[in] hm Тело HTTP запроса
+ * @param[in] db Хранилище
+ * @return Действие api, enum api_action
+ */
+int op_del(struct mg_connection * nc, 
+           const struct http_message * hm,
+           struct storage * db){
+
+  const struct mg_str *body =
+      hm->query_string.len > 0 ? &hm->query_string : &hm->body;
+
+  int action = switch_action(body);
+
+  switch (action)
+  {
+  case API_ACTION_DELETE_MESSAGE:
+    change_message(nc, hm, db, 1);
+    break;
+  case API_ACTION_NULL:
+    mg_http_send_error(nc, 501, "Not implemented");
+    break;
+  default:
+    mg_http_send_error(nc, 405, "Method not allowed");
+    break;
+  }
+  return action;
+}
+
+
+/**
+ * @brief Функция-обработчик любого запроса к api
+ *
+ * @param[in] nc Соединение, по которому нужно отправить ответ
+ * @param[in] hm Тело HTTP запроса
+ * @param[in] db Хранилище
+ * @param[in] op Тип запроса к api
+ * @return Действие api, enum api_action
+ */
+int db_op(struct mg_connection *nc, 
+          const struct http_message *hm,
+          struct storage *db, 
+          int op){
+  switch (op) {
+    case API_OP_POST:
+      return op_post(nc, hm, db);
+    case API_OP_GET:
+      return op_get(nc, hm, db);
+    case API_OP_SET:
+      return op_set(nc, hm, db);
+    case API_OP_DEL:
+      return op_del(nc, hm, db);
+    default:
+      mg_http_send_error(nc, 501, "Not implemented");
+      return API_ACTION_NULL;
+  }
+}
+
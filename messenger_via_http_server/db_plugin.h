@@ -8,7 +8,8 @@
 #ifndef _MESSENGER_VIA_HTTP_SERVER__DB_PLUGIN_H_
 #define _MESSENGER_VIA_HTTP_SERVER__DB_PLUGIN_H_
 
-#include "sqlite3.h"
+#include "storage.h"
+#include "arena.h"
 
 /// Максимальная длина имени пользователя
 #define USERNAME_MAX_LENGTH 40
@@ -16,11 +17,29 @@
 /// Максимальная длина пароля
 #define PASS_MAX_LENGTH 256
 
+/// Максимальная длина идентификатора сообщения в текстовом виде
+#define MESSAGE_ID_MAX_LENGTH 24
+
+/// Максимальная длина текста сообщения
+#define MESSAGE_MAX_LENGTH 4096
+
+/// Максимальное количество сообщений в одном пакетном запросе
+#define BATCH_MAX_SIZE 256
+
+/// Количество сообщений на странице истории переписки по умолчанию
+#define HISTORY_PAGE_SIZE 20
+
+/// Максимальное количество сообщений на странице истории переписки
+#define HISTORY_PAGE_MAX 100
+
+/// Начальный размер списка в ответе, который растёт в памяти арены запроса
+#define ANSWER_INITIAL_SIZE 4096
+
 /// Набор возможных типов запросов к api
 enum api_op { 
   API_OP_POST, ///< POST
   API_OP_GET, ///< GET
-  API_OP_SET, ///< SET
+  API_OP_SET, ///< PUT
   API_OP_DEL  ///< DELETE
 };
 
@@ -30,16 +49,23 @@ enum api_action {
   API_ACTION_SEND_MESSAGE, ///< Отправка сообщения
   API_ACTION_GET_MESSAGE, ///< Получение сообщения
   API_ACTION_REGISTER, ///< Регистрация нового пользователя
-  API_ACTION_GET_USER ///< Получение данных о пользователе
+  API_ACTION_GET_USER, ///< Получение данных о пользователе
+  API_ACTION_SEND_BATCH, ///< Пакетная отправка сообщений
+  API_ACTION_HAS_NEW, ///< Проверка наличия новых сообщений
+  API_ACTION_GET_HISTORY, ///< Страница истории переписки с собеседником
+  API_ACTION_LIST_CONVERSATIONS, ///< Список переписок
+  API_ACTION_MARK_READ, ///< Отметка о прочтении переписки
+  API_ACTION_CREATE_GROUP, ///< Создание группы
+  API_ACTION_ADD_MEMBER, ///< Добавление участника группы
+  API_ACTION_REMOVE_MEMBER, ///< Исключение участника группы
+  API_ACTION_EDIT_MESSAGE, ///< Правка сообщения
+  API_ACTION_DELETE_MESSAGE, ///< Удаление сообщения
+  API_ACTION_GET_CHANGES, ///< Изменения сообщений после версии
+  API_ACTION_COUNT ///< Количество действий, не действие
 };
 
-void * db_open(const char * db_path);
-
-
-void db_close(void ** db_handle);
-
-
-char * build_message_json(const char * message_id, 
+char * build_message_json(struct arena * a,
+                          const char * message_id, 
                           const char * from, 
                           const char * to, 
                           const char * message, 
@@ -49,48 +75,137 @@ char * build_message_json(const char * message_id,
 int switch_action(const mg_str * buf);                          
 
 
-char * check_auth(const http_message * hm, 
-                  void * db);
+char * check_auth(struct arena * a,
+                  const http_message * hm, 
+                  struct storage * db);
+
+
+int load_latest_messages(struct storage * db);
+
+
+int load_conversations(struct storage * db);
+
+
+int load_groups(struct storage * db);
+
+
+int load_changes(struct storage * db);
+
+
+void compact_changes(struct storage * db, 
+                     int64_t retention);
+
+
+int migrate_storage(struct storage * db);
 
 
 void get_message(struct mg_connection * nc, 
                  const struct http_message * hm,
-                 void * db);
+                 struct storage * db);
                  
                  
+void has_new(struct mg_connection * nc, 
+             const struct http_message * hm,
+             struct storage * db);
+
+
+void get_history(struct mg_connection * nc, 
+                 const struct http_message * hm,
+                 struct storage * db);
+
+
+void list_conversations(struct mg_connection * nc, 
+                        const struct http_message * hm,
+                        struct storage * db);
+
+
+void mark_read(struct mg_connection * nc, 
+               const struct http_message * hm,
+               struct storage * db);
+
+
+void create_group(struct mg_connection * nc, 
+                  const struct http_message * hm,
+                  struct storage * db);
+
+
+void put_member(struct mg_connection * nc, 
+                const struct http_message * hm,
+                struct storage * db,
+                int joined);
+
+
+void change_message(struct mg_connection * nc, 
+                    const struct http_message * hm,
+                    struct storage * db,
+                    int deleted);
+
+
+void get_changes(struct mg_connection * nc, 
+                 const struct http_message * hm,
+                 struct storage * db);
+
+
 void send_message(struct mg_connection * nc, 
                   const struct http_message * hm,
-                  void * db);
+                  struct storage * db);
+
+
+int get_http_var_list(const struct mg_str * buf, 
+                      const char * name, 
+                      struct mg_str * values, 
+                      int max_count);
+
+
+void send_batch(struct mg_connection * nc, 
+                const struct http_message * hm,
+                struct storage * db);
 
                   
-char * get_user_from_db(void * db, 
+char * get_user_from_db(struct arena * a,
+                        struct storage * db, 
                     char * user);
 
 
 void register_user(struct mg_connection * nc, 
                    const struct http_message * hm,
-                   void * db);
+                   struct storage * db);
 
                    
 void get_user(struct mg_connection * nc, 
               const struct http_message * hm,
-              void * db);
+              struct storage * db);
 
             
-void op_post(struct mg_connection * nc, 
-             const struct http_message * hm,
-             void * db);
+int op_post(struct mg_connection * nc, 
+            const struct http_message * hm,
+            struct storage * db);
+
+
+int op_get(struct mg_connection * nc, 
+           const struct http_message * hm,
+           struct storage * db);
+
+
+int op_set(struct mg_connection * nc, 
+           const struct http_message * hm,
+           struct storage * db);
+
+
+int op_del(struct mg_connection * nc, 
+           const struct http_message * hm,
+           struct storage * db);
 
              
-void db_op(struct mg_connection *nc, 
-           const struct http_message *hm,
-           void *db, int op);             
+int db_op(struct mg_connection *nc, 
+          const struct http_message *hm,
+          struct storage *db, int op);             
 
            
-void db_op(struct mg_connection *nc, 
-           const struct http_message *hm, 
-           void *db, 
-           int op);
+int db_op(struct mg_connection *nc, 
+          const struct http_message *hm, 
+          struct storage *db, 
+          int op);
 
            
 #endif //_MESSENGER_VIA_HTTP_SERVER__DB_PLUGIN_H_
\ No newline at end of file
@@ -0,0 +1,117 @@
+/**
+ * @file
+ * @brief Таблица недавних ключей повтора отправки
+ *
+ * Ключи хранятся в хеш-таблице по паре (отправитель, client_msg_id) и в
+ * очереди в порядке добавления. При заполнении таблицы вытесняется ключ из
+ * начала очереди, поэтому добавление и поиск выполняются за постоянное
+ * время.
+ *
+ */
+
+#include <deque>
+#include <string>
+#include <unordered_map>
+
+#include "dedup.h"
+
+/// Сообщения по ключу повтора, ключ - dedup_key
+static std::unordered_map<std::string, int64_t> s_keys;
+/// Ключи в порядке добавления
+static std::deque<std::string> s_order;
+/// Наибольшее количество ключей, 0 - таблица выключена
+static size_t s_capacity = DEDUP_CAPACITY;
+/// Повторы, найденные в таблице
+static int64_t s_hits = 0;
+/// Ключи, вытесненные из таблицы
+static int64_t s_evictions = 0;
+
+
+/**
+ * @brief Функция возвращает ключ таблицы: имя пользователя не содержит
+ * нулевого символа, поэтому пара однозначна
+ */
+static std::string dedup_key(const char * user,
+                             const char * client_msg_id){
+  return std::string(user) + '\0' + client_msg_id;
+}
+
+
+/**
+ * @brief Функция задаёт размер таблицы и очищает её
+ *
+ * @param[in] capacity Наибольшее количество ключей, 0 - повторы находит
+ * только хранилище
+ */
+void dedup_init(size_t capacity){
+  dedup_free();
+  s_capacity = capacity;
+}
+
+
+/**
+ * @brief Функция находит сообщение, отправленное с ключом повтора
+ *
+ * @param[in] user Отправитель
+ * @param[in] client_msg_id Ключ повтора
+ * @return Идентификатор сообщения, 0 если ключа нет в таблице
+ */
+int64_t dedup_find(const char * user,
+                   const char * client_msg_id){
+  std::unordered_map<std::string, int64_t>::const_iterator it =
+    s_keys.find(dedup_key(user, client_msg_id));
+
+  if (it == s_keys.end()){
+    return 0;
+  }
+  s_hits++;
+  return it->second;
+}
+
+
+/**
+ * @brief Функция запоминает ключ повтора сохранённого сообщения, при
+ * заполнении таблицы вытесняя самый старый ключ
+ *
+ * @param[in] user Отправитель
+ * @param[in] client_msg_id Ключ повтора
+ * @param[in] message_id Идентификатор сообщения
+ */
+void dedup_put(const char * user,
+               const char * client_msg_id,
+               int64_t message_id){
+  if (s_capacity == 0){
+    return;
+  }
+  std::string key = dedup_key(user, client_msg_id);
+  if (!s_keys.insert(std::make_pair(key, message_id)).second){
+    return;
+  }
+  s_order.push_back(key);
+  if (s_order.size() > s_capacity){
+    s_keys.erase(s_order.front());
+    s_order.pop_front();
+    s_evictions++;
+  }
+}
+
+
+/**
+ * @brief Функция заполняет статистику таблицы
+ */
+void dedup_get_stats(struct dedup_stats * stats){
+  stats->keys = s_keys.size();
+  stats->hits = s_hits;
+  stats->evictions = s_evictions;
+}
+
+
+/**
+ * @brief Функция освобождает таблицу
+ */
+void dedup_free(void){
+  s_keys.clear();
+  s_order.clear();
+  s_hits = 0;
+  s_evictions = 0;
+}
@@ -0,0 +1,52 @@
+/**
+ * @file
+ * @brief Заголовочный файл таблицы недавних ключей повтора отправки.
+ *
+ * Клиент, не дождавшийся ответа send_message, повторяет запрос с тем же
+ * client_msg_id. Ключи недавно отправленных сообщений хранятся в памяти
+ * вместе с присвоенными message_id, поэтому повтор получает исходный
+ * message_id без обращения к хранилищу. Таблица ограничена по количеству
+ * ключей и вытесняет самые старые: повторы приходят вскоре после исходного
+ * запроса. Ключ, вытесненный из таблицы или потерянный при перезапуске,
+ * отклоняет уникальный индекс хранилища.
+ *
+ */
+
+#ifndef _MESSENGER_VIA_HTTP_SERVER__DEDUP_H_
+#define _MESSENGER_VIA_HTTP_SERVER__DEDUP_H_
+
+#include <stddef.h>
+#include "mongoose.h"
+
+/// Количество ключей в таблице по умолчанию
+#define DEDUP_CAPACITY 65536
+
+/// Максимальная длина ключа повтора отправки
+#define CLIENT_MSG_ID_MAX_LENGTH 64
+
+/// Статистика таблицы ключей
+struct dedup_stats {
+  size_t keys; ///< Ключи в таблице
+  int64_t hits; ///< Повторы, найденные в таблице
+  int64_t evictions; ///< Ключи, вытесненные из таблицы
+};
+
+void dedup_init(size_t capacity);
+
+
+int64_t dedup_find(const char * user,
+                   const char * client_msg_id);
+
+
+void dedup_put(const char * user,
+               const char * client_msg_id,
+               int64_t message_id);
+
+
+void dedup_get_stats(struct dedup_stats * stats);
+
+
+void dedup_free(void);
+
+
+#endif //_MESSENGER_VIA_HTTP_SERVER__DEDUP_H_
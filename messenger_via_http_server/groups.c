@@ -0,0 +1,237 @@
+/**
+ * @file
+ * @brief Таблица участников групп
+ *
+ * Участие пользователя в группе - интервал идентификаторов сообщений: 
+ * участнику видны сообщения группы после joined и не позже left. Выход из 
+ * группы закрывает интервал, повторное вступление открывает новый, 
+ * поэтому изменение состава не трогает ни хранилище сообщений, ни чужие 
+ * интервалы.
+ *
+ * Последнее видимое пользователю сообщение группы - последнее сообщение 
+ * группы для открытого интервала и последнее сообщение группы внутри 
+ * интервала для закрытого, его запоминает groups_leave. Пользователь 
+ * состоит в немногих группах, поэтому оно считается обходом его интервалов.
+ *
+ */
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "groups.h"
+#include "storage.h"
+
+/// Группа
+struct group_entry {
+  int64_t latest; ///< Последнее сообщение группы
+  size_t members; ///< Текущие участники
+};
+
+/// Интервал участия пользователя в группе
+struct group_membership {
+  struct group_entry * group; ///< Группа, адрес не меняется до groups_free
+  std::string name; ///< Имя группы
+  int64_t joined; ///< Последнее сообщение при вступлении
+  int64_t left; ///< Последнее сообщение при выходе или STORAGE_CURSOR_MAX
+  int64_t last; ///< Последнее сообщение группы в закрытом интервале
+};
+
+/// Группы по имени
+static std::unordered_map<std::string, struct group_entry> s_groups;
+/// Интервалы участия по имени пользователя
+static std::unordered_map<std::string, std::vector<group_membership> > 
+  s_users;
+
+
+/**
+ * @brief Функция находит открытый интервал участия user в group
+ */
+static struct group_membership * find_current(const char * group,
+                                              const char * user){
+  std::unordered_map<std::string, std::vector<group_membership> >::iterator 
+    it = s_users.find(user);
+
+  if (it == s_users.end()){
+    return NULL;
+  }
+  for (size_t i = 0; i < it->second.size(); i++){
+    if (it->second[i].left == STORAGE_CURSOR_MAX && 
+        it->second[i].name == group){
+      return &it->second[i];
+    }
+  }
+  return NULL;
+}
+
+
+/**
+ * @brief Функция открывает интервал участия пользователя в группе, 
+ * создавая группу, если её нет
+ *
+ * @param[in] group Имя группы без префикса
+ * @param[in] user Участник
+ * @param[in] joined Последнее сообщение хранилища при вступлении
+ */
+void groups_join(const char * group,
+                 const char * user,
+                 int64_t joined){
+  struct group_entry & entry = s_groups[group];
+  struct group_membership membership;
+
+  if (find_current(group, user) != NULL){
+    return;
+  }
+  membership.group = &entry;
+  membership.name = group;
+  membership.joined = joined;
+  membership.left = STORAGE_CURSOR_MAX;
+  membership.last = 0;
+  s_users[user].push_back(membership);
+  entry.members++;
+}
+
+
+/**
+ * @brief Функция закрывает интервал участия пользователя в группе
+ *
+ * @param[in] group Имя группы без префикса
+ * @param[in] user Участник
+ * @param[in] left Последнее сообщение хранилища при выходе
+ * @param[in] last Последнее сообщение группы не позже left
+ */
+void groups_leave(const char * group,
+                  const char * user,
+                  int64_t left,
+                  int64_t last){
+  struct group_membership * membership = find_current(group, user);
+
+  if (membership != NULL){
+    membership->left = left;
+    membership->last = last;
+    membership->group->members--;
+  }
+}
+
+
+/**
+ * @brief Функция проверяет, что группа существует
+ */
+int groups_exists(const char * group){
+  return s_groups.count(group) > 0;
+}
+
+
+/**
+ * @brief Функция проверяет, что пользователь сейчас состоит в группе
+ */
+int groups_is_member(const char * group,
+                     const char * user){
+  return find_current(group, user) != NULL;
+}
+
+
+/**
+ * @brief Функция возвращает количество текущих участников группы
+ */
+size_t groups_members(const char * group){
+  std::unordered_map<std::string, struct group_entry>::const_iterator it =
+    s_groups.find(group);
+  return it == s_groups.end() ? 0 : it->second.members;
+}
+
+
+/**
+ * @brief Функция учитывает сообщение группы, создавая группу, если её нет
+ *
+ * @param[in] group Имя группы без префикса
+ * @param[in] message_id Идентификатор сообщения
+ */
+void groups_put(const char * group,
+                int64_t message_id){
+  struct group_entry & entry = s_groups[group];
+
+  if (message_id > entry.latest){
+    entry.latest = message_id;
+  }
+}
+
+
+/**
+ * @brief Функция возвращает последнее сообщение группы
+ *
+ * @return Идентификатор сообщения, 0 если группы или сообщений нет
+ */
+int64_t groups_last_message(const char * group){
+  std::unordered_map<std::string, struct group_entry>::const_iterator it =
+    s_groups.find(group);
+  return it == s_groups.end() ? 0 : it->second.latest;
+}
+
+
+/**
+ * @brief Функция возвращает последнее сообщение групп, видимое пользователю
+ *
+ * @param[in] user Пользователь
+ * @return Идентификатор сообщения, 0 если сообщений групп пользователю не 
+ * видно
+ */
+int64_t groups_latest(const char * user){
+  std::unordered_map<std::string, std::vector<group_membership> >::const_iterator
+    it = s_users.find(user);
+  int64_t latest = 0;
+
+  if (it == s_users.end()){
+    return 0;
+  }
+  for (size_t i = 0; i < it->second.size(); i++){
+    const struct group_membership & membership = it->second[i];
+    int64_t visible = membership.left == STORAGE_CURSOR_MAX ?
+                      membership.group->latest : membership.last;
+    if (visible > membership.joined && visible > latest){
+      latest = visible;
+    }
+  }
+  return latest;
+}
+
+
+/**
+ * @brief Функция обходит интервалы участия пользователя, открытые и 
+ * закрытые
+ *
+ * @param[in] user Пользователь
+ * @param[in] cb Функция, вызываемая для каждого интервала
+ * @param[in] arg Аргумент cb
+ */
+void groups_memberships(const char * user,
+                        groups_membership_cb cb,
+                        void * arg){
+  std::unordered_map<std::string, std::vector<group_membership> >::const_iterator
+    it = s_users.find(user);
+
+  if (it == s_users.end()){
+    return;
+  }
+  for (size_t i = 0; i < it->second.size(); i++){
+    cb(it->second[i].name.c_str(), it->second[i].joined, it->second[i].left,
+       arg);
+  }
+}
+
+
+/**
+ * @brief Функция возвращает количество групп в памяти
+ */
+size_t groups_count(void){
+  return s_groups.size();
+}
+
+
+/**
+ * @brief Функция освобождает таблицу
+ */
+void groups_free(void){
+  s_users.clear();
+  s_groups.clear();
+}
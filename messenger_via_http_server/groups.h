@@ -0,0 +1,68 @@
+/**
+ * @file
+ * @brief Заголовочный файл таблицы участников групп.
+ *
+ * Сообщение группе хранится один раз, а участники читают его вместе со 
+ * своими личными сообщениями. Чтобы ответить, есть ли у пользователя новые 
+ * сообщения, не обходя хранилище, в памяти хранятся интервалы участия 
+ * каждого пользователя и последнее сообщение каждой группы. Таблица 
+ * строится одним обходом хранилища при запуске сервера и дальше обновляется 
+ * при отправке сообщений группам и изменениях состава групп.
+ *
+ */
+
+#ifndef _MESSENGER_VIA_HTTP_SERVER__GROUPS_H_
+#define _MESSENGER_VIA_HTTP_SERVER__GROUPS_H_
+
+#include <stddef.h>
+#include "mongoose.h"
+
+/// Функция, вызываемая для каждого интервала участия пользователя
+typedef void (*groups_membership_cb)(const char * group,
+                                     int64_t joined,
+                                     int64_t left,
+                                     void * arg);
+
+void groups_join(const char * group,
+                 const char * user,
+                 int64_t joined);
+
+
+void groups_leave(const char * group,
+                  const char * user,
+                  int64_t left,
+                  int64_t last);
+
+
+int groups_exists(const char * group);
+
+
+int groups_is_member(const char * group,
+                     const char * user);
+
+
+size_t groups_members(const char * group);
+
+
+void groups_put(const char * group,
+                int64_t message_id);
+
+
+int64_t groups_last_message(const char * group);
+
+
+int64_t groups_latest(const char * user);
+
+
+void groups_memberships(const char * user,
+                        groups_membership_cb cb,
+                        void * arg);
+
+
+size_t groups_count(void);
+
+
+void groups_free(void);
+
+
+#endif //_MESSENGER_VIA_HTTP_SERVER__GROUPS_H_
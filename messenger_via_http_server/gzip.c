@@ -0,0 +1,259 @@
+/**
+ * @file
+ * @brief Сжатие данных в формат gzip
+ *
+ * Весь вход кодируется одним блоком deflate с фиксированными кодами. Для
+ * каждой позиции просматривается не больше max_chain предыдущих позиций с
+ * тем же хэшем трёх байт, берётся самый длинный повтор. Биты пишутся
+ * начиная с младших, коды Хаффмана - начиная со старших, поэтому перед
+ * записью они разворачиваются.
+ *
+ */
+
+#include <string.h>
+#include <vector>
+
+#include "gzip.h"
+#include "mongoose.h"
+
+/// Размер окна поиска повторов
+#define GZIP_WINDOW 32768
+
+/// Наименьшая и наибольшая длина повтора
+#define GZIP_MIN_MATCH 3
+#define GZIP_MAX_MATCH 258
+
+/// Количество бит хэша трёх байт
+#define GZIP_HASH_BITS 12
+
+/// Начальные длины кодов длины 257..285
+static const unsigned short s_length_base[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+/// Дополнительные биты кодов длины
+static const unsigned char s_length_extra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+/// Начальные расстояния кодов расстояния 0..29
+static const unsigned short s_dist_base[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289,
+  16385, 24577
+};
+
+/// Дополнительные биты кодов расстояния
+static const unsigned char s_dist_extra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/// Поток бит
+struct bit_writer {
+  std::string * out; ///< Выход
+  uint32_t bits; ///< Ещё не записанные биты
+  int count; ///< Количество ещё не записанных бит
+};
+
+
+/**
+ * @brief Функция дописывает n младших бит value
+ */
+static void put_bits(struct bit_writer * w,
+                     uint32_t value,
+                     int n){
+  w->bits |= value << w->count;
+  w->count += n;
+  while (w->count >= 8){
+    w->out->push_back((char) (w->bits & 0xff));
+    w->bits >>= 8;
+    w->count -= 8;
+  }
+}
+
+
+/**
+ * @brief Функция дописывает код Хаффмана длиной n бит
+ */
+static void put_code(struct bit_writer * w,
+                     uint32_t code,
+                     int n){
+  uint32_t reversed = 0;
+
+  for (int i = 0; i < n; i++){
+    reversed = (reversed << 1) | ((code >> i) & 1);
+  }
+  put_bits(w, reversed, n);
+}
+
+
+/**
+ * @brief Функция дописывает литерал или код длины фиксированным кодом
+ */
+static void put_symbol(struct bit_writer * w,
+                       int symbol){
+  if (symbol < 144){
+    put_code(w, 0x30 + symbol, 8);
+  } else if (symbol < 256){
+    put_code(w, 0x190 + symbol - 144, 9);
+  } else if (symbol < 280){
+    put_code(w, symbol - 256, 7);
+  } else {
+    put_code(w, 0xc0 + symbol - 280, 8);
+  }
+}
+
+
+/**
+ * @brief Функция дописывает повтор длины length на расстоянии dist
+ */
+static void put_match(struct bit_writer * w,
+                      int length,
+                      int dist){
+  int i = 28;
+
+  while (s_length_base[i] > length){
+    i--;
+  }
+  put_symbol(w, 257 + i);
+  put_bits(w, length - s_length_base[i], s_length_extra[i]);
+  i = 29;
+  while (s_dist_base[i] > dist){
+    i--;
+  }
+  put_code(w, i, 5);
+  put_bits(w, dist - s_dist_base[i], s_dist_extra[i]);
+}
+
+
+/**
+ * @brief Функция возвращает контрольную сумму CRC-32 данных
+ */
+static uint32_t crc32(const char * data,
+                      size_t len){
+  static uint32_t table[256];
+  static int ready = 0;
+  uint32_t crc = 0xffffffff;
+
+  if (!ready){
+    for (uint32_t n = 0; n < 256; n++){
+      uint32_t c = n;
+      for (int k = 0; k < 8; k++){
+        c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      }
+      table[n] = c;
+    }
+    ready = 1;
+  }
+  for (size_t i = 0; i < len; i++){
+    crc = table[(crc ^ (unsigned char) data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc ^ 0xffffffff;
+}
+
+
+/**
+ * @brief Функция возвращает хэш трёх байт, начиная с p
+ */
+static uint32_t hash3(const char * p){
+  uint32_t v = ((uint32_t) (unsigned char) p[0] << 16) |
+               ((uint32_t) (unsigned char) p[1] << 8) |
+               (unsigned char) p[2];
+  return (v * 2654435761u) >> (32 - GZIP_HASH_BITS);
+}
+
+
+/**
+ * @brief Функция дописывает четыре байта value, начиная с младшего
+ */
+static void put_le32(std::string * out,
+                     uint32_t value){
+  for (int i = 0; i < 4; i++){
+    out->push_back((char) ((value >> (8 * i)) & 0xff));
+  }
+}
+
+
+/**
+ * @brief Функция сжимает данные в формат gzip
+ *
+ * @param[in] data Данные
+ * @param[in] len Размер данных
+ * @param[in] max_chain Сколько предыдущих позиций просматривать в поиске
+ * повтора, больше - лучше сжатие и дольше работа
+ * @param[out] out Строка, в которую записывается результат
+ */
+void gzip_compress(const char * data,
+                   size_t len,
+                   int max_chain,
+                   std::string * out){
+  static const char header[10] = {
+    0x1f, (char) 0x8b, 8, 0, 0, 0, 0, 0, 0, (char) 0xff
+  };
+  std::vector<int> head((size_t) 1 << GZIP_HASH_BITS, -1);
+  std::vector<int> prev(len);
+  struct bit_writer w;
+  size_t i = 0;
+
+  out->clear();
+  out->reserve(len / 2 + 32);
+  out->append(header, sizeof(header));
+  w.out = out;
+  w.bits = 0;
+  w.count = 0;
+  // One final block with fixed codes
+  put_bits(&w, 1, 1);
+  put_bits(&w, 1, 2);
+
+  while (i < len){
+    int best_len = 0;
+    int best_dist = 0;
+
+    if (i + GZIP_MIN_MATCH <= len){
+      uint32_t h = hash3(data + i);
+      size_t max_len = len - i < GZIP_MAX_MATCH ? len - i : GZIP_MAX_MATCH;
+      int chain = max_chain;
+
+      for (int j = head[h]; j >= 0 && chain > 0 &&
+           i - j <= GZIP_WINDOW; j = prev[j], chain--){
+        size_t n = 0;
+        while (n < max_len && data[j + n] == data[i + n]){
+          n++;
+        }
+        if ((int) n > best_len){
+          best_len = (int) n;
+          best_dist = (int) (i - j);
+          if (n == max_len){
+            break;
+          }
+        }
+      }
+      prev[i] = head[h];
+      head[h] = (int) i;
+    }
+    if (best_len < GZIP_MIN_MATCH){
+      put_symbol(&w, (unsigned char) data[i]);
+      i++;
+      continue;
+    }
+    put_match(&w, best_len, best_dist);
+    // Positions inside the match are still worth finding later
+    for (size_t k = i + 1; k < i + best_len; k++){
+      if (k + GZIP_MIN_MATCH <= len){
+        uint32_t h = hash3(data + k);
+        prev[k] = head[h];
+        head[h] = (int) k;
+      }
+    }
+    i += best_len;
+  }
+  put_symbol(&w, 256);
+  if (w.count > 0){
+    put_bits(&w, 0, 8 - w.count);
+  }
+  put_le32(out, crc32(data, len));
+  put_le32(out, (uint32_t) len);
+}
@@ -0,0 +1,27 @@
+/**
+ * @file
+ * @brief Заголовочный файл сжатия данных в формат gzip.
+ *
+ * Сжатие без внешних библиотек: поиск повторов LZ77 по цепочкам хэшей и
+ * кодирование фиксированными кодами Хаффмана deflate (RFC 1951, 1952).
+ * Степень сжатия ниже, чем у zlib, зато JSON и текстовые файлы сжимаются в
+ * разы без новых зависимостей сборки.
+ *
+ */
+
+#ifndef _MESSENGER_VIA_HTTP_SERVER__GZIP_H_
+#define _MESSENGER_VIA_HTTP_SERVER__GZIP_H_
+
+#include <stddef.h>
+#include <string>
+
+/// Длина просматриваемой цепочки повторов по умолчанию
+#define GZIP_MAX_CHAIN 32
+
+void gzip_compress(const char * data,
+                   size_t len,
+                   int max_chain,
+                   std::string * out);
+
+
+#endif //_MESSENGER_VIA_HTTP_SERVER__GZIP_H_
@@ -0,0 +1,81 @@
+/**
+ * @file
+ * @brief Запись строк JSON
+ *
+ * Управляющие символы записываются как \u00XX, остальные байты, в том
+ * числе UTF-8, копируются как есть.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "json.h"
+
+/// Длина записи управляющего символа \u00XX
+#define JSON_CONTROL_LENGTH 6
+
+
+/**
+ * @brief Функция возвращает длину строки JSON в кавычках
+ *
+ * @param[in] s Строка
+ * @return Длина записи без завершающего нуля
+ */
+size_t json_string_length(const char * s){
+  size_t len = 2;
+
+  for (; *s != '\0'; s++){
+    if (*s == '"' || *s == '\\'){
+      len += 2;
+    } else if ((unsigned char) *s < 0x20){
+      len += JSON_CONTROL_LENGTH;
+    } else {
+      len++;
+    }
+  }
+  return len;
+}
+
+
+/**
+ * @brief Функция записывает строку JSON в кавычках, экранируя специальные
+ * символы
+ *
+ * @param[out] dst Буфер не меньше json_string_length(s) + 1 байт
+ * @param[in] s Строка
+ * @return Указатель на завершающий нуль записи
+ */
+char * json_write_string(char * dst,
+                         const char * s){
+  *dst++ = '"';
+  for (; *s != '\0'; s++){
+    if (*s == '"' || *s == '\\'){
+      *dst++ = '\\';
+      *dst++ = *s;
+    } else if ((unsigned char) *s < 0x20){
+      snprintf(dst, JSON_CONTROL_LENGTH + 1, "\\u%04x", (unsigned char) *s);
+      dst += JSON_CONTROL_LENGTH;
+    } else {
+      *dst++ = *s;
+    }
+  }
+  *dst++ = '"';
+  *dst = '\0';
+  return dst;
+}
+
+
+/**
+ * @brief Функция дописывает строку JSON в кавычках
+ *
+ * @param[out] out Строка, к которой дописывается запись
+ * @param[in] s Строка
+ */
+void json_append_string(std::string * out,
+                        const char * s){
+  size_t len = out->size();
+
+  out->resize(len + json_string_length(s) + 1);
+  out->resize(json_write_string(&(*out)[len], s) - out->data());
+}
@@ -0,0 +1,29 @@
+/**
+ * @file
+ * @brief Заголовочный файл записи строк JSON.
+ *
+ * Строки, пришедшие от клиентов (имена пользователей и групп, тексты
+ * сообщений), попадают в ответы api и в вывод отладки только через эти
+ * функции: кавычки, обратная косая черта и управляющие символы
+ * экранируются, поэтому ответ остаётся правильным JSON при любом тексте.
+ *
+ */
+
+#ifndef _MESSENGER_VIA_HTTP_SERVER__JSON_H_
+#define _MESSENGER_VIA_HTTP_SERVER__JSON_H_
+
+#include <stddef.h>
+#include <string>
+
+size_t json_string_length(const char * s);
+
+
+char * json_write_string(char * dst,
+                         const char * s);
+
+
+void json_append_string(std::string * out,
+                        const char * s);
+
+
+#endif //_MESSENGER_VIA_HTTP_SERVER__JSON_H_
@@ -0,0 +1,274 @@
+/**
+ * @file
+ * @brief Сетевой интерфейс mongoose без сокетов
+ *
+ * Каждое соединение хранит в mgr_data указатель на соединение на другом
+ * конце. Буфер отправки передаётся другому концу целиком: если его буфер
+ * приёма пуст, mongoose принимает память буфера отправки без копирования.
+ * Установка соединения откладывается до mg_mgr_poll, чтобы события
+ * MG_EV_CONNECT и MG_EV_ACCEPT, как и у сокетов, приходили из цикла событий.
+ *
+ * Основной интерфейс в глобальном mg_ifaces должен оставаться сокетным:
+ * его цикл опроса доставляет MG_EV_POLL и MG_EV_TIMER и закрывает соединения.
+ *
+ */
+
+#include <string.h>
+#include <vector>
+
+#include "loopback.h"
+
+/// Состояние соединения
+struct loopback_conn {
+  struct mg_connection * peer; ///< Соединение на другом конце или NULL
+};
+
+
+/**
+ * @brief Функция возвращает слушающее соединение интерфейса с портом
+ * адреса sa или NULL
+ */
+static struct mg_connection * find_listener(struct mg_iface * iface,
+                                            const union socket_address * sa){
+  struct mg_connection * c;
+
+  for (c = iface->mgr->active_connections; c != NULL; c = c->next){
+    if (c->iface == iface && (c->flags & MG_F_LISTENING) &&
+        c->sa.sin.sin_port == sa->sin.sin_port){
+      return c;
+    }
+  }
+  return NULL;
+}
+
+
+/**
+ * @brief Функция устанавливает отложенное соединение nc со слушающим
+ * соединением на порту его адреса
+ */
+static void complete_connect(struct mg_connection * nc){
+  struct mg_connection * lc = find_listener(nc->iface, &nc->sa);
+  struct mg_connection * ac;
+  union socket_address sa;
+
+  if (lc == NULL || (ac = mg_if_accept_new_conn(lc)) == NULL){
+    mg_if_connect_cb(nc, 1);
+    return;
+  }
+  ((struct loopback_conn *) nc->mgr_data)->peer = ac;
+  ((struct loopback_conn *) ac->mgr_data)->peer = nc;
+  // The client port is the address of its connection, it is never reused
+  memset(&sa, 0, sizeof(sa));
+  sa.sin.sin_family = AF_INET;
+  sa.sin.sin_addr.s_addr = htonl(0x7f000001);
+  sa.sin.sin_port = htons((uint16_t) ((uintptr_t) nc & 0xffff));
+  mg_if_connect_cb(nc, 0);
+  mg_if_accept_tcp_cb(ac, &sa, sizeof(sa.sin));
+}
+
+
+/**
+ * @brief Функция передаёт буфер отправки nc в буфер приёма другого конца
+ */
+static void deliver(struct mg_connection * nc){
+  struct mg_connection * peer = ((struct loopback_conn *) nc->mgr_data)->peer;
+  int len = (int) nc->send_mbuf.len;
+
+  if (peer == NULL){
+    // The other end is closed, like a reset socket
+    mbuf_remove(&nc->send_mbuf, nc->send_mbuf.len);
+    mg_if_sent_cb(nc, -1);
+    return;
+  }
+  if (peer->recv_mbuf.len >= peer->recv_mbuf_limit){
+    return;
+  }
+  char * buf = nc->send_mbuf.buf;
+  mbuf_init(&nc->send_mbuf, 0);
+  mg_if_recv_tcp_cb(peer, buf, len, 1);
+  mg_if_sent_cb(nc, len);
+}
+
+
+static void loopback_if_init(struct mg_iface * iface){
+  (void) iface;
+}
+
+
+static void loopback_if_free(struct mg_iface * iface){
+  (void) iface;
+}
+
+
+static void loopback_if_add_conn(struct mg_connection * nc){
+  (void) nc;
+}
+
+
+static void loopback_if_remove_conn(struct mg_connection * nc){
+  (void) nc;
+}
+
+
+/**
+ * @brief Функция выполняет одну итерацию: устанавливает отложенные
+ * соединения и передаёт данные, затем доставляет MG_EV_POLL и MG_EV_TIMER и
+ * закрывает соединения циклом сокетного интерфейса, в котором нет сокетов.
+ * Функция не ждёт событий, timeout_ms не используется.
+ */
+static time_t loopback_if_poll(struct mg_iface * iface, int timeout_ms){
+  struct mg_connection * nc, * tmp;
+
+  (void) timeout_ms;
+  for (nc = iface->mgr->active_connections; nc != NULL; nc = tmp){
+    tmp = nc->next;
+    if (nc->iface != iface){
+      continue;
+    }
+    if (nc->flags & MG_F_CONNECTING){
+      complete_connect(nc);
+    } else if (nc->send_mbuf.len > 0 && !(nc->flags & MG_F_LISTENING)){
+      deliver(nc);
+    }
+  }
+  // mg_close_conn is internal to mongoose.c, the socket loop closes for us
+  return mg_ifaces[MG_MAIN_IFACE]->poll(iface, 0);
+}
+
+
+/**
+ * @brief Функция начинает прослушивание порта адреса sa
+ *
+ * @retval 0 Порт свободен
+ * @retval 1 Порт уже прослушивается
+ */
+static int loopback_if_listen_tcp(struct mg_connection * nc,
+                                  union socket_address * sa){
+  return find_listener(nc->iface, sa) != NULL ? 1 : 0;
+}
+
+
+static int loopback_if_listen_udp(struct mg_connection * nc,
+                                  union socket_address * sa){
+  (void) nc;
+  (void) sa;
+  return 1;
+}
+
+
+static void loopback_if_connect_tcp(struct mg_connection * nc,
+                                    const union socket_address * sa){
+  (void) sa;
+  nc->err = 0;
+}
+
+
+static void loopback_if_connect_udp(struct mg_connection * nc){
+  nc->err = 1;
+}
+
+
+static void loopback_if_send(struct mg_connection * nc,
+                             const void * buf,
+                             size_t len){
+  mbuf_append(&nc->send_mbuf, buf, len);
+}
+
+
+static void loopback_if_recved(struct mg_connection * nc, size_t len){
+  (void) nc;
+  (void) len;
+}
+
+
+static int loopback_if_create_conn(struct mg_connection * nc){
+  struct loopback_conn * c = new loopback_conn;
+  c->peer = NULL;
+  nc->mgr_data = c;
+  return 1;
+}
+
+
+/**
+ * @brief Функция освобождает состояние соединения, другой конец закрывается
+ * после отправки своих данных, как при закрытии сокета
+ */
+static void loopback_if_destroy_conn(struct mg_connection * nc){
+  struct loopback_conn * c = (struct loopback_conn *) nc->mgr_data;
+
+  if (c == NULL){
+    return;
+  }
+  if (c->peer != NULL){
+    ((struct loopback_conn *) c->peer->mgr_data)->peer = NULL;
+    c->peer->flags |= MG_F_SEND_AND_CLOSE;
+  }
+  delete c;
+  nc->mgr_data = NULL;
+}
+
+
+static void loopback_if_sock_set(struct mg_connection * nc, sock_t sock){
+  (void) nc;
+  (void) sock;
+}
+
+
+static void loopback_if_get_conn_addr(struct mg_connection * nc,
+                                      int remote,
+                                      union socket_address * sa){
+  struct loopback_conn * c = (struct loopback_conn *) nc->mgr_data;
+
+  if (remote){
+    *sa = nc->sa;
+  } else if (c != NULL && c->peer != NULL){
+    *sa = c->peer->sa;
+  } else {
+    memset(sa, 0, sizeof(*sa));
+  }
+}
+
+
+/// Интерфейс, который передаётся в mg_mgr_init_opt
+struct mg_iface_vtable loopback_iface_vtable = {
+  loopback_if_init,
+  loopback_if_free,
+  loopback_if_add_conn,
+  loopback_if_remove_conn,
+  loopback_if_poll,
+  loopback_if_listen_tcp,
+  loopback_if_listen_udp,
+  loopback_if_connect_tcp,
+  loopback_if_connect_udp,
+  loopback_if_send,
+  loopback_if_send,
+  loopback_if_recved,
+  loopback_if_create_conn,
+  loopback_if_destroy_conn,
+  loopback_if_sock_set,
+  loopback_if_get_conn_addr
+};
+
+
+/**
+ * @brief Функция инициализирует менеджер соединений, основной интерфейс
+ * которого - loopback_iface_vtable
+ *
+ * mg_mgr_init_opt с main_iface заменяет основной интерфейс в глобальном
+ * массиве интерфейсов, поэтому передаётся его копия.
+ *
+ * @param[out] mgr Менеджер соединений
+ * @param[in] user_data Данные пользователя менеджера
+ */
+void loopback_mgr_init(struct mg_mgr * mgr,
+                       void * user_data){
+  std::vector<struct mg_iface_vtable *> ifaces(mg_ifaces,
+                                               mg_ifaces + mg_num_ifaces);
+  struct mg_mgr_init_opts opts;
+
+  ifaces[MG_MAIN_IFACE] = &loopback_iface_vtable;
+  memset(&opts, 0, sizeof(opts));
+  opts.num_ifaces = mg_num_ifaces;
+  opts.ifaces = &ifaces[0];
+  mg_mgr_init_opt(mgr, user_data, opts);
+}
@@ -0,0 +1,28 @@
+/**
+ * @file
+ * @brief Заголовочный файл сетевого интерфейса mongoose без сокетов.
+ *
+ * Интерфейс соединяет клиентские и серверные соединения одного mg_mgr через
+ * память: данные из буфера отправки одного соединения передаются в буфер
+ * приёма другого без системных вызовов. Бенчмарки могут прогонять через
+ * разбор HTTP, обработчик событий и хранилище полный запрос, не измеряя
+ * сетевой стек ядра, а порядок событий при этом полностью определён.
+ *
+ * Соединения создаются обычными mg_bind и mg_connect с адресом вида
+ * "127.0.0.1:PORT", соединение принимает слушающее соединение с тем же
+ * портом. Поддерживается только TCP, mg_mgr_poll не ждёт событий.
+ *
+ */
+
+#ifndef _MESSENGER_VIA_HTTP_SERVER__LOOPBACK_H_
+#define _MESSENGER_VIA_HTTP_SERVER__LOOPBACK_H_
+
+#include "mongoose.h"
+
+extern struct mg_iface_vtable loopback_iface_vtable;
+
+void loopback_mgr_init(struct mg_mgr * mgr,
+                       void * user_data);
+
+
+#endif //_MESSENGER_VIA_HTTP_SERVER__LOOPBACK_H_
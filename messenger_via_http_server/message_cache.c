@@ -0,0 +1,457 @@
+/**
+ * @file
+ * @brief Кэш последних сообщений пользователей
+ *
+ * Каждый кольцевой буфер хранит последние сообщения пользователя и границу
+ * floor_id: все сообщения пользователя с идентификатором больше floor_id
+ * гарантированно находятся в буфере. Поэтому запрос get_message, курсор
+ * которого не меньше floor_id, можно обслужить без обращения к базе данных.
+ * Буферы упорядочены в LRU список, при превышении бюджета памяти вытесняются
+ * давно не использовавшиеся буферы.
+ *
+ * Таблица последних сообщений пользователей не зависит от бюджета и хранит
+ * запись для каждого пользователя, у которого есть хотя бы одно сообщение.
+ *
+ */
+
+#include <string.h>
+#include <string>
+#include <unordered_map>
+
+#include "message_cache.h"
+
+struct message_ring {
+  std::string user; ///< Имя пользователя - владельца буфера
+  int64_t floor_id; ///< Все сообщения с id больше floor_id находятся в буфере
+  int head; ///< Индекс самого старого сообщения
+  int count; ///< Количество сообщений в буфере
+  size_t bytes; ///< Память, занимаемая буфером и его сообщениями
+  struct message_ring * prev; ///< Предыдущий (более свежий) буфер в LRU
+  struct message_ring * next; ///< Следующий (более старый) буфер в LRU
+  struct cached_message ** messages; ///< Сообщения буфера
+};
+
+/// Буферы пользователей по имени пользователя
+static std::unordered_map<std::string, struct message_ring *> s_rings;
+/// Самый недавно использованный буфер
+static struct message_ring * s_lru_head = NULL;
+/// Самый давно использованный буфер
+static struct message_ring * s_lru_tail = NULL;
+/// Бюджет памяти кэша
+static size_t s_budget = 0;
+/// Память, занимаемая кэшем
+static size_t s_bytes = 0;
+/// Размер кольцевого буфера, 0 если кэш выключен
+static int s_ring_size = 0;
+/// Идентификатор последнего сообщения каждого пользователя
+static std::unordered_map<std::string, int64_t> s_latest;
+
+
+/**
+ * @brief Функция создаёт сообщение для кэша одним блоком памяти
+ */
+static struct cached_message * message_new(int64_t message_id,
+                                           const char * from,
+                                           const char * to,
+                                           const char * message,
+                                           int64_t time){
+  size_t from_len = strlen(from) + 1;
+  size_t to_len = strlen(to) + 1;
+  size_t message_len = message != NULL ? strlen(message) + 1 : 0;
+  size_t size = sizeof(struct cached_message) + from_len + to_len + message_len;
+  char * block = new char[size];
+  struct cached_message * result = (struct cached_message *) block;
+  char * p = block + sizeof(struct cached_message);
+
+  result->message_id = message_id;
+  result->time = time;
+  result->from = (const char *) memcpy(p, from, from_len);
+  result->to = (const char *) memcpy(p + from_len, to, to_len);
+  result->message = message == NULL ? NULL :
+    (const char *) memcpy(p + from_len + to_len, message, message_len);
+  result->size = size;
+  result->refs = 0;
+  return result;
+}
+
+
+/**
+ * @brief Функция освобождает ссылку буфера на сообщение
+ */
+static void message_release(struct cached_message * message){
+  if (--message->refs == 0){
+    delete[] (char *) message;
+  }
+}
+
+
+/**
+ * @brief Функция перемещает буфер в начало LRU списка
+ */
+static void lru_touch(struct message_ring * ring){
+  if (ring == s_lru_head){
+    return;
+  }
+  // Unlink
+  if (ring->prev != NULL){
+    ring->prev->next = ring->next;
+  }
+  if (ring->next != NULL){
+    ring->next->prev = ring->prev;
+  }
+  if (ring == s_lru_tail){
+    s_lru_tail = ring->prev;
+  }
+  // Link to the head
+  ring->prev = NULL;
+  ring->next = s_lru_head;
+  if (s_lru_head != NULL){
+    s_lru_head->prev = ring;
+  }
+  s_lru_head = ring;
+  if (s_lru_tail == NULL){
+    s_lru_tail = ring;
+  }
+}
+
+
+/**
+ * @brief Функция удаляет все сообщения из буфера
+ */
+static void ring_clear(struct message_ring * ring){
+  for (int i = 0; i < ring->count; i++){
+    struct cached_message * message =
+      ring->messages[(ring->head + i) % s_ring_size];
+    ring->bytes -= message->size;
+    s_bytes -= message->size;
+    message_release(message);
+  }
+  ring->head = 0;
+  ring->count = 0;
+}
+
+
+/**
+ * @brief Функция удаляет буфер из кэша
+ */
+static void ring_destroy(struct message_ring * ring){
+  ring_clear(ring);
+  if (ring->prev != NULL){
+    ring->prev->next = ring->next;
+  } else {
+    s_lru_head = ring->next;
+  }
+  if (ring->next != NULL){
+    ring->next->prev = ring->prev;
+  } else {
+    s_lru_tail = ring->prev;
+  }
+  s_bytes -= ring->bytes;
+  s_rings.erase(ring->user);
+  delete[] ring->messages;
+  delete ring;
+}
+
+
+/**
+ * @brief Функция вытесняет давно не использовавшиеся буферы, пока кэш не
+ * уложится в бюджет. Самый свежий буфер не вытесняется никогда
+ */
+static void cache_evict(void){
+  while (s_bytes > s_budget && s_lru_tail != s_lru_head){
+    ring_destroy(s_lru_tail);
+  }
+}
+
+
+/**
+ * @brief Функция находит буфер пользователя
+ *
+ * @param[in] user Имя пользователя
+ * @param[in] create Создать буфер, если он не найден
+ * @param[in] floor_id Граница floor_id для нового буфера
+ * @retval NULL Буфер не найден
+ * @retval Указатель на буфер, перемещённый в начало LRU списка
+ */
+static struct message_ring * ring_find(const char * user,
+                                       int create,
+                                       int64_t floor_id){
+  std::unordered_map<std::string, struct message_ring *>::iterator it =
+    s_rings.find(user);
+  struct message_ring * ring = NULL;
+
+  if (it != s_rings.end()){
+    ring = it->second;
+  } else if (create){
+    ring = new message_ring;
+    ring->user = user;
+    ring->floor_id = floor_id;
+    ring->head = 0;
+    ring->count = 0;
+    ring->bytes = sizeof(struct message_ring) + ring->user.size() +
+                  s_ring_size * sizeof(struct cached_message *);
+    ring->prev = NULL;
+    ring->next = NULL;
+    ring->messages = new struct cached_message *[s_ring_size];
+    s_bytes += ring->bytes;
+    s_rings[ring->user] = ring;
+  } else {
+    return NULL;
+  }
+  lru_touch(ring);
+  return ring;
+}
+
+
+/**
+ * @brief Функция добавляет сообщение в конец буфера. Если буфер заполнен,
+ * самое старое сообщение вытесняется и граница floor_id сдвигается
+ */
+static void ring_push(struct message_ring * ring,
+                      struct cached_message * message){
+  if (ring->count == s_ring_size){
+    struct cached_message * oldest = ring->messages[ring->head];
+    ring->floor_id = oldest->message_id;
+    ring->bytes -= oldest->size;
+    s_bytes -= oldest->size;
+    message_release(oldest);
+    ring->head = (ring->head + 1) % s_ring_size;
+    ring->count--;
+  }
+  ring->messages[(ring->head + ring->count) % s_ring_size] = message;
+  ring->count++;
+  message->refs++;
+  ring->bytes += message->size;
+  s_bytes += message->size;
+}
+
+
+/**
+ * @brief Функция инициализирует кэш
+ *
+ * @param[in] budget Бюджет памяти кэша в байтах
+ * @param[in] ring_size Количество сообщений в буфере одного пользователя.
+ * Значение 0 выключает кэш
+ */
+void message_cache_init(size_t budget, int ring_size){
+  message_cache_free();
+  s_budget = budget;
+  s_ring_size = budget > 0 && ring_size > 0 ? ring_size : 0;
+}
+
+
+/**
+ * @brief Функция освобождает всю память кэша
+ */
+void message_cache_free(void){
+  while (s_lru_head != NULL){
+    ring_destroy(s_lru_head);
+  }
+  s_latest.clear();
+}
+
+
+/**
+ * @brief Функция добавляет в кэш только что сохранённое в базе данных
+ * сообщение (write-through)
+ *
+ * Сообщение попадает в буферы отправителя и получателя. Если буфера ещё нет,
+ * он создаётся с границей message_id - 1: идентификаторы сообщений растут
+ * монотонно, поэтому более новых сообщений пользователя в базе данных нет.
+ * Идентификатор последнего сообщения обновляется, даже если кэш выключен.
+ *
+ * @param[in] message_id Уникальный идентификатор сообщения
+ * @param[in] from От кого адресовано сообщение
+ * @param[in] to Кому адресовано сообщение
+ * @param[in] message Текст сообщения
+ * @param[in] time Время получения сообщения сервером (UTC Unix)
+ */
+void message_cache_put(int64_t message_id,
+                       const char * from,
+                       const char * to,
+                       const char * message,
+                       int64_t time){
+  message_cache_set_latest(from, message_id);
+  message_cache_set_latest(to, message_id);
+  if (s_ring_size == 0){
+    return;
+  }
+  struct cached_message * cached =
+    message_new(message_id, from, to, message, time);
+
+  ring_push(ring_find(from, 1, message_id - 1), cached);
+  if (strcmp(from, to)){
+    ring_push(ring_find(to, 1, message_id - 1), cached);
+  }
+  cache_evict();
+}
+
+
+/**
+ * @brief Функция ищет в кэше первое сообщение пользователя после курсора
+ *
+ * @param[in] user Имя пользователя
+ * @param[in] last_message Последнее известное клиенту сообщение
+ * @param[out] result Найденное сообщение или NULL, если новых сообщений нет.
+ * Указатель действителен до следующего изменения кэша
+ * @return enum message_cache_result
+ */
+int message_cache_get(const char * user,
+                      int64_t last_message,
+                      const struct cached_message ** result){
+  if (s_ring_size == 0){
+    return MESSAGE_CACHE_MISS;
+  }
+  struct message_ring * ring = ring_find(user, 0, 0);
+
+  if (ring == NULL){
+    return MESSAGE_CACHE_ABSENT;
+  }
+  if (last_message < ring->floor_id){
+    return MESSAGE_CACHE_MISS;
+  }
+  *result = NULL;
+  for (int i = 0; i < ring->count; i++){
+    struct cached_message * message =
+      ring->messages[(ring->head + i) % s_ring_size];
+    if (message->message_id > last_message){
+      *result = message;
+      break;
+    }
+  }
+  return MESSAGE_CACHE_HIT;
+}
+
+
+/**
+ * @brief Функция очищает (или создаёт) буфер пользователя перед заполнением
+ * из базы данных
+ *
+ * Буфер считается содержащим все сообщения пользователя. Чтобы это было так,
+ * в буфер нужно добавить от новых к старым ring_size + 1 последних сообщений 
+ * пользователя (или все, если их меньше): самое старое из них не поместится
+ * и станет границей floor_id.
+ *
+ * @param[in] user Имя пользователя
+ * @retval NULL Кэш выключен
+ * @retval Указатель на буфер для message_cache_prepend
+ */
+struct message_ring * message_cache_reset(const char * user){
+  if (s_ring_size == 0){
+    return NULL;
+  }
+  struct message_ring * ring = ring_find(user, 1, 0);
+  ring_clear(ring);
+  ring->floor_id = 0;
+  return ring;
+}
+
+
+/**
+ * @brief Функция добавляет сообщение из базы данных в начало буфера 
+ * пользователя. Сообщения должны добавляться в порядке убывания 
+ * идентификаторов
+ *
+ * Если буфер уже заполнен, сообщение не сохраняется и становится границей
+ * floor_id.
+ *
+ * @param[in] ring Буфер, полученный от message_cache_reset
+ * @param[in] message_id Уникальный идентификатор сообщения
+ * @param[in] from От кого адресовано сообщение
+ * @param[in] to Кому адресовано сообщение
+ * @param[in] message Текст сообщения
+ * @param[in] time Время получения сообщения сервером (UTC Unix)
+ */
+void message_cache_prepend(struct message_ring * ring,
+                           int64_t message_id,
+                           const char * from,
+                           const char * to,
+                           const char * message,
+                           int64_t time){
+  if (ring == NULL){
+    return;
+  }
+  if (ring->count == s_ring_size){
+    if (message_id > ring->floor_id){
+      ring->floor_id = message_id;
+    }
+    return;
+  }
+  struct cached_message * cached =
+    message_new(message_id, from, to, message, time);
+
+  ring->head = (ring->head + s_ring_size - 1) % s_ring_size;
+  ring->messages[ring->head] = cached;
+  ring->count++;
+  cached->refs++;
+  ring->bytes += cached->size;
+  s_bytes += cached->size;
+  lru_touch(ring);
+  cache_evict();
+}
+
+
+/**
+ * @brief Функция удаляет буфер пользователя из кэша
+ *
+ * Вызывается, когда сообщение пользователя изменено: буфер заполнится 
+ * заново из хранилища при следующем запросе.
+ *
+ * @param[in] user Имя пользователя
+ */
+void message_cache_forget(const char * user){
+  std::unordered_map<std::string, struct message_ring *>::iterator it =
+    s_rings.find(user);
+
+  if (it != s_rings.end()){
+    ring_destroy(it->second);
+  }
+}
+
+
+/**
+ * @brief Функция обновляет идентификатор последнего сообщения пользователя
+ *
+ * @param[in] user Имя пользователя
+ * @param[in] message_id Идентификатор сообщения, в котором участвует 
+ * пользователь. Меньшие значения, чем уже известное, игнорируются
+ */
+void message_cache_set_latest(const char * user,
+                              int64_t message_id){
+  int64_t & latest = s_latest[user];
+  if (message_id > latest){
+    latest = message_id;
+  }
+}
+
+
+/**
+ * @brief Функция возвращает идентификатор последнего сообщения пользователя
+ *
+ * @param[in] user Имя пользователя
+ * @retval 0 У пользователя нет сообщений
+ * @retval Идентификатор последнего сообщения, в котором участвует пользователь
+ */
+int64_t message_cache_latest(const char * user){
+  std::unordered_map<std::string, int64_t>::const_iterator it =
+    s_latest.find(user);
+  return it == s_latest.end() ? 0 : it->second;
+}
+
+
+/**
+ * @brief Функция возвращает размер кольцевого буфера
+ *
+ * @retval 0 Кэш выключен
+ */
+int message_cache_ring_size(void){
+  return s_ring_size;
+}
+
+
+/**
+ * @brief Функция возвращает память, занимаемую кэшем
+ */
+size_t message_cache_bytes(void){
+  return s_bytes;
+}
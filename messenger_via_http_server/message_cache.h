@@ -0,0 +1,94 @@
+/**
+ * @file
+ * @brief Заголовочный файл кэша последних сообщений пользователей.
+ *
+ * Для каждого активного пользователя в памяти хранится кольцевой буфер
+ * последних сообщений, в которых он является отправителем или получателем.
+ * Буферы заполняются при отправке сообщений (write-through) и вытесняются по
+ * принципу LRU при превышении общего бюджета памяти.
+ *
+ * Кроме того, для каждого пользователя хранится идентификатор последнего
+ * сообщения, в котором он участвует, что позволяет без обращения к базе данных
+ * выяснить, есть ли у пользователя новые сообщения.
+ *
+ */
+
+#ifndef _MESSENGER_VIA_HTTP_SERVER__MESSAGE_CACHE_H_
+#define _MESSENGER_VIA_HTTP_SERVER__MESSAGE_CACHE_H_
+
+#include <stddef.h>
+#include "mongoose.h"
+
+/// Количество сообщений в кольцевом буфере пользователя по умолчанию
+#define MESSAGE_CACHE_RING_SIZE 32
+
+/// Бюджет памяти кэша по умолчанию (в байтах)
+#define MESSAGE_CACHE_BUDGET (64 * 1024 * 1024)
+
+/// Сообщение, хранящееся в кэше. Строки размещены в одном блоке памяти
+struct cached_message {
+  int64_t message_id; ///< Уникальный идентификатор сообщения
+  int64_t time; ///< Время получения сообщения сервером (UTC Unix)
+  const char * from; ///< От кого адресовано сообщение
+  const char * to; ///< Кому адресовано сообщение
+  const char * message; ///< Текст сообщения, NULL - сообщение удалено
+  size_t size; ///< Размер блока памяти сообщения
+  int refs; ///< Количество кольцевых буферов, ссылающихся на сообщение
+};
+
+/// Кольцевой буфер сообщений одного пользователя
+struct message_ring;
+
+/// Результаты поиска в кэше
+enum message_cache_result {
+  MESSAGE_CACHE_ABSENT, ///< Буфера пользователя нет в кэше
+  MESSAGE_CACHE_MISS, ///< Курсор старше сообщений, хранящихся в буфере
+  MESSAGE_CACHE_HIT ///< Ответ найден в кэше
+};
+
+void message_cache_init(size_t budget, int ring_size);
+
+
+void message_cache_free(void);
+
+
+void message_cache_put(int64_t message_id,
+                       const char * from,
+                       const char * to,
+                       const char * message,
+                       int64_t time);
+
+
+int message_cache_get(const char * user,
+                      int64_t last_message,
+                      const struct cached_message ** result);
+
+
+struct message_ring * message_cache_reset(const char * user);
+
+
+void message_cache_prepend(struct message_ring * ring,
+                           int64_t message_id,
+                           const char * from,
+                           const char * to,
+                           const char * message,
+                           int64_t time);
+
+
+void message_cache_forget(const char * user);
+
+
+void message_cache_set_latest(const char * user,
+                              int64_t message_id);
+
+
+int64_t message_cache_latest(const char * user);
+
+
+int message_cache_ring_size(void);
+
+
+size_t message_cache_bytes(void);
+
+
+#endif //_MESSENGER_VIA_HTTP_SERVER__MESSAGE_CACHE_H_
@@ -5,8 +5,22 @@
  * Файл содержит функцию main и основные переменные сервера
  */
 #include "stdafx.h"
+#include <new>
 #include "mongoose.h"
+#include "sqlite3.h"
 #include "db_plugin.h"
+#include "message_cache.h"
+#include "conversations.h"
+#include "groups.h"
+#include "changes.h"
+#include "dedup.h"
+#include "arena.h"
+#include "metrics.h"
+#include "stall.h"
+#include "capture.h"
+#include "admission.h"
+#include "reaper.h"
+#include "compress.h"
 
 /// Порт, который будет прослушивать сервер
 static const char * s_http_port = "8000";
@@ -14,12 +28,136 @@ static const char * s_http_port = "8000";
 static struct mg_serve_http_opts s_http_server_opts;
 /// Signal не докумментирован в mongoose, но активно используется
 static int s_sig_num = 0;
+/// Реализация хранилища
+static const struct storage_vtable * s_storage = NULL;
 /// Handler базы данных
-static void *s_db_handle = NULL;
+static struct storage *s_db_handle = NULL;
 /// Путь к базе данных
 static const char * s_db_path = "./../server_database.db";
+/// Бюджет памяти кэша последних сообщений
+static size_t s_cache_budget = MESSAGE_CACHE_BUDGET;
+/// Количество сообщений в кэше одного пользователя
+static int s_cache_ring_size = MESSAGE_CACHE_RING_SIZE;
+/// Порог задержки цикла событий в миллисекундах
+static double s_stall_threshold_ms = STALL_THRESHOLD_MS;
+/// Порог журнала медленных запросов в миллисекундах, < 0 выключает журнал
+static double s_slow_query_ms = STORAGE_SLOW_QUERY_MS;
+/// Путь к журналу медленных запросов, NULL - stderr
+static const char * s_slow_query_log_path = NULL;
+/// Журнал медленных запросов
+static FILE * s_slow_query_log = NULL;
+/// Путь к файлу записи трафика api, NULL - запись выключена
+static const char * s_capture_path = NULL;
+/// Наибольшее количество соединений, 0 - без ограничения
+static int s_max_connections = ADMISSION_MAX_CONNECTIONS;
+/// Наибольшее количество запросов api за итерацию, 0 - без ограничения
+static int s_max_requests = ADMISSION_MAX_REQUESTS;
+/// Наибольшее время обработки запросов api за итерацию в миллисекундах
+static double s_max_work_ms = ADMISSION_MAX_WORK_MS;
+/// Значение заголовка Retry-After ответа 503
+static int s_retry_after = ADMISSION_RETRY_AFTER;
+/// Время ожидания заголовков запроса в миллисекундах, 0 - без ограничения
+static double s_header_timeout_ms = REAPER_HEADER_TIMEOUT_MS;
+/// Время ожидания тела запроса в миллисекундах, 0 - без ограничения
+static double s_body_timeout_ms = REAPER_BODY_TIMEOUT_MS;
+/// Время простоя соединения в миллисекундах, 0 - без ограничения
+static double s_idle_timeout_ms = REAPER_IDLE_TIMEOUT_MS;
+/// Наибольший размер заголовков запроса, 0 - без ограничения
+static size_t s_max_header_bytes = REAPER_MAX_HEADER_BYTES;
+/// Наименьший сжимаемый ответ api, 0 - ответы не сжимаются
+static size_t s_gzip_min_bytes = COMPRESS_MIN_BYTES;
+/// Время сжатия ответов за итерацию в миллисекундах, 0 - без ограничения
+static double s_gzip_budget_ms = COMPRESS_BUDGET_MS;
+/// Срок хранения изменений сообщений в секундах
+static int64_t s_change_retention = CHANGES_RETENTION_S;
+/// Количество недавних ключей повтора отправки в памяти
+static size_t s_dedup_keys = DEDUP_CAPACITY;
+/// Обработчик протокола HTTP, вызов которого измеряется детектором задержек
+static mg_event_handler_t s_http_proto_handler = NULL;
 /// Обрабатываемый api тип запроса
 static const struct mg_str s_post_method = MG_MK_STR("POST");
+/// Тип запроса метрик
+static const struct mg_str s_get_method = MG_MK_STR("GET");
+/// Тип запроса правки сообщения
+static const struct mg_str s_put_method = MG_MK_STR("PUT");
+/// Тип запроса удаления сообщения
+static const struct mg_str s_delete_method = MG_MK_STR("DELETE");
+/// Адрес метрик сервера
+static const struct mg_str s_metrics_uri = MG_MK_STR("/messenger_api/metrics");
+/// Адрес последних задержек цикла событий
+static const struct mg_str s_stalls_uri = MG_MK_STR("/messenger_api/stalls");
+/// Выделения памяти из кучи через operator new и SQLite с начала работы
+static int64_t s_heap_allocs = 0;
+/// Выделения памяти из кучи во время обработки запросов api
+static int64_t s_request_heap_allocs = 0;
+/// Стандартные функции выделения памяти SQLite
+static sqlite3_mem_methods s_sqlite_mem;
+
+
+void * operator new(size_t size){
+  s_heap_allocs++;
+  void * p = malloc(size == 0 ? 1 : size);
+  if (p == NULL){
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+
+void * operator new[](size_t size){
+  s_heap_allocs++;
+  void * p = malloc(size == 0 ? 1 : size);
+  if (p == NULL){
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+
+void operator delete(void * p){
+  free(p);
+}
+
+
+void operator delete[](void * p){
+  free(p);
+}
+
+
+/**
+ * @brief Функция выделения памяти SQLite, считающая выделения
+ */
+static void * sqlite_counting_malloc(int size){
+  s_heap_allocs++;
+  return s_sqlite_mem.xMalloc(size);
+}
+
+
+/**
+ * @brief Функция изменения размера памяти SQLite, считающая выделения
+ */
+static void * sqlite_counting_realloc(void * p, int size){
+  s_heap_allocs++;
+  return s_sqlite_mem.xRealloc(p, size);
+}
+
+
+/**
+ * @brief Функция включает подсчёт выделений памяти SQLite
+ *
+ * Вызывается до открытия хранилища: после инициализации SQLite функции 
+ * выделения памяти не меняются. Буферы mongoose выделяются через malloc и 
+ * не учитываются.
+ */
+static void count_sqlite_allocs(void){
+  sqlite3_mem_methods counting;
+
+  sqlite3_config(SQLITE_CONFIG_GETMALLOC, &s_sqlite_mem);
+  counting = s_sqlite_mem;
+  counting.xMalloc = sqlite_counting_malloc;
+  counting.xRealloc = sqlite_counting_realloc;
+  sqlite3_config(SQLITE_CONFIG_MALLOC, &counting);
+}
 
 /**
  * @brief Функция проверяет, начинается ли строка uri со строки prefix
@@ -44,6 +182,122 @@ int is_equal(const struct mg_str * s1, const struct mg_str * s2) {
   return s1->len == s2->len && memcmp(s1->p, s2->p, s2->len) == 0;
 }
 
+/**
+ * @brief Функция возвращает код ответа, поставленного в очередь отправки
+ *
+ * @param[in] nc Соединение
+ * @param[in] offset Длина буфера отправки до обработки запроса
+ * @return Код HTTP ответа или 0, если ответ не был отправлен
+ */
+static int response_status(const struct mg_connection * nc, size_t offset) {
+  static const struct mg_str http = MG_MK_STR("HTTP/1.");
+  const char * p = nc->send_mbuf.buf + offset;
+
+  // "HTTP/1.1 200 ..."
+  if (nc->send_mbuf.len < offset + 12 || memcmp(p, http.p, http.len) != 0) {
+    return 0;
+  }
+  return atoi(p + 9);
+}
+
+/**
+ * @brief Функция отправляет ответ 503 при отказе контроля допуска
+ *
+ * @param[in] nc Соединение, по которому нужно отправить ответ
+ * @param[in] close Закрыть соединение после отправки
+ */
+static void send_unavailable(struct mg_connection * nc, int close) {
+  mg_printf(nc,
+            "HTTP/1.1 503 Service Unavailable\r\n"
+            "Retry-After: %d\r\n"
+            "%s"
+            "Content-Length: 0\r\n\r\n", s_retry_after,
+            close ? "Connection: close\r\n" : "");
+  if (close) {
+    nc->flags |= MG_F_SEND_AND_CLOSE;
+  }
+}
+
+/**
+ * @brief Функция отправляет метрики сервера в текстовом формате Prometheus
+ *
+ * @param[in] nc Соединение, по которому нужно отправить ответ
+ */
+static void send_metrics(struct mg_connection * nc) {
+  struct metrics_gauges gauges;
+  struct mg_connection * c;
+  std::string out;
+
+  memset(&gauges, 0, sizeof(gauges));
+  for (c = mg_next(nc->mgr, NULL); c != NULL; c = mg_next(nc->mgr, c)) {
+    if (c->flags & MG_F_LISTENING) {
+      continue;
+    }
+    gauges.connections++;
+    gauges.send_used += c->send_mbuf.len;
+    gauges.send_allocated += c->send_mbuf.size;
+    gauges.recv_used += c->recv_mbuf.len;
+    gauges.recv_allocated += c->recv_mbuf.size;
+    if (reaper_is_idle(c)) {
+      gauges.idle_connections++;
+      gauges.idle_bytes += sizeof(*c) + c->send_mbuf.size +
+                           c->recv_mbuf.size +
+                           arena_size((struct arena *) c->user_data);
+    }
+  }
+  gauges.cache_bytes = message_cache_bytes();
+  gauges.conversations = conversations_count();
+  gauges.groups = groups_count();
+  gauges.changes = changes_count();
+  dedup_get_stats(&gauges.dedup);
+  arena_get_stats(&gauges.arena);
+  gauges.request_heap_allocs = s_request_heap_allocs;
+  gauges.stalls = stall_count();
+  admission_get_stats(&gauges.admission);
+  reaper_get_stats(&gauges.reaper);
+  compress_get_stats(&gauges.compress);
+  metrics_format(&gauges, &out);
+
+  mg_printf(nc,
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %d\r\n\r\n", (int) out.size());
+  mg_send(nc, out.data(), (int) out.size());
+}
+
+/**
+ * @brief Функция отправляет последние задержки цикла событий в JSON
+ *
+ * @param[in] nc Соединение, по которому нужно отправить ответ
+ */
+static void send_stalls(struct mg_connection * nc) {
+  std::string out;
+
+  stall_format(&out);
+  mg_printf(nc,
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: text/json\r\n"
+            "Content-Length: %d\r\n\r\n", (int) out.size());
+  mg_send(nc, out.data(), (int) out.size());
+}
+
+/**
+ * @brief Функция измеряет обработку события соединения обработчиком 
+ * протокола HTTP, который вызывает ev_handler
+ *
+ * Устанавливается прослушивающему соединению и наследуется принятыми.
+ */
+static void timed_proto_handler(struct mg_connection * nc, int ev, 
+                                void * ev_data) {
+  int64_t start = metrics_now_ns();
+
+  stall_event_begin();
+  s_http_proto_handler(nc, ev, ev_data);
+  int64_t elapsed = metrics_now_ns() - start;
+  metrics_observe_event(ev, elapsed);
+  stall_event_end(ev, elapsed);
+}
+
 /**
  * @brief Функция-обработчик сигнала
  *
@@ -66,16 +320,85 @@ static void ev_handler(struct mg_connection * nc,  int ev,  void * ev_data){
   struct http_message * hm = (http_message *) ev_data;
   
   switch (ev){
+    case MG_EV_ACCEPT:
+      reaper_accept(nc);
+      if (!admission_accept()){
+        send_unavailable(nc, 1);
+      }
+      break;
+    case MG_EV_RECV:
+      reaper_recv(nc);
+      break;
+    case MG_EV_TIMER:
+      reaper_timer(nc);
+      break;
     case MG_EV_HTTP_REQUEST:
-      if (has_prefix(&hm->uri, &api_prefix)){
-        if (is_equal(&hm->method, &s_post_method)){
-          db_op(nc, hm, s_db_handle, API_OP_POST);
+      reaper_request(nc, hm);
+      // A shed or failed connection is closing, its requests are not served
+      if (nc->flags & MG_F_SEND_AND_CLOSE){
+        break;
+      }
+      if (is_equal(&hm->uri, &s_metrics_uri) && 
+          is_equal(&hm->method, &s_get_method)){
+        size_t offset = nc->send_mbuf.len;
+        send_metrics(nc);
+        compress_response(nc, hm, offset);
+      } else if (is_equal(&hm->uri, &s_stalls_uri) && 
+                 is_equal(&hm->method, &s_get_method)){
+        size_t offset = nc->send_mbuf.len;
+        send_stalls(nc);
+        compress_response(nc, hm, offset);
+      } else if (has_prefix(&hm->uri, &api_prefix)){
+        int op = is_equal(&hm->method, &s_get_method) ? API_OP_GET :
+                 is_equal(&hm->method, &s_post_method) ? API_OP_POST :
+                 is_equal(&hm->method, &s_put_method) ? API_OP_SET :
+                 is_equal(&hm->method, &s_delete_method) ? API_OP_DEL : -1;
+        if (op != -1){
+          int64_t start = metrics_now_ns();
+          int64_t heap_allocs = s_heap_allocs;
+          size_t offset = nc->send_mbuf.len;
+          int action = switch_action(op == API_OP_GET || 
+                                     hm->query_string.len > 0 ? 
+                                     &hm->query_string : &hm->body);
+          if (admission_request(action)){
+            // Request buffers live in the connection arena until the answer 
+            // is queued
+            if (nc->user_data == NULL){
+              nc->user_data = arena_new();
+            }
+            action = db_op(nc, hm, s_db_handle, op);
+            arena_reset((struct arena *) nc->user_data);
+            compress_response(nc, hm, offset);
+            s_request_heap_allocs += s_heap_allocs - heap_allocs;
+            admission_done(metrics_now_ns() - start);
+          } else {
+            send_unavailable(nc, 0);
+            compress_response(nc, hm, offset);
+          }
+          int status = response_status(nc, offset);
+          int64_t elapsed = metrics_now_ns() - start;
+          stall_note_request(&hm->uri, action);
+          metrics_observe_request(action, status, elapsed);
+          capture_request(nc, hm, start, status, elapsed);
         } else {
+          size_t offset = nc->send_mbuf.len;
           mg_http_send_error(nc, 501, "Not implemented");
+          compress_response(nc, hm, offset);
         }
-      } else {
+      } else if (!compress_serve_static(nc, hm,
+                                        s_http_server_opts.document_root)){
         mg_serve_http(nc, hm, s_http_server_opts);
       }
+      break;
+    case MG_EV_CLOSE:
+      arena_delete((struct arena *) nc->user_data);
+      nc->user_data = NULL;
+      capture_forget(nc);
+      reaper_close(nc);
+      if (nc->listener != NULL){
+        admission_close();
+      }
+      break;
     default:
       break;
   }
@@ -88,33 +411,158 @@ int main(int argc, char* argv[]) {
   /* Менеджер событий, который содержит все активные соединения */
   struct mg_mgr mgr;
   struct mg_connection *nc;
+  struct arena_stats stats;
+  int migrating = 1;
+  int i;
+
+  /* Parse command line arguments */
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+      s_http_port = argv[++i];
+    } else if (strcmp(argv[i], "--db") == 0 && i + 1 < argc) {
+      s_db_path = argv[++i];
+    } else if (strcmp(argv[i], "--cache-budget") == 0 && i + 1 < argc) {
+      s_cache_budget = (size_t) to64(argv[++i]);
+    } else if (strcmp(argv[i], "--cache-ring-size") == 0 && i + 1 < argc) {
+      s_cache_ring_size = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--stall-threshold") == 0 && i + 1 < argc) {
+      s_stall_threshold_ms = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--slow-query-ms") == 0 && i + 1 < argc) {
+      s_slow_query_ms = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--slow-query-log") == 0 && i + 1 < argc) {
+      s_slow_query_log_path = argv[++i];
+    } else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+      s_capture_path = argv[++i];
+    } else if (strcmp(argv[i], "--max-connections") == 0 && i + 1 < argc) {
+      s_max_connections = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--max-requests") == 0 && i + 1 < argc) {
+      s_max_requests = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--max-work-ms") == 0 && i + 1 < argc) {
+      s_max_work_ms = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--retry-after") == 0 && i + 1 < argc) {
+      s_retry_after = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--header-timeout-ms") == 0 && i + 1 < argc) {
+      s_header_timeout_ms = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--body-timeout-ms") == 0 && i + 1 < argc) {
+      s_body_timeout_ms = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--idle-timeout-ms") == 0 && i + 1 < argc) {
+      s_idle_timeout_ms = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--max-header-bytes") == 0 && i + 1 < argc) {
+      s_max_header_bytes = (size_t) to64(argv[++i]);
+    } else if (strcmp(argv[i], "--gzip-min-bytes") == 0 && i + 1 < argc) {
+      s_gzip_min_bytes = (size_t) to64(argv[++i]);
+    } else if (strcmp(argv[i], "--gzip-budget-ms") == 0 && i + 1 < argc) {
+      s_gzip_budget_ms = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--change-retention") == 0 && i + 1 < argc) {
+      s_change_retention = to64(argv[++i]);
+    } else if (strcmp(argv[i], "--dedup-keys") == 0 && i + 1 < argc) {
+      s_dedup_keys = (size_t) to64(argv[++i]);
+    } else if (strcmp(argv[i], "--storage") == 0 && i + 1 < argc) {
+      if ((s_storage = storage_find_vtable(argv[++i])) == NULL) {
+        fprintf(stderr, "Unknown storage [%s]\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+    } else {
+      fprintf(stderr, "Unknown option [%s]\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
 
   /* Open listening socket */
   mg_mgr_init(&mgr, NULL);
   nc = mg_bind(&mgr, s_http_port, ev_handler);
+  if (nc == NULL) {
+    fprintf(stderr, "Cannot bind to port [%s]\n", s_http_port);
+    exit(EXIT_FAILURE);
+  }
   mg_set_protocol_http_websocket(nc);
+  s_http_proto_handler = nc->proto_handler;
+  nc->proto_handler = timed_proto_handler;
+  stall_init((int64_t) (s_stall_threshold_ms * 1e6));
+  admission_init(s_max_connections, s_max_requests, 
+                 (int64_t) (s_max_work_ms * 1e6));
+  reaper_init(s_header_timeout_ms, s_body_timeout_ms, s_idle_timeout_ms,
+              s_max_header_bytes);
+  compress_init(s_gzip_min_bytes, (int64_t) (s_gzip_budget_ms * 1e6));
   s_http_server_opts.document_root = "web_root";
+  // Caches must not give a gzip variant to a client without gzip
+  s_http_server_opts.extra_headers = "Vary: Accept-Encoding";
+  printf("Prepared %d gzip variants in %s\n",
+         compress_prepare_static(s_http_server_opts.document_root),
+         s_http_server_opts.document_root);
 
   signal(SIGINT, signal_handler);
   signal(SIGTERM, signal_handler);
 
   /* Open database */
-  if ((s_db_handle = db_open(s_db_path)) == NULL) {
+  if (s_slow_query_ms >= 0) {
+    s_slow_query_log = s_slow_query_log_path != NULL ? 
+                       fopen(s_slow_query_log_path, "a") : stderr;
+    if (s_slow_query_log == NULL) {
+      fprintf(stderr, "Cannot open slow query log [%s]\n", 
+              s_slow_query_log_path);
+      exit(EXIT_FAILURE);
+    }
+    storage_sqlite_set_slow_log(s_slow_query_log, 
+                                (int64_t) (s_slow_query_ms * 1e6));
+  }
+  if (s_storage == NULL) {
+    s_storage = storage_find_vtable(NULL);
+  }
+  count_sqlite_allocs();
+  if ((s_db_handle = storage_open(s_storage, s_db_path)) == NULL) {
     fprintf(stderr, "Cannot open DB [%s]\n", s_db_path);
     exit(EXIT_FAILURE);
   }
+  message_cache_init(s_cache_budget, s_cache_ring_size);
+  dedup_init(s_dedup_keys);
+  if (!load_latest_messages(s_db_handle) || !load_conversations(s_db_handle) ||
+      !load_groups(s_db_handle) || !load_changes(s_db_handle)) {
+    fprintf(stderr, "Cannot read DB [%s]\n", s_db_path);
+    exit(EXIT_FAILURE);
+  }
+
+  if (s_capture_path != NULL && !capture_open(s_capture_path)) {
+    fprintf(stderr, "Cannot open capture [%s]\n", s_capture_path);
+    exit(EXIT_FAILURE);
+  }
 
   /* Run event loop until signal is received */
   printf("Starting RESTful server on port %s\n", s_http_port);
   while (s_sig_num == 0) {
-    mg_mgr_poll(&mgr, 1000);
+    int64_t start = metrics_now_ns();
+    stall_iteration_begin();
+    admission_iteration_begin();
+    compress_iteration_begin();
+    // A pending migration moves a chunk every iteration, even when idle
+    mg_mgr_poll(&mgr, migrating ? 0 : 1000);
+    compact_changes(s_db_handle, s_change_retention);
+    migrating = migrate_storage(s_db_handle);
+    metrics_observe_loop(metrics_now_ns() - start, stall_iteration_end());
   }
 
   /* Cleanup */
   mg_mgr_free(&mgr);
-  db_close(&s_db_handle);
+  capture_close();
+  message_cache_free();
+  conversations_free();
+  groups_free();
+  changes_free();
+  dedup_free();
+  storage_close(&s_db_handle);
+  if (s_slow_query_log != NULL && s_slow_query_log != stderr) {
+    fclose(s_slow_query_log);
+  }
 
+  arena_get_stats(&stats);
   printf("Exiting on signal %d\n", s_sig_num);
+  printf("API requests: %" INT64_FMT ", heap allocations per request: %.2f "
+         "(arena chunks: %.2f), peak request arena memory: %d bytes\n", 
+         stats.requests, 
+         stats.requests > 0 ? 
+         (double) s_request_heap_allocs / stats.requests : 0.0, 
+         stats.requests > 0 ? (double) stats.mallocs / stats.requests : 0.0, 
+         (int) stats.peak_bytes);
 
 
   return 0;
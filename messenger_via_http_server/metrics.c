@@ -0,0 +1,554 @@
+/**
+ * @file
+ * @brief Реестр метрик сервера
+ *
+ * Длительности хранятся в гистограммах с фиксированными границами корзин.
+ * Значение попадает в одну корзину, накопленные суммы, которых требует
+ * формат Prometheus, считаются при выводе.
+ *
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "db_plugin.h"
+
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+/// Коды ответов, для которых ведутся отдельные гистограммы
+static const int s_statuses[] = { 200, 304, 400, 401, 404, 413, 500, 501, 503 };
+
+/// Количество учитываемых кодов ответа, последний индекс - прочие коды
+#define METRICS_STATUS_COUNT (sizeof(s_statuses) / sizeof(s_statuses[0]) + 1)
+
+/// Имена действий api в порядке enum api_action
+static const char * s_action_names[API_ACTION_COUNT] = {
+  "unknown",
+  "send_message",
+  "get_message",
+  "register",
+  "get_user",
+  "send_batch",
+  "has_new",
+  "get_history",
+  "list_conversations",
+  "mark_read",
+  "create_group",
+  "add_member",
+  "remove_member",
+  "edit_message",
+  "delete_message",
+  "get_changes"
+};
+
+/// Количество учитываемых событий соединения, последний индекс - прочие
+#define METRICS_EVENT_COUNT 8
+
+/// Имена событий соединения в порядке номеров MG_EV_*
+static const char * s_event_names[METRICS_EVENT_COUNT] = {
+  "poll",
+  "accept",
+  "connect",
+  "recv",
+  "send",
+  "close",
+  "timer",
+  "other"
+};
+
+/// Имена причин отказа в порядке enum admission_reason
+static const char * s_shed_reasons[ADMISSION_REASON_COUNT] = {
+  "connections",
+  "requests",
+  "work"
+};
+
+/// Имена причин закрытия в порядке enum reaper_reason
+static const char * s_reap_reasons[REAPER_REASON_COUNT] = {
+  "idle",
+  "header_timeout",
+  "body_timeout",
+  "header_bytes"
+};
+
+/// Верхние границы корзин гистограмм в наносекундах, кроме корзины +Inf
+static const int64_t s_bounds_ns[METRICS_BUCKET_COUNT - 1] = {
+  50000, 100000, 250000, 500000,
+  1000000, 2500000, 5000000, 10000000, 25000000, 50000000,
+  100000000, 250000000, 500000000, 1000000000, 2500000000LL
+};
+
+/// Длительность запросов к api по действию и коду ответа
+static struct metrics_histogram s_requests[API_ACTION_COUNT]
+                                          [METRICS_STATUS_COUNT];
+/// Имена запросов к базе данных
+static const char * s_statement_names[METRICS_STATEMENT_MAX];
+/// Количество зарегистрированных запросов к базе данных
+static int s_statement_count = 0;
+/// Длительность одного шага запроса к базе данных
+static struct metrics_histogram s_statements[METRICS_STATEMENT_MAX];
+
+/// Счётчики выполнений запроса к базе данных
+struct metrics_execution {
+  int64_t count; ///< Количество выполнений
+  int64_t elapsed_ns; ///< Суммарное время выполнений
+  int64_t rows; ///< Полученные строки
+  int64_t fullscan_steps; ///< Шаги полного просмотра таблицы
+  int64_t slow; ///< Выполнения, записанные в журнал медленных запросов
+};
+
+/// Выполнения запросов к базе данных
+static struct metrics_execution s_executions[METRICS_STATEMENT_MAX];
+/// Длительность обработки события соединения по событию
+static struct metrics_histogram s_events[METRICS_EVENT_COUNT];
+/// Длительность итерации цикла событий
+static struct metrics_histogram s_loop;
+/// Время обработки событий за итерацию цикла событий
+static struct metrics_histogram s_loop_busy;
+
+
+/**
+ * @brief Функция возвращает монотонное время в наносекундах
+ */
+int64_t metrics_now_ns(void){
+#ifdef _WIN32
+  LARGE_INTEGER counter, frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  return (int64_t) ((double) counter.QuadPart * 1e9 /
+                    (double) frequency.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+
+/**
+ * @brief Функция возвращает имя действия api
+ *
+ * @param[in] action Действие api, enum api_action
+ */
+const char * metrics_action_name(int action){
+  if (action < 0 || action >= API_ACTION_COUNT){
+    action = API_ACTION_NULL;
+  }
+  return s_action_names[action];
+}
+
+
+/**
+ * @brief Функция возвращает номер события соединения в метриках
+ */
+static int event_index(int ev){
+  return ev >= 0 && ev < METRICS_EVENT_COUNT - 1 ? ev : METRICS_EVENT_COUNT - 1;
+}
+
+
+/**
+ * @brief Функция возвращает имя события соединения
+ *
+ * @param[in] ev Событие, MG_EV_*
+ */
+const char * metrics_event_name(int ev){
+  return s_event_names[event_index(ev)];
+}
+
+
+/**
+ * @brief Функция добавляет значение в гистограмму
+ */
+static void histogram_observe(struct metrics_histogram * h,
+                              int64_t elapsed_ns){
+  int i = 0;
+
+  while (i < METRICS_BUCKET_COUNT - 1 && elapsed_ns > s_bounds_ns[i]){
+    i++;
+  }
+  h->buckets[i]++;
+  h->count++;
+  h->sum_ns += elapsed_ns;
+}
+
+
+/**
+ * @brief Функция учитывает обработанный запрос к api
+ *
+ * @param[in] action Действие api, enum api_action
+ * @param[in] status Код HTTP ответа
+ * @param[in] elapsed_ns Время обработки запроса в наносекундах
+ */
+void metrics_observe_request(int action,
+                             int status,
+                             int64_t elapsed_ns){
+  size_t i = 0;
+
+  if (action < 0 || action >= API_ACTION_COUNT){
+    action = API_ACTION_NULL;
+  }
+  while (i < METRICS_STATUS_COUNT - 1 && s_statuses[i] != status){
+    i++;
+  }
+  histogram_observe(&s_requests[action][i], elapsed_ns);
+}
+
+
+/**
+ * @brief Функция регистрирует запрос к базе данных. Повторная регистрация
+ * того же имени возвращает тот же номер
+ *
+ * @param[in] name Имя запроса, строка должна существовать всё время работы
+ * @return Номер запроса для metrics_observe_statement или -1, если
+ * зарегистрировано METRICS_STATEMENT_MAX запросов
+ */
+int metrics_register_statement(const char * name){
+  int i;
+
+  for (i = 0; i < s_statement_count; i++){
+    if (strcmp(s_statement_names[i], name) == 0){
+      return i;
+    }
+  }
+  if (s_statement_count == METRICS_STATEMENT_MAX){
+    return -1;
+  }
+  s_statement_names[s_statement_count] = name;
+  return s_statement_count++;
+}
+
+
+/**
+ * @brief Функция учитывает один шаг (sqlite3_step) запроса к базе данных
+ *
+ * @param[in] statement Номер запроса из metrics_register_statement
+ * @param[in] elapsed_ns Время шага в наносекундах
+ */
+void metrics_observe_statement(int statement,
+                               int64_t elapsed_ns){
+  if (statement >= 0 && statement < s_statement_count){
+    histogram_observe(&s_statements[statement], elapsed_ns);
+  }
+}
+
+
+/**
+ * @brief Функция учитывает выполнение запроса к базе данных от первого шага 
+ * до сброса запроса
+ *
+ * @param[in] statement Номер запроса из metrics_register_statement
+ * @param[in] elapsed_ns Суммарное время шагов в наносекундах
+ * @param[in] rows Полученные строки
+ * @param[in] fullscan_steps Шаги полного просмотра таблицы
+ * @param[in] slow Запрос записан в журнал медленных запросов
+ */
+void metrics_observe_execution(int statement,
+                               int64_t elapsed_ns,
+                               int rows,
+                               int fullscan_steps,
+                               int slow){
+  if (statement >= 0 && statement < s_statement_count){
+    struct metrics_execution * e = &s_executions[statement];
+    e->count++;
+    e->elapsed_ns += elapsed_ns;
+    e->rows += rows;
+    e->fullscan_steps += fullscan_steps;
+    e->slow += slow != 0;
+  }
+}
+
+
+/**
+ * @brief Функция учитывает обработку события соединения
+ *
+ * @param[in] ev Событие, MG_EV_*
+ * @param[in] elapsed_ns Время обработки события в наносекундах
+ */
+void metrics_observe_event(int ev,
+                           int64_t elapsed_ns){
+  histogram_observe(&s_events[event_index(ev)], elapsed_ns);
+}
+
+
+/**
+ * @brief Функция учитывает итерацию цикла событий
+ *
+ * @param[in] elapsed_ns Время mg_mgr_poll, включая ожидание событий
+ * @param[in] busy_ns Время обработки событий за итерацию
+ */
+void metrics_observe_loop(int64_t elapsed_ns,
+                          int64_t busy_ns){
+  histogram_observe(&s_loop, elapsed_ns);
+  histogram_observe(&s_loop_busy, busy_ns);
+}
+
+
+/**
+ * @brief Функция дописывает форматированную строку к выводу
+ */
+static void append(std::string * out,
+                   const char * fmt,
+                   ...){
+  char line[256];
+  va_list ap;
+
+  va_start(ap, fmt);
+  int len = vsnprintf(line, sizeof(line), fmt, ap);
+  va_end(ap);
+  if (len > 0){
+    out->append(line, len < (int) sizeof(line) ? len : sizeof(line) - 1);
+  }
+}
+
+
+/**
+ * @brief Функция выводит заголовок семейства метрик
+ */
+static void format_family(std::string * out,
+                          const char * name,
+                          const char * type,
+                          const char * help){
+  append(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+
+/**
+ * @brief Функция выводит гистограмму с накопленными суммами корзин
+ *
+ * @param[out] out Вывод
+ * @param[in] name Имя семейства метрик
+ * @param[in] labels Метки через запятую, или пустая строка
+ * @param[in] h Гистограмма
+ */
+static void format_histogram(std::string * out,
+                             const char * name,
+                             const char * labels,
+                             const struct metrics_histogram * h){
+  const char * sep = labels[0] != '\0' ? "," : "";
+  int64_t cumulative = 0;
+  int i;
+
+  for (i = 0; i < METRICS_BUCKET_COUNT - 1; i++){
+    cumulative += h->buckets[i];
+    append(out, "%s_bucket{%s%sle=\"%g\"} %" INT64_FMT "\n", name, labels,
+           sep, s_bounds_ns[i] / 1e9, cumulative);
+  }
+  append(out, "%s_bucket{%s%sle=\"+Inf\"} %" INT64_FMT "\n", name, labels,
+         sep, h->count);
+  if (labels[0] != '\0'){
+    append(out, "%s_sum{%s} %.9f\n", name, labels, h->sum_ns / 1e9);
+    append(out, "%s_count{%s} %" INT64_FMT "\n", name, labels, h->count);
+  } else {
+    append(out, "%s_sum %.9f\n", name, h->sum_ns / 1e9);
+    append(out, "%s_count %" INT64_FMT "\n", name, h->count);
+  }
+}
+
+
+/**
+ * @brief Функция выводит счётчики выполнений запросов к базе данных
+ */
+static void format_executions(std::string * out){
+  static const char * names[] = {
+    "messenger_db_executions_total",
+    "messenger_db_execution_seconds_total",
+    "messenger_db_rows_total",
+    "messenger_db_fullscan_steps_total",
+    "messenger_db_slow_queries_total"
+  };
+  static const char * help[] = {
+    "Statement executions.",
+    "Time of statement executions.",
+    "Rows returned by statements.",
+    "Full table scan steps made by statements.",
+    "Statement executions written to the slow query log."
+  };
+  int i, k;
+
+  for (k = 0; k < 5; k++){
+    format_family(out, names[k], "counter", help[k]);
+    for (i = 0; i < s_statement_count; i++){
+      const struct metrics_execution * e = &s_executions[i];
+      if (e->count == 0){
+        continue;
+      }
+      if (k == 1){
+        append(out, "%s{statement=\"%s\"} %.9f\n", names[k], 
+               s_statement_names[i], e->elapsed_ns / 1e9);
+      } else {
+        int64_t values[] = { e->count, 0, e->rows, e->fullscan_steps, e->slow };
+        append(out, "%s{statement=\"%s\"} %" INT64_FMT "\n", names[k], 
+               s_statement_names[i], values[k]);
+      }
+    }
+  }
+}
+
+
+/**
+ * @brief Функция выводит все метрики в текстовом формате Prometheus
+ *
+ * Выводятся только гистограммы, в которые попало хотя бы одно значение.
+ *
+ * @param[in] gauges Показатели, собранные сервером в момент запроса
+ * @param[out] out Строка, к которой дописывается вывод
+ */
+void metrics_format(const struct metrics_gauges * gauges,
+                    std::string * out){
+  char labels[128];
+  size_t i, j;
+
+  format_family(out, "messenger_api_request_duration_seconds", "histogram",
+                "API request handling time by action and HTTP status.");
+  for (i = 0; i < API_ACTION_COUNT; i++){
+    for (j = 0; j < METRICS_STATUS_COUNT; j++){
+      if (s_requests[i][j].count == 0){
+        continue;
+      }
+      if (j < METRICS_STATUS_COUNT - 1){
+        snprintf(labels, sizeof(labels), "action=\"%s\",status=\"%d\"",
+                 s_action_names[i], s_statuses[j]);
+      } else {
+        snprintf(labels, sizeof(labels), "action=\"%s\",status=\"other\"",
+                 s_action_names[i]);
+      }
+      format_histogram(out, "messenger_api_request_duration_seconds", labels,
+                       &s_requests[i][j]);
+    }
+  }
+
+  format_family(out, "messenger_db_step_duration_seconds", "histogram",
+                "Time of one sqlite3_step call by statement.");
+  for (i = 0; i < (size_t) s_statement_count; i++){
+    if (s_statements[i].count == 0){
+      continue;
+    }
+    snprintf(labels, sizeof(labels), "statement=\"%s\"", s_statement_names[i]);
+    format_histogram(out, "messenger_db_step_duration_seconds", labels,
+                     &s_statements[i]);
+  }
+  format_executions(out);
+
+  format_family(out, "messenger_event_loop_iteration_seconds", "histogram",
+                "Time of one mg_mgr_poll call, including the wait for events.");
+  format_histogram(out, "messenger_event_loop_iteration_seconds", "", &s_loop);
+  format_family(out, "messenger_event_loop_busy_seconds", "histogram",
+                "Time spent handling connection events in one iteration.");
+  format_histogram(out, "messenger_event_loop_busy_seconds", "", &s_loop_busy);
+  format_family(out, "messenger_event_loop_stalls_total", "counter",
+                "Iterations that handled events longer than the stall "
+                "threshold.");
+  append(out, "messenger_event_loop_stalls_total %" INT64_FMT "\n",
+         gauges->stalls);
+
+  format_family(out, "messenger_event_duration_seconds", "histogram",
+                "Connection event handling time by event.");
+  for (i = 0; i < METRICS_EVENT_COUNT; i++){
+    if (s_events[i].count == 0){
+      continue;
+    }
+    snprintf(labels, sizeof(labels), "event=\"%s\"", s_event_names[i]);
+    format_histogram(out, "messenger_event_duration_seconds", labels,
+                     &s_events[i]);
+  }
+
+  format_family(out, "messenger_connections", "gauge",
+                "Open client connections.");
+  append(out, "messenger_connections %d\n", gauges->connections);
+  format_family(out, "messenger_shed_total", "counter",
+                "Connections and API requests answered with 503 by "
+                "admission control.");
+  for (i = 0; i < ADMISSION_REASON_COUNT; i++){
+    append(out, "messenger_shed_total{reason=\"%s\"} %" INT64_FMT "\n",
+           s_shed_reasons[i], gauges->admission.shed[i]);
+  }
+  format_family(out, "messenger_reaped_total", "counter",
+                "Connections closed for idling, slow requests or oversized "
+                "headers.");
+  for (i = 0; i < REAPER_REASON_COUNT; i++){
+    append(out, "messenger_reaped_total{reason=\"%s\"} %" INT64_FMT "\n",
+           s_reap_reasons[i], gauges->reaper.closed[i]);
+  }
+  format_family(out, "messenger_idle_connections", "gauge",
+                "Connections waiting between requests.");
+  append(out, "messenger_idle_connections %d\n", gauges->idle_connections);
+  format_family(out, "messenger_idle_connection_bytes", "gauge",
+                "Memory held by idle connections: connection, buffers and "
+                "arena.");
+  append(out, "messenger_idle_connection_bytes %d\n", (int) gauges->idle_bytes);
+  format_family(out, "messenger_gzip_responses_total", "counter",
+                "Responses sent compressed: static files from .gz copies and "
+                "API responses compressed on the fly.");
+  append(out, "messenger_gzip_responses_total{kind=\"static\"} %" INT64_FMT
+         "\nmessenger_gzip_responses_total{kind=\"dynamic\"} %" INT64_FMT
+         "\n", gauges->compress.static_files, gauges->compress.responses);
+  format_family(out, "messenger_gzip_bytes_total", "counter",
+                "Size of API responses compressed on the fly.");
+  append(out, "messenger_gzip_bytes_total{stage=\"in\"} %" INT64_FMT "\n"
+         "messenger_gzip_bytes_total{stage=\"out\"} %" INT64_FMT "\n",
+         gauges->compress.bytes_in, gauges->compress.bytes_out);
+  format_family(out, "messenger_gzip_over_budget_total", "counter",
+                "API responses sent uncompressed because the iteration "
+                "compression budget was spent.");
+  append(out, "messenger_gzip_over_budget_total %" INT64_FMT "\n",
+         gauges->compress.over_budget);
+  format_family(out, "messenger_mbuf_used_bytes", "gauge",
+                "Data queued in connection buffers.");
+  append(out, "messenger_mbuf_used_bytes{buffer=\"send\"} %d\n"
+         "messenger_mbuf_used_bytes{buffer=\"recv\"} %d\n",
+         (int) gauges->send_used, (int) gauges->recv_used);
+  format_family(out, "messenger_mbuf_allocated_bytes", "gauge",
+                "Memory allocated for connection buffers.");
+  append(out, "messenger_mbuf_allocated_bytes{buffer=\"send\"} %d\n"
+         "messenger_mbuf_allocated_bytes{buffer=\"recv\"} %d\n",
+         (int) gauges->send_allocated, (int) gauges->recv_allocated);
+  format_family(out, "messenger_message_cache_bytes", "gauge",
+                "Memory used by the latest messages cache.");
+  append(out, "messenger_message_cache_bytes %d\n", (int) gauges->cache_bytes);
+  format_family(out, "messenger_conversations", "gauge",
+                "Conversation summaries kept in memory.");
+  append(out, "messenger_conversations %d\n", (int) gauges->conversations);
+  format_family(out, "messenger_groups", "gauge",
+                "Groups kept in memory.");
+  append(out, "messenger_groups %d\n", (int) gauges->groups);
+  format_family(out, "messenger_changes", "gauge",
+                "Message changes kept in memory until compaction.");
+  append(out, "messenger_changes %d\n", (int) gauges->changes);
+  format_family(out, "messenger_dedup_keys", "gauge",
+                "Recent send_message retry keys kept in memory.");
+  append(out, "messenger_dedup_keys %d\n", (int) gauges->dedup.keys);
+  format_family(out, "messenger_dedup_hits_total", "counter",
+                "Retried send_message answered from the recent keys table.");
+  append(out, "messenger_dedup_hits_total %" INT64_FMT "\n",
+         gauges->dedup.hits);
+  format_family(out, "messenger_dedup_evictions_total", "counter",
+                "Retry keys evicted from the recent keys table.");
+  append(out, "messenger_dedup_evictions_total %" INT64_FMT "\n",
+         gauges->dedup.evictions);
+
+  format_family(out, "messenger_arena_requests_total", "counter",
+                "Requests served from connection arenas.");
+  append(out, "messenger_arena_requests_total %" INT64_FMT "\n",
+         gauges->arena.requests);
+  format_family(out, "messenger_arena_mallocs_total", "counter",
+                "Heap allocations made by the arenas themselves: overflow "
+                "chunks and block growth.");
+  append(out, "messenger_arena_mallocs_total %" INT64_FMT "\n",
+         gauges->arena.mallocs);
+  format_family(out, "messenger_arena_bytes_total", "counter",
+                "Memory handed out by arenas to requests.");
+  append(out, "messenger_arena_bytes_total %" INT64_FMT "\n",
+         gauges->arena.bytes);
+  format_family(out, "messenger_arena_peak_bytes", "gauge",
+                "Largest memory used by a single request.");
+  append(out, "messenger_arena_peak_bytes %d\n", (int) gauges->arena.peak_bytes);
+  format_family(out, "messenger_request_heap_allocations_total", "counter",
+                "Heap allocations by operator new and SQLite while serving "
+                "API requests (mongoose buffers are not counted).");
+  append(out, "messenger_request_heap_allocations_total %" INT64_FMT "\n",
+         gauges->request_heap_allocs);
+}
@@ -0,0 +1,98 @@
+/**
+ * @file
+ * @brief Заголовочный файл реестра метрик сервера.
+ *
+ * Метрики обновляются на пути обработки запроса и отдаются по запросу
+ * GET /messenger_api/metrics в текстовом формате Prometheus. Все обработчики
+ * mongoose выполняются в потоке цикла событий, поэтому счётчики изменяются
+ * только из него и не требуют блокировок.
+ *
+ */
+
+#ifndef _MESSENGER_VIA_HTTP_SERVER__METRICS_H_
+#define _MESSENGER_VIA_HTTP_SERVER__METRICS_H_
+
+#include <string>
+#include "mongoose.h"
+#include "arena.h"
+#include "admission.h"
+#include "reaper.h"
+#include "compress.h"
+#include "dedup.h"
+
+/// Количество корзин гистограммы, включая корзину +Inf
+#define METRICS_BUCKET_COUNT 16
+
+/// Наибольшее количество учитываемых запросов к базе данных
+#define METRICS_STATEMENT_MAX 32
+
+/// Гистограмма длительностей
+struct metrics_histogram {
+  int64_t buckets[METRICS_BUCKET_COUNT]; ///< Количество значений в корзинах
+  int64_t count; ///< Количество значений
+  int64_t sum_ns; ///< Сумма значений в наносекундах
+};
+
+/// Показатели, которые сервер собирает в момент запроса метрик
+struct metrics_gauges {
+  int connections; ///< Открытые соединения, кроме прослушивающего
+  size_t send_used; ///< Данные в буферах отправки
+  size_t send_allocated; ///< Память буферов отправки
+  size_t recv_used; ///< Данные в буферах приёма
+  size_t recv_allocated; ///< Память буферов приёма
+  size_t cache_bytes; ///< Память кэша последних сообщений
+  size_t conversations; ///< Сводки переписок в памяти
+  size_t groups; ///< Группы в памяти
+  size_t changes; ///< Несжатые изменения сообщений в памяти
+  struct arena_stats arena; ///< Статистика арен запросов
+  int64_t request_heap_allocs; ///< Выделения из кучи во время запросов api
+  int64_t stalls; ///< Количество задержек цикла событий
+  struct admission_stats admission; ///< Статистика контроля допуска
+  struct reaper_stats reaper; ///< Статистика закрытых соединений
+  int idle_connections; ///< Соединения, простаивающие между запросами
+  size_t idle_bytes; ///< Память простаивающих соединений
+  struct compress_stats compress; ///< Статистика сжатия ответов
+  struct dedup_stats dedup; ///< Статистика ключей повтора отправки
+};
+
+int64_t metrics_now_ns(void);
+
+
+const char * metrics_action_name(int action);
+
+
+const char * metrics_event_name(int ev);
+
+
+void metrics_observe_request(int action,
+                             int status,
+                             int64_t elapsed_ns);
+
+
+int metrics_register_statement(const char * name);
+
+
+void metrics_observe_statement(int statement,
+                               int64_t elapsed_ns);
+
+
+void metrics_observe_execution(int statement,
+                               int64_t elapsed_ns,
+                               int rows,
+                               int fullscan_steps,
+                               int slow);
+
+
+void metrics_observe_event(int ev,
+                           int64_t elapsed_ns);
+
+
+void metrics_observe_loop(int64_t elapsed_ns,
+                          int64_t busy_ns);
+
+
+void metrics_format(const struct metrics_gauges * gauges,
+                    std::string * out);
+
+
+#endif //_MESSENGER_VIA_HTTP_SERVER__METRICS_H_
@@ -0,0 +1,285 @@
+/**
+ * @file
+ * @brief Закрытие простаивающих и медленных соединений
+ *
+ * Соединение проходит состояния: простой между запросами, получение
+ * заголовков, получение тела. Состояние меняется по событиям MG_EV_RECV,
+ * которое обработчик получает до разбора запроса mongoose, и
+ * MG_EV_HTTP_REQUEST. Таймер mongoose у соединения один, он ставится на
+ * ближайший срок текущего состояния; сработавший раньше срока таймер
+ * переставляется. Время простоя отсчитывается и от последнего обмена
+ * данными, поэтому медленная отправка ответа не считается простоем, пока
+ * клиент его читает.
+ *
+ * Время, равное 0, выключает соответствующую проверку. Состояния хранятся
+ * только для принятых соединений и изменяются только из потока цикла
+ * событий.
+ *
+ */
+
+#include <string.h>
+#include <unordered_map>
+
+#include "reaper.h"
+
+/// Состояния соединения
+enum reaper_phase {
+  REAPER_PHASE_IDLE, ///< Простой между запросами
+  REAPER_PHASE_HEADERS, ///< Получение заголовков
+  REAPER_PHASE_BODY, ///< Получение тела
+  REAPER_PHASE_CLOSING ///< Ответ об ошибке отправляется перед закрытием
+};
+
+/// Состояние соединения
+struct reaper_conn {
+  enum reaper_phase phase; ///< Состояние
+  double since; ///< Время начала состояния
+  size_t scanned; ///< Просмотренная в поисках конца заголовков часть буфера
+};
+
+/// Время ожидания заголовков в секундах
+static double s_header_timeout = REAPER_HEADER_TIMEOUT_MS / 1000.0;
+/// Время ожидания тела в секундах
+static double s_body_timeout = REAPER_BODY_TIMEOUT_MS / 1000.0;
+/// Время простоя в секундах
+static double s_idle_timeout = REAPER_IDLE_TIMEOUT_MS / 1000.0;
+/// Наибольший размер заголовков
+static size_t s_max_header_bytes = REAPER_MAX_HEADER_BYTES;
+/// Состояния принятых соединений
+static std::unordered_map<struct mg_connection *, struct reaper_conn> s_conns;
+/// Статистика
+static struct reaper_stats s_stats;
+
+
+/**
+ * @brief Функция устанавливает ограничения, 0 выключает ограничение
+ *
+ * @param[in] header_timeout_ms Время ожидания заголовков запроса
+ * @param[in] body_timeout_ms Время ожидания тела запроса
+ * @param[in] idle_timeout_ms Время простоя соединения между запросами
+ * @param[in] max_header_bytes Наибольший размер заголовков запроса
+ */
+void reaper_init(double header_timeout_ms,
+                 double body_timeout_ms,
+                 double idle_timeout_ms,
+                 size_t max_header_bytes){
+  s_header_timeout = header_timeout_ms / 1000.0;
+  s_body_timeout = body_timeout_ms / 1000.0;
+  s_idle_timeout = idle_timeout_ms / 1000.0;
+  s_max_header_bytes = max_header_bytes;
+  memset(&s_stats, 0, sizeof(s_stats));
+}
+
+
+/**
+ * @brief Функция возвращает время, когда соединение нужно закрыть, или 0
+ */
+static double deadline(const struct mg_connection * nc,
+                       const struct reaper_conn * c){
+  double last_io = (double) nc->last_io_time;
+
+  switch (c->phase){
+    case REAPER_PHASE_IDLE:
+      if (s_idle_timeout <= 0){
+        return 0;
+      }
+      return (last_io > c->since ? last_io : c->since) + s_idle_timeout;
+    case REAPER_PHASE_HEADERS:
+    case REAPER_PHASE_CLOSING:
+      return s_header_timeout > 0 ? c->since + s_header_timeout : 0;
+    case REAPER_PHASE_BODY:
+      return s_body_timeout > 0 ? c->since + s_body_timeout : 0;
+  }
+  return 0;
+}
+
+
+/**
+ * @brief Функция переводит соединение в состояние phase и ставит таймер,
+ * если срок нового состояния наступает раньше
+ */
+static void enter(struct mg_connection * nc,
+                  struct reaper_conn * c,
+                  enum reaper_phase phase){
+  c->phase = phase;
+  c->since = mg_time();
+  c->scanned = 0;
+
+  double d = deadline(nc, c);
+  if (d > 0 && (nc->ev_timer_time == 0 || d < nc->ev_timer_time)){
+    mg_set_timer(nc, d);
+  }
+}
+
+
+/**
+ * @brief Функция ищет конец заголовков в буфере приёма, продолжая с места,
+ * где остановился прошлый поиск
+ *
+ * @retval 1 Заголовки получены
+ * @retval 0 Нужно ждать данных
+ */
+static int headers_complete(const struct mbuf * io,
+                            size_t * scanned){
+  size_t i = *scanned > 2 ? *scanned - 2 : 0;
+
+  // Same end of headers as mongoose looks for: "\n\n" or "\n\r\n"
+  for (; i + 1 < io->len; i++){
+    if (io->buf[i] == '\n' &&
+        (io->buf[i + 1] == '\n' ||
+         (i + 2 < io->len && io->buf[i + 1] == '\r' &&
+          io->buf[i + 2] == '\n'))){
+      return 1;
+    }
+  }
+  *scanned = io->len;
+  return 0;
+}
+
+
+/**
+ * @brief Функция начинает следить за принятым соединением
+ *
+ * @param[in] nc Соединение
+ */
+void reaper_accept(struct mg_connection * nc){
+  enter(nc, &s_conns[nc], REAPER_PHASE_IDLE);
+}
+
+
+/**
+ * @brief Функция учитывает полученные данные, вызывается по MG_EV_RECV
+ *
+ * @param[in] nc Соединение
+ */
+void reaper_recv(struct mg_connection * nc){
+  std::unordered_map<struct mg_connection *, struct reaper_conn>::iterator it =
+    s_conns.find(nc);
+  struct reaper_conn * c;
+
+  if (it == s_conns.end()){
+    return;
+  }
+  c = &it->second;
+  if (c->phase == REAPER_PHASE_IDLE){
+    enter(nc, c, REAPER_PHASE_HEADERS);
+  }
+  if (c->phase != REAPER_PHASE_HEADERS){
+    return;
+  }
+  if (headers_complete(&nc->recv_mbuf, &c->scanned)){
+    enter(nc, c, REAPER_PHASE_BODY);
+  } else if (s_max_header_bytes > 0 &&
+             nc->recv_mbuf.len > s_max_header_bytes){
+    s_stats.closed[REAPER_HEADER_BYTES]++;
+    // Nothing of the request is needed any more
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+    mbuf_trim(&nc->recv_mbuf);
+    // mg_http_send_error does not know the status line of 431
+    mg_printf(nc, "HTTP/1.1 431 Request Header Fields Too Large\r\n"
+                  "Connection: close\r\n"
+                  "Content-Length: 0\r\n\r\n");
+    nc->flags |= MG_F_SEND_AND_CLOSE;
+    enter(nc, c, REAPER_PHASE_CLOSING);
+  }
+}
+
+
+/**
+ * @brief Функция учитывает полученный запрос, вызывается по
+ * MG_EV_HTTP_REQUEST
+ *
+ * @param[in] nc Соединение
+ * @param[in] hm Запрос, ещё не удалённый из буфера приёма
+ */
+void reaper_request(struct mg_connection * nc,
+                    const struct http_message * hm){
+  std::unordered_map<struct mg_connection *, struct reaper_conn>::iterator it =
+    s_conns.find(nc);
+
+  if (it == s_conns.end() || it->second.phase == REAPER_PHASE_CLOSING){
+    return;
+  }
+  // A pipelined request may already be waiting behind this one
+  enter(nc, &it->second, nc->recv_mbuf.len > hm->message.len ?
+                         REAPER_PHASE_HEADERS : REAPER_PHASE_IDLE);
+}
+
+
+/**
+ * @brief Функция закрывает соединение, срок состояния которого истёк,
+ * вызывается по MG_EV_TIMER
+ *
+ * @param[in] nc Соединение
+ */
+void reaper_timer(struct mg_connection * nc){
+  std::unordered_map<struct mg_connection *, struct reaper_conn>::iterator it =
+    s_conns.find(nc);
+  struct reaper_conn * c;
+  double d;
+
+  if (it == s_conns.end()){
+    return;
+  }
+  c = &it->second;
+  if ((d = deadline(nc, c)) <= 0){
+    return;
+  }
+  if (mg_time() < d){
+    mg_set_timer(nc, d);
+    return;
+  }
+  switch (c->phase){
+    case REAPER_PHASE_IDLE:
+      s_stats.closed[REAPER_IDLE]++;
+      break;
+    case REAPER_PHASE_HEADERS:
+      s_stats.closed[REAPER_HEADER_TIMEOUT]++;
+      break;
+    case REAPER_PHASE_BODY:
+      s_stats.closed[REAPER_BODY_TIMEOUT]++;
+      break;
+    case REAPER_PHASE_CLOSING:
+      // Already counted, the client does not read the error
+      break;
+  }
+  // A client this slow would not read a 408 either
+  nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+}
+
+
+/**
+ * @brief Функция забывает закрытое соединение
+ *
+ * @param[in] nc Соединение
+ */
+void reaper_close(struct mg_connection * nc){
+  s_conns.erase(nc);
+}
+
+
+/**
+ * @brief Функция проверяет, что принятое соединение простаивает между
+ * запросами и ему нечего отправлять
+ *
+ * @param[in] nc Соединение
+ * @retval 1 Соединение простаивает
+ * @retval 0 В противном случае
+ */
+int reaper_is_idle(struct mg_connection * nc){
+  std::unordered_map<struct mg_connection *, struct reaper_conn>::iterator it =
+    s_conns.find(nc);
+
+  return it != s_conns.end() && it->second.phase == REAPER_PHASE_IDLE &&
+         nc->send_mbuf.len == 0;
+}
+
+
+/**
+ * @brief Функция возвращает статистику закрытых соединений
+ *
+ * @param[out] stats Статистика
+ */
+void reaper_get_stats(struct reaper_stats * stats){
+  *stats = s_stats;
+}
@@ -0,0 +1,74 @@
+/**
+ * @file
+ * @brief Заголовочный файл закрытия простаивающих и медленных соединений.
+ *
+ * mongoose не закрывает соединения сам: клиент, который держит открытое
+ * соединение без запросов или отправляет запрос по байту, занимает
+ * mg_connection, буферы и арену сколь угодно долго. Таймер каждого
+ * принятого соединения закрывает его, если заголовки запроса не получены
+ * за время ожидания заголовков, тело - за время ожидания тела, а между
+ * запросами нет обмена данными дольше времени простоя. Запросу, заголовки
+ * которого не уместились в ограничение, сервер отвечает 431.
+ *
+ */
+
+#ifndef _MESSENGER_VIA_HTTP_SERVER__REAPER_H_
+#define _MESSENGER_VIA_HTTP_SERVER__REAPER_H_
+
+#include "mongoose.h"
+
+/// Время ожидания заголовков запроса по умолчанию (мс)
+#define REAPER_HEADER_TIMEOUT_MS 10000
+
+/// Время ожидания тела запроса по умолчанию (мс)
+#define REAPER_BODY_TIMEOUT_MS 30000
+
+/// Время простоя соединения между запросами по умолчанию (мс)
+#define REAPER_IDLE_TIMEOUT_MS 60000
+
+/// Наибольший размер заголовков запроса по умолчанию
+#define REAPER_MAX_HEADER_BYTES MG_MAX_HTTP_REQUEST_SIZE
+
+/// Причины закрытия
+enum reaper_reason {
+  REAPER_IDLE, ///< Простой между запросами
+  REAPER_HEADER_TIMEOUT, ///< Заголовки не получены вовремя
+  REAPER_BODY_TIMEOUT, ///< Тело не получено вовремя
+  REAPER_HEADER_BYTES, ///< Заголовки превысили ограничение размера
+  REAPER_REASON_COUNT ///< Количество причин, не причина
+};
+
+/// Статистика закрытых соединений
+struct reaper_stats {
+  int64_t closed[REAPER_REASON_COUNT]; ///< Закрытые соединения по причинам
+};
+
+void reaper_init(double header_timeout_ms,
+                 double body_timeout_ms,
+                 double idle_timeout_ms,
+                 size_t max_header_bytes);
+
+
+void reaper_accept(struct mg_connection * nc);
+
+
+void reaper_recv(struct mg_connection * nc);
+
+
+void reaper_request(struct mg_connection * nc,
+                    const struct http_message * hm);
+
+
+void reaper_timer(struct mg_connection * nc);
+
+
+void reaper_close(struct mg_connection * nc);
+
+
+int reaper_is_idle(struct mg_connection * nc);
+
+
+void reaper_get_stats(struct reaper_stats * stats);
+
+
+#endif //_MESSENGER_VIA_HTTP_SERVER__REAPER_H_
@@ -0,0 +1,410 @@
+/**
+ * @file
+ * @brief Разделяемые неизменяемые данные для отправки
+ *
+ * Пока буфер отправки mongoose не пуст, разделяемые данные ждут в очереди
+ * за ним, чтобы сохранить порядок. Когда он пуст, данные пишутся в сокет
+ * без копирования. Если сокет заполнен, в буфер отправки копируется один
+ * байт: mongoose ждёт готовности сокета к записи только при непустом
+ * буфере, а после отправки байта присылает MG_EV_SEND, и отправка
+ * продолжается из общего буфера. Поэтому непустая очередь всегда стоит за
+ * непустым буфером отправки и MG_F_SEND_AND_CLOSE закрывает соединение
+ * только после отправки всех разделяемых данных.
+ *
+ * Очередь помнит, сколько байт буфера отправки стоит перед ней. Байты,
+ * дописанные в буфер после этой границы, переносятся в конец очереди копией,
+ * а граница уменьшается на количество байт, о котором сообщает MG_EV_SEND.
+ *
+ * Соединения без сокета, например loopback_iface_vtable, получают копию
+ * данных через mg_send. Очереди используются только из потока цикла
+ * событий, счётчик ссылок можно изменять из любого потока.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <atomic>
+#include <unordered_map>
+
+#include "shared_payload.h"
+
+/// Разделяемые неизменяемые данные
+struct shared_payload {
+  std::atomic<int> refs; ///< Количество ссылок
+  size_t len; ///< Размер данных
+  char data[1]; ///< Данные
+};
+
+/// Ссылка в очереди соединения
+struct shared_ref {
+  struct shared_ref * next; ///< Следующая ссылка
+  struct shared_payload * payload; ///< Данные
+  size_t offset; ///< Размер уже отправленной части
+};
+
+/// Очередь соединения
+struct shared_queue {
+  struct shared_ref * head; ///< Первая ссылка
+  struct shared_ref * tail; ///< Последняя ссылка
+  size_t barrier; ///< Байты буфера отправки, стоящие перед очередью
+};
+
+/// Очереди соединений, у которых есть неотправленные данные
+static std::unordered_map<struct mg_connection *, struct shared_queue> s_queues;
+/// Количество существующих разделяемых данных
+static std::atomic<int64_t> s_payloads(0);
+/// Суммарный размер существующих разделяемых данных
+static std::atomic<int64_t> s_payload_bytes(0);
+/// Количество ссылок в очередях
+static int64_t s_queued = 0;
+/// Байты, отправленные прямо из общих буферов
+static int64_t s_direct_bytes = 0;
+/// Байты, скопированные в буферы отправки
+static int64_t s_copied_bytes = 0;
+/// Байты, перенесённые из буферов отправки в очереди
+static int64_t s_moved_bytes = 0;
+/// Соединения, закрытые из-за записи в обход очереди
+static int64_t s_reordered = 0;
+
+
+/**
+ * @brief Функция проверяет, что неблокирующий вызов не выполнен из-за
+ * заполненного буфера сокета
+ */
+static int would_block(void){
+#ifdef _WIN32
+  return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+
+/**
+ * @brief Функция создаёт разделяемые данные с одной ссылкой
+ *
+ * @param[in] data Данные, копируются
+ * @param[in] len Размер данных
+ * @return Разделяемые данные
+ */
+struct shared_payload * shared_payload_new(const void * data,
+                                           size_t len){
+  struct shared_payload * payload = (struct shared_payload *)
+    malloc(sizeof(struct shared_payload) + len);
+
+  if (payload == NULL){
+    return NULL;
+  }
+  new (&payload->refs) std::atomic<int>(1);
+  payload->len = len;
+  memcpy(payload->data, data, len);
+  s_payloads++;
+  s_payload_bytes += len;
+  return payload;
+}
+
+
+/**
+ * @brief Функция добавляет ссылку на разделяемые данные
+ */
+void shared_payload_ref(struct shared_payload * payload){
+  payload->refs++;
+}
+
+
+/**
+ * @brief Функция удаляет ссылку на разделяемые данные и освобождает их
+ * после удаления последней
+ */
+void shared_payload_unref(struct shared_payload * payload){
+  if (--payload->refs == 0){
+    s_payloads--;
+    s_payload_bytes -= payload->len;
+    free(payload);
+  }
+}
+
+
+/**
+ * @brief Функция удаляет первую ссылку очереди
+ */
+static void pop(struct shared_queue * q){
+  struct shared_ref * ref = q->head;
+
+  q->head = ref->next;
+  if (q->head == NULL){
+    q->tail = NULL;
+  }
+  shared_payload_unref(ref->payload);
+  delete ref;
+  s_queued--;
+}
+
+
+/**
+ * @brief Функция добавляет ссылку в конец очереди
+ *
+ * @param[in] q Очередь
+ * @param[in] payload Данные, ссылка передаётся очереди
+ * @param[in] offset Размер уже отправленной части
+ */
+static void push(struct shared_queue * q,
+                 struct shared_payload * payload,
+                 size_t offset){
+  struct shared_ref * ref = new shared_ref;
+
+  ref->next = NULL;
+  ref->payload = payload;
+  ref->offset = offset;
+  if (q->tail == NULL){
+    q->head = ref;
+  } else {
+    q->tail->next = ref;
+  }
+  q->tail = ref;
+  s_queued++;
+}
+
+
+/**
+ * @brief Функция переносит в конец очереди байты, дописанные в буфер
+ * отправки после неё
+ *
+ * @param[in] nc Соединение
+ * @param[in] q Очередь соединения
+ */
+static void move_behind(struct mg_connection * nc,
+                        struct shared_queue * q){
+  struct shared_payload * payload;
+  size_t len;
+
+  if (nc->send_mbuf.len <= q->barrier){
+    return;
+  }
+  len = nc->send_mbuf.len - q->barrier;
+  if ((payload = shared_payload_new(nc->send_mbuf.buf + q->barrier, 
+                                    len)) == NULL){
+    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+    return;
+  }
+  nc->send_mbuf.len = q->barrier;
+  push(q, payload, 0);
+  s_moved_bytes += len;
+}
+
+
+/**
+ * @brief Функция удаляет очередь соединения со всеми ссылками
+ */
+static void drop(struct mg_connection * nc){
+  std::unordered_map<struct mg_connection *, struct shared_queue>::iterator it =
+    s_queues.find(nc);
+
+  if (it == s_queues.end()){
+    return;
+  }
+  while (it->second.head != NULL){
+    pop(&it->second);
+  }
+  s_queues.erase(it);
+}
+
+
+/**
+ * @brief Функция пишет данные в сокет соединения, пока они есть и сокет
+ * их принимает
+ *
+ * @param[in] nc Соединение с пустым буфером отправки
+ * @param[in,out] payload Данные
+ * @param[in,out] offset Размер уже отправленной части
+ * @retval 1 Данные отправлены целиком
+ * @retval 0 Сокет заполнен, один следующий байт скопирован в буфер отправки
+ * @retval -1 Ошибка сокета, соединение закрывается
+ */
+static int write_direct(struct mg_connection * nc,
+                        struct shared_payload * payload,
+                        size_t * offset){
+  while (*offset < payload->len){
+    int n = (int) send(nc->sock, payload->data + *offset,
+                       payload->len - *offset, 0);
+    if (n > 0){
+      *offset += n;
+      s_direct_bytes += n;
+      nc->last_io_time = (time_t) mg_time();
+    } else if (n < 0 && would_block()){
+      // mongoose watches the socket for writing while send_mbuf is not empty
+      mg_send(nc, payload->data + *offset, 1);
+      *offset += 1;
+      s_copied_bytes += 1;
+      return *offset == payload->len ? 1 : 0;
+    } else {
+      nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+      return -1;
+    }
+  }
+  return 1;
+}
+
+
+/**
+ * @brief Функция отправляет очередь соединения, если его буфер отправки пуст
+ */
+static void flush(struct mg_connection * nc){
+  std::unordered_map<struct mg_connection *, struct shared_queue>::iterator it =
+    s_queues.find(nc);
+  struct shared_queue * q;
+
+  if (it == s_queues.end() || nc->send_mbuf.len > 0){
+    return;
+  }
+  q = &it->second;
+  while (q->head != NULL){
+    int ret = write_direct(nc, q->head->payload, &q->head->offset);
+    if (ret < 0){
+      drop(nc);
+      return;
+    }
+    if (q->head->offset == q->head->payload->len){
+      pop(q);
+    }
+    if (ret == 0){
+      q->barrier = nc->send_mbuf.len;
+      return;
+    }
+  }
+  s_queues.erase(it);
+}
+
+
+/**
+ * @brief Функция ставит разделяемые данные в очередь отправки соединения
+ *
+ * Ссылка передаётся соединению, вызывающий при необходимости добавляет
+ * её заранее shared_payload_ref. Данные, отправленные раньше через
+ * mg_send или shared_payload_write, уходят первыми.
+ *
+ * @param[in] nc Соединение
+ * @param[in] payload Данные
+ */
+void shared_payload_send(struct mg_connection * nc,
+                         struct shared_payload * payload){
+  std::unordered_map<struct mg_connection *, struct shared_queue>::iterator it;
+  size_t offset = 0;
+
+  if (nc->flags & MG_F_CLOSE_IMMEDIATELY){
+    shared_payload_unref(payload);
+    return;
+  }
+  if (nc->sock == INVALID_SOCKET){
+    mg_send(nc, payload->data, (int) payload->len);
+    s_copied_bytes += payload->len;
+    shared_payload_unref(payload);
+    return;
+  }
+  if ((it = s_queues.find(nc)) != s_queues.end()){
+    // Bytes written since the last event go before this payload
+    move_behind(nc, &it->second);
+    push(&it->second, payload, 0);
+    return;
+  }
+  // The common case: nothing is pending and the socket takes everything
+  if (nc->send_mbuf.len == 0 && write_direct(nc, payload, &offset) != 0){
+    shared_payload_unref(payload);
+    return;
+  }
+
+  struct shared_queue * q = &s_queues[nc];
+  q->head = NULL;
+  q->tail = NULL;
+  q->barrier = nc->send_mbuf.len;
+  push(q, payload, offset);
+}
+
+
+/**
+ * @brief Функция отправляет копию данных соединению после его очереди
+ *
+ * Без очереди данные копируются в буфер отправки, как mg_send, иначе
+ * ставятся в конец очереди.
+ *
+ * @param[in] nc Соединение
+ * @param[in] data Данные, копируются
+ * @param[in] len Размер данных
+ */
+void shared_payload_write(struct mg_connection * nc,
+                          const void * data,
+                          size_t len){
+  std::unordered_map<struct mg_connection *, struct shared_queue>::iterator it =
+    s_queues.find(nc);
+  struct shared_payload * payload;
+
+  if (it == s_queues.end()){
+    mg_send(nc, data, (int) len);
+    return;
+  }
+  if ((payload = shared_payload_new(data, len)) == NULL){
+    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+    return;
+  }
+  move_behind(nc, &it->second);
+  push(&it->second, payload, 0);
+}
+
+
+/**
+ * @brief Функция обрабатывает событие соединения: переносит в очередь
+ * данные, записанные во время события, после MG_EV_SEND продолжает
+ * отправку очереди, при MG_EV_CLOSE удаляет её
+ *
+ * Вызывается в конце обработки каждого события соединения.
+ *
+ * @param[in] nc Соединение
+ * @param[in] ev Событие
+ * @param[in] ev_data Данные события, для MG_EV_SEND - количество
+ * отправленных байт
+ */
+void shared_payload_event(struct mg_connection * nc,
+                          int ev,
+                          void * ev_data){
+  std::unordered_map<struct mg_connection *, struct shared_queue>::iterator it;
+
+  if (s_queues.empty() || (it = s_queues.find(nc)) == s_queues.end()){
+    return;
+  }
+  if (ev == MG_EV_CLOSE){
+    drop(nc);
+    return;
+  }
+  if (ev == MG_EV_SEND){
+    size_t sent = (size_t) *(int *) ev_data;
+    if (sent > it->second.barrier){
+      // Bytes behind the queue already reached the socket
+      s_reordered++;
+      nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+      drop(nc);
+      return;
+    }
+    it->second.barrier -= sent;
+  }
+  move_behind(nc, &it->second);
+  if (ev == MG_EV_SEND){
+    flush(nc);
+  }
+}
+
+
+/**
+ * @brief Функция возвращает статистику отправки разделяемых данных
+ *
+ * @param[out] stats Статистика
+ */
+void shared_payload_get_stats(struct shared_payload_stats * stats){
+  stats->payloads = s_payloads;
+  stats->payload_bytes = s_payload_bytes;
+  stats->queued = s_queued;
+  stats->direct_bytes = s_direct_bytes;
+  stats->copied_bytes = s_copied_bytes;
+  stats->moved_bytes = s_moved_bytes;
+  stats->reordered = s_reordered;
+}
@@ -0,0 +1,69 @@
+/**
+ * @file
+ * @brief Заголовочный файл разделяемых неизменяемых данных для отправки.
+ *
+ * mg_send копирует данные в буфер отправки каждого соединения, поэтому
+ * одно сообщение, отправленное многим соединениям, занимает память столько
+ * раз, сколько соединений. Разделяемые данные создаются один раз со
+ * счётчиком ссылок, а очередь соединения хранит только ссылку и смещение
+ * уже отправленной части. Данные отправляются в сокет прямо из общего
+ * буфера и освобождаются, когда их отправят все соединения.
+ *
+ * Обработчик событий соединения, которому отправляются разделяемые данные,
+ * должен в конце обработки каждого события вызывать shared_payload_event.
+ * Данные, записанные в соединение через mg_send или mg_printf во время
+ * события, пока у соединения есть очередь, переносятся в её конец, поэтому
+ * порядок отправки сохраняется. Вне событий самого соединения (например, из
+ * обработчика другого соединения) в такое соединение нужно писать через
+ * shared_payload_write. Соединение, отправившее данные в обход очереди,
+ * закрывается: поток ответов в нём уже нарушен.
+ *
+ */
+
+#ifndef _MESSENGER_VIA_HTTP_SERVER__SHARED_PAYLOAD_H_
+#define _MESSENGER_VIA_HTTP_SERVER__SHARED_PAYLOAD_H_
+
+#include "mongoose.h"
+
+/// Разделяемые неизменяемые данные
+struct shared_payload;
+
+/// Статистика отправки разделяемых данных
+struct shared_payload_stats {
+  int64_t payloads; ///< Существующие разделяемые данные
+  int64_t payload_bytes; ///< Их суммарный размер
+  int64_t queued; ///< Ссылки в очередях соединений
+  int64_t direct_bytes; ///< Байты, отправленные прямо из общих буферов
+  int64_t copied_bytes; ///< Байты, скопированные в буферы отправки
+  int64_t moved_bytes; ///< Байты, перенесённые из буферов отправки в очереди
+  int64_t reordered; ///< Соединения, закрытые из-за записи в обход очереди
+};
+
+struct shared_payload * shared_payload_new(const void * data,
+                                           size_t len);
+
+
+void shared_payload_ref(struct shared_payload * payload);
+
+
+void shared_payload_unref(struct shared_payload * payload);
+
+
+void shared_payload_send(struct mg_connection * nc,
+                         struct shared_payload * payload);
+
+
+void shared_payload_write(struct mg_connection * nc,
+                          const void * data,
+                          size_t len);
+
+
+void shared_payload_event(struct mg_connection * nc,
+                          int ev,
+                          void * ev_data);
+
+
+void shared_payload_get_stats(struct shared_payload_stats * stats);
+
+
+#endif //_MESSENGER_VIA_HTTP_SERVER__SHARED_PAYLOAD_H_
@@ -0,0 +1,182 @@
+/**
+ * @file
+ * @brief Детектор задержек цикла событий
+ *
+ * Контекст события (URI, действие api, самый долгий запрос к базе данных)
+ * заполняется во время его обработки. По окончании события контекст самого
+ * долгого события итерации сохраняется, а по окончании итерации, превысившей
+ * порог, попадает в кольцевой буфер последних задержек.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "stall.h"
+#include "metrics.h"
+#include "db_plugin.h"
+#include "json.h"
+
+/// Порог времени обработки событий за итерацию
+static int64_t s_threshold_ns = (int64_t) STALL_THRESHOLD_MS * 1000000;
+/// Контекст обрабатываемого события
+static struct stall_record s_event;
+/// Обрабатываемая итерация и её самое долгое событие
+static struct stall_record s_iteration;
+/// Последние задержки
+static struct stall_record s_ring[STALL_RING_SIZE];
+/// Количество задержек с начала работы
+static int64_t s_count = 0;
+
+
+/**
+ * @brief Функция устанавливает порог задержки
+ *
+ * @param[in] threshold_ns Порог времени обработки событий за итерацию
+ */
+void stall_init(int64_t threshold_ns){
+  s_threshold_ns = threshold_ns;
+}
+
+
+/**
+ * @brief Функция начинает итерацию цикла событий
+ */
+void stall_iteration_begin(void){
+  memset(&s_iteration, 0, sizeof(s_iteration));
+  s_iteration.event = -1;
+}
+
+
+/**
+ * @brief Функция завершает итерацию цикла событий и сохраняет её, если время
+ * обработки событий превысило порог
+ *
+ * @return Время обработки событий итерации в наносекундах
+ */
+int64_t stall_iteration_end(void){
+  if (s_iteration.busy_ns > s_threshold_ns){
+    struct stall_record * r = &s_ring[s_count % STALL_RING_SIZE];
+    *r = s_iteration;
+    r->time = (int64_t) time(NULL);
+    s_count++;
+    fprintf(stderr, "Event loop stall: %.1f ms in %d events, slowest %s "
+            "%.1f ms [%s] action %s, statement %s %.1f ms\n",
+            r->busy_ns / 1e6, r->events, metrics_event_name(r->event),
+            r->event_ns / 1e6, r->uri, metrics_action_name(r->action),
+            r->statement != NULL ? r->statement : "none",
+            r->statement_ns / 1e6);
+  }
+  return s_iteration.busy_ns;
+}
+
+
+/**
+ * @brief Функция начинает обработку события соединения
+ */
+void stall_event_begin(void){
+  s_event.action = API_ACTION_NULL;
+  s_event.uri[0] = '\0';
+  s_event.statement = NULL;
+  s_event.statement_ns = 0;
+}
+
+
+/**
+ * @brief Функция завершает обработку события соединения
+ *
+ * @param[in] ev Событие, MG_EV_*
+ * @param[in] elapsed_ns Время обработки события
+ */
+void stall_event_end(int ev,
+                     int64_t elapsed_ns){
+  s_iteration.busy_ns += elapsed_ns;
+  s_iteration.events++;
+  if (elapsed_ns > s_iteration.event_ns){
+    s_iteration.event = ev;
+    s_iteration.event_ns = elapsed_ns;
+    s_iteration.action = s_event.action;
+    memcpy(s_iteration.uri, s_event.uri, sizeof(s_iteration.uri));
+    s_iteration.statement = s_event.statement;
+    s_iteration.statement_ns = s_event.statement_ns;
+  }
+}
+
+
+/**
+ * @brief Функция запоминает запрос, обработанный в текущем событии
+ *
+ * @param[in] uri URI запроса
+ * @param[in] action Действие api, enum api_action
+ */
+void stall_note_request(const struct mg_str * uri,
+                        int action){
+  size_t len = uri->len < STALL_URI_MAX_LENGTH - 1 ?
+               uri->len : STALL_URI_MAX_LENGTH - 1;
+
+  memcpy(s_event.uri, uri->p, len);
+  s_event.uri[len] = '\0';
+  s_event.action = action;
+}
+
+
+/**
+ * @brief Функция запоминает запрос к базе данных, если он самый долгий в
+ * текущем событии
+ *
+ * @param[in] statement Имя запроса, строка должна существовать всё время
+ * работы
+ * @param[in] elapsed_ns Время запроса
+ */
+void stall_note_statement(const char * statement,
+                          int64_t elapsed_ns){
+  if (elapsed_ns > s_event.statement_ns){
+    s_event.statement = statement;
+    s_event.statement_ns = elapsed_ns;
+  }
+}
+
+
+/**
+ * @brief Функция возвращает количество задержек с начала работы
+ */
+int64_t stall_count(void){
+  return s_count;
+}
+
+
+/**
+ * @brief Функция выводит последние задержки в JSON, начиная с последней
+ *
+ * @param[out] out Строка, к которой дописывается вывод
+ */
+void stall_format(std::string * out){
+  char buf[256];
+  int64_t i;
+
+  snprintf(buf, sizeof(buf), "{\"threshold_ms\":%.1f,\"stalls_total\":%"
+           INT64_FMT ",\"stalls\":[", s_threshold_ns / 1e6, s_count);
+  out->append(buf);
+  for (i = s_count - 1; i >= 0 && i >= s_count - STALL_RING_SIZE; i--){
+    const struct stall_record * r = &s_ring[i % STALL_RING_SIZE];
+    snprintf(buf, sizeof(buf), "%s{\"time\":%" INT64_FMT ",\"busy_ms\":%.3f,"
+             "\"events\":%d,\"event\":\"%s\",\"event_ms\":%.3f,"
+             "\"action\":\"%s\",\"uri\":", i == s_count - 1 ? "" : ",",
+             r->time, r->busy_ns / 1e6, r->events,
+             metrics_event_name(r->event), r->event_ns / 1e6,
+             metrics_action_name(r->action));
+    out->append(buf);
+    json_append_string(out, r->uri);
+    out->append(",\"statement\":");
+    if (r->statement != NULL){
+      json_append_string(out, r->statement);
+    } else {
+      out->append("null");
+    }
+    snprintf(buf, sizeof(buf), ",\"statement_ms\":%.3f}",
+             r->statement_ns / 1e6);
+    out->append(buf);
+  }
+  out->append("]}");
+}
@@ -0,0 +1,71 @@
+/**
+ * @file
+ * @brief Заголовочный файл детектора задержек цикла событий.
+ *
+ * Все соединения обслуживаются одним потоком, поэтому долгая обработка
+ * одного события (например, медленный запрос к базе данных) задерживает все
+ * остальные соединения. Детектор суммирует время обработки событий за
+ * итерацию цикла и сохраняет итерации дольше порога вместе с самым долгим
+ * событием: URI, действием api и самым долгим запросом к базе данных.
+ *
+ */
+
+#ifndef _MESSENGER_VIA_HTTP_SERVER__STALL_H_
+#define _MESSENGER_VIA_HTTP_SERVER__STALL_H_
+
+#include <string>
+#include "mongoose.h"
+
+/// Порог времени обработки событий за итерацию по умолчанию (в миллисекундах)
+#define STALL_THRESHOLD_MS 100
+
+/// Количество последних задержек, которые хранятся для просмотра
+#define STALL_RING_SIZE 64
+
+/// Наибольшая сохраняемая длина URI
+#define STALL_URI_MAX_LENGTH 128
+
+/// Итерация цикла событий, превысившая порог
+struct stall_record {
+  int64_t time; ///< Время окончания итерации (UTC Unix)
+  int64_t busy_ns; ///< Время обработки всех событий итерации
+  int events; ///< Количество событий итерации
+  int event; ///< Самое долгое событие, MG_EV_*
+  int64_t event_ns; ///< Время обработки самого долгого события
+  int action; ///< Действие api, выполненное в самом долгом событии
+  char uri[STALL_URI_MAX_LENGTH]; ///< URI запроса самого долгого события
+  const char * statement; ///< Самый долгий запрос к базе данных или NULL
+  int64_t statement_ns; ///< Время этого запроса
+};
+
+void stall_init(int64_t threshold_ns);
+
+
+void stall_iteration_begin(void);
+
+
+int64_t stall_iteration_end(void);
+
+
+void stall_event_begin(void);
+
+
+void stall_event_end(int ev,
+                     int64_t elapsed_ns);
+
+
+void stall_note_request(const struct mg_str * uri,
+                        int action);
+
+
+void stall_note_statement(const char * statement,
+                          int64_t elapsed_ns);
+
+
+int64_t stall_count(void);
+
+
+void stall_format(std::string * out);
+
+
+#endif //_MESSENGER_VIA_HTTP_SERVER__STALL_H_
@@ -0,0 +1,146 @@
+/**
+ * @file
+ * @brief Выбор, открытие и закрытие реализации хранилища
+ *
+ */
+
+#include <string.h>
+
+#include "storage.h"
+
+/// Все доступные реализации хранилища. Первая используется по умолчанию
+static const struct storage_vtable * s_vtables[] = {
+  &storage_sqlite_vtable,
+  &storage_log_vtable,
+  &storage_memory_vtable
+};
+
+/// Сохранность записи в хранилищах, открываемых после storage_set_durability
+static int s_durability = STORAGE_DURABILITY_DEFAULT;
+
+/// Имена уровней сохранности в порядке enum storage_durability
+static const char * s_durability_names[] = {
+  "default",
+  "none",
+  "process",
+  "disk"
+};
+
+
+/**
+ * @brief Функция находит уровень сохранности по имени
+ *
+ * @param[in] name Имя уровня
+ * @retval -1 Уровень не найден
+ * @retval enum storage_durability
+ */
+int storage_find_durability(const char * name){
+  for (size_t i = 0; i < sizeof(s_durability_names) / 
+                         sizeof(s_durability_names[0]); i++){
+    if (!strcmp(s_durability_names[i], name)){
+      return (int) i;
+    }
+  }
+  return -1;
+}
+
+
+/**
+ * @brief Функция задаёт сохранность записи для хранилищ, открываемых после
+ * вызова
+ *
+ * SQLite при STORAGE_DURABILITY_PROCESS не вызывает fsync, журнал при 
+ * STORAGE_DURABILITY_DISK сбрасывает сегмент на диск после каждой операции 
+ * записи.
+ *
+ * @param[in] durability enum storage_durability, кроме 
+ * STORAGE_DURABILITY_NONE
+ */
+void storage_set_durability(int durability){
+  s_durability = durability;
+}
+
+
+/**
+ * @brief Функция возвращает сохранность записи, которую обеспечит 
+ * хранилище при открытии
+ *
+ * Хранилище в памяти остаётся несохраняемым при любой заданной сохранности.
+ *
+ * @param[in] vtable Реализация хранилища
+ * @return enum storage_durability, кроме STORAGE_DURABILITY_DEFAULT
+ */
+int storage_durability(const struct storage_vtable * vtable){
+  if (vtable->durability == STORAGE_DURABILITY_NONE ||
+      s_durability == STORAGE_DURABILITY_DEFAULT){
+    return vtable->durability;
+  }
+  return s_durability;
+}
+
+
+/**
+ * @brief Функция возвращает имя уровня сохранности
+ *
+ * @param[in] durability enum storage_durability
+ * @return Имя уровня
+ */
+const char * storage_durability_name(int durability){
+  return s_durability_names[durability];
+}
+
+
+/**
+ * @brief Функция находит реализацию хранилища по имени
+ *
+ * @param[in] name Имя реализации или NULL для реализации по умолчанию
+ * @retval NULL Реализация не найдена
+ * @retval Указатель на таблицу функций реализации
+ */
+const struct storage_vtable * storage_find_vtable(const char * name){
+  if (name == NULL){
+    return s_vtables[0];
+  }
+  for (size_t i = 0; i < sizeof(s_vtables) / sizeof(s_vtables[0]); i++){
+    if (!strcmp(s_vtables[i]->name, name)){
+      return s_vtables[i];
+    }
+  }
+  return NULL;
+}
+
+
+/**
+ * @brief Функция открывает хранилище
+ *
+ * @param[in] vtable Реализация хранилища
+ * @param[in] path Путь к данным хранилища
+ * @retval NULL Хранилище не может быть открыто
+ * @retval Указатель на открытое хранилище
+ */
+struct storage * storage_open(const struct storage_vtable * vtable,
+                              const char * path){
+  struct storage * st = new storage;
+
+  st->vtable = vtable;
+  st->data = NULL;
+  if (vtable->open(st, path) != STORAGE_OK){
+    delete st;
+    return NULL;
+  }
+  return st;
+}
+
+
+/**
+ * @brief Функция закрывает хранилище
+ *
+ * @param[in] st Указатель на хранилище, которое необходимо закрыть
+ */
+void storage_close(struct storage ** st){
+  if (st != NULL && *st != NULL){
+    (*st)->vtable->close(*st);
+    delete *st;
+    *st = NULL;
+  }
+}
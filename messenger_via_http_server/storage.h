@@ -0,0 +1,252 @@
+/**
+ * @file
+ * @brief Заголовочный файл интерфейса хранилища сообщений и пользователей.
+ *
+ * Функции api сервера работают с хранилищем только через таблицу функций
+ * storage_vtable и ничего не знают о конкретной базе данных. Реализация
+ * выбирается при запуске сервера.
+ *
+ */
+
+#ifndef _MESSENGER_VIA_HTTP_SERVER__STORAGE_H_
+#define _MESSENGER_VIA_HTTP_SERVER__STORAGE_H_
+
+#include <stddef.h>
+#include <stdio.h>
+#include "mongoose.h"
+
+/// Курсор, который больше идентификатора любого сообщения
+#define STORAGE_CURSOR_MAX INT64_MAX
+
+/// Первый символ адресата сообщения группе: to - имя группы с префиксом
+#define STORAGE_GROUP_PREFIX '#'
+
+/// Порог журнала медленных запросов SQLite по умолчанию (в миллисекундах)
+#define STORAGE_SLOW_QUERY_MS 100
+
+/// Результаты операций хранилища
+enum storage_result {
+  STORAGE_OK, ///< Операция выполнена
+  STORAGE_NOT_FOUND, ///< Пользователь или группа не найдены
+  STORAGE_EXISTS, ///< Пользователь или группа уже существуют
+  STORAGE_ERROR ///< Ошибка хранилища
+};
+
+/// Сохранность записанных данных
+enum storage_durability {
+  STORAGE_DURABILITY_DEFAULT, ///< Как принято в реализации хранилища
+  STORAGE_DURABILITY_NONE, ///< Данные теряются при остановке процесса
+  /// Запись переживает аварийное завершение процесса (данные в страничном
+  /// кэше ОС), но не сбой ОС или питания
+  STORAGE_DURABILITY_PROCESS,
+  STORAGE_DURABILITY_DISK ///< Запись завершается после сброса данных на диск
+};
+
+/// Направления обхода сообщений пользователя
+enum storage_scan {
+  STORAGE_SCAN_FORWARD, ///< Сообщения после курсора по возрастанию id
+  STORAGE_SCAN_BACKWARD ///< Сообщения до курсора по убыванию id
+};
+
+/// Сообщение в хранилище
+struct storage_message {
+  int64_t message_id; ///< Уникальный идентификатор сообщения
+  const char * from; ///< От кого адресовано сообщение
+  /// Кому адресовано сообщение, для группы - STORAGE_GROUP_PREFIX и имя
+  const char * to;
+  const char * message; ///< Текст сообщения, NULL - сообщение удалено
+  int64_t time; ///< Время получения сообщения сервером (UTC Unix)
+  /// Ключ повтора отправки, уникальный для отправителя, NULL - без ключа.
+  /// При обходе сообщений не заполняется
+  const char * client_msg_id;
+};
+
+/// Функция, вызываемая для каждого найденного сообщения. Строки сообщения
+/// действительны только во время вызова
+typedef void (*storage_message_cb)(const struct storage_message * message,
+                                   void * arg);
+
+/// Функция, вызываемая для последнего сообщения каждого пользователя
+typedef void (*storage_latest_cb)(const char * user,
+                                  int64_t message_id,
+                                  void * arg);
+
+/// Сводка переписки пользователя с собеседником
+struct storage_conversation {
+  const char * user; ///< Пользователь
+  const char * peer; ///< Собеседник
+  struct storage_message last; ///< Последнее сообщение переписки
+  int64_t read; ///< Последнее прочитанное пользователем сообщение
+  int64_t unread; ///< Сообщения собеседника после прочитанного
+};
+
+/// Функция, вызываемая для каждой переписки каждого пользователя. Строки
+/// действительны только во время вызова
+typedef void (*storage_conversation_cb)(
+  const struct storage_conversation * conversation, void * arg);
+
+/// Участие пользователя в группе. Участнику видны сообщения группы с
+/// идентификаторами от joined (не включая) до left (включая)
+struct storage_membership {
+  const char * group; ///< Имя группы без префикса
+  const char * user; ///< Участник
+  int64_t joined; ///< Последнее сообщение хранилища при вступлении
+  /// Последнее сообщение хранилища при выходе, STORAGE_CURSOR_MAX - участник
+  /// ещё в группе
+  int64_t left;
+};
+
+/// Функция, вызываемая для каждого участия в группе. Строки действительны
+/// только во время вызова
+typedef void (*storage_membership_cb)(
+  const struct storage_membership * membership, void * arg);
+
+/// Изменение сохранённого сообщения: правка или удаление
+struct storage_change {
+  int64_t version; ///< Версия изменения, растёт с каждым изменением
+  int64_t message_id; ///< Изменённое сообщение
+  const char * from; ///< Отправитель сообщения, он же автор изменения
+  const char * to; ///< Адресат сообщения
+  const char * message; ///< Новый текст сообщения, NULL - сообщение удалено
+  int64_t time; ///< Время изменения (UTC Unix)
+};
+
+/// Функция, вызываемая для каждого изменения. Строки действительны только
+/// во время вызова
+typedef void (*storage_change_cb)(const struct storage_change * change,
+                                  void * arg);
+
+struct storage;
+
+/// Таблица функций реализации хранилища
+struct storage_vtable {
+  /// Имя реализации, по которому она выбирается при запуске
+  const char * name;
+  /// Сохранность записи по умолчанию, enum storage_durability
+  int durability;
+
+  /// Открывает хранилище по пути path. Возвращает STORAGE_OK или
+  /// STORAGE_ERROR
+  int (*open)(struct storage * st, const char * path);
+  /// Освобождает всё, что выделил open
+  void (*close)(struct storage * st);
+
+  /// Находит зарегистрированного пользователя. При STORAGE_OK копирует хеш
+  /// пароля в pass_hash (если он не NULL). Для неизвестного пользователя
+  /// возвращает STORAGE_NOT_FOUND
+  int (*lookup_user)(struct storage * st, const char * user, char * pass_hash,
+                     size_t pass_hash_len);
+  /// Регистрирует пользователя. Возвращает STORAGE_OK, STORAGE_EXISTS или
+  /// STORAGE_ERROR
+  int (*create_user)(struct storage * st, const char * user,
+                     const char * pass_hash);
+
+  /// Атомарно сохраняет count сообщений и присваивает им message_id.
+  /// Сообщение группе сохраняется один раз. Возвращает STORAGE_NOT_FOUND,
+  /// ничего не сохранив, если адресат неизвестен или отправитель не состоит
+  /// в группе. Возвращает STORAGE_EXISTS, ничего не сохранив, если
+  /// отправитель уже сохранил сообщение с тем же client_msg_id; message_id
+  /// такого сообщения заменяется сохранённым
+  int (*put_messages)(struct storage * st, struct storage_message * messages,
+                      int count);
+  /// Вызывает cb не более чем для limit сообщений, отправленных или
+  /// полученных пользователем user, включая сообщения его групп за время
+  /// участия, после курсора (forward) или до него (backward)
+  int (*scan_messages)(struct storage * st, const char * user, int64_t cursor,
+                       int direction, int limit, storage_message_cb cb,
+                       void * arg);
+  /// То же, что scan_messages, но только сообщения между user и peer в обе
+  /// стороны или только сообщения группы peer (с префиксом). Возвращает
+  /// STORAGE_NOT_FOUND, если peer неизвестен
+  int (*scan_conversation)(struct storage * st, const char * user,
+                           const char * peer, int64_t cursor, int direction,
+                           int limit, storage_message_cb cb, void * arg);
+  /// Вызывает cb один раз для каждого пользователя с идентификатором его
+  /// последнего сообщения и один раз для каждой группы (имя с префиксом) с
+  /// её последним сообщением. Сообщения группы передаются только для группы,
+  /// но не для её участников
+  int (*scan_latest)(struct storage * st, storage_latest_cb cb, void * arg);
+  /// Запоминает, что user прочитал переписку с peer до message_id.
+  /// Возвращает STORAGE_NOT_FOUND, если один из пользователей неизвестен
+  int (*put_read_cursor)(struct storage * st, const char * user,
+                         const char * peer, int64_t message_id);
+  /// Вызывает cb один раз для каждой пары пользователя и собеседника,
+  /// обменявшихся личными сообщениями
+  int (*scan_conversations)(struct storage * st, storage_conversation_cb cb,
+                            void * arg);
+  /// Создаёт группу group с первым участником user. Возвращает
+  /// STORAGE_EXISTS, если группа существует, STORAGE_NOT_FOUND, если
+  /// пользователь неизвестен
+  int (*create_group)(struct storage * st, const char * group,
+                      const char * user);
+  /// Добавляет user в группу (joined != 0) или исключает его. Сохранённые
+  /// сообщения не меняются: участие начинается или заканчивается на
+  /// последнем сохранённом сообщении, которое возвращается в cursor.
+  /// Возвращает STORAGE_NOT_FOUND, если группа или пользователь неизвестны,
+  /// STORAGE_EXISTS, если участие не меняется
+  int (*put_member)(struct storage * st, const char * group,
+                    const char * user, int joined, int64_t * cursor);
+  /// Вызывает cb для каждого интервала участия в каждой группе
+  int (*scan_members)(struct storage * st, storage_membership_cb cb,
+                      void * arg);
+  /// Заменяет текст сохранённого сообщения (change->message != NULL) или
+  /// удаляет его, оставляя метку, которую обход передаёт с message NULL.
+  /// Заполняет change->version и change->to. Возвращает STORAGE_NOT_FOUND,
+  /// если сообщение неизвестно, удалено или отправлено не change->from
+  int (*put_change)(struct storage * st, struct storage_change * change);
+  /// Вызывает cb для каждого сохранённого изменения по возрастанию версии.
+  /// Изменения до версии, возвращённой в horizon, уже сжаты
+  int (*scan_changes)(struct storage * st, int64_t * horizon,
+                      storage_change_cb cb, void * arg);
+  /// Удаляет изменения до версии through и удалённые ими сообщения, чтобы
+  /// обход больше не передавал их метки
+  int (*compact_changes)(struct storage * st, int64_t through);
+  /// Переносит на текущую схему порцию данных, оставшихся от старой схемы.
+  /// Возвращает 1, пока перенос не закончен, и 0, когда переносить нечего.
+  /// NULL - у хранилища нет старых схем
+  int (*migrate)(struct storage * st);
+};
+
+/// Открытое хранилище
+struct storage {
+  const struct storage_vtable * vtable; ///< Реализация хранилища
+  void * data; ///< Данные реализации
+};
+
+/// Хранилище в базе данных SQLite
+extern const struct storage_vtable storage_sqlite_vtable;
+
+/// Хранилище в виде журнала сегментов, отображённых в память. Путь
+/// хранилища используется как префикс имён файлов сегментов
+extern const struct storage_vtable storage_log_vtable;
+
+/// Хранилище в памяти процесса, данные теряются при остановке сервера
+extern const struct storage_vtable storage_memory_vtable;
+
+const struct storage_vtable * storage_find_vtable(const char * name);
+
+
+void storage_sqlite_set_slow_log(FILE * file, 
+                                 int64_t threshold_ns);
+
+
+int storage_find_durability(const char * name);
+
+
+void storage_set_durability(int durability);
+
+
+int storage_durability(const struct storage_vtable * vtable);
+
+
+const char * storage_durability_name(int durability);
+
+
+struct storage * storage_open(const struct storage_vtable * vtable,
+                              const char * path);
+
+
+void storage_close(struct storage ** st);
+
+
+#endif //_MESSENGER_VIA_HTTP_SERVER__STORAGE_H_
@@ -0,0 +1,1418 @@
+/**
+ * @file
+ * @brief Хранилище в виде журнала сегментов фиксированного размера
+ *
+ * Пользователи, группы, сообщения, изменения участия в группах и отметки о
+ * прочтении переписок только дописываются в конец журнала. Журнал
+ * состоит из файлов-сегментов размером LOG_SEGMENT_SIZE, отображённых в
+ * память, поэтому запись сообщения - это копирование в память без системных
+ * вызовов. Индексы (пользователи и группы по имени, участие в группах и
+ * упорядоченные списки сообщений каждого пользователя, каждой пары
+ * собеседников и каждой группы) хранятся только в памяти и строятся при
+ * открытии чтением всего журнала. Сообщение группе записывается один раз.
+ *
+ * Правка или удаление сообщения дописывает запись изменения, исходная
+ * запись сообщения не меняется: текст берётся из последнего изменения.
+ * Сжатие изменений тоже только дописывает запись, по которой удалённые
+ * сообщения убираются из индексов. Ключ повтора отправки записывается за
+ * текстом сообщения, таблица ключей тоже строится при открытии.
+ *
+ * Каждая запись защищена контрольной суммой. При открытии журнал читается до
+ * первой повреждённой или недописанной записи, всё, что находится после неё,
+ * отбрасывается. Сообщения одного вызова put_messages восстанавливаются либо
+ * все, либо ни одного.
+ *
+ * Записанные данные переживают аварийное завершение процесса (они уже в
+ * страничном кэше ОС). На диск сегменты сбрасываются при закрытии хранилища,
+ * а с сохранностью STORAGE_DURABILITY_DISK - ещё и в конце каждой операции
+ * записи, например после каждого пакета put_messages.
+ *
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <functional>
+
+#include "storage.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+/// Размер одного сегмента журнала
+#define LOG_SEGMENT_SIZE (16 * 1024 * 1024)
+
+/// Выравнивание записей в сегменте
+#define LOG_RECORD_ALIGN 8
+
+/// Типы записей журнала
+enum log_record_type {
+  LOG_RECORD_USER = 1, ///< Регистрация пользователя
+  LOG_RECORD_MESSAGE = 2, ///< Сообщение
+  LOG_RECORD_READ = 3, ///< Прочитанное сообщение переписки
+  LOG_RECORD_GROUP = 4, ///< Создание группы
+  LOG_RECORD_MEMBER = 5, ///< Вступление в группу или выход из неё
+  LOG_RECORD_CHANGE = 6, ///< Правка или удаление сообщения
+  LOG_RECORD_COMPACT = 7 ///< Сжатие изменений
+};
+
+/// Флаги записей журнала
+enum log_record_flag {
+  LOG_FLAG_GROUP = 1, ///< Сообщение адресовано группе
+  LOG_FLAG_JOINED = 2, ///< Запись MEMBER - вступление, без флага - выход
+  LOG_FLAG_DELETED = 4, ///< Запись CHANGE - удаление, без флага - правка
+  LOG_FLAG_KEY = 8 ///< Запись MESSAGE: за текстом следует ключ повтора
+};
+
+/// Заголовок записи журнала. За ним следуют данные записи
+struct log_record {
+  uint32_t checksum; ///< Контрольная сумма записи без этого поля
+  uint32_t size; ///< Размер записи с заголовком и выравниванием
+  uint32_t type; ///< enum log_record_type
+  uint32_t batch; ///< Количество следующих записей того же put_messages
+  /// Индекс отправителя (пользователя для USER, читателя для READ, группы
+  /// для GROUP, участника для MEMBER, автора изменения для CHANGE)
+  uint32_t from;
+  /// Индекс получателя (собеседника для READ, создателя для GROUP, группы
+  /// для MEMBER и сообщения группе)
+  uint32_t to;
+  uint32_t length; ///< Длина текста сообщения (имени для USER и GROUP)
+  uint32_t flags; ///< enum log_record_flag
+  /// Уникальный идентификатор сообщения (курсор для READ, GROUP и MEMBER,
+  /// изменённое сообщение для CHANGE, последняя сжатая версия для COMPACT)
+  int64_t message_id;
+  int64_t time; ///< Время получения сообщения сервером (UTC Unix)
+};
+
+/// Отображённый в память сегмент журнала
+struct log_segment {
+  char * base; ///< Начало отображения
+#ifdef _WIN32
+  HANDLE file; ///< Файл сегмента
+  HANDLE mapping; ///< Отображение файла
+#endif
+};
+
+/// Участие пользователя в группе
+struct log_membership {
+  uint32_t group; ///< Индекс группы
+  int64_t joined; ///< Последнее сообщение при вступлении
+  int64_t left; ///< Последнее сообщение при выходе или STORAGE_CURSOR_MAX
+};
+
+/// Пользователь журнала
+struct log_user {
+  std::string name; ///< Имя пользователя
+  std::string pass_hash; ///< Пароль пользователя
+  /// Личные сообщения пользователя по возрастанию
+  std::vector<int64_t> messages;
+  /// Участие в группах по времени вступления
+  std::vector<log_membership> groups;
+};
+
+/// Группа журнала
+struct log_group {
+  std::string name; ///< Имя группы
+  std::string address; ///< Адресат сообщений группы: префикс и имя
+  std::vector<int64_t> messages; ///< Сообщения группы по возрастанию
+};
+
+/// Данные хранилища-журнала
+struct log_storage {
+  std::string path; ///< Префикс имён файлов сегментов
+  std::vector<log_segment> segments; ///< Сегменты по порядку
+  size_t used; ///< Занятая часть последнего сегмента
+  /// Индексы пользователей по имени
+  std::unordered_map<std::string, uint32_t> user_index;
+  std::vector<log_user> users; ///< Пользователи
+  /// Записи сообщений в сегментах, индекс message_id - 1
+  std::vector<const struct log_record *> messages;
+  /// Сообщения пар собеседников по возрастанию, ключ - log_pair
+  std::unordered_map<uint64_t, std::vector<int64_t> > conversations;
+  /// Прочитанные сообщения, ключ - (пользователь << 32) | собеседник
+  std::unordered_map<uint64_t, int64_t> read_cursors;
+  /// Индексы групп по имени
+  std::unordered_map<std::string, uint32_t> group_index;
+  std::vector<log_group> groups; ///< Группы
+  /// Записи несжатых изменений, индекс - версия - horizon - 1
+  std::vector<const struct log_record *> changes;
+  /// Последнее изменение каждого изменённого сообщения
+  std::unordered_map<int64_t, const struct log_record *> edits;
+  int64_t horizon; ///< Последняя сжатая версия
+  /// Сообщения по ключу повтора отправки, ключ - log_key
+  std::unordered_map<std::string, int64_t> client_keys;
+  int sync; ///< Каждая операция записи сбрасывает журнал на диск
+  size_t synced; ///< Часть последнего сегмента, сброшенная на диск
+};
+
+
+/**
+ * @brief Функция возвращает ключ пары собеседников, не зависящий от порядка
+ */
+static uint64_t log_pair(uint32_t a,
+                         uint32_t b){
+  return a < b ? ((uint64_t) a << 32) | b : ((uint64_t) b << 32) | a;
+}
+
+
+/**
+ * @brief Функция возвращает ключ повтора отправки, уникальный среди всех 
+ * отправителей
+ */
+static std::string log_key(uint32_t from,
+                           const char * client_msg_id){
+  return std::string((const char *) &from, sizeof(from)) + client_msg_id;
+}
+
+
+/**
+ * @brief Функция считает контрольную сумму записи (FNV-1a)
+ */
+static uint32_t log_checksum(const struct log_record * record){
+  const unsigned char * p = (const unsigned char *) &record->size;
+  const unsigned char * end = (const unsigned char *) record + record->size;
+  uint32_t hash = 2166136261U;
+
+  for (; p < end; p++){
+    hash = (hash ^ *p) * 16777619U;
+  }
+  return hash;
+}
+
+
+/**
+ * @brief Функция формирует имя файла сегмента
+ */
+static std::string log_segment_name(const struct log_storage * data,
+                                    size_t index){
+  char name[32];
+  snprintf(name, sizeof(name), ".%06d.log", (int) index);
+  return data->path + name;
+}
+
+
+/**
+ * @brief Функция отображает файл сегмента в память
+ *
+ * @param[in] name Имя файла сегмента
+ * @param[in] create Создать файл, если он не существует
+ * @param[out] segment Отображённый сегмент
+ * @retval 1 Сегмент отображён
+ * @retval 0 Файл не существует или не может быть отображён
+ */
+static int log_segment_map(const std::string & name,
+                           int create,
+                           struct log_segment * segment){
+#ifdef _WIN32
+  segment->file = CreateFileA(name.c_str(), GENERIC_READ | GENERIC_WRITE,
+                              FILE_SHARE_READ, NULL,
+                              create ? OPEN_ALWAYS : OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+  if (segment->file == INVALID_HANDLE_VALUE){
+    return 0;
+  }
+  // The mapping grows the file to the full segment size
+  segment->mapping = CreateFileMappingA(segment->file, NULL, PAGE_READWRITE,
+                                        0, LOG_SEGMENT_SIZE, NULL);
+  segment->base = segment->mapping == NULL ? NULL :
+    (char *) MapViewOfFile(segment->mapping, FILE_MAP_WRITE, 0, 0,
+                           LOG_SEGMENT_SIZE);
+  if (segment->base == NULL){
+    if (segment->mapping != NULL){
+      CloseHandle(segment->mapping);
+    }
+    CloseHandle(segment->file);
+    return 0;
+  }
+#else
+  int fd = open(name.c_str(), create ? O_RDWR | O_CREAT : O_RDWR, 0644);
+  if (fd < 0){
+    return 0;
+  }
+  void * base = MAP_FAILED;
+  if (ftruncate(fd, LOG_SEGMENT_SIZE) == 0){
+    base = mmap(NULL, LOG_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                fd, 0);
+  }
+  close(fd);
+  if (base == MAP_FAILED){
+    return 0;
+  }
+  segment->base = (char *) base;
+#endif
+  return 1;
+}
+
+
+/**
+ * @brief Функция сбрасывает сегмент на диск и освобождает отображение
+ */
+static void log_segment_unmap(struct log_segment * segment){
+#ifdef _WIN32
+  FlushViewOfFile(segment->base, 0);
+  UnmapViewOfFile(segment->base);
+  CloseHandle(segment->mapping);
+  CloseHandle(segment->file);
+#else
+  msync(segment->base, LOG_SEGMENT_SIZE, MS_SYNC);
+  munmap(segment->base, LOG_SEGMENT_SIZE);
+#endif
+  segment->base = NULL;
+}
+
+
+/**
+ * @brief Функция сбрасывает на диск часть сегмента от offset до end
+ */
+static void log_segment_sync(struct log_segment * segment,
+                             size_t offset,
+                             size_t end){
+#ifdef _WIN32
+  FlushViewOfFile(segment->base + offset, end - offset);
+  FlushFileBuffers(segment->file);
+#else
+  // msync takes a page-aligned start
+  size_t start = offset & ~((size_t) sysconf(_SC_PAGESIZE) - 1);
+  msync(segment->base + start, end - start, MS_SYNC);
+#endif
+}
+
+
+/**
+ * @brief Функция отбрасывает журнал начиная с позиции offset сегмента
+ * segment: хвост сегмента обнуляется, следующие сегменты удаляются
+ */
+static void log_truncate(struct log_storage * data,
+                         size_t segment,
+                         size_t offset){
+  memset(data->segments[segment].base + offset, 0, LOG_SEGMENT_SIZE - offset);
+  while (data->segments.size() > segment + 1){
+    log_segment_unmap(&data->segments.back());
+    remove(log_segment_name(data, data->segments.size() - 1).c_str());
+    data->segments.pop_back();
+  }
+  data->used = offset;
+}
+
+
+/**
+ * @brief Функция проверяет запись по адресу offset сегмента
+ *
+ * @retval NULL Записи нет (конец сегмента) или она повреждена
+ * @retval Указатель на запись
+ */
+static const struct log_record * log_record_at(const struct log_segment * segment,
+                                               size_t offset){
+  if (offset + sizeof(struct log_record) > LOG_SEGMENT_SIZE){
+    return NULL;
+  }
+  const struct log_record * record =
+    (const struct log_record *) (segment->base + offset);
+  size_t text = record->type == LOG_RECORD_USER ? 2 : 1;
+
+  if (record->size < sizeof(struct log_record) + record->length + text ||
+      record->size > LOG_SEGMENT_SIZE - offset ||
+      log_checksum(record) != record->checksum){
+    return NULL;
+  }
+  return record;
+}
+
+
+/**
+ * @brief Функция проверяет, что сообщение удалено
+ */
+static int log_is_deleted(const struct log_storage * data,
+                          int64_t message_id){
+  std::unordered_map<int64_t, const struct log_record *>::const_iterator it =
+    data->edits.find(message_id);
+  return it != data->edits.end() && (it->second->flags & LOG_FLAG_DELETED);
+}
+
+
+/**
+ * @brief Функция удаляет идентификатор из упорядоченного списка
+ */
+static void log_erase_id(std::vector<int64_t> * ids,
+                         int64_t message_id){
+  std::vector<int64_t>::iterator it =
+    std::lower_bound(ids->begin(), ids->end(), message_id);
+  if (it != ids->end() && *it == message_id){
+    ids->erase(it);
+  }
+}
+
+
+/**
+ * @brief Функция сжимает изменения до версии through: удалённые ими
+ * сообщения убираются из списков
+ */
+static void log_compact_index(struct log_storage * data,
+                              int64_t through){
+  size_t count = (size_t) (through - data->horizon);
+
+  for (size_t i = 0; i < count; i++){
+    const struct log_record * change = data->changes[i];
+    if (!(change->flags & LOG_FLAG_DELETED)){
+      continue;
+    }
+    const struct log_record * record =
+      data->messages[(size_t) change->message_id - 1];
+    if (record->flags & LOG_FLAG_GROUP){
+      log_erase_id(&data->groups[record->to].messages, change->message_id);
+      continue;
+    }
+    log_erase_id(&data->users[record->from].messages, change->message_id);
+    log_erase_id(&data->users[record->to].messages, change->message_id);
+    uint64_t pair = log_pair(record->from, record->to);
+    std::vector<int64_t> & ids = data->conversations[pair];
+    log_erase_id(&ids, change->message_id);
+    if (ids.empty()){
+      data->conversations.erase(pair);
+    }
+  }
+  data->changes.erase(data->changes.begin(), data->changes.begin() + count);
+  data->horizon = through;
+}
+
+
+/**
+ * @brief Функция проверяет, что прочитанная запись согласуется с журналом
+ *
+ * @param[in] data Хранилище
+ * @param[in] record Запись
+ * @param[in] pending Количество ещё не добавленных в индексы сообщений
+ * перед записью
+ */
+static int log_record_valid(const struct log_storage * data,
+                            const struct log_record * record,
+                            size_t pending){
+  if (record->type == LOG_RECORD_READ){
+    return record->batch == 0 && pending == 0 &&
+           record->from < data->users.size() && record->to < data->users.size();
+  }
+  if (record->type == LOG_RECORD_USER){
+    return record->batch == 0 && pending == 0 &&
+           record->from == data->users.size();
+  }
+  if (record->type == LOG_RECORD_GROUP){
+    return record->batch == 0 && pending == 0 &&
+           record->from == data->groups.size() &&
+           record->to < data->users.size();
+  }
+  if (record->type == LOG_RECORD_MEMBER){
+    return record->batch == 0 && pending == 0 &&
+           record->from < data->users.size() &&
+           record->to < data->groups.size();
+  }
+  if (record->type == LOG_RECORD_CHANGE){
+    return record->batch == 0 && pending == 0 && record->message_id >= 1 &&
+           record->message_id <= (int64_t) data->messages.size() &&
+           data->messages[(size_t) record->message_id - 1]->from ==
+             record->from &&
+           !log_is_deleted(data, record->message_id);
+  }
+  if (record->type == LOG_RECORD_COMPACT){
+    return record->batch == 0 && pending == 0 &&
+           record->message_id >= data->horizon &&
+           record->message_id <=
+             data->horizon + (int64_t) data->changes.size();
+  }
+  return record->type == LOG_RECORD_MESSAGE &&
+         record->message_id == (int64_t) (data->messages.size() + pending + 1) &&
+         record->from < data->users.size() &&
+         record->to < (record->flags & LOG_FLAG_GROUP ? data->groups.size() :
+                                                        data->users.size());
+}
+
+
+/**
+ * @brief Функция добавляет прочитанную запись в индексы
+ */
+static void log_index_record(struct log_storage * data,
+                             const struct log_record * record){
+  const char * text = (const char *) (record + 1);
+
+  if (record->type == LOG_RECORD_USER){
+    data->user_index[std::string(text, record->length)] = record->from;
+    data->users.push_back(log_user());
+    data->users.back().name.assign(text, record->length);
+    data->users.back().pass_hash = text + record->length + 1;
+    return;
+  }
+  if (record->type == LOG_RECORD_READ){
+    data->read_cursors[((uint64_t) record->from << 32) | record->to] =
+      record->message_id;
+    return;
+  }
+  if (record->type == LOG_RECORD_GROUP){
+    struct log_membership membership = {
+      record->from, record->message_id, STORAGE_CURSOR_MAX
+    };
+    data->group_index[std::string(text, record->length)] = record->from;
+    data->groups.push_back(log_group());
+    data->groups.back().name.assign(text, record->length);
+    data->groups.back().address = STORAGE_GROUP_PREFIX +
+                                  data->groups.back().name;
+    data->users[record->to].groups.push_back(membership);
+    return;
+  }
+  if (record->type == LOG_RECORD_MEMBER){
+    std::vector<log_membership> & groups = data->users[record->from].groups;
+    if (record->flags & LOG_FLAG_JOINED){
+      struct log_membership membership = {
+        record->to, record->message_id, STORAGE_CURSOR_MAX
+      };
+      groups.push_back(membership);
+      return;
+    }
+    for (size_t i = 0; i < groups.size(); i++){
+      if (groups[i].group == record->to &&
+          groups[i].left == STORAGE_CURSOR_MAX){
+        groups[i].left = record->message_id;
+      }
+    }
+    return;
+  }
+  if (record->type == LOG_RECORD_CHANGE){
+    data->changes.push_back(record);
+    data->edits[record->message_id] = record;
+    return;
+  }
+  if (record->type == LOG_RECORD_COMPACT){
+    log_compact_index(data, record->message_id);
+    return;
+  }
+  data->messages.push_back(record);
+  if (record->flags & LOG_FLAG_KEY){
+    data->client_keys.insert(std::make_pair(
+      log_key(record->from, text + record->length + 1), record->message_id));
+  }
+  // Stored once, members find it through their memberships
+  if (record->flags & LOG_FLAG_GROUP){
+    data->groups[record->to].messages.push_back(record->message_id);
+    return;
+  }
+  data->users[record->from].messages.push_back(record->message_id);
+  if (record->to != record->from){
+    data->users[record->to].messages.push_back(record->message_id);
+  }
+  data->conversations[log_pair(record->from, record->to)].push_back(
+    record->message_id);
+}
+
+
+/**
+ * @brief Функция читает журнал и строит индексы
+ *
+ * Чтение останавливается на первой записи, которая не прошла проверку, или
+ * на незавершённом put_messages. Журнал с этого места отбрасывается. Записи
+ * одного put_messages добавляются в индексы только вместе.
+ */
+static void log_recover(struct log_storage * data){
+  std::vector<const struct log_record *> batch;
+  size_t batch_segment = 0;
+  size_t batch_offset = 0;
+  size_t segment = 0;
+  size_t offset = 0;
+
+  for (;;){
+    const struct log_record * record =
+      log_record_at(&data->segments[segment], offset);
+    if (record == NULL){
+      // A record that did not fit was written to the next segment
+      const struct log_record * tail =
+        (const struct log_record *) (data->segments[segment].base + offset);
+      if (segment + 1 < data->segments.size() &&
+          (offset + sizeof(struct log_record) > LOG_SEGMENT_SIZE ||
+           tail->size == 0)){
+        segment++;
+        offset = 0;
+        continue;
+      }
+      break;
+    }
+    if (!log_record_valid(data, record, batch.size()) ||
+        (!batch.empty() && batch.back()->batch != record->batch + 1)){
+      break;
+    }
+    if (batch.empty()){
+      batch_segment = segment;
+      batch_offset = offset;
+    }
+    batch.push_back(record);
+    offset += record->size;
+    if (record->batch != 0){
+      continue;
+    }
+    for (size_t i = 0; i < batch.size(); i++){
+      log_index_record(data, batch[i]);
+    }
+    batch.clear();
+  }
+  if (!batch.empty()){
+    log_truncate(data, batch_segment, batch_offset);
+  } else {
+    log_truncate(data, segment, offset);
+  }
+}
+
+
+/**
+ * @brief Функция возвращает размер записи с данными длиной length
+ */
+static size_t log_record_size(size_t length){
+  size_t size = sizeof(struct log_record) + length;
+  return (size + LOG_RECORD_ALIGN - 1) & ~(size_t) (LOG_RECORD_ALIGN - 1);
+}
+
+
+/**
+ * @brief Функция обеспечивает место для записей общим размером size в 
+ * последнем сегменте, при необходимости создавая новый сегмент
+ *
+ * @retval 1 Место есть
+ * @retval 0 Не удалось создать новый сегмент
+ */
+static int log_reserve(struct log_storage * data,
+                       size_t size){
+  if (data->used + size <= LOG_SEGMENT_SIZE){
+    return 1;
+  }
+  struct log_segment segment;
+  if (size > LOG_SEGMENT_SIZE ||
+      !log_segment_map(log_segment_name(data, data->segments.size()), 1,
+                       &segment)){
+    return 0;
+  }
+  data->segments.push_back(segment);
+  data->used = 0;
+  data->synced = 0;
+  return 1;
+}
+
+
+/**
+ * @brief Функция дописывает запись в конец журнала. Место под запись должно
+ * быть обеспечено log_reserve
+ *
+ * @param[in] data Хранилище
+ * @param[in] header Заголовок записи, поля checksum и size заполняются
+ * @param[in] text Данные записи
+ * @param[in] text_len Длина данных записи
+ * @return Указатель на запись
+ */
+static const struct log_record * log_append(struct log_storage * data,
+                                            struct log_record * header,
+                                            const char * text,
+                                            size_t text_len){
+  size_t size = log_record_size(text_len);
+  char * p = data->segments.back().base + data->used;
+  struct log_record * record = (struct log_record *) p;
+
+  // The tail of a segment is zero, so the padding is zero too
+  memcpy(p + sizeof(struct log_record), text, text_len);
+  header->size = (uint32_t) size;
+  header->checksum = 0;
+  *record = *header;
+  record->checksum = log_checksum(record);
+  data->used += size;
+  return record;
+}
+
+
+/**
+ * @brief Функция сбрасывает на диск записи, дописанные после прошлого 
+ * сброса, если каждая операция записи должна дойти до диска
+ *
+ * Операция записи дописывает записи в один сегмент (см. log_reserve), 
+ * поэтому достаточно сбросить хвост последнего сегмента.
+ */
+static void log_sync(struct log_storage * data){
+  if (data->sync && data->synced < data->used){
+    log_segment_sync(&data->segments.back(), data->synced, data->used);
+    data->synced = data->used;
+  }
+}
+
+
+/**
+ * @brief Функция находит пользователя по имени
+ *
+ * @retval NULL Пользователь не найден
+ * @retval Указатель на индекс пользователя
+ */
+static const uint32_t * log_find_user(const struct log_storage * data,
+                                      const char * user){
+  std::unordered_map<std::string, uint32_t>::const_iterator it =
+    data->user_index.find(user);
+  return it == data->user_index.end() ? NULL : &it->second;
+}
+
+
+/**
+ * @brief Функция находит группу по адресату сообщения
+ *
+ * @retval NULL Адресат - не группа или группа не найдена
+ * @retval Указатель на индекс группы
+ */
+static const uint32_t * log_find_group(const struct log_storage * data,
+                                       const char * to){
+  if (to[0] != STORAGE_GROUP_PREFIX){
+    return NULL;
+  }
+  std::unordered_map<std::string, uint32_t>::const_iterator it =
+    data->group_index.find(to + 1);
+  return it == data->group_index.end() ? NULL : &it->second;
+}
+
+
+/**
+ * @brief Функция проверяет, что пользователь сейчас состоит в группе
+ */
+static int log_is_member(const struct log_storage * data,
+                         uint32_t user,
+                         uint32_t group){
+  const std::vector<log_membership> & groups = data->users[user].groups;
+
+  for (size_t i = 0; i < groups.size(); i++){
+    if (groups[i].group == group && groups[i].left == STORAGE_CURSOR_MAX){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+/**
+ * @brief Функция сбрасывает сегменты на диск и освобождает хранилище
+ */
+static void log_close(struct storage * st){
+  struct log_storage * data = (struct log_storage *) st->data;
+
+  if (data == NULL){
+    return;
+  }
+  for (size_t i = 0; i < data->segments.size(); i++){
+    log_segment_unmap(&data->segments[i]);
+  }
+  delete data;
+  st->data = NULL;
+}
+
+
+/**
+ * @brief Функция открывает журнал, а если он не существует, то создаёт новый
+ *
+ * @param[in] st Хранилище
+ * @param[in] path Префикс имён файлов сегментов
+ * @retval STORAGE_OK Журнал открыт
+ * @retval STORAGE_ERROR Сегмент не может быть отображён в память
+ */
+static int log_open(struct storage * st, const char * path){
+  struct log_storage * data = new log_storage;
+  struct log_segment segment;
+
+  data->path = path;
+  data->used = 0;
+  data->horizon = 0;
+  data->sync = storage_durability(&storage_log_vtable) == 
+               STORAGE_DURABILITY_DISK;
+  st->data = data;
+  while (log_segment_map(log_segment_name(data, data->segments.size()), 0,
+                         &segment)){
+    data->segments.push_back(segment);
+  }
+  if (data->segments.empty()){
+    if (!log_segment_map(log_segment_name(data, 0), 1, &segment)){
+      log_close(st);
+      return STORAGE_ERROR;
+    }
+    data->segments.push_back(segment);
+  }
+  log_recover(data);
+  data->synced = data->used;
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция находит пароль пользователя
+ */
+static int log_lookup_user(struct storage * st,
+                           const char * user,
+                           char * pass_hash,
+                           size_t pass_hash_len){
+  struct log_storage * data = (struct log_storage *) st->data;
+  const uint32_t * found = log_find_user(data, user);
+
+  if (found == NULL){
+    return STORAGE_NOT_FOUND;
+  }
+  if (pass_hash != NULL){
+    strncpy(pass_hash, data->users[*found].pass_hash.c_str(),
+            pass_hash_len - 1);
+    pass_hash[pass_hash_len - 1] = '\0';
+  }
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция регистрирует пользователя
+ */
+static int log_create_user(struct storage * st,
+                           const char * user,
+                           const char * pass_hash){
+  struct log_storage * data = (struct log_storage *) st->data;
+  struct log_record header;
+
+  if (log_find_user(data, user) != NULL){
+    return STORAGE_EXISTS;
+  }
+  // Name and password are stored as two strings
+  std::string text = std::string(user) + '\0' + pass_hash + '\0';
+  if (!log_reserve(data, log_record_size(text.size()))){
+    return STORAGE_ERROR;
+  }
+  memset(&header, 0, sizeof(header));
+  header.type = LOG_RECORD_USER;
+  header.from = (uint32_t) data->users.size();
+  header.length = (uint32_t) strlen(user);
+  log_append(data, &header, text.data(), text.size());
+  data->user_index[user] = header.from;
+  data->users.push_back(log_user());
+  data->users.back().name = user;
+  data->users.back().pass_hash = pass_hash;
+  log_sync(data);
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция дописывает сообщения в журнал. Если хотя бы один
+ * пользователь не найден, не добавляется ни одно сообщение
+ */
+static int log_put_messages(struct storage * st,
+                            struct storage_message * messages,
+                            int count){
+  struct log_storage * data = (struct log_storage *) st->data;
+  struct log_record header;
+  int i;
+
+  size_t size = 0;
+
+  for (i = 0; i < count; i++){
+    const uint32_t * from = log_find_user(data, messages[i].from);
+    const uint32_t * group = log_find_group(data, messages[i].to);
+    if (from == NULL ||
+        (group == NULL && log_find_user(data, messages[i].to) == NULL) ||
+        (group != NULL && !log_is_member(data, *from, *group))){
+      return STORAGE_NOT_FOUND;
+    }
+    if (messages[i].client_msg_id != NULL){
+      std::unordered_map<std::string, int64_t>::const_iterator it =
+        data->client_keys.find(log_key(*from, messages[i].client_msg_id));
+      if (it != data->client_keys.end()){
+        messages[i].message_id = it->second;
+        return STORAGE_EXISTS;
+      }
+    }
+    size += log_record_size(strlen(messages[i].message) + 1 +
+                            (messages[i].client_msg_id != NULL ?
+                             strlen(messages[i].client_msg_id) + 1 : 0));
+  }
+  // The whole batch goes to one segment, so appending it cannot fail halfway
+  if (!log_reserve(data, size)){
+    return STORAGE_ERROR;
+  }
+  memset(&header, 0, sizeof(header));
+  header.type = LOG_RECORD_MESSAGE;
+  for (i = 0; i < count; i++){
+    const uint32_t * group = log_find_group(data, messages[i].to);
+    header.batch = (uint32_t) (count - i - 1);
+    header.from = *log_find_user(data, messages[i].from);
+    header.to = group != NULL ? *group : *log_find_user(data, messages[i].to);
+    header.flags = group != NULL ? LOG_FLAG_GROUP : 0;
+    header.length = (uint32_t) strlen(messages[i].message);
+    header.message_id = (int64_t) data->messages.size() + 1;
+    header.time = messages[i].time;
+    const char * text = messages[i].message;
+    size_t text_len = header.length + 1;
+    std::string keyed;
+    if (messages[i].client_msg_id != NULL){
+      // Text and key are stored as two strings
+      keyed.assign(text, text_len);
+      keyed.append(messages[i].client_msg_id,
+                   strlen(messages[i].client_msg_id) + 1);
+      text = keyed.data();
+      text_len = keyed.size();
+      header.flags |= LOG_FLAG_KEY;
+    }
+    const struct log_record * record =
+      log_append(data, &header, text, text_len);
+    messages[i].message_id = header.message_id;
+    log_index_record(data, record);
+  }
+  log_sync(data);
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция возвращает текущий текст сообщения
+ *
+ * @retval NULL Сообщение удалено
+ * @retval Текст последней правки или исходный текст
+ */
+static const char * log_text(const struct log_storage * data,
+                             int64_t message_id){
+  std::unordered_map<int64_t, const struct log_record *>::const_iterator it =
+    data->edits.find(message_id);
+
+  if (it == data->edits.end()){
+    return (const char *) (data->messages[(size_t) message_id - 1] + 1);
+  }
+  return it->second->flags & LOG_FLAG_DELETED ? NULL :
+                                                (const char *) (it->second + 1);
+}
+
+
+/**
+ * @brief Функция передаёт сообщение с данным идентификатором в cb
+ */
+static void log_emit(const struct log_storage * data,
+                     int64_t message_id,
+                     storage_message_cb cb,
+                     void * arg){
+  const struct log_record * record = data->messages[(size_t) message_id - 1];
+  struct storage_message message;
+
+  message.message_id = message_id;
+  message.from = data->users[record->from].name.c_str();
+  message.to = record->flags & LOG_FLAG_GROUP ?
+               data->groups[record->to].address.c_str() :
+               data->users[record->to].name.c_str();
+  message.message = log_text(data, message_id);
+  message.time = record->time;
+  message.client_msg_id = NULL;
+  cb(&message, arg);
+}
+
+
+/**
+ * @brief Функция обходит упорядоченный список сообщений от курсора
+ */
+static void log_scan_ids(const struct log_storage * data,
+                         const std::vector<int64_t> & ids,
+                         int64_t cursor,
+                         int direction,
+                         int limit,
+                         storage_message_cb cb,
+                         void * arg){
+  if (direction == STORAGE_SCAN_FORWARD){
+    std::vector<int64_t>::const_iterator it =
+      std::upper_bound(ids.begin(), ids.end(), cursor);
+    for (; it != ids.end() && limit > 0; ++it, limit--){
+      log_emit(data, *it, cb, arg);
+    }
+  } else {
+    std::vector<int64_t>::const_iterator it =
+      std::lower_bound(ids.begin(), ids.end(), cursor);
+    for (; it != ids.begin() && limit > 0; limit--){
+      --it;
+      log_emit(data, *it, cb, arg);
+    }
+  }
+}
+
+
+/**
+ * @brief Функция добавляет в ids не больше limit идентификаторов
+ * упорядоченного списка из промежутка (after, through], ближайших к курсору
+ */
+static void log_collect_ids(const std::vector<int64_t> & list,
+                            int64_t after,
+                            int64_t through,
+                            int direction,
+                            int limit,
+                            std::vector<int64_t> * ids){
+  if (direction == STORAGE_SCAN_FORWARD){
+    std::vector<int64_t>::const_iterator it =
+      std::upper_bound(list.begin(), list.end(), after);
+    for (; it != list.end() && *it <= through && limit > 0; ++it, limit--){
+      ids->push_back(*it);
+    }
+  } else {
+    std::vector<int64_t>::const_iterator it =
+      std::upper_bound(list.begin(), list.end(), through);
+    for (; it != list.begin() && it[-1] > after && limit > 0; limit--){
+      ids->push_back(*--it);
+    }
+  }
+}
+
+
+/**
+ * @brief Функция добавляет в ids сообщения группы, видимые в пределах
+ * участия, не больше limit от курсора
+ */
+static void log_collect_group(const struct log_storage * data,
+                              const struct log_membership * membership,
+                              int64_t cursor,
+                              int direction,
+                              int limit,
+                              std::vector<int64_t> * ids){
+  const std::vector<int64_t> & list = data->groups[membership->group].messages;
+
+  if (direction == STORAGE_SCAN_FORWARD){
+    log_collect_ids(list, std::max(cursor, membership->joined),
+                    membership->left, direction, limit, ids);
+  } else {
+    log_collect_ids(list, membership->joined,
+                    std::min(cursor - 1, membership->left), direction, limit,
+                    ids);
+  }
+}
+
+
+/**
+ * @brief Функция упорядочивает собранные из нескольких списков сообщения и
+ * передаёт в cb первые limit из них
+ */
+static void log_emit_merged(const struct log_storage * data,
+                            std::vector<int64_t> * ids,
+                            int direction,
+                            int limit,
+                            storage_message_cb cb,
+                            void * arg){
+  if (direction == STORAGE_SCAN_FORWARD){
+    std::sort(ids->begin(), ids->end());
+  } else {
+    std::sort(ids->begin(), ids->end(), std::greater<int64_t>());
+  }
+  ids->erase(std::unique(ids->begin(), ids->end()), ids->end());
+  for (size_t i = 0; i < ids->size() && (int) i < limit; i++){
+    log_emit(data, (*ids)[i], cb, arg);
+  }
+}
+
+
+/**
+ * @brief Функция обходит сообщения пользователя от курсора
+ *
+ * Каждый список (личные сообщения и каждое участие в группе) даёт не больше
+ * limit сообщений от курсора, первые limit из их объединения - ответ.
+ */
+static int log_scan_messages(struct storage * st,
+                             const char * user,
+                             int64_t cursor,
+                             int direction,
+                             int limit,
+                             storage_message_cb cb,
+                             void * arg){
+  struct log_storage * data = (struct log_storage *) st->data;
+  const uint32_t * found = log_find_user(data, user);
+  std::vector<int64_t> ids;
+
+  if (found == NULL){
+    return STORAGE_OK;
+  }
+  const struct log_user & found_user = data->users[*found];
+  if (found_user.groups.empty()){
+    log_scan_ids(data, found_user.messages, cursor, direction, limit, cb, arg);
+    return STORAGE_OK;
+  }
+  if (direction == STORAGE_SCAN_FORWARD){
+    log_collect_ids(found_user.messages, cursor, STORAGE_CURSOR_MAX,
+                    direction, limit, &ids);
+  } else {
+    log_collect_ids(found_user.messages, 0, cursor - 1, direction, limit,
+                    &ids);
+  }
+  for (size_t i = 0; i < found_user.groups.size(); i++){
+    log_collect_group(data, &found_user.groups[i], cursor, direction, limit,
+                      &ids);
+  }
+  log_emit_merged(data, &ids, direction, limit, cb, arg);
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция обходит сообщения пары собеседников от курсора
+ */
+static int log_scan_conversation(struct storage * st,
+                                 const char * user,
+                                 const char * peer,
+                                 int64_t cursor,
+                                 int direction,
+                                 int limit,
+                                 storage_message_cb cb,
+                                 void * arg){
+  struct log_storage * data = (struct log_storage *) st->data;
+  const uint32_t * a = log_find_user(data, user);
+  const uint32_t * b = log_find_user(data, peer);
+
+  if (peer[0] == STORAGE_GROUP_PREFIX){
+    const uint32_t * group = log_find_group(data, peer);
+    std::vector<int64_t> ids;
+    if (group == NULL){
+      return STORAGE_NOT_FOUND;
+    }
+    if (a == NULL){
+      return STORAGE_OK;
+    }
+    const std::vector<log_membership> & groups = data->users[*a].groups;
+    for (size_t i = 0; i < groups.size(); i++){
+      if (groups[i].group == *group){
+        log_collect_group(data, &groups[i], cursor, direction, limit, &ids);
+      }
+    }
+    log_emit_merged(data, &ids, direction, limit, cb, arg);
+    return STORAGE_OK;
+  }
+  if (b == NULL){
+    return STORAGE_NOT_FOUND;
+  }
+  if (a == NULL){
+    return STORAGE_OK;
+  }
+  std::unordered_map<uint64_t, std::vector<int64_t> >::const_iterator it =
+    data->conversations.find(log_pair(*a, *b));
+  if (it != data->conversations.end()){
+    log_scan_ids(data, it->second, cursor, direction, limit, cb, arg);
+  }
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция передаёт в cb сводку переписки user с peer
+ *
+ * @param[in] data Данные хранилища
+ * @param[in] user Индекс пользователя
+ * @param[in] peer Индекс собеседника
+ * @param[in] ids Сообщения переписки по возрастанию
+ * @param[in] cb Функция, принимающая сводку
+ * @param[in] arg Аргумент cb
+ */
+static void log_emit_conversation(const struct log_storage * data,
+                                  uint32_t user,
+                                  uint32_t peer,
+                                  const std::vector<int64_t> & ids,
+                                  storage_conversation_cb cb,
+                                  void * arg){
+  const struct log_record * last = data->messages[(size_t) ids.back() - 1];
+  std::unordered_map<uint64_t, int64_t>::const_iterator it =
+    data->read_cursors.find(((uint64_t) user << 32) | peer);
+  struct storage_conversation conversation;
+
+  conversation.user = data->users[user].name.c_str();
+  conversation.peer = data->users[peer].name.c_str();
+  conversation.last.message_id = ids.back();
+  conversation.last.from = data->users[last->from].name.c_str();
+  conversation.last.to = data->users[last->to].name.c_str();
+  conversation.last.message = log_text(data, ids.back());
+  conversation.last.time = last->time;
+  conversation.read = it == data->read_cursors.end() ? 0 : it->second;
+  conversation.unread = 0;
+  // Only the unread tail is walked
+  for (size_t i = ids.size(); i > 0 && ids[i - 1] > conversation.read; i--){
+    if (user != peer && data->messages[(size_t) ids[i - 1] - 1]->from == peer){
+      conversation.unread++;
+    }
+  }
+  cb(&conversation, arg);
+}
+
+
+/**
+ * @brief Функция находит последнее сообщение каждого пользователя
+ */
+static int log_scan_latest(struct storage * st,
+                           storage_latest_cb cb,
+                           void * arg){
+  struct log_storage * data = (struct log_storage *) st->data;
+
+  for (size_t i = 0; i < data->users.size(); i++){
+    if (!data->users[i].messages.empty()){
+      cb(data->users[i].name.c_str(), data->users[i].messages.back(), arg);
+    }
+  }
+  for (size_t i = 0; i < data->groups.size(); i++){
+    if (!data->groups[i].messages.empty()){
+      cb(data->groups[i].address.c_str(), data->groups[i].messages.back(), arg);
+    }
+  }
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция дописывает в журнал последнее прочитанное сообщение
+ * переписки
+ */
+static int log_put_read_cursor(struct storage * st,
+                               const char * user,
+                               const char * peer,
+                               int64_t message_id){
+  struct log_storage * data = (struct log_storage *) st->data;
+  const uint32_t * a = log_find_user(data, user);
+  const uint32_t * b = log_find_user(data, peer);
+  struct log_record header;
+
+  if (a == NULL || b == NULL){
+    return STORAGE_NOT_FOUND;
+  }
+  if (!log_reserve(data, log_record_size(1))){
+    return STORAGE_ERROR;
+  }
+  memset(&header, 0, sizeof(header));
+  header.type = LOG_RECORD_READ;
+  header.from = *a;
+  header.to = *b;
+  header.message_id = message_id;
+  log_index_record(data, log_append(data, &header, "", 1));
+  log_sync(data);
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция передаёт в cb сводки всех переписок обоих собеседников
+ */
+static int log_scan_conversations(struct storage * st,
+                                  storage_conversation_cb cb,
+                                  void * arg){
+  struct log_storage * data = (struct log_storage *) st->data;
+  std::unordered_map<uint64_t, std::vector<int64_t> >::const_iterator it;
+
+  for (it = data->conversations.begin(); it != data->conversations.end();
+       ++it){
+    uint32_t a = (uint32_t) (it->first >> 32);
+    uint32_t b = (uint32_t) (it->first & 0xffffffff);
+    log_emit_conversation(data, a, b, it->second, cb, arg);
+    if (a != b){
+      log_emit_conversation(data, b, a, it->second, cb, arg);
+    }
+  }
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция дописывает в журнал создание группы, создатель становится
+ * её участником
+ */
+static int log_create_group(struct storage * st,
+                            const char * group,
+                            const char * user){
+  struct log_storage * data = (struct log_storage *) st->data;
+  const uint32_t * found = log_find_user(data, user);
+  struct log_record header;
+
+  if (data->group_index.count(group)){
+    return STORAGE_EXISTS;
+  }
+  if (found == NULL){
+    return STORAGE_NOT_FOUND;
+  }
+  if (!log_reserve(data, log_record_size(strlen(group) + 1))){
+    return STORAGE_ERROR;
+  }
+  memset(&header, 0, sizeof(header));
+  header.type = LOG_RECORD_GROUP;
+  header.from = (uint32_t) data->groups.size();
+  header.to = *found;
+  header.length = (uint32_t) strlen(group);
+  header.message_id = (int64_t) data->messages.size();
+  log_index_record(data, log_append(data, &header, group, header.length + 1));
+  log_sync(data);
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция дописывает в журнал вступление пользователя в группу или
+ * выход из неё
+ */
+static int log_put_member(struct storage * st,
+                          const char * group,
+                          const char * user,
+                          int joined,
+                          int64_t * cursor){
+  struct log_storage * data = (struct log_storage *) st->data;
+  const uint32_t * found = log_find_user(data, user);
+  std::unordered_map<std::string, uint32_t>::const_iterator it =
+    data->group_index.find(group);
+  struct log_record header;
+
+  if (found == NULL || it == data->group_index.end()){
+    return STORAGE_NOT_FOUND;
+  }
+  if (log_is_member(data, *found, it->second) == (joined != 0)){
+    return STORAGE_EXISTS;
+  }
+  if (!log_reserve(data, log_record_size(1))){
+    return STORAGE_ERROR;
+  }
+  memset(&header, 0, sizeof(header));
+  header.type = LOG_RECORD_MEMBER;
+  header.from = *found;
+  header.to = it->second;
+  header.flags = joined ? LOG_FLAG_JOINED : 0;
+  header.message_id = (int64_t) data->messages.size();
+  log_index_record(data, log_append(data, &header, "", 1));
+  *cursor = header.message_id;
+  log_sync(data);
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция передаёт в cb все участия в группах
+ */
+static int log_scan_members(struct storage * st,
+                            storage_membership_cb cb,
+                            void * arg){
+  struct log_storage * data = (struct log_storage *) st->data;
+  struct storage_membership membership;
+
+  for (size_t i = 0; i < data->users.size(); i++){
+    for (size_t j = 0; j < data->users[i].groups.size(); j++){
+      const log_membership & stored = data->users[i].groups[j];
+      membership.group = data->groups[stored.group].name.c_str();
+      membership.user = data->users[i].name.c_str();
+      membership.joined = stored.joined;
+      membership.left = stored.left;
+      cb(&membership, arg);
+    }
+  }
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция возвращает адресата сообщения записи
+ */
+static const char * log_address(const struct log_storage * data,
+                                const struct log_record * record){
+  return record->flags & LOG_FLAG_GROUP ?
+         data->groups[record->to].address.c_str() :
+         data->users[record->to].name.c_str();
+}
+
+
+/**
+ * @brief Функция дописывает в журнал правку или удаление сообщения
+ * отправителя
+ */
+static int log_put_change(struct storage * st,
+                          struct storage_change * change){
+  struct log_storage * data = (struct log_storage *) st->data;
+  const uint32_t * from = log_find_user(data, change->from);
+  const char * text = change->message != NULL ? change->message : "";
+  struct log_record header;
+
+  if (from == NULL || change->message_id < 1 ||
+      change->message_id > (int64_t) data->messages.size() ||
+      data->messages[(size_t) change->message_id - 1]->from != *from ||
+      log_is_deleted(data, change->message_id)){
+    return STORAGE_NOT_FOUND;
+  }
+  if (!log_reserve(data, log_record_size(strlen(text) + 1))){
+    return STORAGE_ERROR;
+  }
+  memset(&header, 0, sizeof(header));
+  header.type = LOG_RECORD_CHANGE;
+  header.from = *from;
+  header.flags = change->message == NULL ? LOG_FLAG_DELETED : 0;
+  header.length = (uint32_t) strlen(text);
+  header.message_id = change->message_id;
+  header.time = change->time;
+  log_index_record(data, log_append(data, &header, text, header.length + 1));
+  change->version = data->horizon + (int64_t) data->changes.size();
+  change->to = log_address(data,
+                           data->messages[(size_t) change->message_id - 1]);
+  log_sync(data);
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция передаёт в cb все несжатые изменения
+ */
+static int log_scan_changes(struct storage * st,
+                            int64_t * horizon,
+                            storage_change_cb cb,
+                            void * arg){
+  struct log_storage * data = (struct log_storage *) st->data;
+  struct storage_change change;
+
+  *horizon = data->horizon;
+  for (size_t i = 0; i < data->changes.size(); i++){
+    const struct log_record * record = data->changes[i];
+    change.version = data->horizon + (int64_t) i + 1;
+    change.message_id = record->message_id;
+    change.from = data->users[record->from].name.c_str();
+    change.to = log_address(data,
+                            data->messages[(size_t) record->message_id - 1]);
+    change.message = record->flags & LOG_FLAG_DELETED ?
+                     NULL : (const char *) (record + 1);
+    change.time = record->time;
+    cb(&change, arg);
+  }
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция дописывает в журнал сжатие изменений до версии through
+ */
+static int log_compact_changes(struct storage * st,
+                               int64_t through){
+  struct log_storage * data = (struct log_storage *) st->data;
+  struct log_record header;
+
+  through = std::min(through, data->horizon + (int64_t) data->changes.size());
+  if (through <= data->horizon){
+    return STORAGE_OK;
+  }
+  if (!log_reserve(data, log_record_size(1))){
+    return STORAGE_ERROR;
+  }
+  memset(&header, 0, sizeof(header));
+  header.type = LOG_RECORD_COMPACT;
+  header.message_id = through;
+  log_index_record(data, log_append(data, &header, "", 1));
+  log_sync(data);
+  return STORAGE_OK;
+}
+
+
+const struct storage_vtable storage_log_vtable = {
+  "log",
+  STORAGE_DURABILITY_PROCESS,
+  log_open,
+  log_close,
+  log_lookup_user,
+  log_create_user,
+  log_put_messages,
+  log_scan_messages,
+  log_scan_conversation,
+  log_scan_latest,
+  log_put_read_cursor,
+  log_scan_conversations,
+  log_create_group,
+  log_put_member,
+  log_scan_members,
+  log_put_change,
+  log_scan_changes,
+  log_compact_changes,
+  NULL
+};
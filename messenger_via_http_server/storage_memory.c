@@ -0,0 +1,817 @@
+/**
+ * @file
+ * @brief Хранилище в памяти процесса
+ *
+ * Сообщения хранятся в массиве, индекс которого равен message_id - 1. Для
+ * каждого пользователя и каждой пары собеседников хранится упорядоченный
+ * список идентификаторов сообщений, поэтому обход от курсора выполняется
+ * двоичным поиском. Сообщение группе хранится один раз в списке группы,
+ * сообщения пользователя сливаются из его списка и списков его групп в
+ * пределах участия. Удалённое сообщение остаётся в списках с пустым
+ * текстом, пока его изменение не будет сжато. Ключи повтора отправки 
+ * хранятся в таблице по отправителю и ключу. Данные
+ * не сохраняются между запусками, хранилище предназначено для измерения
+ * накладных расходов HTTP и цикла событий без базы данных.
+ *
+ */
+
+#include <string.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <functional>
+
+#include "storage.h"
+
+/// Участие пользователя в группе
+struct memory_membership {
+  size_t group; ///< Индекс группы
+  int64_t joined; ///< Последнее сообщение при вступлении
+  int64_t left; ///< Последнее сообщение при выходе или STORAGE_CURSOR_MAX
+};
+
+/// Пользователь хранилища в памяти
+struct memory_user {
+  std::string name; ///< Имя пользователя
+  std::string pass_hash; ///< Пароль пользователя
+  /// Личные сообщения пользователя по возрастанию
+  std::vector<int64_t> messages;
+  /// Участие в группах по времени вступления
+  std::vector<memory_membership> groups;
+};
+
+/// Группа хранилища в памяти
+struct memory_group {
+  std::string name; ///< Имя группы
+  std::string address; ///< Адресат сообщений группы: префикс и имя
+  std::vector<int64_t> messages; ///< Сообщения группы по возрастанию
+};
+
+/// Сообщение хранилища в памяти
+struct memory_message {
+  size_t from; ///< Индекс отправителя
+  size_t to; ///< Индекс получателя или группы
+  int group; ///< Сообщение группе
+  std::string message; ///< Текст сообщения
+  int64_t time; ///< Время получения сообщения сервером (UTC Unix)
+  int deleted; ///< Сообщение удалено
+};
+
+/// Изменение сообщения в хранилище в памяти
+struct memory_change {
+  int64_t message_id; ///< Изменённое сообщение
+  std::string message; ///< Новый текст сообщения
+  int deleted; ///< Сообщение удалено
+  int64_t time; ///< Время изменения (UTC Unix)
+};
+
+/// Данные хранилища в памяти
+struct memory_storage {
+  /// Индексы пользователей по имени
+  std::unordered_map<std::string, size_t> user_index;
+  std::vector<memory_user> users; ///< Пользователи
+  std::vector<memory_message> messages; ///< Сообщения, индекс message_id - 1
+  /// Сообщения пар собеседников по возрастанию, ключ - memory_pair
+  std::unordered_map<uint64_t, std::vector<int64_t> > conversations;
+  /// Прочитанные сообщения, ключ - (пользователь << 32) | собеседник
+  std::unordered_map<uint64_t, int64_t> read_cursors;
+  /// Индексы групп по имени
+  std::unordered_map<std::string, size_t> group_index;
+  std::vector<memory_group> groups; ///< Группы
+  /// Изменения по возрастанию версии, индекс - версия - horizon - 1
+  std::vector<memory_change> changes;
+  int64_t horizon; ///< Последняя сжатая версия
+  /// Сообщения по ключу повтора отправки, ключ - memory_key
+  std::unordered_map<std::string, int64_t> client_keys;
+};
+
+
+/**
+ * @brief Функция возвращает ключ пары собеседников, не зависящий от порядка
+ */
+static uint64_t memory_pair(size_t a,
+                            size_t b){
+  return a < b ? ((uint64_t) a << 32) | b : ((uint64_t) b << 32) | a;
+}
+
+
+/**
+ * @brief Функция возвращает ключ повтора отправки, уникальный среди всех 
+ * отправителей
+ */
+static std::string memory_key(size_t from,
+                              const char * client_msg_id){
+  return std::string((const char *) &from, sizeof(from)) + client_msg_id;
+}
+
+
+/**
+ * @brief Функция находит пользователя по имени
+ *
+ * @retval NULL Пользователь не найден
+ * @retval Указатель на пользователя
+ */
+static struct memory_user * memory_find_user(struct memory_storage * data,
+                                             const char * user){
+  std::unordered_map<std::string, size_t>::const_iterator it =
+    data->user_index.find(user);
+  return it == data->user_index.end() ? NULL : &data->users[it->second];
+}
+
+
+/**
+ * @brief Функция находит группу по адресату сообщения
+ *
+ * @retval NULL Адресат - не группа или группа не найдена
+ * @retval Указатель на индекс группы
+ */
+static const size_t * memory_find_group(const struct memory_storage * data,
+                                        const char * to){
+  if (to[0] != STORAGE_GROUP_PREFIX){
+    return NULL;
+  }
+  std::unordered_map<std::string, size_t>::const_iterator it =
+    data->group_index.find(to + 1);
+  return it == data->group_index.end() ? NULL : &it->second;
+}
+
+
+/**
+ * @brief Функция находит текущее участие пользователя в группе
+ *
+ * @retval NULL Пользователь не состоит в группе
+ * @retval Указатель на участие
+ */
+static struct memory_membership * memory_find_member(struct memory_user * user,
+                                                     size_t group){
+  for (size_t i = 0; i < user->groups.size(); i++){
+    if (user->groups[i].group == group &&
+        user->groups[i].left == STORAGE_CURSOR_MAX){
+      return &user->groups[i];
+    }
+  }
+  return NULL;
+}
+
+
+/**
+ * @brief Функция создаёт пустое хранилище. Путь не используется
+ */
+static int memory_open(struct storage * st, const char * path){
+  (void) path;
+  st->data = new memory_storage();
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция освобождает хранилище
+ */
+static void memory_close(struct storage * st){
+  delete (struct memory_storage *) st->data;
+  st->data = NULL;
+}
+
+
+/**
+ * @brief Функция находит пароль пользователя
+ */
+static int memory_lookup_user(struct storage * st,
+                              const char * user,
+                              char * pass_hash,
+                              size_t pass_hash_len){
+  struct memory_user * found =
+    memory_find_user((struct memory_storage *) st->data, user);
+
+  if (found == NULL){
+    return STORAGE_NOT_FOUND;
+  }
+  if (pass_hash != NULL){
+    strncpy(pass_hash, found->pass_hash.c_str(), pass_hash_len - 1);
+    pass_hash[pass_hash_len - 1] = '\0';
+  }
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция регистрирует пользователя
+ */
+static int memory_create_user(struct storage * st,
+                              const char * user,
+                              const char * pass_hash){
+  struct memory_storage * data = (struct memory_storage *) st->data;
+
+  if (memory_find_user(data, user) != NULL){
+    return STORAGE_EXISTS;
+  }
+  data->user_index[user] = data->users.size();
+  data->users.push_back(memory_user());
+  data->users.back().name = user;
+  data->users.back().pass_hash = pass_hash;
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция добавляет сообщения. Если хотя бы один пользователь не
+ * найден, не добавляется ни одно сообщение
+ */
+static int memory_put_messages(struct storage * st,
+                               struct storage_message * messages,
+                               int count){
+  struct memory_storage * data = (struct memory_storage *) st->data;
+  int i;
+
+  for (i = 0; i < count; i++){
+    struct memory_user * from = memory_find_user(data, messages[i].from);
+    const size_t * group = memory_find_group(data, messages[i].to);
+    if (from == NULL ||
+        (group == NULL && memory_find_user(data, messages[i].to) == NULL) ||
+        (group != NULL && memory_find_member(from, *group) == NULL)){
+      return STORAGE_NOT_FOUND;
+    }
+  }
+  for (i = 0; i < count; i++){
+    if (messages[i].client_msg_id == NULL){
+      continue;
+    }
+    std::unordered_map<std::string, int64_t>::const_iterator it =
+      data->client_keys.find(memory_key(data->user_index[messages[i].from],
+                                        messages[i].client_msg_id));
+    if (it != data->client_keys.end()){
+      messages[i].message_id = it->second;
+      return STORAGE_EXISTS;
+    }
+  }
+  for (i = 0; i < count; i++){
+    const size_t * group = memory_find_group(data, messages[i].to);
+    memory_message message;
+    message.from = data->user_index[messages[i].from];
+    message.to = group != NULL ? *group : data->user_index[messages[i].to];
+    message.group = group != NULL;
+    message.message = messages[i].message;
+    message.time = messages[i].time;
+    message.deleted = 0;
+    data->messages.push_back(message);
+
+    messages[i].message_id = (int64_t) data->messages.size();
+    if (messages[i].client_msg_id != NULL){
+      data->client_keys[memory_key(message.from, messages[i].client_msg_id)] =
+        messages[i].message_id;
+    }
+    // Stored once, members find it through their memberships
+    if (message.group){
+      data->groups[message.to].messages.push_back(messages[i].message_id);
+      continue;
+    }
+    data->users[message.from].messages.push_back(messages[i].message_id);
+    if (message.to != message.from){
+      data->users[message.to].messages.push_back(messages[i].message_id);
+    }
+    data->conversations[memory_pair(message.from, message.to)].push_back(
+      messages[i].message_id);
+  }
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция передаёт сообщение с данным идентификатором в cb
+ */
+static void memory_emit(struct memory_storage * data,
+                        int64_t message_id,
+                        storage_message_cb cb,
+                        void * arg){
+  const memory_message & stored = data->messages[(size_t) message_id - 1];
+  struct storage_message message;
+
+  message.message_id = message_id;
+  message.from = data->users[stored.from].name.c_str();
+  message.to = stored.group ? data->groups[stored.to].address.c_str() :
+                              data->users[stored.to].name.c_str();
+  message.message = stored.deleted ? NULL : stored.message.c_str();
+  message.time = stored.time;
+  message.client_msg_id = NULL;
+  cb(&message, arg);
+}
+
+
+/**
+ * @brief Функция обходит упорядоченный список сообщений от курсора
+ */
+static void memory_scan_ids(struct memory_storage * data,
+                            const std::vector<int64_t> & ids,
+                            int64_t cursor,
+                            int direction,
+                            int limit,
+                            storage_message_cb cb,
+                            void * arg){
+  if (direction == STORAGE_SCAN_FORWARD){
+    std::vector<int64_t>::const_iterator it =
+      std::upper_bound(ids.begin(), ids.end(), cursor);
+    for (; it != ids.end() && limit > 0; ++it, limit--){
+      memory_emit(data, *it, cb, arg);
+    }
+  } else {
+    std::vector<int64_t>::const_iterator it =
+      std::lower_bound(ids.begin(), ids.end(), cursor);
+    for (; it != ids.begin() && limit > 0; limit--){
+      --it;
+      memory_emit(data, *it, cb, arg);
+    }
+  }
+}
+
+
+/**
+ * @brief Функция добавляет в ids не больше limit идентификаторов
+ * упорядоченного списка из промежутка (after, through], ближайших к курсору
+ */
+static void memory_collect_ids(const std::vector<int64_t> & list,
+                               int64_t after,
+                               int64_t through,
+                               int direction,
+                               int limit,
+                               std::vector<int64_t> * ids){
+  if (direction == STORAGE_SCAN_FORWARD){
+    std::vector<int64_t>::const_iterator it =
+      std::upper_bound(list.begin(), list.end(), after);
+    for (; it != list.end() && *it <= through && limit > 0; ++it, limit--){
+      ids->push_back(*it);
+    }
+  } else {
+    std::vector<int64_t>::const_iterator it =
+      std::upper_bound(list.begin(), list.end(), through);
+    for (; it != list.begin() && it[-1] > after && limit > 0; limit--){
+      ids->push_back(*--it);
+    }
+  }
+}
+
+
+/**
+ * @brief Функция добавляет в ids сообщения группы, видимые в пределах
+ * участия, не больше limit от курсора
+ */
+static void memory_collect_group(const struct memory_storage * data,
+                                 const struct memory_membership * membership,
+                                 int64_t cursor,
+                                 int direction,
+                                 int limit,
+                                 std::vector<int64_t> * ids){
+  const std::vector<int64_t> & list = data->groups[membership->group].messages;
+
+  if (direction == STORAGE_SCAN_FORWARD){
+    memory_collect_ids(list, std::max(cursor, membership->joined),
+                       membership->left, direction, limit, ids);
+  } else {
+    memory_collect_ids(list, membership->joined,
+                       std::min(cursor - 1, membership->left), direction,
+                       limit, ids);
+  }
+}
+
+
+/**
+ * @brief Функция упорядочивает собранные из нескольких списков сообщения и
+ * передаёт в cb первые limit из них
+ */
+static void memory_emit_merged(struct memory_storage * data,
+                               std::vector<int64_t> * ids,
+                               int direction,
+                               int limit,
+                               storage_message_cb cb,
+                               void * arg){
+  if (direction == STORAGE_SCAN_FORWARD){
+    std::sort(ids->begin(), ids->end());
+  } else {
+    std::sort(ids->begin(), ids->end(), std::greater<int64_t>());
+  }
+  ids->erase(std::unique(ids->begin(), ids->end()), ids->end());
+  for (size_t i = 0; i < ids->size() && (int) i < limit; i++){
+    memory_emit(data, (*ids)[i], cb, arg);
+  }
+}
+
+
+/**
+ * @brief Функция обходит сообщения пользователя от курсора
+ *
+ * Каждый список (личные сообщения и каждое участие в группе) даёт не больше
+ * limit сообщений от курсора, первые limit из их объединения - ответ.
+ */
+static int memory_scan_messages(struct storage * st,
+                                const char * user,
+                                int64_t cursor,
+                                int direction,
+                                int limit,
+                                storage_message_cb cb,
+                                void * arg){
+  struct memory_storage * data = (struct memory_storage *) st->data;
+  struct memory_user * found = memory_find_user(data, user);
+  std::vector<int64_t> ids;
+
+  if (found == NULL){
+    return STORAGE_OK;
+  }
+  if (found->groups.empty()){
+    memory_scan_ids(data, found->messages, cursor, direction, limit, cb, arg);
+    return STORAGE_OK;
+  }
+  if (direction == STORAGE_SCAN_FORWARD){
+    memory_collect_ids(found->messages, cursor, STORAGE_CURSOR_MAX, direction,
+                       limit, &ids);
+  } else {
+    memory_collect_ids(found->messages, 0, cursor - 1, direction, limit,
+                       &ids);
+  }
+  for (size_t i = 0; i < found->groups.size(); i++){
+    memory_collect_group(data, &found->groups[i], cursor, direction, limit,
+                         &ids);
+  }
+  memory_emit_merged(data, &ids, direction, limit, cb, arg);
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция обходит сообщения пары собеседников от курсора
+ */
+static int memory_scan_conversation(struct storage * st,
+                                    const char * user,
+                                    const char * peer,
+                                    int64_t cursor,
+                                    int direction,
+                                    int limit,
+                                    storage_message_cb cb,
+                                    void * arg){
+  struct memory_storage * data = (struct memory_storage *) st->data;
+  std::unordered_map<std::string, size_t>::const_iterator a =
+    data->user_index.find(user);
+  std::unordered_map<std::string, size_t>::const_iterator b =
+    data->user_index.find(peer);
+
+  if (peer[0] == STORAGE_GROUP_PREFIX){
+    const size_t * group = memory_find_group(data, peer);
+    std::vector<int64_t> ids;
+    if (group == NULL){
+      return STORAGE_NOT_FOUND;
+    }
+    if (a == data->user_index.end()){
+      return STORAGE_OK;
+    }
+    const std::vector<memory_membership> & groups =
+      data->users[a->second].groups;
+    for (size_t i = 0; i < groups.size(); i++){
+      if (groups[i].group == *group){
+        memory_collect_group(data, &groups[i], cursor, direction, limit, &ids);
+      }
+    }
+    memory_emit_merged(data, &ids, direction, limit, cb, arg);
+    return STORAGE_OK;
+  }
+  if (b == data->user_index.end()){
+    return STORAGE_NOT_FOUND;
+  }
+  if (a == data->user_index.end()){
+    return STORAGE_OK;
+  }
+  std::unordered_map<uint64_t, std::vector<int64_t> >::const_iterator it =
+    data->conversations.find(memory_pair(a->second, b->second));
+  if (it != data->conversations.end()){
+    memory_scan_ids(data, it->second, cursor, direction, limit, cb, arg);
+  }
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция передаёт в cb сводку переписки user с peer
+ *
+ * @param[in] data Данные хранилища
+ * @param[in] user Индекс пользователя
+ * @param[in] peer Индекс собеседника
+ * @param[in] ids Сообщения переписки по возрастанию
+ * @param[in] cb Функция, принимающая сводку
+ * @param[in] arg Аргумент cb
+ */
+static void memory_emit_conversation(struct memory_storage * data,
+                                     size_t user,
+                                     size_t peer,
+                                     const std::vector<int64_t> & ids,
+                                     storage_conversation_cb cb,
+                                     void * arg){
+  const memory_message & last = data->messages[(size_t) ids.back() - 1];
+  std::unordered_map<uint64_t, int64_t>::const_iterator it =
+    data->read_cursors.find(((uint64_t) user << 32) | peer);
+  struct storage_conversation conversation;
+
+  conversation.user = data->users[user].name.c_str();
+  conversation.peer = data->users[peer].name.c_str();
+  conversation.last.message_id = ids.back();
+  conversation.last.from = data->users[last.from].name.c_str();
+  conversation.last.to = data->users[last.to].name.c_str();
+  conversation.last.message = last.deleted ? NULL : last.message.c_str();
+  conversation.last.time = last.time;
+  conversation.read = it == data->read_cursors.end() ? 0 : it->second;
+  conversation.unread = 0;
+  // Only the unread tail is walked
+  for (size_t i = ids.size(); i > 0 && ids[i - 1] > conversation.read; i--){
+    if (user != peer && data->messages[(size_t) ids[i - 1] - 1].from == peer){
+      conversation.unread++;
+    }
+  }
+  cb(&conversation, arg);
+}
+
+
+/**
+ * @brief Функция находит последнее сообщение каждого пользователя
+ */
+static int memory_scan_latest(struct storage * st,
+                              storage_latest_cb cb,
+                              void * arg){
+  struct memory_storage * data = (struct memory_storage *) st->data;
+
+  for (size_t i = 0; i < data->users.size(); i++){
+    if (!data->users[i].messages.empty()){
+      cb(data->users[i].name.c_str(), data->users[i].messages.back(), arg);
+    }
+  }
+  for (size_t i = 0; i < data->groups.size(); i++){
+    if (!data->groups[i].messages.empty()){
+      cb(data->groups[i].address.c_str(), data->groups[i].messages.back(), arg);
+    }
+  }
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция запоминает последнее прочитанное сообщение переписки
+ */
+static int memory_put_read_cursor(struct storage * st,
+                                  const char * user,
+                                  const char * peer,
+                                  int64_t message_id){
+  struct memory_storage * data = (struct memory_storage *) st->data;
+  std::unordered_map<std::string, size_t>::const_iterator a =
+    data->user_index.find(user);
+  std::unordered_map<std::string, size_t>::const_iterator b =
+    data->user_index.find(peer);
+
+  if (a == data->user_index.end() || b == data->user_index.end()){
+    return STORAGE_NOT_FOUND;
+  }
+  data->read_cursors[((uint64_t) a->second << 32) | b->second] = message_id;
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция передаёт в cb сводки всех переписок обоих собеседников
+ */
+static int memory_scan_conversations(struct storage * st,
+                                     storage_conversation_cb cb,
+                                     void * arg){
+  struct memory_storage * data = (struct memory_storage *) st->data;
+  std::unordered_map<uint64_t, std::vector<int64_t> >::const_iterator it;
+
+  for (it = data->conversations.begin(); it != data->conversations.end();
+       ++it){
+    size_t a = (size_t) (it->first >> 32);
+    size_t b = (size_t) (it->first & 0xffffffff);
+    memory_emit_conversation(data, a, b, it->second, cb, arg);
+    if (a != b){
+      memory_emit_conversation(data, b, a, it->second, cb, arg);
+    }
+  }
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция создаёт группу, создатель становится её участником
+ */
+static int memory_create_group(struct storage * st,
+                               const char * group,
+                               const char * user){
+  struct memory_storage * data = (struct memory_storage *) st->data;
+  struct memory_user * found = memory_find_user(data, user);
+
+  if (data->group_index.count(group)){
+    return STORAGE_EXISTS;
+  }
+  if (found == NULL){
+    return STORAGE_NOT_FOUND;
+  }
+  struct memory_membership membership = {
+    data->groups.size(), (int64_t) data->messages.size(), STORAGE_CURSOR_MAX
+  };
+  data->group_index[group] = data->groups.size();
+  data->groups.push_back(memory_group());
+  data->groups.back().name = group;
+  data->groups.back().address = std::string(1, STORAGE_GROUP_PREFIX) + group;
+  found->groups.push_back(membership);
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция начинает или заканчивает участие пользователя в группе
+ */
+static int memory_put_member(struct storage * st,
+                             const char * group,
+                             const char * user,
+                             int joined,
+                             int64_t * cursor){
+  struct memory_storage * data = (struct memory_storage *) st->data;
+  struct memory_user * found = memory_find_user(data, user);
+  std::unordered_map<std::string, size_t>::const_iterator it =
+    data->group_index.find(group);
+
+  if (found == NULL || it == data->group_index.end()){
+    return STORAGE_NOT_FOUND;
+  }
+  struct memory_membership * current = memory_find_member(found, it->second);
+  if ((current != NULL) == (joined != 0)){
+    return STORAGE_EXISTS;
+  }
+  *cursor = (int64_t) data->messages.size();
+  if (current != NULL){
+    current->left = *cursor;
+  } else {
+    struct memory_membership membership = {
+      it->second, *cursor, STORAGE_CURSOR_MAX
+    };
+    found->groups.push_back(membership);
+  }
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция передаёт в cb все участия в группах
+ */
+static int memory_scan_members(struct storage * st,
+                               storage_membership_cb cb,
+                               void * arg){
+  struct memory_storage * data = (struct memory_storage *) st->data;
+  struct storage_membership membership;
+
+  for (size_t i = 0; i < data->users.size(); i++){
+    for (size_t j = 0; j < data->users[i].groups.size(); j++){
+      const memory_membership & stored = data->users[i].groups[j];
+      membership.group = data->groups[stored.group].name.c_str();
+      membership.user = data->users[i].name.c_str();
+      membership.joined = stored.joined;
+      membership.left = stored.left;
+      cb(&membership, arg);
+    }
+  }
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция возвращает адресата сообщения
+ */
+static const char * memory_address(const struct memory_storage * data,
+                                   const memory_message & stored){
+  return stored.group ? data->groups[stored.to].address.c_str() :
+                        data->users[stored.to].name.c_str();
+}
+
+
+/**
+ * @brief Функция правит или удаляет сообщение отправителя
+ */
+static int memory_put_change(struct storage * st,
+                             struct storage_change * change){
+  struct memory_storage * data = (struct memory_storage *) st->data;
+  std::unordered_map<std::string, size_t>::const_iterator from =
+    data->user_index.find(change->from);
+
+  if (change->message_id < 1 ||
+      change->message_id > (int64_t) data->messages.size() ||
+      from == data->user_index.end()){
+    return STORAGE_NOT_FOUND;
+  }
+  memory_message & stored = data->messages[(size_t) change->message_id - 1];
+  if (stored.deleted || stored.from != from->second){
+    return STORAGE_NOT_FOUND;
+  }
+  memory_change record;
+  record.message_id = change->message_id;
+  record.deleted = change->message == NULL;
+  record.message = record.deleted ? "" : change->message;
+  record.time = change->time;
+  data->changes.push_back(record);
+
+  stored.deleted = record.deleted;
+  stored.message = record.message;
+  change->version = data->horizon + (int64_t) data->changes.size();
+  change->to = memory_address(data, stored);
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция передаёт в cb все несжатые изменения
+ */
+static int memory_scan_changes(struct storage * st,
+                               int64_t * horizon,
+                               storage_change_cb cb,
+                               void * arg){
+  struct memory_storage * data = (struct memory_storage *) st->data;
+  struct storage_change change;
+
+  *horizon = data->horizon;
+  for (size_t i = 0; i < data->changes.size(); i++){
+    const memory_change & record = data->changes[i];
+    const memory_message & stored =
+      data->messages[(size_t) record.message_id - 1];
+    change.version = data->horizon + (int64_t) i + 1;
+    change.message_id = record.message_id;
+    change.from = data->users[stored.from].name.c_str();
+    change.to = memory_address(data, stored);
+    change.message = record.deleted ? NULL : record.message.c_str();
+    change.time = record.time;
+    cb(&change, arg);
+  }
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция удаляет идентификатор из упорядоченного списка
+ */
+static void memory_erase_id(std::vector<int64_t> * ids,
+                            int64_t message_id){
+  std::vector<int64_t>::iterator it =
+    std::lower_bound(ids->begin(), ids->end(), message_id);
+  if (it != ids->end() && *it == message_id){
+    ids->erase(it);
+  }
+}
+
+
+/**
+ * @brief Функция сжимает изменения до версии through: удалённые ими
+ * сообщения убираются из списков
+ */
+static int memory_compact_changes(struct storage * st,
+                                  int64_t through){
+  struct memory_storage * data = (struct memory_storage *) st->data;
+  size_t count = through <= data->horizon ? 0 :
+    (size_t) std::min(through - data->horizon,
+                      (int64_t) data->changes.size());
+
+  for (size_t i = 0; i < count; i++){
+    if (!data->changes[i].deleted){
+      continue;
+    }
+    int64_t message_id = data->changes[i].message_id;
+    memory_message & stored = data->messages[(size_t) message_id - 1];
+    if (stored.group){
+      memory_erase_id(&data->groups[stored.to].messages, message_id);
+      continue;
+    }
+    memory_erase_id(&data->users[stored.from].messages, message_id);
+    memory_erase_id(&data->users[stored.to].messages, message_id);
+    uint64_t pair = memory_pair(stored.from, stored.to);
+    std::vector<int64_t> & ids = data->conversations[pair];
+    memory_erase_id(&ids, message_id);
+    if (ids.empty()){
+      data->conversations.erase(pair);
+    }
+  }
+  data->changes.erase(data->changes.begin(), data->changes.begin() + count);
+  data->horizon += (int64_t) count;
+  return STORAGE_OK;
+}
+
+
+const struct storage_vtable storage_memory_vtable = {
+  "memory",
+  STORAGE_DURABILITY_NONE,
+  memory_open,
+  memory_close,
+  memory_lookup_user,
+  memory_create_user,
+  memory_put_messages,
+  memory_scan_messages,
+  memory_scan_conversation,
+  memory_scan_latest,
+  memory_put_read_cursor,
+  memory_scan_conversations,
+  memory_create_group,
+  memory_put_member,
+  memory_scan_members,
+  memory_put_change,
+  memory_scan_changes,
+  memory_compact_changes,
+  NULL
+};
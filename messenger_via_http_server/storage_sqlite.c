@@ -0,0 +1,1804 @@
+/**
+ * @file
+ * @brief Хранилище в базе данных SQLite
+ *
+ * Сообщения ссылаются на пользователей по целочисленному user_id, таблица 
+ * соответствия имён и идентификаторов пользователей хранится в памяти. 
+ * Сообщение группе хранится один раз с to_id, равным -group_id; группы и 
+ * участие в них тоже хранятся в памяти. Правка сообщения заменяет его текст, 
+ * удаление оставляет строку с текстом NULL до сжатия изменений; каждое 
+ * изменение добавляет строку в таблицу changes. Ключи повтора отправки 
+ * хранятся в таблице message_keys с первичным ключом (from_id, 
+ * client_msg_id). Запросы подготавливаются один раз при открытии хранилища.
+ * База данных старой схемы переносится на новую в фоне, порциями между 
+ * запросами, и всё это время обслуживает и чтение, и запись (см. 
+ * db_migrate_v1_begin).
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "storage.h"
+#include "metrics.h"
+#include "stall.h"
+#include "sqlite3.h"
+
+/// Версия схемы базы данных, хранящаяся в PRAGMA user_version
+#define DB_SCHEMA_VERSION 1
+
+/// Количество сообщений, переносимых при миграции за одну итерацию цикла 
+/// событий (одной транзакцией)
+#define DB_MIGRATION_CHUNK 1000
+
+
+/// Запросы, время выполнения которых учитывается в метриках
+enum sqlite_statement {
+  DB_STMT_LOOKUP_USER, ///< Поиск пароля пользователя
+  DB_STMT_INSERT_USER, ///< Добавление пользователя
+  DB_STMT_CLAIM_USER, ///< Регистрация пользователя без пароля
+  DB_STMT_INSERT_MESSAGE, ///< Добавление сообщения
+  DB_STMT_COMMIT, ///< Фиксация транзакции добавления сообщений
+  DB_STMT_SCAN_FORWARD, ///< Сообщения пользователя после курсора
+  DB_STMT_SCAN_BACKWARD, ///< Сообщения пользователя до курсора
+  DB_STMT_CONVERSATION_FORWARD, ///< Сообщения пары собеседников после курсора
+  DB_STMT_CONVERSATION_BACKWARD, ///< Сообщения пары собеседников до курсора
+  DB_STMT_SCAN_LATEST, ///< Последние сообщения всех пользователей
+  DB_STMT_PUT_READ_CURSOR, ///< Запись прочитанного сообщения переписки
+  DB_STMT_SCAN_CONVERSATIONS, ///< Последние сообщения всех пар собеседников
+  DB_STMT_INSERT_GROUP, ///< Добавление группы
+  DB_STMT_PUT_MEMBER, ///< Вступление в группу или выход из неё
+  DB_STMT_GROUP_FORWARD, ///< Сообщения группы после курсора
+  DB_STMT_GROUP_BACKWARD, ///< Сообщения группы до курсора
+  DB_STMT_FIND_MESSAGE, ///< Поиск изменяемого сообщения
+  DB_STMT_UPDATE_MESSAGE, ///< Правка или удаление сообщения
+  DB_STMT_INSERT_CHANGE, ///< Добавление изменения
+  DB_STMT_SCAN_CHANGES, ///< Несжатые изменения
+  DB_STMT_COMPACT_CHANGES, ///< Сжатие изменений
+  DB_STMT_INSERT_KEY, ///< Добавление ключа повтора отправки
+  DB_STMT_FIND_KEY, ///< Поиск сообщения по ключу повтора отправки
+  DB_STMT_MIGRATE, ///< Перенос порции сообщений старой схемы
+  DB_STMT_COUNT ///< Количество запросов
+};
+
+/// Имена запросов в метриках в порядке enum sqlite_statement
+static const char * s_statement_names[DB_STMT_COUNT] = {
+  "lookup_user",
+  "insert_user",
+  "claim_user",
+  "insert_message",
+  "commit",
+  "scan_forward",
+  "scan_backward",
+  "conversation_forward",
+  "conversation_backward",
+  "scan_latest",
+  "put_read_cursor",
+  "scan_conversations",
+  "insert_group",
+  "put_member",
+  "group_forward",
+  "group_backward",
+  "find_message",
+  "update_message",
+  "insert_change",
+  "scan_changes",
+  "compact_changes",
+  "insert_key",
+  "find_key",
+  "migrate"
+};
+
+/// Номера запросов в реестре метрик
+static int s_statement_metrics[DB_STMT_COUNT];
+/// Журнал медленных запросов или NULL, если журнал выключен
+static FILE * s_slow_log = NULL;
+/// Время запроса, начиная с которого запрос записывается в журнал
+static int64_t s_slow_threshold_ns = (int64_t) STORAGE_SLOW_QUERY_MS * 1000000;
+
+/// Участие пользователя в группе
+struct sqlite_membership {
+  int64_t group_id; ///< Идентификатор группы
+  int64_t joined; ///< Последнее сообщение при вступлении
+  int64_t left; ///< Последнее сообщение при выходе или STORAGE_CURSOR_MAX
+};
+
+/// Сообщение, прочитанное из одного из сливаемых запросов
+struct sqlite_row {
+  int64_t message_id; ///< Уникальный идентификатор сообщения
+  int64_t from_id; ///< Отправитель
+  int64_t to_id; ///< Получатель, -group_id для сообщения группе
+  std::string message; ///< Текст сообщения
+  int deleted; ///< Сообщение удалено, текст NULL
+  int64_t time; ///< Время получения сообщения сервером (UTC Unix)
+};
+
+/// Данные хранилища SQLite
+struct sqlite_storage {
+  sqlite3 * db; ///< Handler базы данных
+  /// Идентификаторы пользователей по имени
+  std::unordered_map<std::string, int64_t> user_ids;
+  /// Имена пользователей по идентификатору
+  std::unordered_map<int64_t, std::string> user_names;
+  /// Идентификаторы групп по имени
+  std::unordered_map<std::string, int64_t> group_ids;
+  /// Адресаты сообщений групп (префикс и имя) по идентификатору
+  std::unordered_map<int64_t, std::string> group_names;
+  /// Участие в группах по времени вступления, ключ - user_id
+  std::unordered_map<int64_t, std::vector<sqlite_membership> > memberships;
+  sqlite3_stmt * lookup_user; ///< Поиск пароля пользователя
+  sqlite3_stmt * insert_user; ///< Добавление пользователя
+  sqlite3_stmt * claim_user; ///< Регистрация пользователя без пароля
+  sqlite3_stmt * insert_message; ///< Добавление сообщения
+  sqlite3_stmt * scan_forward; ///< Сообщения пользователя после курсора
+  sqlite3_stmt * scan_backward; ///< Сообщения пользователя до курсора
+  /// Сообщения пары собеседников после курсора
+  sqlite3_stmt * conversation_forward;
+  /// Сообщения пары собеседников до курсора
+  sqlite3_stmt * conversation_backward;
+  sqlite3_stmt * put_read_cursor; ///< Запись прочитанного сообщения
+  sqlite3_stmt * insert_group; ///< Добавление группы
+  sqlite3_stmt * insert_member; ///< Вступление в группу
+  sqlite3_stmt * close_member; ///< Выход из группы
+  sqlite3_stmt * group_forward; ///< Сообщения группы после курсора
+  sqlite3_stmt * group_backward; ///< Сообщения группы до курсора
+  sqlite3_stmt * find_message; ///< Поиск изменяемого сообщения
+  sqlite3_stmt * update_message; ///< Правка или удаление сообщения
+  sqlite3_stmt * insert_change; ///< Добавление изменения
+  sqlite3_stmt * compact_messages; ///< Удаление сжимаемых сообщений
+  sqlite3_stmt * compact_changes; ///< Удаление сжимаемых изменений
+  sqlite3_stmt * insert_key; ///< Добавление ключа повтора отправки
+  sqlite3_stmt * find_key; ///< Поиск сообщения по ключу повтора отправки
+  /// Перенос сообщений старой схемы в новую таблицу, NULL - миграция не идёт
+  sqlite3_stmt * migrate_insert;
+  sqlite3_stmt * migrate_delete; ///< Удаление перенесённых сообщений
+  int64_t migrate_skipped; ///< Сообщения без отправителя или получателя
+  int64_t exec_ns; ///< Время шагов выполняемого подготовленного запроса
+  int exec_rows; ///< Строки, полученные выполняемым подготовленным запросом
+  int timed; ///< Запрос измеряется хранилищем, а не sqlite3_profile
+};
+
+/// Схема базы данных. Сообщения ссылаются на пользователей по user_id
+static const char * s_schema_sql =
+  "CREATE TABLE IF NOT EXISTS \"users\" ( "
+    "\"user_id\" INTEGER PRIMARY KEY, "
+    "\"user\" TEXT UNIQUE NOT NULL, "
+    "\"pass_hash\" TEXT );"
+  "CREATE TABLE IF NOT EXISTS \"messages\" ( "
+    "\"message_id\" INTEGER PRIMARY KEY AUTOINCREMENT, "
+    "\"from_id\" INTEGER NOT NULL, "
+    "\"to_id\" INTEGER NOT NULL, "
+    "\"message\" TEXT, "
+    "\"date\" INTEGER );"
+  // Index entries are (user_id, rowid), i.e. sorted by message_id per user
+  "CREATE INDEX IF NOT EXISTS \"messages_from\" ON \"messages\" (\"from_id\");"
+  "CREATE INDEX IF NOT EXISTS \"messages_to\" ON \"messages\" (\"to_id\");"
+  // Entries are (from_id, to_id, rowid): a page of one direction of a 
+  // conversation is a single range scan that never reads the table
+  "CREATE INDEX IF NOT EXISTS \"messages_pair\" ON \"messages\" "
+    "(\"from_id\", \"to_id\");"
+  "CREATE TABLE IF NOT EXISTS \"read_cursors\" ( "
+    "\"user_id\" INTEGER NOT NULL, "
+    "\"peer_id\" INTEGER NOT NULL, "
+    "\"message_id\" INTEGER NOT NULL, "
+    "PRIMARY KEY (\"user_id\", \"peer_id\") );"
+  // Group messages have to_id = -group_id, messages_to serves their ranges
+  "CREATE TABLE IF NOT EXISTS \"groups\" ( "
+    "\"group_id\" INTEGER PRIMARY KEY, "
+    "\"name\" TEXT UNIQUE NOT NULL );"
+  // A membership is an interval of message ids, messages are never rewritten
+  "CREATE TABLE IF NOT EXISTS \"group_members\" ( "
+    "\"group_id\" INTEGER NOT NULL, "
+    "\"user_id\" INTEGER NOT NULL, "
+    "\"joined\" INTEGER NOT NULL, "
+    "\"left\" INTEGER NOT NULL, "
+    "PRIMARY KEY (\"group_id\", \"user_id\", \"joined\") );"
+  // One row per edit or delete, message is NULL for a delete
+  "CREATE TABLE IF NOT EXISTS \"changes\" ( "
+    "\"version\" INTEGER PRIMARY KEY AUTOINCREMENT, "
+    "\"message_id\" INTEGER NOT NULL, "
+    "\"from_id\" INTEGER NOT NULL, "
+    "\"to_id\" INTEGER NOT NULL, "
+    "\"message\" TEXT, "
+    "\"date\" INTEGER );"
+  // The primary key is the unique index that rejects a repeated send
+  "CREATE TABLE IF NOT EXISTS \"message_keys\" ( "
+    "\"from_id\" INTEGER NOT NULL, "
+    "\"client_msg_id\" TEXT NOT NULL, "
+    "\"message_id\" INTEGER NOT NULL, "
+    "PRIMARY KEY (\"from_id\", \"client_msg_id\") );"
+  "PRAGMA user_version = 1;";
+
+
+/**
+ * @brief Функция включает журнал медленных запросов хранилища SQLite
+ *
+ * @param[in] file Файл журнала или NULL, чтобы выключить журнал
+ * @param[in] threshold_ns Время запроса, начиная с которого запрос 
+ * записывается в журнал
+ */
+void storage_sqlite_set_slow_log(FILE * file, 
+                                 int64_t threshold_ns){
+  s_slow_log = file;
+  s_slow_threshold_ns = threshold_ns;
+}
+
+
+/**
+ * @brief Функция записывает запрос в журнал медленных запросов
+ *
+ * @param[in] data Данные хранилища для EXPLAIN QUERY PLAN или NULL, если 
+ * план не нужен
+ * @param[in] name Имя подготовленного запроса или NULL
+ * @param[in] sql Текст запроса
+ * @param[in] elapsed_ns Время выполнения запроса
+ * @param[in] rows Строки результата или -1, если они не считались
+ * @param[in] fullscan_steps Шаги полного просмотра таблицы
+ */
+static void slow_log_write(struct sqlite_storage * data, 
+                           const char * name, 
+                           const char * sql, 
+                           int64_t elapsed_ns, 
+                           int rows, 
+                           int fullscan_steps){
+  time_t now = time(NULL);
+  char stamp[32];
+
+  strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+  fprintf(s_slow_log, "%s slow query %s: %.3f ms", stamp, 
+          name != NULL ? name : "exec", elapsed_ns / 1e6);
+  if (rows >= 0){
+    fprintf(s_slow_log, ", %d rows, %d full scan steps", rows, fullscan_steps);
+  }
+  fprintf(s_slow_log, "\n  SQL: %s\n", sql);
+  if (data != NULL){
+    std::string explain = std::string("EXPLAIN QUERY PLAN ") + sql;
+    sqlite3_stmt * stmt = NULL;
+    data->timed = 1; // not logged itself
+    if (sqlite3_prepare_v2(data->db, explain.c_str(), -1, &stmt, 
+                           NULL) == SQLITE_OK){
+      // Columns: selectid, order, from, detail
+      while (sqlite3_step(stmt) == SQLITE_ROW){
+        fprintf(s_slow_log, "  PLAN: %s\n", 
+                (const char *) sqlite3_column_text(stmt, 3));
+      }
+    }
+    sqlite3_finalize(stmt);
+    data->timed = 0;
+  }
+  fflush(s_slow_log);
+}
+
+
+/**
+ * @brief Функция sqlite3_profile, вызываемая по окончании запроса
+ *
+ * Подготовленные запросы хранилища измеряются в db_step и db_reset, здесь 
+ * в журнал попадают остальные: запросы sqlite3_exec (COMMIT, миграция схемы) 
+ * и разовые запросы. Время sqlite3_profile измеряется с точностью до 
+ * миллисекунды.
+ */
+static void db_profile(void * arg, 
+                       const char * sql, 
+                       sqlite3_uint64 elapsed_ns){
+  struct sqlite_storage * data = (struct sqlite_storage *) arg;
+
+  if (!data->timed && s_slow_log != NULL && 
+      (int64_t) elapsed_ns >= s_slow_threshold_ns){
+    slow_log_write(NULL, NULL, sql, (int64_t) elapsed_ns, -1, 0);
+  }
+}
+
+
+/**
+ * @brief Функция выполняет шаг подготовленного запроса и учитывает его время
+ *
+ * @param[in] data Данные хранилища
+ * @param[in] stmt Подготовленный запрос
+ * @param[in] statement Запрос, enum sqlite_statement
+ * @return Результат sqlite3_step
+ */
+static int db_step(struct sqlite_storage * data, 
+                   sqlite3_stmt * stmt, 
+                   int statement){
+  int64_t start = metrics_now_ns();
+  data->timed = 1;
+  int result = sqlite3_step(stmt);
+  data->timed = 0;
+  int64_t elapsed = metrics_now_ns() - start;
+
+  metrics_observe_statement(s_statement_metrics[statement], elapsed);
+  data->exec_ns += elapsed;
+  if (result == SQLITE_ROW){
+    data->exec_rows++;
+  }
+  return result;
+}
+
+
+/**
+ * @brief Функция завершает выполнение подготовленного запроса: учитывает его
+ * время и строки в метриках и записывает медленный запрос в журнал
+ *
+ * @param[in] data Данные хранилища
+ * @param[in] stmt Подготовленный запрос
+ * @param[in] statement Запрос, enum sqlite_statement
+ */
+static void db_reset(struct sqlite_storage * data, 
+                     sqlite3_stmt * stmt, 
+                     int statement){
+  int64_t elapsed = data->exec_ns;
+  int rows = data->exec_rows;
+  int fullscan = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+  int slow = s_slow_log != NULL && elapsed >= s_slow_threshold_ns;
+
+  data->timed = 1;
+  sqlite3_reset(stmt);
+  data->timed = 0;
+  data->exec_ns = 0;
+  data->exec_rows = 0;
+  metrics_observe_execution(s_statement_metrics[statement], elapsed, rows, 
+                            fullscan, slow);
+  stall_note_statement(s_statement_names[statement], elapsed);
+  if (slow){
+    slow_log_write(data, s_statement_names[statement], sqlite3_sql(stmt),
+                   elapsed, rows, fullscan);
+  }
+}
+
+
+/**
+ * @brief Функция выполняет запрос, возвращающий одно целое число
+ *
+ * @param[in] db Handler базы данных
+ * @param[in] sql Текст запроса
+ * @param[out] value Результат запроса, 0 если запрос не вернул строк
+ * @retval 1 Запрос выполнен
+ * @retval 0 Ошибка базы данных
+ */
+static int db_query_int64(sqlite3 * db, 
+                          const char * sql, 
+                          int64_t * value){
+  sqlite3_stmt * stmt = NULL;
+
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK){
+    sqlite3_finalize(stmt);
+    return 0;
+  }
+  int result = sqlite3_step(stmt);
+  *value = result == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : 0;
+  sqlite3_finalize(stmt);
+  return result == SQLITE_ROW || result == SQLITE_DONE;
+}
+
+
+/**
+ * @brief Функция начинает перенос базы данных со схемы, где сообщения хранят 
+ * имена пользователей, на схему с целочисленными user_id
+ *
+ * Одной транзакцией старая таблица сообщений переименовывается в 
+ * messages_legacy, создаётся текущая схема, пользователи получают user_id, а
+ * нумерация новых сообщений продолжает нумерацию старых. Сообщения не 
+ * копируются: их переносит sqlite_migrate порциями между запросами, поэтому 
+ * сервер принимает соединения сразу. Получатели, не зарегистрированные в 
+ * таблице users (send_message раньше их не проверял), получают user_id с 
+ * пустым паролем и могут быть зарегистрированы позже.
+ *
+ * @param[in] db Handler базы данных
+ * @retval 1 Миграция начата
+ * @retval 0 Ошибка базы данных
+ */
+static int db_migrate_v1_begin(sqlite3 * db){
+  if (sqlite3_exec(db, "BEGIN;"
+    "ALTER TABLE \"messages\" RENAME TO \"messages_legacy\";"
+    "ALTER TABLE \"users\" RENAME TO \"users_legacy\";", 0, 0, 0) != SQLITE_OK ||
+      sqlite3_exec(db, s_schema_sql, 0, 0, 0) != SQLITE_OK ||
+      sqlite3_exec(db,
+    "INSERT OR IGNORE INTO \"users\" (\"user\", \"pass_hash\") "
+      "SELECT \"user\", \"pass_hash\" FROM \"users_legacy\" "
+      "WHERE \"user\" IS NOT NULL;"
+    "INSERT OR IGNORE INTO \"users\" (\"user\") "
+      "SELECT \"from\" FROM \"messages_legacy\" WHERE \"from\" IS NOT NULL UNION "
+      "SELECT \"to\" FROM \"messages_legacy\" WHERE \"to\" IS NOT NULL;"
+    // New messages get ids above the old ones, even deleted old ones
+    "INSERT INTO \"sqlite_sequence\" (\"name\", \"seq\") "
+      "SELECT 'messages', COALESCE(MAX(\"seq\"), 0) FROM ("
+      "SELECT \"seq\" FROM \"sqlite_sequence\" "
+      "WHERE \"name\" = 'messages_legacy' UNION ALL "
+      "SELECT MAX(\"message_id\") FROM \"messages_legacy\");"
+    "DROP TABLE \"users_legacy\";"
+    "COMMIT;", 0, 0, 0) != SQLITE_OK){
+    sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+    return 0;
+  }
+  return 1;
+}
+
+
+/**
+ * @brief Функция готовит хранилище к работе посреди миграции на схему v1
+ *
+ * Если в базе осталась таблица messages_legacy, временное представление 
+ * messages объединяет новую таблицу с ещё не перенесёнными сообщениями, и 
+ * все запросы чтения видят сразу оба источника. Запросы записи обращаются к 
+ * таблице main.messages явно: представление изменять нельзя. Сообщения без 
+ * отправителя или получателя (NULL) перенести нельзя, представление их не 
+ * показывает, а sqlite_migrate пропускает. Прерванная миграция 
+ * продолжается при следующем запуске.
+ *
+ * @param[in] data Данные хранилища
+ * @retval 1 Миграции нет или хранилище к ней готово
+ * @retval 0 Ошибка базы данных
+ */
+static int db_migrate_v1_prepare(struct sqlite_storage * data){
+  int64_t legacy = 0;
+  int64_t total = 0;
+
+  if (!db_query_int64(data->db, "SELECT COUNT(*) FROM \"sqlite_master\" "
+                      "WHERE \"type\" = 'table' AND "
+                      "\"name\" = 'messages_legacy';", &legacy)){
+    return 0;
+  }
+  if (!legacy){
+    return 1;
+  }
+  if (!db_query_int64(data->db, "SELECT COUNT(*) FROM \"messages_legacy\";", 
+                      &total) ||
+      sqlite3_exec(data->db, "CREATE TEMP VIEW \"messages\" AS "
+        "SELECT \"message_id\", \"from_id\", \"to_id\", \"message\", \"date\" "
+        "FROM \"main\".\"messages\" UNION ALL "
+        "SELECT \"m\".\"message_id\", \"f\".\"user_id\", \"t\".\"user_id\", "
+        "\"m\".\"message\", \"m\".\"date\" FROM \"messages_legacy\" AS \"m\" "
+        "JOIN \"users\" AS \"f\" ON \"f\".\"user\" = \"m\".\"from\" "
+        "JOIN \"users\" AS \"t\" ON \"t\".\"user\" = \"m\".\"to\";", 
+        0, 0, 0) != SQLITE_OK ||
+      sqlite3_prepare_v2(data->db, "INSERT INTO \"main\".\"messages\" "
+        "SELECT \"m\".\"message_id\", \"f\".\"user_id\", \"t\".\"user_id\", "
+        "\"m\".\"message\", \"m\".\"date\" FROM \"messages_legacy\" AS \"m\" "
+        "JOIN \"users\" AS \"f\" ON \"f\".\"user\" = \"m\".\"from\" "
+        "JOIN \"users\" AS \"t\" ON \"t\".\"user\" = \"m\".\"to\" "
+        "WHERE \"m\".\"message_id\" BETWEEN ?1 AND ?2;", -1, 
+        &data->migrate_insert, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(data->db, "DELETE FROM \"messages_legacy\" "
+        "WHERE \"message_id\" BETWEEN ?1 AND ?2;", -1, 
+        &data->migrate_delete, NULL) != SQLITE_OK){
+    return 0;
+  }
+  fprintf(stderr, "Migrating %" INT64_FMT " messages to schema v1 in the "
+          "background, %d per event loop iteration\n", total, 
+          DB_MIGRATION_CHUNK);
+  return 1;
+}
+
+
+/**
+ * @brief Функция переносит сообщения старой схемы с идентификаторами от lo 
+ * до hi в новую таблицу
+ *
+ * Выполняется внутри транзакции вызывающей функции.
+ *
+ * @param[in] data Данные хранилища
+ * @param[in] lo,hi Границы идентификаторов сообщений (включительно)
+ * @retval 1 Сообщения перенесены
+ * @retval 0 Ошибка базы данных
+ */
+static int db_migrate_v1_range(struct sqlite_storage * data, 
+                               int64_t lo, 
+                               int64_t hi){
+  sqlite3_bind_int64(data->migrate_insert, 1, lo);
+  sqlite3_bind_int64(data->migrate_insert, 2, hi);
+  int result = db_step(data, data->migrate_insert, DB_STMT_MIGRATE);
+  int moved = sqlite3_changes(data->db);
+  db_reset(data, data->migrate_insert, DB_STMT_MIGRATE);
+  if (result != SQLITE_DONE){
+    return 0;
+  }
+  sqlite3_bind_int64(data->migrate_delete, 1, lo);
+  sqlite3_bind_int64(data->migrate_delete, 2, hi);
+  result = db_step(data, data->migrate_delete, DB_STMT_MIGRATE);
+  // The join does not move rows without sender or recipient
+  data->migrate_skipped += sqlite3_changes(data->db) - moved;
+  db_reset(data, data->migrate_delete, DB_STMT_MIGRATE);
+  return result == SQLITE_DONE;
+}
+
+
+/**
+ * @brief Функция загружает таблицу имён и идентификаторов пользователей
+ *
+ * @param[in] data Данные хранилища
+ * @retval 1 Таблица загружена
+ * @retval 0 Ошибка базы данных
+ */
+static int load_users(struct sqlite_storage * data){
+  sqlite3_stmt * stmt = NULL;
+
+  data->user_ids.clear();
+  data->user_names.clear();
+  if (sqlite3_prepare_v2(data->db, "SELECT \"user_id\", \"user\" FROM \"users\";", 
+                         -1, &stmt, NULL) != SQLITE_OK){
+    sqlite3_finalize(stmt);
+    return 0;
+  }
+  int result;
+  while ((result = sqlite3_step(stmt)) == SQLITE_ROW){
+    int64_t user_id = sqlite3_column_int64(stmt, 0);
+    const char * user = (char*)sqlite3_column_text(stmt, 1);
+    data->user_ids[user] = user_id;
+    data->user_names[user_id] = user;
+  }
+  sqlite3_finalize(stmt);
+  return result == SQLITE_DONE;
+}
+
+
+/**
+ * @brief Функция загружает группы и участие в них
+ *
+ * @param[in] data Данные хранилища
+ * @retval 1 Группы загружены
+ * @retval 0 Ошибка базы данных
+ */
+static int load_groups(struct sqlite_storage * data){
+  sqlite3_stmt * stmt = NULL;
+  int result;
+
+  data->group_ids.clear();
+  data->group_names.clear();
+  data->memberships.clear();
+  if (sqlite3_prepare_v2(data->db, "SELECT \"group_id\", \"name\" "
+                         "FROM \"groups\";", -1, &stmt, NULL) != SQLITE_OK){
+    sqlite3_finalize(stmt);
+    return 0;
+  }
+  while ((result = sqlite3_step(stmt)) == SQLITE_ROW){
+    int64_t group_id = sqlite3_column_int64(stmt, 0);
+    const char * group = (char*)sqlite3_column_text(stmt, 1);
+    data->group_ids[group] = group_id;
+    data->group_names[group_id] = std::string(1, STORAGE_GROUP_PREFIX) + group;
+  }
+  sqlite3_finalize(stmt);
+  stmt = NULL;
+  if (result != SQLITE_DONE ||
+      sqlite3_prepare_v2(data->db, "SELECT \"user_id\", \"group_id\", "
+        "\"joined\", \"left\" FROM \"group_members\" ORDER BY \"joined\";", 
+        -1, &stmt, NULL) != SQLITE_OK){
+    sqlite3_finalize(stmt);
+    return 0;
+  }
+  while ((result = sqlite3_step(stmt)) == SQLITE_ROW){
+    struct sqlite_membership membership = {
+      sqlite3_column_int64(stmt, 1), sqlite3_column_int64(stmt, 2),
+      sqlite3_column_int64(stmt, 3)
+    };
+    data->memberships[sqlite3_column_int64(stmt, 0)].push_back(membership);
+  }
+  sqlite3_finalize(stmt);
+  return result == SQLITE_DONE;
+}
+
+
+/**
+ * @brief Функция возвращает идентификатор пользователя по имени
+ *
+ * @param[in] data Данные хранилища
+ * @param[in] user Имя пользователя
+ * @retval 0 Пользователь не найден
+ * @retval Идентификатор пользователя
+ */
+static int64_t intern_user_id(const struct sqlite_storage * data,
+                              const char * user){
+  std::unordered_map<std::string, int64_t>::const_iterator it =
+    data->user_ids.find(user);
+  return it == data->user_ids.end() ? 0 : it->second;
+}
+
+
+/**
+ * @brief Функция возвращает идентификатор группы по адресату сообщения
+ *
+ * @param[in] data Данные хранилища
+ * @param[in] to Адресат сообщения
+ * @retval 0 Адресат - не группа или группа не найдена
+ * @retval Идентификатор группы
+ */
+static int64_t intern_group_id(const struct sqlite_storage * data,
+                               const char * to){
+  if (to[0] != STORAGE_GROUP_PREFIX){
+    return 0;
+  }
+  std::unordered_map<std::string, int64_t>::const_iterator it =
+    data->group_ids.find(to + 1);
+  return it == data->group_ids.end() ? 0 : it->second;
+}
+
+
+/**
+ * @brief Функция возвращает имя пользователя по идентификатору
+ *
+ * @param[in] data Данные хранилища
+ * @param[in] user_id Идентификатор пользователя, -group_id для группы
+ * @return Имя пользователя (адресат группы) или пустая строка, если 
+ * пользователь не найден
+ */
+static const char * intern_user_name(const struct sqlite_storage * data,
+                                     int64_t user_id){
+  const std::unordered_map<int64_t, std::string> & names =
+    user_id < 0 ? data->group_names : data->user_names;
+  std::unordered_map<int64_t, std::string>::const_iterator it =
+    names.find(user_id < 0 ? -user_id : user_id);
+  return it == names.end() ? "" : it->second.c_str();
+}
+
+
+/**
+ * @brief Функция находит текущее участие пользователя в группе
+ *
+ * @retval NULL Пользователь не состоит в группе
+ * @retval Указатель на участие
+ */
+static struct sqlite_membership * find_member(struct sqlite_storage * data,
+                                              int64_t user_id,
+                                              int64_t group_id){
+  std::unordered_map<int64_t, std::vector<sqlite_membership> >::iterator it =
+    data->memberships.find(user_id);
+
+  if (it == data->memberships.end()){
+    return NULL;
+  }
+  for (size_t i = 0; i < it->second.size(); i++){
+    if (it->second[i].group_id == group_id &&
+        it->second[i].left == STORAGE_CURSOR_MAX){
+      return &it->second[i];
+    }
+  }
+  return NULL;
+}
+
+
+/**
+ * @brief Функция освобождает подготовленные запросы и закрывает базу данных
+ */
+static void sqlite_close(struct storage * st){
+  struct sqlite_storage * data = (struct sqlite_storage *) st->data;
+
+  if (data == NULL){
+    return;
+  }
+  sqlite3_finalize(data->lookup_user);
+  sqlite3_finalize(data->insert_user);
+  sqlite3_finalize(data->claim_user);
+  sqlite3_finalize(data->insert_message);
+  sqlite3_finalize(data->scan_forward);
+  sqlite3_finalize(data->scan_backward);
+  sqlite3_finalize(data->conversation_forward);
+  sqlite3_finalize(data->conversation_backward);
+  sqlite3_finalize(data->put_read_cursor);
+  sqlite3_finalize(data->insert_group);
+  sqlite3_finalize(data->insert_member);
+  sqlite3_finalize(data->close_member);
+  sqlite3_finalize(data->group_forward);
+  sqlite3_finalize(data->group_backward);
+  sqlite3_finalize(data->find_message);
+  sqlite3_finalize(data->update_message);
+  sqlite3_finalize(data->insert_change);
+  sqlite3_finalize(data->compact_messages);
+  sqlite3_finalize(data->compact_changes);
+  sqlite3_finalize(data->insert_key);
+  sqlite3_finalize(data->find_key);
+  sqlite3_finalize(data->migrate_insert);
+  sqlite3_finalize(data->migrate_delete);
+  sqlite3_close(data->db);
+  delete data;
+  st->data = NULL;
+}
+
+
+/**
+ * @brief Функция открывает локальную базу данных, а если она не существует, то создаёт
+ * новую
+ *
+ * У базы данных со старой схемой (имена пользователей в таблице messages) 
+ * при открытии меняется только схема, сообщения переносит sqlite_migrate.
+ *
+ * @param[in] st Хранилище
+ * @param[in] path Путь к базе данных
+ * @retval STORAGE_OK База данных открыта
+ * @retval STORAGE_ERROR База данных не может быть открыта или перенесена
+ */
+static int sqlite_open(struct storage * st, const char * path){
+  struct sqlite_storage * data = new sqlite_storage;
+  int64_t version = 0;
+  int64_t legacy = 0;
+  int i;
+
+  for (i = 0; i < DB_STMT_COUNT; i++){
+    s_statement_metrics[i] = metrics_register_statement(s_statement_names[i]);
+  }
+
+  data->db = NULL;
+  data->lookup_user = NULL;
+  data->insert_user = NULL;
+  data->claim_user = NULL;
+  data->insert_message = NULL;
+  data->scan_forward = NULL;
+  data->scan_backward = NULL;
+  data->conversation_forward = NULL;
+  data->conversation_backward = NULL;
+  data->put_read_cursor = NULL;
+  data->insert_group = NULL;
+  data->insert_member = NULL;
+  data->close_member = NULL;
+  data->group_forward = NULL;
+  data->group_backward = NULL;
+  data->find_message = NULL;
+  data->update_message = NULL;
+  data->insert_change = NULL;
+  data->compact_messages = NULL;
+  data->compact_changes = NULL;
+  data->insert_key = NULL;
+  data->find_key = NULL;
+  data->migrate_insert = NULL;
+  data->migrate_delete = NULL;
+  data->migrate_skipped = 0;
+  data->exec_ns = 0;
+  data->exec_rows = 0;
+  data->timed = 0;
+  st->data = data;
+
+  if (sqlite3_open_v2(path, &data->db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+                                        SQLITE_OPEN_FULLMUTEX, 
+      NULL) != SQLITE_OK){
+    sqlite_close(st);
+    return STORAGE_ERROR;
+  }
+  sqlite3_profile(data->db, db_profile, data);
+  // Without fsync a commit survives a process crash, but not a power loss
+  if ((storage_durability(&storage_sqlite_vtable) == 
+       STORAGE_DURABILITY_PROCESS &&
+       sqlite3_exec(data->db, "PRAGMA synchronous = OFF;", 
+                    0, 0, 0) != SQLITE_OK) ||
+      !db_query_int64(data->db, "PRAGMA user_version;", &version) ||
+      !db_query_int64(data->db, "SELECT COUNT(*) FROM \"sqlite_master\" "
+                      "WHERE \"type\" = 'table' AND \"name\" = 'messages';", 
+                      &legacy) ||
+      (version < DB_SCHEMA_VERSION && legacy && 
+       !db_migrate_v1_begin(data->db)) ||
+      sqlite3_exec(data->db, s_schema_sql, 0, 0, 0) != SQLITE_OK ||
+      !db_migrate_v1_prepare(data) ||
+      !load_users(data) ||
+      !load_groups(data) ||
+      sqlite3_prepare_v2(data->db, "SELECT \"pass_hash\" FROM \"users\" "
+        "WHERE \"user\" = ?;", -1, &data->lookup_user, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(data->db, "INSERT INTO \"users\" "
+        "(\"user\", \"pass_hash\") VALUES (?1, ?2);", -1, 
+        &data->insert_user, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(data->db, "UPDATE \"users\" SET \"pass_hash\" = ?2 "
+        "WHERE \"user\" = ?1 AND \"pass_hash\" IS NULL;", -1, 
+        &data->claim_user, NULL) != SQLITE_OK ||
+      // Writes name the table: during a migration "messages" is a view
+      sqlite3_prepare_v2(data->db, "INSERT INTO \"main\".\"messages\" "
+        "VALUES (?, ?, ?, ?, ?);", -1, &data->insert_message, NULL) != SQLITE_OK ||
+      // Two index range scans, one per direction, merged by message_id
+      sqlite3_prepare_v2(data->db, "SELECT \"message_id\", \"from_id\", "
+        "\"to_id\", \"message\", \"date\" FROM \"messages\" WHERE \"message_id\" IN ("
+        "SELECT \"message_id\" FROM (SELECT \"message_id\" FROM \"messages\" "
+        "WHERE \"from_id\" = ?1 AND \"message_id\" > ?2 ORDER BY \"message_id\" LIMIT ?3) UNION ALL "
+        "SELECT \"message_id\" FROM (SELECT \"message_id\" FROM \"messages\" "
+        "WHERE \"to_id\" = ?1 AND \"message_id\" > ?2 ORDER BY \"message_id\" LIMIT ?3)) "
+        "ORDER BY \"message_id\" LIMIT ?3;", -1, 
+        &data->scan_forward, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(data->db, "SELECT \"message_id\", \"from_id\", "
+        "\"to_id\", \"message\", \"date\" FROM \"messages\" WHERE \"message_id\" IN ("
+        "SELECT \"message_id\" FROM (SELECT \"message_id\" FROM \"messages\" "
+        "WHERE \"from_id\" = ?1 AND \"message_id\" < ?2 ORDER BY \"message_id\" DESC LIMIT ?3) UNION ALL "
+        "SELECT \"message_id\" FROM (SELECT \"message_id\" FROM \"messages\" "
+        "WHERE \"to_id\" = ?1 AND \"message_id\" < ?2 ORDER BY \"message_id\" DESC LIMIT ?3)) "
+        "ORDER BY \"message_id\" DESC LIMIT ?3;", -1, 
+        &data->scan_backward, NULL) != SQLITE_OK ||
+      // The same merge over messages_pair, the reverse direction is skipped 
+      // for a conversation with oneself
+      sqlite3_prepare_v2(data->db, "SELECT \"message_id\", \"from_id\", "
+        "\"to_id\", \"message\", \"date\" FROM \"messages\" WHERE \"message_id\" IN ("
+        "SELECT \"message_id\" FROM (SELECT \"message_id\" FROM \"messages\" "
+        "WHERE \"from_id\" = ?1 AND \"to_id\" = ?2 AND \"message_id\" > ?3 "
+        "ORDER BY \"message_id\" LIMIT ?4) UNION ALL "
+        "SELECT \"message_id\" FROM (SELECT \"message_id\" FROM \"messages\" "
+        "WHERE \"from_id\" = ?2 AND \"to_id\" = ?1 AND ?1 <> ?2 AND \"message_id\" > ?3 "
+        "ORDER BY \"message_id\" LIMIT ?4)) "
+        "ORDER BY \"message_id\" LIMIT ?4;", -1, 
+        &data->conversation_forward, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(data->db, "SELECT \"message_id\", \"from_id\", "
+        "\"to_id\", \"message\", \"date\" FROM \"messages\" WHERE \"message_id\" IN ("
+        "SELECT \"message_id\" FROM (SELECT \"message_id\" FROM \"messages\" "
+        "WHERE \"from_id\" = ?1 AND \"to_id\" = ?2 AND \"message_id\" < ?3 "
+        "ORDER BY \"message_id\" DESC LIMIT ?4) UNION ALL "
+        "SELECT \"message_id\" FROM (SELECT \"message_id\" FROM \"messages\" "
+        "WHERE \"from_id\" = ?2 AND \"to_id\" = ?1 AND ?1 <> ?2 AND \"message_id\" < ?3 "
+        "ORDER BY \"message_id\" DESC LIMIT ?4)) "
+        "ORDER BY \"message_id\" DESC LIMIT ?4;", -1, 
+        &data->conversation_backward, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(data->db, "INSERT OR REPLACE INTO \"read_cursors\" "
+        "VALUES (?, ?, ?);", -1, &data->put_read_cursor, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(data->db, "INSERT INTO \"groups\" (\"name\") "
+        "VALUES (?);", -1, &data->insert_group, NULL) != SQLITE_OK ||
+      // Replaces an empty interval left at the same cursor
+      sqlite3_prepare_v2(data->db, "INSERT OR REPLACE INTO \"group_members\" "
+        "VALUES (?1, ?2, ?3, ?4);", -1, &data->insert_member, 
+        NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(data->db, "UPDATE \"group_members\" SET \"left\" = ?3 "
+        "WHERE \"group_id\" = ?1 AND \"user_id\" = ?2 AND \"left\" = ?4;", 
+        -1, &data->close_member, NULL) != SQLITE_OK ||
+      // One range of messages_to per membership interval
+      sqlite3_prepare_v2(data->db, "SELECT \"message_id\", \"from_id\", "
+        "\"to_id\", \"message\", \"date\" FROM \"messages\" "
+        "WHERE \"to_id\" = ?1 AND \"message_id\" > ?2 AND \"message_id\" <= ?3 "
+        "ORDER BY \"message_id\" LIMIT ?4;", -1, 
+        &data->group_forward, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(data->db, "SELECT \"message_id\", \"from_id\", "
+        "\"to_id\", \"message\", \"date\" FROM \"messages\" "
+        "WHERE \"to_id\" = ?1 AND \"message_id\" > ?2 AND \"message_id\" <= ?3 "
+        "ORDER BY \"message_id\" DESC LIMIT ?4;", -1, 
+        &data->group_backward, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(data->db, "SELECT \"from_id\", \"to_id\", "
+        "\"message\" IS NULL FROM \"messages\" WHERE \"message_id\" = ?;", 
+        -1, &data->find_message, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(data->db, "UPDATE \"main\".\"messages\" SET \"message\" = ?2 "
+        "WHERE \"message_id\" = ?1;", -1, &data->update_message, 
+        NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(data->db, "INSERT INTO \"changes\" (\"message_id\", "
+        "\"from_id\", \"to_id\", \"message\", \"date\") "
+        "VALUES (?, ?, ?, ?, ?);", -1, &data->insert_change, 
+        NULL) != SQLITE_OK ||
+      // Tombstones go first, they are found through the changes to drop
+      sqlite3_prepare_v2(data->db, "DELETE FROM \"main\".\"messages\" "
+        "WHERE \"message_id\" IN (SELECT \"message_id\" FROM \"changes\" "
+        "WHERE \"version\" <= ?1 AND \"message\" IS NULL);", -1, 
+        &data->compact_messages, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(data->db, "DELETE FROM \"changes\" "
+        "WHERE \"version\" <= ?1;", -1, &data->compact_changes, 
+        NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(data->db, "INSERT INTO \"message_keys\" "
+        "VALUES (?, ?, ?);", -1, &data->insert_key, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(data->db, "SELECT \"message_id\" "
+        "FROM \"message_keys\" WHERE \"from_id\" = ? "
+        "AND \"client_msg_id\" = ?;", -1, &data->find_key, 
+        NULL) != SQLITE_OK){
+    sqlite_close(st);
+    return STORAGE_ERROR;
+  }
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция находит пароль зарегистрированного пользователя
+ */
+static int sqlite_lookup_user(struct storage * st, 
+                              const char * user, 
+                              char * pass_hash,
+                              size_t pass_hash_len){
+  struct sqlite_storage * data = (struct sqlite_storage *) st->data;
+  sqlite3_stmt * stmt = data->lookup_user;
+
+  sqlite3_bind_text(stmt, 1, user, strlen(user), SQLITE_STATIC);
+  int result = db_step(data, stmt, DB_STMT_LOOKUP_USER);
+  const char * pass_db = (char*)sqlite3_column_text(stmt, 0);
+  if (result == SQLITE_ROW && pass_db != NULL){
+    result = STORAGE_OK;
+    if (pass_hash != NULL){
+      strncpy(pass_hash, pass_db, pass_hash_len - 1);
+      pass_hash[pass_hash_len - 1] = '\0';
+    }
+  } else {
+    result = result == SQLITE_ROW || result == SQLITE_DONE ? 
+             STORAGE_NOT_FOUND : STORAGE_ERROR;
+  }
+  db_reset(data, stmt, DB_STMT_LOOKUP_USER);
+  return result;
+}
+
+
+/**
+ * @brief Функция регистрирует пользователя. Получатель без пароля, 
+ * оставшийся после миграции схемы, регистрируется установкой пароля
+ */
+static int sqlite_create_user(struct storage * st, 
+                              const char * user, 
+                              const char * pass_hash){
+  struct sqlite_storage * data = (struct sqlite_storage *) st->data;
+  int64_t user_id = intern_user_id(data, user);
+  sqlite3_stmt * stmt = user_id == 0 ? data->insert_user : data->claim_user;
+
+  sqlite3_bind_text(stmt, 1, user, strlen(user), SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, pass_hash, strlen(pass_hash), SQLITE_STATIC);
+  int statement = user_id == 0 ? DB_STMT_INSERT_USER : DB_STMT_CLAIM_USER;
+  int result = db_step(data, stmt, statement);
+  // Read before db_reset, the slow query plan resets them
+  int changes = sqlite3_changes(data->db);
+  int64_t rowid = sqlite3_last_insert_rowid(data->db);
+  db_reset(data, stmt, statement);
+  if (result != SQLITE_DONE && result != SQLITE_CONSTRAINT){
+    return STORAGE_ERROR;
+  }
+  if (result != SQLITE_DONE || changes != 1){
+    return STORAGE_EXISTS;
+  }
+  if (user_id == 0){
+    user_id = rowid;
+    data->user_ids[user] = user_id;
+    data->user_names[user_id] = user;
+  }
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция записывает ключ повтора отправки добавленного сообщения
+ *
+ * @return Результат sqlite3_step, SQLITE_CONSTRAINT - ключ уже записан
+ */
+static int put_key(struct sqlite_storage * data, 
+                   const struct storage_message * message){
+  sqlite3_stmt * stmt = data->insert_key;
+
+  sqlite3_bind_int64(stmt, 1, intern_user_id(data, message->from));
+  sqlite3_bind_text(stmt,  2, message->client_msg_id, 
+                    strlen(message->client_msg_id), SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 3, message->message_id);
+  int result = db_step(data, stmt, DB_STMT_INSERT_KEY);
+  db_reset(data, stmt, DB_STMT_INSERT_KEY);
+  return result;
+}
+
+
+/**
+ * @brief Функция находит сообщение, уже сохранённое с ключом повтора 
+ * отправки
+ *
+ * @retval STORAGE_EXISTS message_id сообщения заполнен
+ * @retval STORAGE_ERROR Ошибка базы данных
+ */
+static int find_key(struct sqlite_storage * data, 
+                    struct storage_message * message){
+  sqlite3_stmt * stmt = data->find_key;
+
+  sqlite3_bind_int64(stmt, 1, intern_user_id(data, message->from));
+  sqlite3_bind_text(stmt,  2, message->client_msg_id, 
+                    strlen(message->client_msg_id), SQLITE_STATIC);
+  int result = db_step(data, stmt, DB_STMT_FIND_KEY);
+  message->message_id = sqlite3_column_int64(stmt, 0);
+  db_reset(data, stmt, DB_STMT_FIND_KEY);
+  return result == SQLITE_ROW ? STORAGE_EXISTS : STORAGE_ERROR;
+}
+
+
+/**
+ * @brief Функция добавляет сообщения одной транзакцией. Повтор отправки 
+ * отклоняется уникальным индексом ключей, тогда транзакция откатывается
+ */
+static int sqlite_put_messages(struct storage * st, 
+                               struct storage_message * messages, 
+                               int count){
+  struct sqlite_storage * data = (struct sqlite_storage *) st->data;
+  sqlite3_stmt * stmt = data->insert_message;
+  int conflict = -1;
+  int i;
+
+  // Recipients are resolved by the in-memory tables, no query needed
+  for (i = 0; i < count; i++){
+    int64_t from_id = intern_user_id(data, messages[i].from);
+    int64_t group_id = intern_group_id(data, messages[i].to);
+    if (from_id == 0 ||
+        (group_id == 0 && intern_user_id(data, messages[i].to) == 0) ||
+        (group_id != 0 && find_member(data, from_id, group_id) == NULL)){
+      return STORAGE_NOT_FOUND;
+    }
+  }
+
+  if (sqlite3_exec(data->db, "BEGIN;", 0, 0, 0) != SQLITE_OK){
+    return STORAGE_ERROR;
+  }
+  for (i = 0; i < count; i++){
+    sqlite3_bind_int64(stmt, 2, intern_user_id(data, messages[i].from));
+    int64_t group_id = intern_group_id(data, messages[i].to);
+    sqlite3_bind_int64(stmt, 3, group_id != 0 ? -group_id : 
+                                intern_user_id(data, messages[i].to));
+    sqlite3_bind_text(stmt,  4, messages[i].message, 
+                      strlen(messages[i].message), SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 5, messages[i].time);
+    int result = db_step(data, stmt, DB_STMT_INSERT_MESSAGE);
+    messages[i].message_id = sqlite3_last_insert_rowid(data->db);
+    db_reset(data, stmt, DB_STMT_INSERT_MESSAGE);
+    if (result != SQLITE_DONE){
+      break;
+    }
+    if (messages[i].client_msg_id != NULL){
+      result = put_key(data, &messages[i]);
+      if (result != SQLITE_DONE){
+        conflict = result == SQLITE_CONSTRAINT ? i : -1;
+        break;
+      }
+    }
+  }
+  if (conflict != -1){
+    sqlite3_exec(data->db, "ROLLBACK;", 0, 0, 0);
+    return find_key(data, &messages[conflict]);
+  }
+  int committed = 0;
+  if (i == count){
+    int64_t start = metrics_now_ns();
+    committed = sqlite3_exec(data->db, "COMMIT;", 0, 0, 0) == SQLITE_OK;
+    int64_t elapsed = metrics_now_ns() - start;
+    // Logged as slow by db_profile, which sees the COMMIT statement
+    metrics_observe_statement(s_statement_metrics[DB_STMT_COMMIT], elapsed);
+    metrics_observe_execution(s_statement_metrics[DB_STMT_COMMIT], elapsed, 0, 
+                              0, s_slow_log != NULL && 
+                                 elapsed >= s_slow_threshold_ns);
+    stall_note_statement(s_statement_names[DB_STMT_COMMIT], elapsed);
+  }
+  if (!committed){
+    sqlite3_exec(data->db, "ROLLBACK;", 0, 0, 0);
+    return STORAGE_ERROR;
+  }
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция читает строки выполняемого запроса обхода сообщений
+ *
+ * @param[in] data Данные хранилища
+ * @param[in] stmt Запрос с привязанными параметрами
+ * @param[in] statement Запрос, enum sqlite_statement
+ * @param[out] rows Массив, в который добавляются строки
+ * @retval 1 Запрос выполнен
+ * @retval 0 Ошибка базы данных
+ */
+static int collect_rows(struct sqlite_storage * data, 
+                        sqlite3_stmt * stmt, 
+                        int statement, 
+                        std::vector<sqlite_row> * rows){
+  int result;
+
+  while ((result = db_step(data, stmt, statement)) == SQLITE_ROW){
+    const char * text = (char*)sqlite3_column_text(stmt, 3);
+    struct sqlite_row row;
+    row.message_id = sqlite3_column_int64(stmt, 0);
+    row.from_id = sqlite3_column_int64(stmt, 1);
+    row.to_id = sqlite3_column_int64(stmt, 2);
+    row.message = text != NULL ? text : "";
+    row.deleted = text == NULL;
+    row.time = sqlite3_column_int64(stmt, 4);
+    rows->push_back(row);
+  }
+  db_reset(data, stmt, statement);
+  return result == SQLITE_DONE;
+}
+
+
+/**
+ * @brief Функция читает не больше limit сообщений группы от курсора, видимых 
+ * в пределах участия
+ *
+ * @retval 1 Сообщения прочитаны
+ * @retval 0 Ошибка базы данных
+ */
+static int collect_group(struct sqlite_storage * data, 
+                         const struct sqlite_membership * membership, 
+                         int64_t cursor,
+                         int direction, 
+                         int limit, 
+                         std::vector<sqlite_row> * rows){
+  int forward = direction == STORAGE_SCAN_FORWARD;
+  sqlite3_stmt * stmt = forward ? data->group_forward : data->group_backward;
+  int64_t after = forward ? std::max(cursor, membership->joined) : 
+                            membership->joined;
+  int64_t through = forward ? membership->left : 
+                              std::min(cursor - 1, membership->left);
+
+  if (after >= through){
+    return 1;
+  }
+  sqlite3_bind_int64(stmt, 1, -membership->group_id);
+  sqlite3_bind_int64(stmt, 2, after);
+  sqlite3_bind_int64(stmt, 3, through);
+  sqlite3_bind_int(stmt, 4, limit);
+  return collect_rows(data, stmt, forward ? DB_STMT_GROUP_FORWARD : 
+                                            DB_STMT_GROUP_BACKWARD, rows);
+}
+
+
+/**
+ * @brief Функция сравнивает строки по message_id для сортировки
+ */
+static bool row_less(const struct sqlite_row & a, 
+                     const struct sqlite_row & b){
+  return a.message_id < b.message_id;
+}
+
+
+/**
+ * @brief Функция сравнивает строки по убыванию message_id для сортировки
+ */
+static bool row_greater(const struct sqlite_row & a, 
+                        const struct sqlite_row & b){
+  return a.message_id > b.message_id;
+}
+
+
+/**
+ * @brief Функция проверяет, что строки - одно сообщение
+ */
+static bool row_same(const struct sqlite_row & a, 
+                     const struct sqlite_row & b){
+  return a.message_id == b.message_id;
+}
+
+
+/**
+ * @brief Функция упорядочивает строки нескольких запросов и передаёт в cb 
+ * первые limit из них
+ */
+static void emit_rows(const struct sqlite_storage * data, 
+                      std::vector<sqlite_row> * rows, 
+                      int direction, 
+                      int limit, 
+                      storage_message_cb cb,
+                      void * arg){
+  struct storage_message message;
+
+  std::sort(rows->begin(), rows->end(), 
+            direction == STORAGE_SCAN_FORWARD ? row_less : row_greater);
+  rows->erase(std::unique(rows->begin(), rows->end(), row_same), rows->end());
+  for (size_t i = 0; i < rows->size() && (int) i < limit; i++){
+    const struct sqlite_row & row = (*rows)[i];
+    message.message_id = row.message_id;
+    message.from = intern_user_name(data, row.from_id);
+    message.to = intern_user_name(data, row.to_id);
+    message.message = row.deleted ? NULL : row.message.c_str();
+    message.time = row.time;
+    message.client_msg_id = NULL;
+    cb(&message, arg);
+  }
+}
+
+
+/**
+ * @brief Функция обходит сообщения пользователя от курсора
+ *
+ * У участника групп личные сообщения и сообщения каждого участия читаются 
+ * отдельными запросами, не больше limit каждый, и сливаются по message_id.
+ */
+static int sqlite_scan_messages(struct storage * st, 
+                                const char * user, 
+                                int64_t cursor,
+                                int direction, 
+                                int limit, 
+                                storage_message_cb cb,
+                                void * arg){
+  struct sqlite_storage * data = (struct sqlite_storage *) st->data;
+  sqlite3_stmt * stmt = direction == STORAGE_SCAN_FORWARD ? 
+                        data->scan_forward : data->scan_backward;
+  int statement = direction == STORAGE_SCAN_FORWARD ? 
+                  DB_STMT_SCAN_FORWARD : DB_STMT_SCAN_BACKWARD;
+  int64_t user_id = intern_user_id(data, user);
+  std::unordered_map<int64_t, std::vector<sqlite_membership> >::const_iterator 
+    groups = data->memberships.find(user_id);
+  struct storage_message message;
+  int result;
+
+  sqlite3_bind_int64(stmt, 1, user_id);
+  sqlite3_bind_int64(stmt, 2, cursor);
+  sqlite3_bind_int(stmt, 3, limit);
+  if (groups != data->memberships.end()){
+    std::vector<sqlite_row> rows;
+    int ok = collect_rows(data, stmt, statement, &rows);
+    for (size_t i = 0; ok && i < groups->second.size(); i++){
+      ok = collect_group(data, &groups->second[i], cursor, direction, limit, 
+                         &rows);
+    }
+    if (!ok){
+      return STORAGE_ERROR;
+    }
+    emit_rows(data, &rows, direction, limit, cb, arg);
+    return STORAGE_OK;
+  }
+  while ((result = db_step(data, stmt, statement)) == SQLITE_ROW){
+    message.message_id = sqlite3_column_int64(stmt, 0);
+    message.from = intern_user_name(data, sqlite3_column_int64(stmt, 1));
+    message.to = intern_user_name(data, sqlite3_column_int64(stmt, 2));
+    message.message = (char*)sqlite3_column_text(stmt, 3);
+    message.time = sqlite3_column_int64(stmt, 4);
+    message.client_msg_id = NULL;
+    cb(&message, arg);
+  }
+  db_reset(data, stmt, statement);
+  return result == SQLITE_DONE ? STORAGE_OK : STORAGE_ERROR;
+}
+
+
+/**
+ * @brief Функция обходит сообщения пары собеседников от курсора
+ */
+static int sqlite_scan_conversation(struct storage * st, 
+                                    const char * user, 
+                                    const char * peer, 
+                                    int64_t cursor,
+                                    int direction, 
+                                    int limit, 
+                                    storage_message_cb cb,
+                                    void * arg){
+  struct sqlite_storage * data = (struct sqlite_storage *) st->data;
+  sqlite3_stmt * stmt = direction == STORAGE_SCAN_FORWARD ? 
+                        data->conversation_forward : 
+                        data->conversation_backward;
+  int statement = direction == STORAGE_SCAN_FORWARD ? 
+                  DB_STMT_CONVERSATION_FORWARD : 
+                  DB_STMT_CONVERSATION_BACKWARD;
+  int64_t peer_id = intern_user_id(data, peer);
+  struct storage_message message;
+  int result;
+
+  if (peer[0] == STORAGE_GROUP_PREFIX){
+    int64_t group_id = intern_group_id(data, peer);
+    std::unordered_map<int64_t, std::vector<sqlite_membership> >::const_iterator 
+      groups = data->memberships.find(intern_user_id(data, user));
+    std::vector<sqlite_row> rows;
+    if (group_id == 0){
+      return STORAGE_NOT_FOUND;
+    }
+    for (size_t i = 0; groups != data->memberships.end() && 
+                       i < groups->second.size(); i++){
+      if (groups->second[i].group_id == group_id &&
+          !collect_group(data, &groups->second[i], cursor, direction, limit, 
+                         &rows)){
+        return STORAGE_ERROR;
+      }
+    }
+    emit_rows(data, &rows, direction, limit, cb, arg);
+    return STORAGE_OK;
+  }
+  if (peer_id == 0){
+    return STORAGE_NOT_FOUND;
+  }
+  sqlite3_bind_int64(stmt, 1, intern_user_id(data, user));
+  sqlite3_bind_int64(stmt, 2, peer_id);
+  sqlite3_bind_int64(stmt, 3, cursor);
+  sqlite3_bind_int(stmt, 4, limit);
+  while ((result = db_step(data, stmt, statement)) == SQLITE_ROW){
+    message.message_id = sqlite3_column_int64(stmt, 0);
+    message.from = intern_user_name(data, sqlite3_column_int64(stmt, 1));
+    message.to = intern_user_name(data, sqlite3_column_int64(stmt, 2));
+    message.message = (char*)sqlite3_column_text(stmt, 3);
+    message.time = sqlite3_column_int64(stmt, 4);
+    message.client_msg_id = NULL;
+    cb(&message, arg);
+  }
+  db_reset(data, stmt, statement);
+  return result == SQLITE_DONE ? STORAGE_OK : STORAGE_ERROR;
+}
+
+
+/**
+ * @brief Функция находит последнее сообщение каждого пользователя одним 
+ * агрегирующим запросом
+ */
+static int sqlite_scan_latest(struct storage * st, 
+                              storage_latest_cb cb, 
+                              void * arg){
+  struct sqlite_storage * data = (struct sqlite_storage *) st->data;
+  sqlite3_stmt * stmt = NULL;
+
+  if (sqlite3_prepare_v2(data->db, "SELECT \"user_id\", MAX(\"id\") FROM ("
+  "SELECT \"from_id\" AS \"user_id\", MAX(\"message_id\") AS \"id\" "
+  "FROM \"messages\" WHERE \"to_id\" > 0 GROUP BY \"from_id\" UNION ALL "
+  "SELECT \"to_id\", MAX(\"message_id\") FROM \"messages\" GROUP BY \"to_id\") "
+  "GROUP BY \"user_id\";", -1, &stmt, NULL) != SQLITE_OK){
+    sqlite3_finalize(stmt);
+    return STORAGE_ERROR;
+  }
+  int result;
+  while ((result = db_step(data, stmt, DB_STMT_SCAN_LATEST)) == SQLITE_ROW){
+    cb(intern_user_name(data, sqlite3_column_int64(stmt, 0)),
+       sqlite3_column_int64(stmt, 1), arg);
+  }
+  db_reset(data, stmt, DB_STMT_SCAN_LATEST);
+  sqlite3_finalize(stmt);
+  return result == SQLITE_DONE ? STORAGE_OK : STORAGE_ERROR;
+}
+
+
+/**
+ * @brief Функция запоминает последнее прочитанное сообщение переписки
+ */
+static int sqlite_put_read_cursor(struct storage * st, 
+                                  const char * user, 
+                                  const char * peer, 
+                                  int64_t message_id){
+  struct sqlite_storage * data = (struct sqlite_storage *) st->data;
+  sqlite3_stmt * stmt = data->put_read_cursor;
+  int64_t user_id = intern_user_id(data, user);
+  int64_t peer_id = intern_user_id(data, peer);
+
+  if (user_id == 0 || peer_id == 0){
+    return STORAGE_NOT_FOUND;
+  }
+  sqlite3_bind_int64(stmt, 1, user_id);
+  sqlite3_bind_int64(stmt, 2, peer_id);
+  sqlite3_bind_int64(stmt, 3, message_id);
+  int result = db_step(data, stmt, DB_STMT_PUT_READ_CURSOR);
+  db_reset(data, stmt, DB_STMT_PUT_READ_CURSOR);
+  return result == SQLITE_DONE ? STORAGE_OK : STORAGE_ERROR;
+}
+
+
+/// Переписка пары собеседников first <= second при обходе всех переписок
+struct sqlite_pair {
+  int64_t last; ///< Последнее сообщение переписки
+  int64_t unread[2]; ///< Непрочитанные сообщения first и second
+};
+
+
+/**
+ * @brief Функция передаёт в cb сводки всех переписок обоих собеседников
+ *
+ * Последнее сообщение каждого направления находится одним группирующим 
+ * обходом индекса messages_pair, без чтения таблицы. Непрочитанные сообщения 
+ * считаются обходом диапазона индекса только для направлений, в которых они 
+ * есть, текст читается только у последнего сообщения пары. Выполняется один 
+ * раз при запуске сервера.
+ */
+static int sqlite_scan_conversations(struct storage * st, 
+                                     storage_conversation_cb cb, 
+                                     void * arg){
+  struct sqlite_storage * data = (struct sqlite_storage *) st->data;
+  std::map<std::pair<int64_t, int64_t>, int64_t> cursors;
+  std::map<std::pair<int64_t, int64_t>, struct sqlite_pair> pairs;
+  sqlite3_stmt * stmt = NULL;
+  sqlite3_stmt * count = NULL;
+  sqlite3_stmt * last = NULL;
+  int result;
+
+  if (sqlite3_prepare_v2(data->db, "SELECT \"user_id\", \"peer_id\", "
+        "\"message_id\" FROM \"read_cursors\";", -1, &stmt, 
+        NULL) != SQLITE_OK){
+    sqlite3_finalize(stmt);
+    return STORAGE_ERROR;
+  }
+  while ((result = sqlite3_step(stmt)) == SQLITE_ROW){
+    cursors[std::make_pair(sqlite3_column_int64(stmt, 0), 
+                           sqlite3_column_int64(stmt, 1))] = 
+      sqlite3_column_int64(stmt, 2);
+  }
+  sqlite3_finalize(stmt);
+  stmt = NULL;
+  if (result != SQLITE_DONE ||
+      sqlite3_prepare_v2(data->db, "SELECT \"from_id\", \"to_id\", "
+        "MAX(\"message_id\") FROM \"messages\" "
+        "GROUP BY \"from_id\", \"to_id\";", -1, &stmt, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(data->db, "SELECT COUNT(*) FROM \"messages\" "
+        "WHERE \"from_id\" = ? AND \"to_id\" = ? AND \"message_id\" > ?;", 
+        -1, &count, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(data->db, "SELECT \"from_id\", \"to_id\", "
+        "\"message\", \"date\" FROM \"messages\" WHERE \"message_id\" = ?;", 
+        -1, &last, NULL) != SQLITE_OK){
+    sqlite3_finalize(stmt);
+    sqlite3_finalize(count);
+    sqlite3_finalize(last);
+    return STORAGE_ERROR;
+  }
+  while ((result = db_step(data, stmt, DB_STMT_SCAN_CONVERSATIONS)) == 
+         SQLITE_ROW){
+    int64_t from = sqlite3_column_int64(stmt, 0);
+    int64_t to = sqlite3_column_int64(stmt, 1);
+    int64_t message_id = sqlite3_column_int64(stmt, 2);
+    if (to < 0){
+      continue; // group messages are not conversations
+    }
+    std::pair<int64_t, int64_t> key = from < to ? std::make_pair(from, to) :
+                                                  std::make_pair(to, from);
+    std::map<std::pair<int64_t, int64_t>, struct sqlite_pair>::iterator it =
+      pairs.find(key);
+    if (it == pairs.end()){
+      struct sqlite_pair pair = { 0, { 0, 0 } };
+      it = pairs.insert(std::make_pair(key, pair)).first;
+    }
+    if (message_id > it->second.last){
+      it->second.last = message_id;
+    }
+    std::map<std::pair<int64_t, int64_t>, int64_t>::const_iterator cursor =
+      cursors.find(std::make_pair(to, from));
+    int64_t read = cursor == cursors.end() ? 0 : cursor->second;
+    if (from == to || message_id <= read){
+      continue;
+    }
+    sqlite3_bind_int64(count, 1, from);
+    sqlite3_bind_int64(count, 2, to);
+    sqlite3_bind_int64(count, 3, read);
+    if (sqlite3_step(count) == SQLITE_ROW){
+      it->second.unread[to == key.first ? 0 : 1] = 
+        sqlite3_column_int64(count, 0);
+    }
+    sqlite3_reset(count);
+  }
+  db_reset(data, stmt, DB_STMT_SCAN_CONVERSATIONS);
+  sqlite3_finalize(stmt);
+  sqlite3_finalize(count);
+
+  std::map<std::pair<int64_t, int64_t>, struct sqlite_pair>::const_iterator it;
+  for (it = pairs.begin(); it != pairs.end() && result == SQLITE_DONE; ++it){
+    struct storage_conversation conversation;
+    sqlite3_bind_int64(last, 1, it->second.last);
+    if (sqlite3_step(last) != SQLITE_ROW){
+      result = SQLITE_ERROR;
+      break;
+    }
+    conversation.last.message_id = it->second.last;
+    conversation.last.from = intern_user_name(data, 
+                                              sqlite3_column_int64(last, 0));
+    conversation.last.to = intern_user_name(data, 
+                                            sqlite3_column_int64(last, 1));
+    conversation.last.message = (char*)sqlite3_column_text(last, 2);
+    conversation.last.time = sqlite3_column_int64(last, 3);
+    for (int side = 0; side < (it->first.first == it->first.second ? 1 : 2); 
+         side++){
+      int64_t user = side == 0 ? it->first.first : it->first.second;
+      int64_t peer = side == 0 ? it->first.second : it->first.first;
+      std::map<std::pair<int64_t, int64_t>, int64_t>::const_iterator cursor =
+        cursors.find(std::make_pair(user, peer));
+      conversation.user = intern_user_name(data, user);
+      conversation.peer = intern_user_name(data, peer);
+      conversation.read = cursor == cursors.end() ? 0 : cursor->second;
+      conversation.unread = it->second.unread[side];
+      cb(&conversation, arg);
+    }
+    sqlite3_reset(last);
+  }
+  sqlite3_finalize(last);
+  return result == SQLITE_DONE ? STORAGE_OK : STORAGE_ERROR;
+}
+
+
+/**
+ * @brief Функция возвращает последний выданный message_id
+ *
+ * @retval 1 Значение прочитано
+ * @retval 0 Ошибка базы данных
+ */
+static int last_message_id(struct sqlite_storage * data, 
+                           int64_t * cursor){
+  return db_query_int64(data->db, "SELECT \"seq\" FROM \"sqlite_sequence\" "
+                        "WHERE \"name\" = 'messages';", cursor);
+}
+
+
+/**
+ * @brief Функция создаёт группу, создатель становится её участником
+ */
+static int sqlite_create_group(struct storage * st, 
+                               const char * group, 
+                               const char * user){
+  struct sqlite_storage * data = (struct sqlite_storage *) st->data;
+  int64_t user_id = intern_user_id(data, user);
+  int64_t cursor = 0;
+
+  if (data->group_ids.count(group)){
+    return STORAGE_EXISTS;
+  }
+  if (user_id == 0){
+    return STORAGE_NOT_FOUND;
+  }
+  if (!last_message_id(data, &cursor) || 
+      sqlite3_exec(data->db, "BEGIN;", 0, 0, 0) != SQLITE_OK){
+    return STORAGE_ERROR;
+  }
+  sqlite3_bind_text(data->insert_group, 1, group, strlen(group), 
+                    SQLITE_STATIC);
+  int result = db_step(data, data->insert_group, DB_STMT_INSERT_GROUP);
+  int64_t group_id = sqlite3_last_insert_rowid(data->db);
+  db_reset(data, data->insert_group, DB_STMT_INSERT_GROUP);
+  if (result == SQLITE_DONE){
+    sqlite3_bind_int64(data->insert_member, 1, group_id);
+    sqlite3_bind_int64(data->insert_member, 2, user_id);
+    sqlite3_bind_int64(data->insert_member, 3, cursor);
+    sqlite3_bind_int64(data->insert_member, 4, STORAGE_CURSOR_MAX);
+    result = db_step(data, data->insert_member, DB_STMT_PUT_MEMBER);
+    db_reset(data, data->insert_member, DB_STMT_PUT_MEMBER);
+  }
+  if (result != SQLITE_DONE || 
+      sqlite3_exec(data->db, "COMMIT;", 0, 0, 0) != SQLITE_OK){
+    sqlite3_exec(data->db, "ROLLBACK;", 0, 0, 0);
+    return result == SQLITE_CONSTRAINT ? STORAGE_EXISTS : STORAGE_ERROR;
+  }
+  struct sqlite_membership membership = { 
+    group_id, cursor, STORAGE_CURSOR_MAX 
+  };
+  data->group_ids[group] = group_id;
+  data->group_names[group_id] = std::string(1, STORAGE_GROUP_PREFIX) + group;
+  data->memberships[user_id].push_back(membership);
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция начинает или заканчивает участие пользователя в группе
+ */
+static int sqlite_put_member(struct storage * st, 
+                             const char * group, 
+                             const char * user, 
+                             int joined, 
+                             int64_t * cursor){
+  struct sqlite_storage * data = (struct sqlite_storage *) st->data;
+  int64_t user_id = intern_user_id(data, user);
+  std::unordered_map<std::string, int64_t>::const_iterator it =
+    data->group_ids.find(group);
+
+  if (user_id == 0 || it == data->group_ids.end()){
+    return STORAGE_NOT_FOUND;
+  }
+  struct sqlite_membership * current = find_member(data, user_id, it->second);
+  if ((current != NULL) == (joined != 0)){
+    return STORAGE_EXISTS;
+  }
+  if (!last_message_id(data, cursor)){
+    return STORAGE_ERROR;
+  }
+  sqlite3_stmt * stmt = joined ? data->insert_member : data->close_member;
+  sqlite3_bind_int64(stmt, 1, it->second);
+  sqlite3_bind_int64(stmt, 2, user_id);
+  sqlite3_bind_int64(stmt, 3, *cursor);
+  sqlite3_bind_int64(stmt, 4, STORAGE_CURSOR_MAX);
+  int result = db_step(data, stmt, DB_STMT_PUT_MEMBER);
+  db_reset(data, stmt, DB_STMT_PUT_MEMBER);
+  if (result != SQLITE_DONE){
+    return STORAGE_ERROR;
+  }
+  if (current != NULL){
+    current->left = *cursor;
+  } else {
+    struct sqlite_membership membership = { 
+      it->second, *cursor, STORAGE_CURSOR_MAX 
+    };
+    data->memberships[user_id].push_back(membership);
+  }
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция передаёт в cb все участия в группах из таблицы в памяти
+ */
+static int sqlite_scan_members(struct storage * st, 
+                               storage_membership_cb cb, 
+                               void * arg){
+  struct sqlite_storage * data = (struct sqlite_storage *) st->data;
+  std::unordered_map<int64_t, std::vector<sqlite_membership> >::const_iterator 
+    it;
+  struct storage_membership membership;
+
+  for (it = data->memberships.begin(); it != data->memberships.end(); ++it){
+    for (size_t i = 0; i < it->second.size(); i++){
+      // Group addresses start with the prefix, names do not
+      membership.group = intern_user_name(data, -it->second[i].group_id) + 1;
+      membership.user = intern_user_name(data, it->first);
+      membership.joined = it->second[i].joined;
+      membership.left = it->second[i].left;
+      cb(&membership, arg);
+    }
+  }
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция правит или удаляет сообщение отправителя одной транзакцией
+ */
+static int sqlite_put_change(struct storage * st, 
+                             struct storage_change * change){
+  struct sqlite_storage * data = (struct sqlite_storage *) st->data;
+  int64_t from_id = intern_user_id(data, change->from);
+  sqlite3_stmt * stmt = data->find_message;
+
+  sqlite3_bind_int64(stmt, 1, change->message_id);
+  int result = db_step(data, stmt, DB_STMT_FIND_MESSAGE);
+  int found = result == SQLITE_ROW && from_id != 0 &&
+              sqlite3_column_int64(stmt, 0) == from_id &&
+              sqlite3_column_int(stmt, 2) == 0;
+  int64_t to_id = sqlite3_column_int64(stmt, 1);
+  db_reset(data, stmt, DB_STMT_FIND_MESSAGE);
+  if (result != SQLITE_ROW && result != SQLITE_DONE){
+    return STORAGE_ERROR;
+  }
+  if (!found){
+    return STORAGE_NOT_FOUND;
+  }
+  if (sqlite3_exec(data->db, "BEGIN;", 0, 0, 0) != SQLITE_OK){
+    return STORAGE_ERROR;
+  }
+  // A message of the old schema is moved first, the update sees only the table
+  if (data->migrate_insert != NULL &&
+      !db_migrate_v1_range(data, change->message_id, change->message_id)){
+    sqlite3_exec(data->db, "ROLLBACK;", 0, 0, 0);
+    return STORAGE_ERROR;
+  }
+  stmt = data->update_message;
+  sqlite3_bind_int64(stmt, 1, change->message_id);
+  if (change->message != NULL){
+    sqlite3_bind_text(stmt, 2, change->message, strlen(change->message), 
+                      SQLITE_STATIC);
+  } else {
+    sqlite3_bind_null(stmt, 2);
+  }
+  result = db_step(data, stmt, DB_STMT_UPDATE_MESSAGE);
+  db_reset(data, stmt, DB_STMT_UPDATE_MESSAGE);
+  if (result == SQLITE_DONE){
+    stmt = data->insert_change;
+    sqlite3_bind_int64(stmt, 1, change->message_id);
+    sqlite3_bind_int64(stmt, 2, from_id);
+    sqlite3_bind_int64(stmt, 3, to_id);
+    if (change->message != NULL){
+      sqlite3_bind_text(stmt, 4, change->message, strlen(change->message), 
+                        SQLITE_STATIC);
+    } else {
+      sqlite3_bind_null(stmt, 4);
+    }
+    sqlite3_bind_int64(stmt, 5, change->time);
+    result = db_step(data, stmt, DB_STMT_INSERT_CHANGE);
+    change->version = sqlite3_last_insert_rowid(data->db);
+    db_reset(data, stmt, DB_STMT_INSERT_CHANGE);
+  }
+  if (result != SQLITE_DONE || 
+      sqlite3_exec(data->db, "COMMIT;", 0, 0, 0) != SQLITE_OK){
+    sqlite3_exec(data->db, "ROLLBACK;", 0, 0, 0);
+    return STORAGE_ERROR;
+  }
+  change->to = intern_user_name(data, to_id);
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция передаёт в cb все несжатые изменения
+ *
+ * Граница сжатия - версия перед первым оставшимся изменением, а если 
+ * изменений нет, последняя выданная версия.
+ */
+static int sqlite_scan_changes(struct storage * st, 
+                               int64_t * horizon, 
+                               storage_change_cb cb, 
+                               void * arg){
+  struct sqlite_storage * data = (struct sqlite_storage *) st->data;
+  sqlite3_stmt * stmt = NULL;
+  struct storage_change change;
+
+  if (!db_query_int64(data->db, "SELECT COALESCE("
+        "(SELECT MIN(\"version\") - 1 FROM \"changes\"), "
+        "(SELECT \"seq\" FROM \"sqlite_sequence\" WHERE \"name\" = 'changes'), "
+        "0);", horizon) ||
+      sqlite3_prepare_v2(data->db, "SELECT \"version\", \"message_id\", "
+        "\"from_id\", \"to_id\", \"message\", \"date\" FROM \"changes\" "
+        "ORDER BY \"version\";", -1, &stmt, NULL) != SQLITE_OK){
+    sqlite3_finalize(stmt);
+    return STORAGE_ERROR;
+  }
+  int result;
+  while ((result = db_step(data, stmt, DB_STMT_SCAN_CHANGES)) == SQLITE_ROW){
+    change.version = sqlite3_column_int64(stmt, 0);
+    change.message_id = sqlite3_column_int64(stmt, 1);
+    change.from = intern_user_name(data, sqlite3_column_int64(stmt, 2));
+    change.to = intern_user_name(data, sqlite3_column_int64(stmt, 3));
+    change.message = (char*)sqlite3_column_text(stmt, 4);
+    change.time = sqlite3_column_int64(stmt, 5);
+    cb(&change, arg);
+  }
+  db_reset(data, stmt, DB_STMT_SCAN_CHANGES);
+  sqlite3_finalize(stmt);
+  return result == SQLITE_DONE ? STORAGE_OK : STORAGE_ERROR;
+}
+
+
+/**
+ * @brief Функция удаляет изменения до версии through и удалённые ими 
+ * сообщения одной транзакцией
+ */
+static int sqlite_compact_changes(struct storage * st, 
+                                  int64_t through){
+  struct sqlite_storage * data = (struct sqlite_storage *) st->data;
+
+  if (sqlite3_exec(data->db, "BEGIN;", 0, 0, 0) != SQLITE_OK){
+    return STORAGE_ERROR;
+  }
+  sqlite3_bind_int64(data->compact_messages, 1, through);
+  int result = db_step(data, data->compact_messages, DB_STMT_COMPACT_CHANGES);
+  db_reset(data, data->compact_messages, DB_STMT_COMPACT_CHANGES);
+  if (result == SQLITE_DONE){
+    sqlite3_bind_int64(data->compact_changes, 1, through);
+    result = db_step(data, data->compact_changes, DB_STMT_COMPACT_CHANGES);
+    db_reset(data, data->compact_changes, DB_STMT_COMPACT_CHANGES);
+  }
+  if (result != SQLITE_DONE || 
+      sqlite3_exec(data->db, "COMMIT;", 0, 0, 0) != SQLITE_OK){
+    sqlite3_exec(data->db, "ROLLBACK;", 0, 0, 0);
+    return STORAGE_ERROR;
+  }
+  return STORAGE_OK;
+}
+
+
+/**
+ * @brief Функция переносит порцию сообщений старой схемы одной транзакцией
+ *
+ * Когда старая таблица пустеет, она удаляется вместе с представлением, 
+ * объединявшим её с новой таблицей, и подготовленные запросы при следующем 
+ * выполнении перекомпилируются уже для таблицы.
+ */
+static int sqlite_migrate(struct storage * st){
+  struct sqlite_storage * data = (struct sqlite_storage *) st->data;
+  int64_t lo = 0;
+
+  if (data->migrate_insert == NULL){
+    return 0;
+  }
+  if (!db_query_int64(data->db, "SELECT MIN(\"message_id\") "
+                      "FROM \"messages_legacy\";", &lo)){
+    return 1;
+  }
+  if (lo == 0){
+    sqlite3_finalize(data->migrate_insert);
+    sqlite3_finalize(data->migrate_delete);
+    data->migrate_insert = NULL;
+    data->migrate_delete = NULL;
+    if (sqlite3_exec(data->db, "BEGIN;"
+      "DROP TABLE \"messages_legacy\";"
+      "DROP VIEW \"temp\".\"messages\";"
+      "COMMIT;", 0, 0, 0) != SQLITE_OK){
+      // The next start resumes the migration with nothing left to move
+      sqlite3_exec(data->db, "ROLLBACK;", 0, 0, 0);
+      fprintf(stderr, "Cannot drop migrated table: %s\n", 
+              sqlite3_errmsg(data->db));
+      return 0;
+    }
+    fprintf(stderr, "Migrated to schema v1, skipped %" INT64_FMT 
+            " messages without sender or recipient\n", data->migrate_skipped);
+    return 0;
+  }
+  // On error the chunk is retried on the next iteration
+  if (sqlite3_exec(data->db, "BEGIN;", 0, 0, 0) != SQLITE_OK){
+    return 1;
+  }
+  if (!db_migrate_v1_range(data, lo, lo + DB_MIGRATION_CHUNK - 1) ||
+      sqlite3_exec(data->db, "COMMIT;", 0, 0, 0) != SQLITE_OK){
+    sqlite3_exec(data->db, "ROLLBACK;", 0, 0, 0);
+  }
+  return 1;
+}
+
+
+const struct storage_vtable storage_sqlite_vtable = {
+  "sqlite",
+  STORAGE_DURABILITY_DISK,
+  sqlite_open,
+  sqlite_close,
+  sqlite_lookup_user,
+  sqlite_create_user,
+  sqlite_put_messages,
+  sqlite_scan_messages,
+  sqlite_scan_conversation,
+  sqlite_scan_latest,
+  sqlite_put_read_cursor,
+  sqlite_scan_conversations,
+  sqlite_create_group,
+  sqlite_put_member,
+  sqlite_scan_members,
+  sqlite_put_change,
+  sqlite_scan_changes,
+  sqlite_compact_changes,
+  sqlite_migrate
+};
@@ -0,0 +1,195 @@
+/**
+ * @file
+ * @brief Очередь пробуждения цикла событий
+ *
+ * Очередь - интрузивный стек с несколькими производителями и одним
+ * потребителем: производитель добавляет элемент в голову сравнением с
+ * обменом, цикл событий забирает весь стек одним обменом на NULL и
+ * разворачивает его, чтобы обработать элементы в порядке постановки.
+ *
+ * Цикл событий будит пара сокетов: mongoose читает сокеты через recv, поэтому
+ * eventfd в его цикле опроса не работает. Байт пробуждения пишется только
+ * производителем, заставшим очередь пустой, и без ожидания, так что на
+ * пачку элементов приходится один системный вызов.
+ *
+ * Очередь принадлежит соединению читающего сокета и освобождается при его
+ * закрытии в mg_mgr_free. Производители должны остановиться раньше.
+ *
+ */
+
+#include <atomic>
+#include <unordered_set>
+#include <vector>
+
+#include "wakeup.h"
+
+/// Элемент очереди
+struct wakeup_item {
+  struct wakeup_item * next; ///< Следующий элемент, более ранний
+  struct mg_connection * nc; ///< Соединение-адресат или NULL
+  wakeup_handler_t handler; ///< Обработчик
+  void * data; ///< Данные для обработчика
+};
+
+/// Очередь пробуждения
+struct wakeup_queue {
+  std::atomic<struct wakeup_item *> head; ///< Последний поставленный элемент
+  sock_t sock; ///< Пишущий сокет пары
+};
+
+
+/**
+ * @brief Функция переводит сокет в неблокирующий режим
+ */
+static void set_non_blocking(sock_t sock){
+#ifdef _WIN32
+  unsigned long on = 1;
+  ioctlsocket(sock, FIONBIO, &on);
+#else
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+#endif
+}
+
+
+/**
+ * @brief Функция проверяет, что неблокирующий вызов не выполнен из-за
+ * заполненного буфера сокета
+ */
+static int would_block(void){
+#ifdef _WIN32
+  return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+
+/**
+ * @brief Функция забирает из очереди все элементы и вызывает их обработчики
+ *
+ * Адресаты проверяются одним проходом по открытым соединениям на всю пачку.
+ * Соединение, закрытое и созданное заново по тому же адресу, от прежнего
+ * не отличить.
+ *
+ * @param[in] queue Очередь
+ * @param[in] mgr Менеджер соединений или NULL, если соединения закрываются
+ */
+static void drain(struct wakeup_queue * queue, struct mg_mgr * mgr){
+  struct wakeup_item * item = queue->head.exchange(NULL);
+  std::vector<struct wakeup_item *> batch;
+  std::unordered_set<struct mg_connection *> targets;
+  std::unordered_set<struct mg_connection *> alive;
+  struct mg_connection * c;
+  size_t i;
+
+  for (; item != NULL; item = item->next){
+    batch.push_back(item);
+    if (item->nc != NULL){
+      targets.insert(item->nc);
+    }
+  }
+  if (mgr != NULL && !targets.empty()){
+    for (c = mg_next(mgr, NULL); c != NULL; c = mg_next(mgr, c)){
+      if (targets.count(c) != 0 && !(c->flags & MG_F_CLOSE_IMMEDIATELY)){
+        alive.insert(c);
+      }
+    }
+  }
+  for (i = batch.size(); i > 0; i--){
+    item = batch[i - 1];
+    item->handler(alive.count(item->nc) != 0 ? item->nc : NULL, item->data);
+    delete item;
+  }
+}
+
+
+/**
+ * @brief Функция-обработчик событий читающего сокета
+ */
+static void wakeup_handler(struct mg_connection * nc, int ev, void * ev_data){
+  struct wakeup_queue * queue = (struct wakeup_queue *) nc->user_data;
+
+  (void) ev_data;
+  switch (ev){
+    case MG_EV_RECV:
+      mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+      drain(queue, nc->mgr);
+      break;
+    case MG_EV_CLOSE:
+      // Handlers still get their data to free it
+      drain(queue, NULL);
+      closesocket(queue->sock);
+      delete queue;
+      nc->user_data = NULL;
+      break;
+    default:
+      break;
+  }
+}
+
+
+/**
+ * @brief Функция создаёт очередь пробуждения цикла событий mgr
+ *
+ * Функция вызывается из потока цикла событий. Очередь освобождается в
+ * mg_mgr_free.
+ *
+ * @param[in] mgr Менеджер соединений
+ * @return Очередь или NULL, если не удалось создать пару сокетов
+ */
+struct wakeup_queue * wakeup_create(struct mg_mgr * mgr){
+  sock_t sp[2];
+  struct mg_connection * nc;
+
+  if (!mg_socketpair(sp, SOCK_STREAM)){
+    return NULL;
+  }
+  if ((nc = mg_add_sock(mgr, sp[1], wakeup_handler)) == NULL){
+    closesocket(sp[0]);
+    closesocket(sp[1]);
+    return NULL;
+  }
+  set_non_blocking(sp[0]);
+
+  struct wakeup_queue * queue = new wakeup_queue;
+  queue->head = NULL;
+  queue->sock = sp[0];
+  nc->user_data = queue;
+  return queue;
+}
+
+
+/**
+ * @brief Функция ставит вызов обработчика в очередь цикла событий
+ *
+ * Функция может вызываться из любого потока и не ждёт вызова обработчика.
+ *
+ * @param[in] queue Очередь
+ * @param[in] nc Соединение-адресат или NULL
+ * @param[in] handler Обработчик, вызывается в потоке цикла событий
+ * @param[in] data Данные для обработчика
+ * @retval 1 Вызов поставлен в очередь
+ * @retval 0 Не удалось разбудить цикл событий, вызов останется в очереди
+ * до следующего пробуждения
+ */
+int wakeup_post(struct wakeup_queue * queue,
+                struct mg_connection * nc,
+                wakeup_handler_t handler,
+                void * data){
+  struct wakeup_item * item = new wakeup_item;
+  struct wakeup_item * head = queue->head.load();
+
+  item->nc = nc;
+  item->handler = handler;
+  item->data = data;
+  // The item may be drained and deleted as soon as it is published
+  do {
+    item->next = head;
+  } while (!queue->head.compare_exchange_weak(head, item));
+  if (head != NULL){
+    // The consumer has not drained yet, the wakeup is already pending
+    return 1;
+  }
+  // A full socket buffer also means a wakeup is pending
+  return send(queue->sock, "", 1, 0) == 1 || would_block() ? 1 : 0;
+}
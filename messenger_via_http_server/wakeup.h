@@ -0,0 +1,40 @@
+/**
+ * @file
+ * @brief Заголовочный файл очереди пробуждения цикла событий.
+ *
+ * mg_broadcast копирует данные в управляющий сокет, ждёт, пока цикл событий
+ * вызовет обработчик для каждого соединения, и только потом возвращается.
+ * Очередь пробуждения позволяет другим потокам передать в цикл событий
+ * работу для одного соединения или одного обработчика, не дожидаясь её
+ * выполнения. Постановка в очередь не блокируется и не захватывает
+ * блокировок, цикл событий забирает накопившиеся элементы одной пачкой
+ * внутри mg_mgr_poll.
+ *
+ */
+
+#ifndef _MESSENGER_VIA_HTTP_SERVER__WAKEUP_H_
+#define _MESSENGER_VIA_HTTP_SERVER__WAKEUP_H_
+
+#include "mongoose.h"
+
+/**
+ * @brief Обработчик элемента очереди, вызывается в потоке цикла событий
+ *
+ * @param[in] nc Соединение-адресат или NULL, если адресат не задан или уже
+ * закрыт
+ * @param[in] data Данные, переданные в wakeup_post
+ */
+typedef void (*wakeup_handler_t)(struct mg_connection * nc, void * data);
+
+struct wakeup_queue;
+
+struct wakeup_queue * wakeup_create(struct mg_mgr * mgr);
+
+
+int wakeup_post(struct wakeup_queue * queue,
+                struct mg_connection * nc,
+                wakeup_handler_t handler,
+                void * data);
+
+
+#endif //_MESSENGER_VIA_HTTP_SERVER__WAKEUP_H_
@@ -0,0 +1,816 @@
+/**
+ * @file
+ * @brief Микробенчмарки составляющих обработки одного запроса к api
+ *
+ * Без сети измеряются разбор HTTP запроса, поиск параметров в теле запроса,
+ * разбор заголовка авторизации, определение действия, сборка JSON сообщения
+ * и проверка авторизации по хранилищу SQLite в памяти. Бенчмарки round_trip
+ * прогоняют полный запрос клиента через разбор HTTP, db_op и хранилище,
+ * соединяя клиента и сервер через loopback_iface_vtable вместо сокетов.
+ * Бенчмарки send_batch прогоняют так же пакетную отправку с размерами 
+ * пакета от 1 до BATCH_MAX_SIZE и выводят пропускную способность в 
+ * сообщениях в секунду.
+ * Бенчмарки fan_out отправляют одно сообщение многим соединениям копиями
+ * через mg_send и ссылками на shared_payload. Бенчмарк
+ * shared_payload/order_after_partial_send пишет в соединение через
+ * shared_payload_write и mg_printf, пока разделяемые данные отправлены
+ * частично, и проверяет, что принимающий сокет получает всё по порядку;
+ * при нарушении порядка утилита завершается с ошибкой.
+ *
+ * Каждый бенчмарк повторяется, пока суммарное время не превысит
+ * --min-time миллисекунд. Результат выводится по строке JSON на бенчмарк:
+ * время и количество выделений памяти на одну операцию. Учитываются
+ * выделения через operator new и выделения SQLite.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <new>
+
+#include "mongoose.h"
+#include "db_plugin.h"
+#include "arena.h"
+#include "message_cache.h"
+#include "conversations.h"
+#include "groups.h"
+#include "changes.h"
+#include "dedup.h"
+#include "loopback.h"
+#include "shared_payload.h"
+#include "sqlite3.h"
+
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+/// Тело запроса для бенчмарков поиска параметров, байт
+#define MICRO_BODY_SIZE 4096
+
+/// Количество соединений в бенчмарках рассылки
+#define MICRO_FAN_OUT 100
+
+/// Размер сообщения в бенчмарках рассылки, байт
+#define MICRO_FAN_OUT_SIZE 1024
+
+/// Размер разделяемых данных в бенчмарке порядка отправки, больше буфера
+/// сокета, чтобы отправка была частичной
+#define MICRO_ORDER_SIZE (1024 * 1024)
+
+/// Размер буферов сокетов в бенчмарке порядка отправки, байт
+#define MICRO_ORDER_SOCKET_BUFFER (64 * 1024)
+
+/// Данные, которые пишутся через shared_payload_write за разделяемыми
+#define MICRO_ORDER_WRITE "WRITE\r\n"
+
+/// Данные, которые пишутся через mg_printf в событии соединения, как
+/// заголовки следующего ответа при конвейерной обработке
+#define MICRO_ORDER_RESPONSE "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n"
+
+/// Размеры пакета в бенчмарках пакетной отправки
+static const int s_batch_sizes[] = { 1, 4, 16, 64, BATCH_MAX_SIZE };
+
+/// Количество выделений памяти с начала работы
+static int64_t s_allocs = 0;
+/// Стандартные функции выделения памяти SQLite
+static sqlite3_mem_methods s_sqlite_mem;
+/// Минимальное время одного бенчмарка в наносекундах
+static double s_min_time_ns = 200e6;
+/// Подстрока имени, по которой выбираются бенчмарки
+static const char * s_filter = NULL;
+/// Результаты, которые не должен выбросить оптимизатор
+static volatile size_t s_sink = 0;
+
+
+void * operator new(size_t size){
+  s_allocs++;
+  void * p = malloc(size == 0 ? 1 : size);
+  if (p == NULL){
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+
+void * operator new[](size_t size){
+  s_allocs++;
+  void * p = malloc(size == 0 ? 1 : size);
+  if (p == NULL){
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+
+void operator delete(void * p){
+  free(p);
+}
+
+
+void operator delete[](void * p){
+  free(p);
+}
+
+
+/**
+ * @brief Функция выделения памяти SQLite, считающая выделения
+ */
+static void * sqlite_counting_malloc(int size){
+  s_allocs++;
+  return s_sqlite_mem.xMalloc(size);
+}
+
+
+/**
+ * @brief Функция изменения размера памяти SQLite, считающая выделения
+ */
+static void * sqlite_counting_realloc(void * p, int size){
+  s_allocs++;
+  return s_sqlite_mem.xRealloc(p, size);
+}
+
+
+/**
+ * @brief Функция возвращает монотонное время в наносекундах
+ */
+static double now_ns(void){
+#ifdef _WIN32
+  LARGE_INTEGER counter, frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  return (double) counter.QuadPart * 1e9 / (double) frequency.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+#endif
+}
+
+
+/// Измеряемая операция, arg - данные бенчмарка
+typedef void (*micro_op)(void * arg);
+
+
+/**
+ * @brief Функция измеряет операцию и выводит результат строкой JSON
+ *
+ * Количество повторений удваивается, пока время не превысит минимальное.
+ *
+ * @return Время одной операции в наносекундах, 0 если бенчмарк не выбран
+ */
+static double run(const char * name,
+                  micro_op op,
+                  void * arg){
+  if (s_filter != NULL && strstr(name, s_filter) == NULL){
+    return 0;
+  }
+  int64_t iterations = 1;
+  double elapsed = 0;
+  int64_t allocs = 0;
+
+  op(arg); // warm up
+  for (;;){
+    int64_t allocs_before = s_allocs;
+    double start = now_ns();
+    for (int64_t i = 0; i < iterations; i++){
+      op(arg);
+    }
+    elapsed = now_ns() - start;
+    allocs = s_allocs - allocs_before;
+    if (elapsed >= s_min_time_ns || iterations >= ((int64_t) 1 << 40)){
+      break;
+    }
+    iterations *= 2;
+  }
+  printf("{\"benchmark\":\"%s\",\"iterations\":%" INT64_FMT
+         ",\"ns_per_op\":%.1f,\"allocs_per_op\":%.3f}\n",
+         name, iterations, elapsed / iterations,
+         (double) allocs / iterations);
+  return elapsed / iterations;
+}
+
+
+/// Данные бенчмарков
+struct micro_data {
+  std::string request; ///< Полный HTTP запрос
+  std::string body; ///< Тело запроса
+  struct http_message hm; ///< Разобранный запрос
+  struct arena * arena; ///< Арена запроса
+  struct storage * db; ///< Хранилище
+};
+
+
+static void op_parse_http(void * arg){
+  struct micro_data * d = (struct micro_data *) arg;
+  struct http_message hm;
+  s_sink += mg_parse_http(d->request.data(), (int) d->request.size(), &hm, 1);
+}
+
+
+static void op_get_http_var_first(void * arg){
+  struct micro_data * d = (struct micro_data *) arg;
+  struct mg_str body = mg_mk_str_n(d->body.data(), d->body.size());
+  char value[64];
+  s_sink += mg_get_http_var(&body, "action", value, sizeof(value));
+}
+
+
+static void op_get_http_var_last(void * arg){
+  struct micro_data * d = (struct micro_data *) arg;
+  struct mg_str body = mg_mk_str_n(d->body.data(), d->body.size());
+  char value[MESSAGE_MAX_LENGTH];
+  s_sink += mg_get_http_var(&body, "message", value, sizeof(value));
+}
+
+
+static void op_get_http_var_missing(void * arg){
+  struct micro_data * d = (struct micro_data *) arg;
+  struct mg_str body = mg_mk_str_n(d->body.data(), d->body.size());
+  char value[64];
+  s_sink += mg_get_http_var(&body, "last_message", value, sizeof(value));
+}
+
+
+static void op_basic_auth(void * arg){
+  struct micro_data * d = (struct micro_data *) arg;
+  char user[USERNAME_MAX_LENGTH];
+  char pass[PASS_MAX_LENGTH];
+  s_sink += mg_get_http_basic_auth(&d->hm, user, sizeof(user), pass,
+                                   sizeof(pass));
+}
+
+
+static void op_switch_action(void * arg){
+  struct micro_data * d = (struct micro_data *) arg;
+  s_sink += switch_action(&d->hm.body);
+}
+
+
+static void op_build_message_json(void * arg){
+  struct micro_data * d = (struct micro_data *) arg;
+  char * json = build_message_json(d->arena, "123456", "alice", "bob",
+                                   d->body.c_str(), "1500000000");
+  s_sink += (size_t) json[0];
+  arena_reset(d->arena);
+}
+
+
+static void op_check_auth(void * arg){
+  struct micro_data * d = (struct micro_data *) arg;
+  s_sink += check_auth(d->arena, &d->hm, d->db) != NULL;
+  arena_reset(d->arena);
+}
+
+
+/// Клиент и сервер бенчмарка полного запроса в одном mg_mgr
+struct micro_loopback {
+  struct mg_mgr mgr; ///< Менеджер соединений с loopback_iface_vtable
+  struct mg_connection * client; ///< Соединение клиента
+  struct storage * db; ///< Хранилище сервера
+  std::string request; ///< Запрос клиента
+  int64_t replies; ///< Количество полученных ответов
+};
+
+
+/**
+ * @brief Функция-обработчик событий сервера бенчмарка полного запроса
+ */
+static void loopback_server_handler(struct mg_connection * nc,
+                                    int ev,
+                                    void * ev_data){
+  struct micro_loopback * l = (struct micro_loopback *) nc->mgr->user_data;
+
+  switch (ev){
+    case MG_EV_HTTP_REQUEST:
+      if (nc->user_data == NULL){
+        nc->user_data = arena_new();
+      }
+      db_op(nc, (struct http_message *) ev_data, l->db, API_OP_POST);
+      arena_reset((struct arena *) nc->user_data);
+      break;
+    case MG_EV_CLOSE:
+      arena_delete((struct arena *) nc->user_data);
+      nc->user_data = NULL;
+      break;
+    default:
+      break;
+  }
+}
+
+
+/**
+ * @brief Функция-обработчик событий клиента бенчмарка полного запроса
+ */
+static void loopback_client_handler(struct mg_connection * nc,
+                                    int ev,
+                                    void * ev_data){
+  struct micro_loopback * l = (struct micro_loopback *) nc->mgr->user_data;
+
+  (void) ev_data;
+  if (ev == MG_EV_HTTP_REPLY){
+    l->replies++;
+  } else if (ev == MG_EV_CLOSE && nc == l->client){
+    // The request would never be answered, the benchmark is broken
+    fprintf(stderr, "Loopback connection closed by the server\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+static void op_round_trip(void * arg){
+  struct micro_loopback * l = (struct micro_loopback *) arg;
+  int64_t replies = l->replies;
+
+  mg_send(l->client, l->request.data(), (int) l->request.size());
+  while (l->replies == replies){
+    mg_mgr_poll(&l->mgr, 0);
+  }
+}
+
+
+/// Соединения бенчмарков рассылки одного сообщения
+struct micro_fan_out {
+  struct mg_mgr mgr; ///< Менеджер соединений с сокетами
+  struct mg_connection * conns[MICRO_FAN_OUT]; ///< Отправляющие соединения
+  sock_t peers[MICRO_FAN_OUT]; ///< Принимающие сокеты
+  std::string message; ///< Сообщение
+  size_t buffered; ///< Байты сообщения после постановки в очереди
+};
+
+
+/**
+ * @brief Функция-обработчик событий отправляющих соединений рассылки
+ */
+static void fan_out_handler(struct mg_connection * nc, int ev, void * ev_data){
+  shared_payload_event(nc, ev, ev_data);
+}
+
+
+/**
+ * @brief Функция возвращает байты в буферах отправки и разделяемых данных
+ */
+static size_t fan_out_buffered(struct micro_fan_out * f){
+  struct shared_payload_stats stats;
+  size_t buffered;
+
+  shared_payload_get_stats(&stats);
+  buffered = (size_t) stats.payload_bytes;
+  for (int i = 0; i < MICRO_FAN_OUT; i++){
+    buffered += f->conns[i]->send_mbuf.len;
+  }
+  return buffered;
+}
+
+
+/**
+ * @brief Функция ждёт отправки сообщения всем соединениям и вычитывает его
+ * из принимающих сокетов
+ */
+static void fan_out_wait(struct micro_fan_out * f){
+  struct shared_payload_stats stats;
+  char buf[MICRO_FAN_OUT_SIZE];
+  int pending;
+
+  for (;;){
+    shared_payload_get_stats(&stats);
+    pending = stats.queued > 0;
+    for (int i = 0; i < MICRO_FAN_OUT; i++){
+      pending |= f->conns[i]->send_mbuf.len > 0;
+    }
+    if (!pending){
+      break;
+    }
+    mg_mgr_poll(&f->mgr, 0);
+  }
+  for (int i = 0; i < MICRO_FAN_OUT; i++){
+    while (recv(f->peers[i], buf, sizeof(buf), 0) > 0){
+    }
+  }
+}
+
+
+static void op_fan_out_mg_send(void * arg){
+  struct micro_fan_out * f = (struct micro_fan_out *) arg;
+
+  for (int i = 0; i < MICRO_FAN_OUT; i++){
+    mg_send(f->conns[i], f->message.data(), (int) f->message.size());
+  }
+  f->buffered = fan_out_buffered(f);
+  fan_out_wait(f);
+}
+
+
+static void op_fan_out_shared_payload(void * arg){
+  struct micro_fan_out * f = (struct micro_fan_out *) arg;
+  struct shared_payload * payload = shared_payload_new(f->message.data(),
+                                                       f->message.size());
+
+  for (int i = 0; i < MICRO_FAN_OUT; i++){
+    shared_payload_ref(payload);
+    shared_payload_send(f->conns[i], payload);
+  }
+  f->buffered = fan_out_buffered(f);
+  shared_payload_unref(payload);
+  fan_out_wait(f);
+}
+
+
+/// Соединение бенчмарка порядка отправки после частичной отправки
+struct micro_order {
+  struct mg_mgr mgr; ///< Менеджер соединения с сокетом
+  struct mg_connection * conn; ///< Отправляющее соединение
+  sock_t peer; ///< Принимающий сокет
+  std::string payload; ///< Разделяемые данные
+  std::string expected; ///< Поток, который должен получить peer
+  std::string received; ///< Поток, полученный peer
+  int respond; ///< Записать ответ в следующем событии MG_EV_POLL
+  int64_t moved_bytes; ///< Байты, перенесённые в очередь за все операции
+  int64_t ops; ///< Выполненные операции
+};
+
+
+/**
+ * @brief Функция-обработчик событий соединения бенчмарка порядка отправки
+ */
+static void order_handler(struct mg_connection * nc, int ev, void * ev_data){
+  struct micro_order * o = (struct micro_order *) nc->user_data;
+
+  if (ev == MG_EV_POLL && o->respond){
+    mg_printf(nc, "%s", MICRO_ORDER_RESPONSE);
+    o->respond = 0;
+  }
+  shared_payload_event(nc, ev, ev_data);
+}
+
+
+static void op_order_after_partial_send(void * arg){
+  struct micro_order * o = (struct micro_order *) arg;
+  struct shared_payload_stats before, after;
+  char buf[64 * 1024];
+  int n;
+
+  shared_payload_get_stats(&before);
+  o->received.clear();
+  shared_payload_send(o->conn, shared_payload_new(o->payload.data(),
+                                                  o->payload.size()));
+  shared_payload_write(o->conn, MICRO_ORDER_WRITE, 
+                       sizeof(MICRO_ORDER_WRITE) - 1);
+  o->respond = 1;
+  while (o->received.size() < o->expected.size()){
+    mg_mgr_poll(&o->mgr, 0);
+    while ((n = (int) recv(o->peer, buf, sizeof(buf), 0)) > 0){
+      o->received.append(buf, n);
+    }
+    shared_payload_get_stats(&after);
+    if (after.reordered != before.reordered){
+      break;
+    }
+  }
+  if (o->received != o->expected){
+    fprintf(stderr, "Shared payload sent out of order\n");
+    exit(EXIT_FAILURE);
+  }
+  o->moved_bytes += after.moved_bytes - before.moved_bytes;
+  o->ops++;
+}
+
+
+/**
+ * @brief Функция формирует HTTP запрос к api в том виде, в котором его
+ * отправляет клиент
+ */
+static std::string make_request(const char * user,
+                                const char * pass,
+                                const std::string & body){
+  struct mbuf auth;
+  char head[128];
+
+  mbuf_init(&auth, 0);
+  mg_basic_auth_header(user, pass, &auth);
+  snprintf(head, sizeof(head), "Content-Length: %d\r\n\r\n", (int) body.size());
+  std::string request = "POST /messenger_api HTTP/1.1\r\n"
+                        "Host: 127.0.0.1:8000\r\n"
+                        "User-Agent: messenger-client/1.0\r\n"
+                        "Accept: */*\r\n"
+                        "Content-Type: application/x-www-form-urlencoded\r\n" +
+                        std::string(auth.buf, auth.len) + head + body;
+  mbuf_free(&auth);
+  return request;
+}
+
+
+/**
+ * @brief Функция готовит данные бенчмарка: запрос, его разбор, арену и
+ * хранилище
+ */
+static void micro_init(struct micro_data * d,
+                       const std::string & body,
+                       struct storage * db){
+  d->body = body;
+  d->request = make_request("alice", "password", body);
+  mg_parse_http(d->request.data(), (int) d->request.size(), &d->hm, 1);
+  d->arena = arena_new();
+  d->db = db;
+}
+
+
+/**
+ * @brief Функция соединяет клиента с сервером бенчмарка полного запроса
+ */
+static void loopback_init(struct micro_loopback * l,
+                          const std::string & body,
+                          struct storage * db){
+  struct mg_connection * nc;
+
+  loopback_mgr_init(&l->mgr, l);
+  l->db = db;
+  l->request = make_request("alice", "password", body);
+  l->replies = 0;
+  nc = mg_bind(&l->mgr, "127.0.0.1:8000", loopback_server_handler);
+  l->client = mg_connect(&l->mgr, "127.0.0.1:8000", loopback_client_handler);
+  if (nc == NULL || l->client == NULL){
+    fprintf(stderr, "Cannot create loopback connections\n");
+    exit(EXIT_FAILURE);
+  }
+  mg_set_protocol_http_websocket(nc);
+  mg_set_protocol_http_websocket(l->client);
+  mg_mgr_poll(&l->mgr, 0);
+}
+
+
+/**
+ * @brief Функция закрывает соединения бенчмарка полного запроса
+ */
+static void loopback_free(struct micro_loopback * l){
+  l->client = NULL;
+  mg_mgr_free(&l->mgr);
+}
+
+
+/**
+ * @brief Функция измеряет пакетную отправку с размерами пакета из 
+ * s_batch_sizes и выводит строкой JSON сообщения в секунду для каждого
+ *
+ * @param[in] storage Имя хранилища в именах бенчмарков
+ * @param[in] db Хранилище
+ */
+static void run_send_batch(const char * storage,
+                           struct storage * db){
+  for (size_t i = 0; i < sizeof(s_batch_sizes) / sizeof(s_batch_sizes[0]); 
+       i++){
+    int batch = s_batch_sizes[i];
+    struct micro_loopback l;
+    std::string body = "action=send_batch";
+    char name[64];
+
+    for (int j = 0; j < batch; j++){
+      body += "&to=bob";
+    }
+    body += "&message=" + std::string(100, 'x');
+    snprintf(name, sizeof(name), "round_trip/send_batch_%d_%s", batch, 
+             storage);
+    loopback_init(&l, body, db);
+    double ns = run(name, op_round_trip, &l);
+    if (ns > 0){
+      printf("{\"benchmark\":\"%s\",\"batch\":%d,"
+             "\"messages_per_sec\":%.0f}\n", name, batch, batch * 1e9 / ns);
+    }
+    loopback_free(&l);
+  }
+}
+
+
+/**
+ * @brief Функция создаёт пары сокетов бенчмарков рассылки
+ */
+static void fan_out_init(struct micro_fan_out * f){
+  mg_mgr_init(&f->mgr, NULL);
+  f->message.assign(MICRO_FAN_OUT_SIZE, 'x');
+  for (int i = 0; i < MICRO_FAN_OUT; i++){
+    sock_t sp[2];
+    if (!mg_socketpair(sp, SOCK_STREAM) ||
+        (f->conns[i] = mg_add_sock(&f->mgr, sp[0], fan_out_handler)) == NULL){
+      fprintf(stderr, "Cannot create socket pairs\n");
+      exit(EXIT_FAILURE);
+    }
+    f->peers[i] = sp[1];
+#ifdef _WIN32
+    unsigned long on = 1;
+    ioctlsocket(sp[1], FIONBIO, &on);
+#else
+    fcntl(sp[1], F_SETFL, fcntl(sp[1], F_GETFL, 0) | O_NONBLOCK);
+#endif
+  }
+}
+
+
+/**
+ * @brief Функция выводит строкой JSON байты сообщения в последней
+ * операции рассылки
+ */
+static void fan_out_report(const char * name,
+                           struct micro_fan_out * f){
+  if (s_filter != NULL && strstr(name, s_filter) == NULL){
+    return;
+  }
+  printf("{\"benchmark\":\"%s\",\"buffered_bytes\":%d}\n", name,
+         (int) f->buffered);
+}
+
+
+/**
+ * @brief Функция закрывает сокеты бенчмарков рассылки
+ */
+static void fan_out_free(struct micro_fan_out * f){
+  mg_mgr_free(&f->mgr);
+  for (int i = 0; i < MICRO_FAN_OUT; i++){
+    closesocket(f->peers[i]);
+  }
+}
+
+
+/**
+ * @brief Функция создаёт пару сокетов бенчмарка порядка отправки
+ */
+static void order_init(struct micro_order * o){
+  sock_t sp[2];
+
+  mg_mgr_init(&o->mgr, NULL);
+  o->payload.resize(MICRO_ORDER_SIZE);
+  for (size_t i = 0; i < o->payload.size(); i++){
+    o->payload[i] = (char) (i % 251);
+  }
+  o->expected = o->payload + MICRO_ORDER_WRITE MICRO_ORDER_RESPONSE;
+  o->respond = 0;
+  o->moved_bytes = 0;
+  o->ops = 0;
+  if (!mg_socketpair(sp, SOCK_STREAM) ||
+      (o->conn = mg_add_sock(&o->mgr, sp[0], order_handler)) == NULL){
+    fprintf(stderr, "Cannot create socket pairs\n");
+    exit(EXIT_FAILURE);
+  }
+  o->conn->user_data = o;
+  o->peer = sp[1];
+  // Fixed buffers stop TCP autotuning from taking the whole payload at once
+  int size = MICRO_ORDER_SOCKET_BUFFER;
+  setsockopt(sp[0], SOL_SOCKET, SO_SNDBUF, (const char *) &size, sizeof(size));
+  setsockopt(sp[1], SOL_SOCKET, SO_RCVBUF, (const char *) &size, sizeof(size));
+#ifdef _WIN32
+  unsigned long on = 1;
+  ioctlsocket(sp[1], FIONBIO, &on);
+#else
+  fcntl(sp[1], F_SETFL, fcntl(sp[1], F_GETFL, 0) | O_NONBLOCK);
+#endif
+}
+
+
+/**
+ * @brief Функция выводит строкой JSON байты, перенесённые в очередь за
+ * одну операцию бенчмарка порядка отправки
+ */
+static void order_report(const char * name,
+                         struct micro_order * o){
+  if (o->ops > 0){
+    printf("{\"benchmark\":\"%s\",\"ordered\":true,"
+           "\"moved_bytes_per_op\":%.1f}\n", name,
+           (double) o->moved_bytes / o->ops);
+  }
+}
+
+
+/**
+ * @brief Функция закрывает сокеты бенчмарка порядка отправки
+ */
+static void order_free(struct micro_order * o){
+  mg_mgr_free(&o->mgr);
+  closesocket(o->peer);
+}
+
+
+/**
+ * @brief Точка входа
+ */
+int main(int argc, char* argv[]) {
+  int i;
+
+  /* Parse command line arguments */
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+      s_min_time_ns = atof(argv[++i]) * 1e6;
+    } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+      s_filter = argv[++i];
+    } else {
+      fprintf(stderr, "Unknown option [%s]\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /* Count SQLite allocations together with operator new */
+  sqlite3_mem_methods counting;
+  sqlite3_config(SQLITE_CONFIG_GETMALLOC, &s_sqlite_mem);
+  counting = s_sqlite_mem;
+  counting.xMalloc = sqlite_counting_malloc;
+  counting.xRealloc = sqlite_counting_realloc;
+  sqlite3_config(SQLITE_CONFIG_MALLOC, &counting);
+
+  struct storage * sqlite_db = storage_open(&storage_sqlite_vtable, ":memory:");
+  struct storage * memory_db = storage_open(&storage_memory_vtable, NULL);
+  if (sqlite_db == NULL || memory_db == NULL ||
+      sqlite_db->vtable->create_user(sqlite_db, "alice", "password") !=
+        STORAGE_OK ||
+      memory_db->vtable->create_user(memory_db, "alice", "password") !=
+        STORAGE_OK ||
+      sqlite_db->vtable->create_user(sqlite_db, "bob", "password") !=
+        STORAGE_OK ||
+      memory_db->vtable->create_user(memory_db, "bob", "password") !=
+        STORAGE_OK) {
+    fprintf(stderr, "Cannot open in-memory storage\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Typical requests of a polling client
+  struct micro_data get_message, send_message, large, sqlite_auth, memory_auth;
+  micro_init(&get_message, "action=get_message&last_message=123456",
+             sqlite_db);
+  micro_init(&send_message, "action=send_message&to=bob&message=" +
+             std::string(100, 'x'), sqlite_db);
+  // Parameters spread over a 4 KB body, the message is the last one
+  std::string body = "action=send_message&to=bob";
+  for (i = 0; body.size() < MICRO_BODY_SIZE / 2; i++) {
+    char param[32];
+    snprintf(param, sizeof(param), "&p%d=v%d", i, i);
+    body += param;
+  }
+  body += "&message=" + std::string(MICRO_BODY_SIZE - body.size() - 9, 'x');
+  micro_init(&large, body, sqlite_db);
+  micro_init(&sqlite_auth, "action=get_message&last_message=1", sqlite_db);
+  micro_init(&memory_auth, "action=get_message&last_message=1", memory_db);
+
+  run("mg_parse_http/get_message", op_parse_http, &get_message);
+  run("mg_parse_http/send_message", op_parse_http, &send_message);
+  run("mg_parse_http/4k_body", op_parse_http, &large);
+  run("mg_get_http_var/4k_first", op_get_http_var_first, &large);
+  run("mg_get_http_var/4k_last", op_get_http_var_last, &large);
+  run("mg_get_http_var/4k_missing", op_get_http_var_missing, &large);
+  run("mg_get_http_basic_auth", op_basic_auth, &get_message);
+  run("switch_action/get_message", op_switch_action, &get_message);
+  run("switch_action/4k_body", op_switch_action, &large);
+  run("build_message_json/100b", op_build_message_json, &get_message);
+  run("build_message_json/4k", op_build_message_json, &large);
+  run("check_auth/sqlite_memory", op_check_auth, &sqlite_auth);
+  run("check_auth/memory", op_check_auth, &memory_auth);
+
+  // Whole requests, each storage gets its own manager and connections
+  struct micro_loopback sqlite_get, sqlite_send, memory_get, memory_send;
+  message_cache_init(MESSAGE_CACHE_BUDGET, MESSAGE_CACHE_RING_SIZE);
+  loopback_init(&sqlite_get, "action=get_message&last_message=0", sqlite_db);
+  loopback_init(&sqlite_send, send_message.body, sqlite_db);
+  loopback_init(&memory_get, "action=get_message&last_message=0", memory_db);
+  loopback_init(&memory_send, send_message.body, memory_db);
+  run("round_trip/get_message_sqlite_memory", op_round_trip, &sqlite_get);
+  run("round_trip/send_message_sqlite_memory", op_round_trip, &sqlite_send);
+  run("round_trip/get_message_memory", op_round_trip, &memory_get);
+  run("round_trip/send_message_memory", op_round_trip, &memory_send);
+  loopback_free(&sqlite_get);
+  loopback_free(&sqlite_send);
+  loopback_free(&memory_get);
+  loopback_free(&memory_send);
+  // Throughput against batch size, one manager per batch size
+  run_send_batch("sqlite_memory", sqlite_db);
+  run_send_batch("memory", memory_db);
+  message_cache_free();
+  conversations_free();
+  groups_free();
+  changes_free();
+  dedup_free();
+
+  // One message to many sockets, copied or shared
+  struct micro_fan_out * fan_out = new micro_fan_out;
+  fan_out_init(fan_out);
+  run("fan_out/mg_send_1k_x100", op_fan_out_mg_send, fan_out);
+  fan_out_report("fan_out/mg_send_1k_x100", fan_out);
+  run("fan_out/shared_payload_1k_x100", op_fan_out_shared_payload, fan_out);
+  fan_out_report("fan_out/shared_payload_1k_x100", fan_out);
+  fan_out_free(fan_out);
+  delete fan_out;
+
+  // Writes behind a partially sent shared payload keep their order
+  struct micro_order * order = new micro_order;
+  order_init(order);
+  run("shared_payload/order_after_partial_send", op_order_after_partial_send,
+      order);
+  order_report("shared_payload/order_after_partial_send", order);
+  order_free(order);
+  delete order;
+
+  arena_delete(get_message.arena);
+  arena_delete(send_message.arena);
+  arena_delete(large.arena);
+  arena_delete(sqlite_auth.arena);
+  arena_delete(memory_auth.arena);
+  storage_close(&sqlite_db);
+  storage_close(&memory_db);
+  return 0;
+}
@@ -0,0 +1,742 @@
+/**
+ * @file
+ * @brief Воспроизведение записанного трафика api
+ *
+ * Утилита читает файл, записанный сервером с параметром --capture, и
+ * отправляет запросы на новый сервер. Каждому записанному соединению
+ * соответствует своё соединение утилиты, запросы одного соединения
+ * отправляются по порядку, следующий только после ответа на предыдущий.
+ * Закрытое сервером соединение открывается заново перед следующим запросом.
+ *
+ * По умолчанию запросы отправляются в записанное время (--speed меняет
+ * масштаб времени), а задержка отсчитывается от запланированного времени,
+ * чтобы отставание сервера не скрывалось. С --max-speed каждое соединение
+ * отправляет следующий запрос сразу после ответа.
+ *
+ * Если не указан --url, сервер запускается в том же процессе на 127.0.0.1 с
+ * пустой временной базой данных. Перед воспроизведением регистрируются
+ * пользователи из заголовков Authorization и получатели сообщений, которые
+ * не регистрируются в самой записи, чтобы ответы совпадали с записанными.
+ *
+ * Для каждого действия выводится пропускная способность, процентили задержки
+ * и количество ответов с кодом, отличным от записанного. --save сохраняет
+ * отчёт, --compare сравнивает его с сохранённым ранее.
+ *
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <atomic>
+
+#include "mongoose.h"
+#include "db_plugin.h"
+#include "message_cache.h"
+#include "conversations.h"
+#include "groups.h"
+#include "changes.h"
+#include "dedup.h"
+#include "metrics.h"
+#include "capture.h"
+#include "arena.h"
+#include "wakeup.h"
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <time.h>
+#endif
+
+/// Пароль получателей, которые ни разу не авторизовались в записи
+#define REPLAY_PASSWORD "replay"
+
+/// Наибольшее количество получателей одного запроса
+#define REPLAY_MAX_RECIPIENTS 256
+
+/// Записанный запрос
+struct replay_request {
+  int64_t time_us; ///< Время получения запроса от начала записи
+  int status; ///< Записанный код ответа
+  int action; ///< Действие api, enum api_action
+  std::string data; ///< Запрос целиком
+};
+
+/// Соединение утилиты, соответствующее записанному соединению
+struct replay_conn {
+  struct mg_connection * nc; ///< Соединение или NULL, если его нужно открыть
+  std::vector<size_t> queue; ///< Запросы соединения по порядку
+  size_t next; ///< Следующий запрос из queue
+  size_t current; ///< Выполняемый запрос
+  int busy; ///< Запрос отправлен, ответ ещё не получен
+  double start_ns; ///< Время, от которого отсчитывается задержка
+};
+
+/// Результаты одного действия
+struct replay_result {
+  std::vector<double> latencies_us; ///< Задержки полученных ответов
+  int64_t errors; ///< Запросы, на которые не получен ответ
+  int64_t mismatches; ///< Ответы с кодом, отличным от записанного
+};
+
+/// Строка отчёта
+struct replay_report {
+  int64_t requests; ///< Количество ответов
+  int64_t errors; ///< Запросы без ответа
+  int64_t mismatches; ///< Ответы с другим кодом
+  double rate; ///< Ответов в секунду
+  double p50_ms; ///< Медиана задержки
+  double p90_ms; ///< 90-й процентиль задержки
+  double p99_ms; ///< 99-й процентиль задержки
+  double max_ms; ///< Наибольшая задержка
+};
+
+/// Адрес сервера
+static std::string s_url;
+/// Адрес сервера для mg_connect
+static std::string s_address;
+/// Порт встроенного сервера
+static const char * s_port = "18001";
+/// Реализация хранилища встроенного сервера
+static const struct storage_vtable * s_storage = NULL;
+/// Путь к файлу записи
+static const char * s_capture_path = NULL;
+/// Масштаб времени записи, 0 - без пауз
+static double s_speed = 1;
+/// Регистрировать пользователей перед воспроизведением
+static int s_register = 1;
+/// Путь для сохранения отчёта
+static const char * s_save_path = NULL;
+/// Путь к отчёту для сравнения
+static const char * s_compare_path = NULL;
+/// Записанные запросы
+static std::vector<replay_request> s_requests;
+/// Результаты по действиям
+static replay_result s_results[API_ACTION_COUNT];
+/// Количество завершённых запросов
+static size_t s_completed = 0;
+/// Признак остановки встроенного сервера, изменяется в его потоке
+static int s_server_stop = 0;
+/// Очередь пробуждения встроенного сервера
+static struct wakeup_queue * s_server_wakeup = NULL;
+/// Признак завершения встроенного сервера
+static std::atomic<int> s_server_done(0);
+/// Хранилище встроенного сервера
+static struct storage * s_db_handle = NULL;
+/// Количество незавершённых регистраций
+static int s_registering = 0;
+/// Количество неуспешных регистраций
+static int s_register_errors = 0;
+
+
+/**
+ * @brief Функция возвращает монотонное время в наносекундах
+ */
+static double now_ns(void){
+#ifdef _WIN32
+  LARGE_INTEGER counter, frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  return (double) counter.QuadPart * 1e9 / (double) frequency.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+#endif
+}
+
+
+/**
+ * @brief Функция приостанавливает поток на ms миллисекунд
+ */
+static void sleep_ms(int ms){
+#ifdef _WIN32
+  Sleep(ms);
+#else
+  usleep(ms * 1000);
+#endif
+}
+
+
+/**
+ * @brief Функция разбирает записанный запрос
+ *
+ * @param[in] data Запрос целиком
+ * @param[out] hm Разобранный запрос, тело ограничено длиной data
+ * @retval 1 Запрос разобран
+ * @retval 0 Запрос повреждён
+ */
+static int parse_request(const std::string & data,
+                         struct http_message * hm){
+  int len = mg_parse_http(data.data(), (int) data.size(), hm, 1);
+
+  if (len <= 0){
+    return 0;
+  }
+  size_t rest = data.size() - (size_t) len;
+  hm->body.p = data.data() + len;
+  if (hm->body.len > rest){
+    hm->body.len = rest;
+  }
+  return 1;
+}
+
+
+/**
+ * @brief Функция читает файл записи в s_requests и распределяет запросы по
+ * соединениям
+ *
+ * @param[out] conns Соединения утилиты
+ * @retval 1 Файл прочитан
+ * @retval 0 Файл не найден или не является записью
+ */
+static int load_capture(std::vector<replay_conn> * conns){
+  std::map<uint32_t, size_t> index;
+  struct capture_record record;
+  struct replay_request request;
+  struct http_message hm;
+  FILE * file = fopen(s_capture_path, "rb");
+
+  if (file == NULL){
+    return 0;
+  }
+  if (!capture_read_header(file)){
+    fclose(file);
+    return 0;
+  }
+  while (capture_read(file, &record, &request.data)){
+    request.time_us = record.time_us;
+    request.status = (int) record.status;
+    request.action = !parse_request(request.data, &hm) ? API_ACTION_NULL :
+                     switch_action(hm.query_string.len > 0 ?
+                                   &hm.query_string : &hm.body);
+    std::map<uint32_t, size_t>::iterator it = index.find(record.connection);
+    if (it == index.end()){
+      it = index.insert(std::make_pair(record.connection,
+                                       conns->size())).first;
+      conns->push_back(replay_conn());
+      conns->back().nc = NULL;
+      conns->back().next = 0;
+      conns->back().busy = 0;
+    }
+    (*conns)[it->second].queue.push_back(s_requests.size());
+    s_requests.push_back(request);
+  }
+  fclose(file);
+  return 1;
+}
+
+
+/**
+ * @brief Функция кодирует строку для тела application/x-www-form-urlencoded
+ */
+static std::string url_encode(const std::string & s){
+  static const char hex[] = "0123456789ABCDEF";
+  std::string out;
+
+  for (size_t i = 0; i < s.size(); i++){
+    unsigned char c = (unsigned char) s[i];
+    if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~'){
+      out.push_back((char) c);
+    } else {
+      out.push_back('%');
+      out.push_back(hex[c >> 4]);
+      out.push_back(hex[c & 15]);
+    }
+  }
+  return out;
+}
+
+
+/**
+ * @brief Функция собирает пользователей, которых нужно зарегистрировать
+ *
+ * Пользователи из заголовков Authorization регистрируются с записанным
+ * паролем (сервер записывает CAPTURE_PASSWORD), пароли запросов, отклонённых
+ * с кодом 401, не используются. Получатели без авторизации регистрируются с
+ * паролем REPLAY_PASSWORD.
+ * Пользователи, которые регистрируются в записи, пропускаются.
+ *
+ * @param[out] users Имена и пароли пользователей
+ */
+static void collect_users(std::map<std::string, std::string> * users){
+  std::set<std::string> registered, recipients;
+  struct mg_str to[REPLAY_MAX_RECIPIENTS];
+  struct http_message hm;
+  char user[256], password[256];
+
+  for (size_t i = 0; i < s_requests.size(); i++){
+    if (!parse_request(s_requests[i].data, &hm)){
+      continue;
+    }
+    if (s_requests[i].status != 401 &&
+        mg_get_http_basic_auth(&hm, user, sizeof(user), password,
+                               sizeof(password)) == 0 &&
+        users->find(user) == users->end()){
+      (*users)[user] = password;
+    }
+    if (s_requests[i].action == API_ACTION_REGISTER &&
+        mg_get_http_var(&hm.body, "user", user, sizeof(user)) > 0){
+      registered.insert(user);
+    }
+    int count = get_http_var_list(&hm.body, "to", to, REPLAY_MAX_RECIPIENTS);
+    for (int j = 0; j < count; j++){
+      if (mg_url_decode(to[j].p, (int) to[j].len, user, sizeof(user), 1) > 0){
+        recipients.insert(user);
+      }
+    }
+  }
+  for (std::set<std::string>::iterator it = recipients.begin();
+       it != recipients.end(); ++it){
+    if (users->find(*it) == users->end()){
+      (*users)[*it] = REPLAY_PASSWORD;
+    }
+  }
+  for (std::set<std::string>::iterator it = registered.begin();
+       it != registered.end(); ++it){
+    users->erase(*it);
+  }
+}
+
+
+/**
+ * @brief Функция-обработчик событий встроенного сервера
+ */
+static void server_handler(struct mg_connection * nc, int ev, void * ev_data){
+  struct http_message * hm = (struct http_message *) ev_data;
+
+  switch (ev){
+    case MG_EV_HTTP_REQUEST:
+      if (nc->user_data == NULL){
+        nc->user_data = arena_new();
+      }
+      db_op(nc, hm, s_db_handle, API_OP_POST);
+      arena_reset((struct arena *) nc->user_data);
+      break;
+    case MG_EV_CLOSE:
+      arena_delete((struct arena *) nc->user_data);
+      nc->user_data = NULL;
+      break;
+    default:
+      break;
+  }
+}
+
+
+/**
+ * @brief Функция останавливает встроенный сервер, вызывается в его потоке
+ */
+static void stop_server(struct mg_connection * nc, void * data){
+  (void) nc;
+  (void) data;
+  s_server_stop = 1;
+}
+
+
+/**
+ * @brief Функция потока встроенного сервера
+ */
+static void * server_thread(void * arg){
+  struct mg_mgr * mgr = (struct mg_mgr *) arg;
+
+  // Stopping wakes the loop, the timeout is never waited out
+  while (!s_server_stop){
+    mg_mgr_poll(mgr, 1000);
+  }
+  s_server_done = 1;
+  return NULL;
+}
+
+
+/**
+ * @brief Функция-обработчик ответов на запросы регистрации
+ */
+static void register_handler(struct mg_connection * nc, int ev, void * ev_data){
+  struct http_message * hm = (struct http_message *) ev_data;
+
+  switch (ev){
+    case MG_EV_CONNECT:
+      if (*(int *) ev_data != 0){
+        s_register_errors++;
+      }
+      break;
+    case MG_EV_HTTP_REPLY:
+      // An existing user is fine when the server is reused
+      if (hm->resp_code != 200 && hm->resp_code != 401){
+        s_register_errors++;
+      }
+      nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+      break;
+    case MG_EV_CLOSE:
+      s_registering--;
+      break;
+    default:
+      break;
+  }
+}
+
+
+/**
+ * @brief Функция регистрирует пользователей по 64 параллельных запроса
+ *
+ * @param[in] users Имена и пароли пользователей
+ * @retval 1 Все пользователи зарегистрированы
+ * @retval 0 Ошибка регистрации
+ */
+static int register_users(const std::map<std::string, std::string> & users){
+  std::map<std::string, std::string>::const_iterator it = users.begin();
+  struct mg_mgr mgr;
+
+  mg_mgr_init(&mgr, NULL);
+  while (it != users.end() || s_registering > 0){
+    for (; it != users.end() && s_registering < 64; ++it){
+      std::string body = "action=register&user=" + url_encode(it->first) +
+                         "&password=" + url_encode(it->second);
+      if (mg_connect_http(&mgr, register_handler, s_url.c_str(),
+          "Content-Type: application/x-www-form-urlencoded\r\n",
+          body.c_str()) == NULL){
+        s_register_errors++;
+        continue;
+      }
+      s_registering++;
+    }
+    mg_mgr_poll(&mgr, 10);
+  }
+  mg_mgr_free(&mgr);
+  return s_register_errors == 0;
+}
+
+
+/**
+ * @brief Функция-обработчик событий соединений утилиты
+ */
+static void client_handler(struct mg_connection * nc, int ev, void * ev_data){
+  struct replay_conn * c = (struct replay_conn *) nc->user_data;
+  struct http_message * hm = (struct http_message *) ev_data;
+
+  switch (ev){
+    case MG_EV_HTTP_REPLY: {
+      const struct replay_request * r = &s_requests[c->current];
+      struct replay_result * result = &s_results[r->action];
+      result->latencies_us.push_back((now_ns() - c->start_ns) / 1000);
+      if (r->status != 0 && hm->resp_code != r->status){
+        result->mismatches++;
+      }
+      c->busy = 0;
+      s_completed++;
+      break;
+    }
+    case MG_EV_CLOSE:
+      if (c != NULL){
+        if (c->busy){
+          s_results[s_requests[c->current].action].errors++;
+          c->busy = 0;
+          s_completed++;
+        }
+        c->nc = NULL;
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+
+/**
+ * @brief Функция воспроизводит запросы и возвращает время воспроизведения
+ * в секундах
+ */
+static double replay(std::vector<replay_conn> * conns){
+  struct mg_mgr mgr;
+  double start = now_ns();
+
+  mg_mgr_init(&mgr, NULL);
+  while (s_completed < s_requests.size()){
+    double now = now_ns();
+    for (size_t i = 0; i < conns->size(); i++){
+      struct replay_conn * c = &(*conns)[i];
+      if (c->busy || c->next == c->queue.size()){
+        continue;
+      }
+      const struct replay_request * r = &s_requests[c->queue[c->next]];
+      double due = s_speed > 0 ? start + r->time_us * 1e3 / s_speed : now;
+      if (due > now){
+        continue;
+      }
+      if (c->nc == NULL){
+        c->nc = mg_connect(&mgr, s_address.c_str(), client_handler);
+        if (c->nc == NULL){
+          s_results[r->action].errors++;
+          s_completed++;
+          c->next++;
+          continue;
+        }
+        c->nc->user_data = c;
+        mg_set_protocol_http_websocket(c->nc);
+      }
+      mg_send(c->nc, r->data.data(), (int) r->data.size());
+      c->current = c->queue[c->next++];
+      c->busy = 1;
+      c->start_ns = due;
+    }
+    mg_mgr_poll(&mgr, 1);
+  }
+  double elapsed = (now_ns() - start) / 1e9;
+  mg_mgr_free(&mgr);
+  return elapsed;
+}
+
+
+/**
+ * @brief Функция возвращает значение, не меньшее доли percentile
+ * отсортированных значений
+ */
+static double percentile(const std::vector<double> & sorted,
+                         double percentile){
+  size_t rank = (size_t) (percentile / 100.0 * sorted.size() + 0.5);
+
+  if (sorted.empty()){
+    return 0;
+  }
+  if (rank < 1){
+    rank = 1;
+  }
+  return sorted[rank > sorted.size() ? sorted.size() - 1 : rank - 1];
+}
+
+
+/**
+ * @brief Функция читает отчёт, сохранённый с --save
+ *
+ * @param[in] path Путь к отчёту
+ * @param[out] reports Строки отчёта по именам действий
+ * @retval 1 Отчёт прочитан
+ * @retval 0 Отчёт не найден
+ */
+static int load_report(const char * path,
+                       std::map<std::string, replay_report> * reports){
+  FILE * file = fopen(path, "r");
+  struct replay_report r;
+  char name[64];
+
+  if (file == NULL){
+    return 0;
+  }
+  while (fscanf(file, "%63s %" INT64_FMT " %" INT64_FMT " %" INT64_FMT
+                " %lf %lf %lf %lf %lf", name, &r.requests, &r.errors,
+                &r.mismatches, &r.rate, &r.p50_ms, &r.p90_ms, &r.p99_ms,
+                &r.max_ms) == 9){
+    (*reports)[name] = r;
+  }
+  fclose(file);
+  return 1;
+}
+
+
+/**
+ * @brief Функция возвращает изменение значения в процентах
+ */
+static double change(double base, double value){
+  return base > 0 ? (value - base) * 100.0 / base : 0;
+}
+
+
+/**
+ * @brief Функция удаляет файлы временной базы данных
+ */
+static void remove_db_files(const std::string & path){
+  char segment[32];
+
+  remove(path.c_str());
+  for (int i = 0; ; i++){
+    snprintf(segment, sizeof(segment), ".%06d.log", i);
+    if (remove((path + segment).c_str()) != 0){
+      break;
+    }
+  }
+}
+
+
+/**
+ * @brief Точка входа
+ */
+int main(int argc, char* argv[]) {
+  struct mg_mgr server_mgr;
+  std::vector<replay_conn> conns;
+  std::map<std::string, replay_report> baseline;
+  std::string db_path;
+  int i;
+
+  /* Parse command line arguments */
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+      s_capture_path = argv[++i];
+    } else if (strcmp(argv[i], "--url") == 0 && i + 1 < argc) {
+      s_url = argv[++i];
+    } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+      s_port = argv[++i];
+    } else if (strcmp(argv[i], "--storage") == 0 && i + 1 < argc) {
+      if ((s_storage = storage_find_vtable(argv[++i])) == NULL) {
+        fprintf(stderr, "Unknown storage [%s]\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+      s_speed = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--max-speed") == 0) {
+      s_speed = 0;
+    } else if (strcmp(argv[i], "--no-register") == 0) {
+      s_register = 0;
+    } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+      s_save_path = argv[++i];
+    } else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc) {
+      s_compare_path = argv[++i];
+    } else {
+      fprintf(stderr, "Unknown option [%s]\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (s_capture_path == NULL || s_speed < 0) {
+    fprintf(stderr, "Usage: %s --capture PATH [--url URL] [--port PORT] "
+            "[--storage NAME] [--speed FACTOR | --max-speed] [--no-register] "
+            "[--save PATH] [--compare PATH]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if (!load_capture(&conns)) {
+    fprintf(stderr, "Cannot read capture [%s]\n", s_capture_path);
+    exit(EXIT_FAILURE);
+  }
+  if (s_compare_path != NULL && !load_report(s_compare_path, &baseline)) {
+    fprintf(stderr, "Cannot read report [%s]\n", s_compare_path);
+    exit(EXIT_FAILURE);
+  }
+
+  /* Start the server in this process unless an external one is given */
+  if (s_url.empty()) {
+    const char * tmp = getenv("TEMP") != NULL ? getenv("TEMP") :
+                       getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+    char name[64];
+    snprintf(name, sizeof(name), "/messenger_replay_%d.db", (int) getpid());
+    db_path = std::string(tmp) + name;
+    remove_db_files(db_path);
+    if ((s_db_handle = storage_open(s_storage != NULL ? s_storage :
+                                    storage_find_vtable(NULL),
+                                    db_path.c_str())) == NULL) {
+      fprintf(stderr, "Cannot open DB [%s]\n", db_path.c_str());
+      exit(EXIT_FAILURE);
+    }
+    message_cache_init(MESSAGE_CACHE_BUDGET, MESSAGE_CACHE_RING_SIZE);
+    load_latest_messages(s_db_handle);
+    load_conversations(s_db_handle);
+    load_groups(s_db_handle);
+    load_changes(s_db_handle);
+
+    std::string address = std::string("127.0.0.1:") + s_port;
+    mg_mgr_init(&server_mgr, NULL);
+    struct mg_connection * nc = mg_bind(&server_mgr, address.c_str(),
+                                        server_handler);
+    if (nc == NULL) {
+      fprintf(stderr, "Cannot bind to [%s]\n", address.c_str());
+      exit(EXIT_FAILURE);
+    }
+    mg_set_protocol_http_websocket(nc);
+    if ((s_server_wakeup = wakeup_create(&server_mgr)) == NULL) {
+      fprintf(stderr, "Cannot create the server wakeup queue\n");
+      exit(EXIT_FAILURE);
+    }
+    mg_start_thread(server_thread, &server_mgr);
+    s_url = "http://" + address + "/messenger_api";
+  }
+  // mg_connect wants host:port, the captured requests carry the path
+  s_address = s_url;
+  if (s_address.compare(0, 7, "http://") == 0) {
+    s_address = s_address.substr(7);
+  }
+  s_address = s_address.substr(0, s_address.find('/'));
+
+  if (s_register) {
+    std::map<std::string, std::string> users;
+    collect_users(&users);
+    double start = now_ns();
+    if (!register_users(users)) {
+      fprintf(stderr, "Cannot register users at [%s]\n", s_url.c_str());
+      exit(EXIT_FAILURE);
+    }
+    printf("Registered %d users in %.1f ms\n", (int) users.size(),
+           (now_ns() - start) / 1e6);
+  }
+
+  printf("Replaying %d requests on %d connections %s\n",
+         (int) s_requests.size(), (int) conns.size(),
+         s_speed > 0 ? "with recorded timing" : "at max speed");
+  double elapsed = replay(&conns);
+  printf("Replayed in %.3f s, %.1f req/s\n", elapsed,
+         elapsed > 0 ? s_requests.size() / elapsed : 0.0);
+
+  FILE * save = NULL;
+  if (s_save_path != NULL && (save = fopen(s_save_path, "w")) == NULL) {
+    fprintf(stderr, "Cannot write report [%s]\n", s_save_path);
+  }
+  printf("%-13s %10s %8s %10s %12s %10s %10s %10s %10s\n", "action",
+         "requests", "errors", "mismatch", "req_per_sec", "p50_ms", "p90_ms",
+         "p99_ms", "max_ms");
+  for (int a = 0; a < API_ACTION_COUNT; a++) {
+    struct replay_result * result = &s_results[a];
+    struct replay_report r;
+    if (result->latencies_us.empty() && result->errors == 0) {
+      continue;
+    }
+    std::sort(result->latencies_us.begin(), result->latencies_us.end());
+    r.requests = (int64_t) result->latencies_us.size();
+    r.errors = result->errors;
+    r.mismatches = result->mismatches;
+    r.rate = elapsed > 0 ? r.requests / elapsed : 0;
+    r.p50_ms = percentile(result->latencies_us, 50) / 1e3;
+    r.p90_ms = percentile(result->latencies_us, 90) / 1e3;
+    r.p99_ms = percentile(result->latencies_us, 99) / 1e3;
+    r.max_ms = percentile(result->latencies_us, 100) / 1e3;
+    printf("%-13s %10d %8d %10d %12.1f %10.3f %10.3f %10.3f %10.3f\n",
+           metrics_action_name(a), (int) r.requests, (int) r.errors,
+           (int) r.mismatches, r.rate, r.p50_ms, r.p90_ms, r.p99_ms,
+           r.max_ms);
+    if (save != NULL) {
+      fprintf(save, "%s %" INT64_FMT " %" INT64_FMT " %" INT64_FMT
+              " %.3f %.3f %.3f %.3f %.3f\n", metrics_action_name(a),
+              r.requests, r.errors, r.mismatches, r.rate, r.p50_ms, r.p90_ms,
+              r.p99_ms, r.max_ms);
+    }
+    std::map<std::string, replay_report>::iterator it =
+      baseline.find(metrics_action_name(a));
+    if (it != baseline.end()) {
+      const struct replay_report * b = &it->second;
+      printf("%-13s %10s %8s %10s %+11.1f%% %+9.1f%% %+9.1f%% %+9.1f%% "
+             "%+9.1f%%\n", "  vs base", "", "", "", change(b->rate, r.rate),
+             change(b->p50_ms, r.p50_ms), change(b->p90_ms, r.p90_ms),
+             change(b->p99_ms, r.p99_ms), change(b->max_ms, r.max_ms));
+    }
+  }
+  if (save != NULL) {
+    fclose(save);
+  }
+
+  if (s_db_handle != NULL) {
+    wakeup_post(s_server_wakeup, NULL, stop_server, NULL);
+    while (!s_server_done) {
+      sleep_ms(10);
+    }
+    mg_mgr_free(&server_mgr);
+    message_cache_free();
+    conversations_free();
+    groups_free();
+    changes_free();
+    dedup_free();
+    storage_close(&s_db_handle);
+    remove_db_files(db_path);
+  }
+  return 0;
+}
@@ -0,0 +1,335 @@
+/**
+ * @file
+ * @brief Сравнение реализаций хранилища на вставке и чтении сообщений
+ *
+ * Для каждой реализации хранилища создаётся новое хранилище, в нём
+ * регистрируются пользователи, затем измеряются:
+ * - insert: отправка сообщений между случайными пользователями
+ *   (put_messages пакетами по --batch сообщений);
+ * - scan_forward: первое сообщение пользователя после случайного курсора
+ *   (как в get_message);
+ * - scan_backward: последние MESSAGE_CACHE_RING_SIZE + 1 сообщений
+ *   пользователя (как при заполнении кэша);
+ * - conversation: последняя страница истории переписки случайной пары
+ *   пользователей (как в get_history);
+ * - group_join: создание группы и добавление в неё --group-members
+ *   пользователей;
+ * - group_insert: отправка --group-messages сообщений группе её случайными
+ *   участниками, сообщение хранится один раз при любом размере группы;
+ * - group_scan: последние сообщения случайного участника, личные и группы
+ *   вместе (как при заполнении кэша участника);
+ * - reopen: повторное открытие хранилища с восстановлением индексов.
+ *
+ * Все реализации, сохраняющие данные, измеряются с одной сохранностью
+ * записи --durability: по умолчанию process (SQLite без fsync, журнал без
+ * msync до закрытия), disk - каждая транзакция SQLite и каждый пакет
+ * журнала сбрасываются на диск, default - как настроено в каждой
+ * реализации. Хранилище в памяти ничего не сохраняет.
+ *
+ * Результат выводится по строке на реализацию и этап, поля разделены
+ * пробелами, durability - сохранность, с которой измерена строка. Файлы
+ * хранилищ удаляются после измерения.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "storage.h"
+
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+/// Количество сообщений, читаемых при заполнении кэша пользователя
+#define BENCHMARK_BACKWARD_LIMIT 33
+
+/// Количество сообщений, читаемых страницей истории переписки
+#define BENCHMARK_HISTORY_LIMIT 21
+
+/// Количество пользователей по умолчанию
+static int s_users = 1000;
+/// Количество сообщений по умолчанию
+static int s_messages = 20000;
+/// Количество сообщений в одном вызове put_messages
+static int s_batch = 1;
+/// Количество чтений каждого вида
+static int s_reads = 100000;
+/// Длина текста сообщения
+static int s_message_length = 100;
+/// Количество участников группы
+static int s_group_members = 200;
+/// Количество сообщений группе
+static int s_group_messages = 10000;
+/// Сохранность записи, enum storage_durability
+static int s_durability = STORAGE_DURABILITY_PROCESS;
+/// Префикс путей к файлам хранилищ
+static const char * s_path = "storage_benchmark";
+/// Состояние генератора случайных чисел
+static unsigned int s_random = 1;
+
+
+/**
+ * @brief Функция возвращает монотонное время в наносекундах
+ */
+static double now_ns(void){
+#ifdef _WIN32
+  LARGE_INTEGER counter, frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  return (double) counter.QuadPart * 1e9 / (double) frequency.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+#endif
+}
+
+
+/**
+ * @brief Функция возвращает псевдослучайное число от 0 до n - 1.
+ * Последовательность одинакова для всех реализаций хранилища
+ */
+static int random_below(int n){
+  s_random = s_random * 1103515245U + 12345U;
+  return (int) ((s_random >> 8) % (unsigned int) n);
+}
+
+
+/**
+ * @brief Функция выводит результат одного этапа
+ */
+static void report(const struct storage_vtable * vtable,
+                   const char * phase,
+                   int ops,
+                   double elapsed_ns){
+  printf("%-8s %-10s %-14s %10d %12.1f %12.1f %14.1f\n", vtable->name, 
+         storage_durability_name(storage_durability(vtable)), phase, ops,
+         elapsed_ns / 1e6, ops > 0 ? elapsed_ns / ops : 0.0,
+         elapsed_ns > 0 ? ops * 1e9 / elapsed_ns : 0.0);
+}
+
+
+/**
+ * @brief Функция удаляет файлы хранилища: файл базы данных SQLite и
+ * сегменты журнала
+ */
+static void remove_storage_files(const std::string & path){
+  char segment[32];
+
+  remove(path.c_str());
+  for (int i = 0; ; i++){
+    snprintf(segment, sizeof(segment), ".%06d.log", i);
+    if (remove((path + segment).c_str()) != 0){
+      break;
+    }
+  }
+}
+
+
+/**
+ * @brief Функция считает прочитанные сообщения для storage_message_cb
+ */
+static void on_message(const struct storage_message * message,
+                       void * arg){
+  (void) message;
+  (*(int *) arg)++;
+}
+
+
+/**
+ * @brief Функция измеряет одну реализацию хранилища
+ *
+ * @param[in] vtable Реализация хранилища
+ * @retval 1 Измерение выполнено
+ * @retval 0 Ошибка хранилища
+ */
+static int run_benchmark(const struct storage_vtable * vtable){
+  std::string path = std::string(s_path) + "." + vtable->name;
+  std::vector<std::string> users;
+  std::string text(s_message_length, 'x');
+  char name[32];
+  int found = 0;
+  int i;
+
+  remove_storage_files(path);
+  struct storage * st = storage_open(vtable, path.c_str());
+  if (st == NULL){
+    fprintf(stderr, "Cannot open storage [%s]\n", path.c_str());
+    return 0;
+  }
+  for (i = 0; i < s_users; i++){
+    snprintf(name, sizeof(name), "user%d", i);
+    users.push_back(name);
+    if (st->vtable->create_user(st, name, "password") != STORAGE_OK){
+      fprintf(stderr, "Cannot create user [%s]\n", name);
+      storage_close(&st);
+      return 0;
+    }
+  }
+
+  s_random = 1;
+  std::vector<struct storage_message> batch(s_batch);
+  double start = now_ns();
+  for (i = 0; i < s_messages; i += s_batch){
+    int count = s_messages - i < s_batch ? s_messages - i : s_batch;
+    for (int j = 0; j < count; j++){
+      batch[j].message_id = 0;
+      batch[j].from = users[random_below(s_users)].c_str();
+      batch[j].to = users[random_below(s_users)].c_str();
+      batch[j].message = text.c_str();
+      batch[j].time = 0;
+    }
+    if (st->vtable->put_messages(st, &batch[0], count) != STORAGE_OK){
+      fprintf(stderr, "Cannot store messages\n");
+      storage_close(&st);
+      return 0;
+    }
+  }
+  report(vtable, "insert", s_messages, now_ns() - start);
+
+  start = now_ns();
+  for (i = 0; i < s_reads; i++){
+    st->vtable->scan_messages(st, users[random_below(s_users)].c_str(),
+                              random_below(s_messages), STORAGE_SCAN_FORWARD,
+                              1, on_message, &found);
+  }
+  report(vtable, "scan_forward", s_reads, now_ns() - start);
+
+  start = now_ns();
+  for (i = 0; i < s_reads; i++){
+    st->vtable->scan_messages(st, users[random_below(s_users)].c_str(),
+                              STORAGE_CURSOR_MAX, STORAGE_SCAN_BACKWARD,
+                              BENCHMARK_BACKWARD_LIMIT, on_message, &found);
+  }
+  report(vtable, "scan_backward", s_reads, now_ns() - start);
+
+  start = now_ns();
+  for (i = 0; i < s_reads; i++){
+    const char * user = users[random_below(s_users)].c_str();
+    st->vtable->scan_conversation(st, user, 
+                                  users[random_below(s_users)].c_str(),
+                                  STORAGE_CURSOR_MAX, STORAGE_SCAN_BACKWARD,
+                                  BENCHMARK_HISTORY_LIMIT, on_message, &found);
+  }
+  report(vtable, "conversation", s_reads, now_ns() - start);
+
+  int members = s_group_members < s_users ? s_group_members : s_users;
+  int64_t cursor;
+  start = now_ns();
+  int result = st->vtable->create_group(st, "group", users[0].c_str());
+  for (i = 1; i < members && result == STORAGE_OK; i++){
+    result = st->vtable->put_member(st, "group", users[i].c_str(), 1, 
+                                    &cursor);
+  }
+  if (result != STORAGE_OK){
+    fprintf(stderr, "Cannot create group\n");
+    storage_close(&st);
+    return 0;
+  }
+  report(vtable, "group_join", members, now_ns() - start);
+
+  start = now_ns();
+  for (i = 0; i < s_group_messages; i += s_batch){
+    int count = s_group_messages - i < s_batch ? s_group_messages - i : 
+                                                 s_batch;
+    for (int j = 0; j < count; j++){
+      batch[j].message_id = 0;
+      batch[j].from = users[random_below(members)].c_str();
+      batch[j].to = "#group";
+      batch[j].message = text.c_str();
+      batch[j].time = 0;
+    }
+    if (st->vtable->put_messages(st, &batch[0], count) != STORAGE_OK){
+      fprintf(stderr, "Cannot store group messages\n");
+      storage_close(&st);
+      return 0;
+    }
+  }
+  report(vtable, "group_insert", s_group_messages, now_ns() - start);
+
+  start = now_ns();
+  for (i = 0; i < s_reads; i++){
+    st->vtable->scan_messages(st, users[random_below(members)].c_str(),
+                              STORAGE_CURSOR_MAX, STORAGE_SCAN_BACKWARD,
+                              BENCHMARK_BACKWARD_LIMIT, on_message, &found);
+  }
+  report(vtable, "group_scan", s_reads, now_ns() - start);
+
+  storage_close(&st);
+  start = now_ns();
+  st = storage_open(vtable, path.c_str());
+  report(vtable, "reopen", 1, now_ns() - start);
+  storage_close(&st);
+  remove_storage_files(path);
+  return 1;
+}
+
+
+/**
+ * @brief Точка входа
+ */
+int main(int argc, char* argv[]) {
+  std::vector<const struct storage_vtable *> engines;
+  int i;
+
+  /* Parse command line arguments */
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--storage") == 0 && i + 1 < argc) {
+      const struct storage_vtable * vtable = storage_find_vtable(argv[++i]);
+      if (vtable == NULL) {
+        fprintf(stderr, "Unknown storage [%s]\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+      engines.push_back(vtable);
+    } else if (strcmp(argv[i], "--users") == 0 && i + 1 < argc) {
+      s_users = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--messages") == 0 && i + 1 < argc) {
+      s_messages = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      s_batch = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--reads") == 0 && i + 1 < argc) {
+      s_reads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--message-length") == 0 && i + 1 < argc) {
+      s_message_length = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--group-members") == 0 && i + 1 < argc) {
+      s_group_members = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--group-messages") == 0 && i + 1 < argc) {
+      s_group_messages = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--durability") == 0 && i + 1 < argc) {
+      s_durability = storage_find_durability(argv[++i]);
+      if (s_durability < 0 || s_durability == STORAGE_DURABILITY_NONE) {
+        fprintf(stderr, "Unknown durability [%s]\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--path") == 0 && i + 1 < argc) {
+      s_path = argv[++i];
+    } else {
+      fprintf(stderr, "Unknown option [%s]\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (s_users < 1 || s_messages < 1 || s_batch < 1 || s_reads < 0 ||
+      s_message_length < 0 || s_group_members < 1 || s_group_messages < 0) {
+    fprintf(stderr, "Invalid benchmark size\n");
+    exit(EXIT_FAILURE);
+  }
+  if (engines.empty()) {
+    engines.push_back(&storage_sqlite_vtable);
+    engines.push_back(&storage_log_vtable);
+    engines.push_back(&storage_memory_vtable);
+  }
+
+  storage_set_durability(s_durability);
+  printf("%-8s %-10s %-14s %10s %12s %12s %14s\n", "engine", "durability", 
+         "phase", "ops", "total_ms", "ns_per_op", "ops_per_sec");
+  for (size_t e = 0; e < engines.size(); e++) {
+    if (!run_benchmark(engines[e])) {
+      exit(EXIT_FAILURE);
+    }
+  }
+  return 0;
+}